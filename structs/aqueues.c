@@ -1,5 +1,243 @@
 #include "../include/aqueues.h"
 
+static _Thread_local QPOOL_CACHE_p_t thread_cache = NULL;
+static _Atomic(QPOOL_CACHE_p_t) all_caches = NULL; // every cache ever created, for qpool_stats()
+
+/**
+ * @brief get the calling thread's node cache, creating and registering it on first use
+ *
+ * @return the cache, or NULL if it could not be allocated
+ */
+static QPOOL_CACHE_p_t qpool_thread_cache(void)
+{
+    QPOOL_CACHE_p_t cache = thread_cache;
+
+    if (NULL != cache)
+    {
+        goto END;
+    }
+
+    if (0 != posix_memalign((void **)&cache, CACHE_LINE_SIZE, sizeof(QPOOL_CACHE_t)))
+    {
+        log_error("Failed to alloc node cache.");
+        cache = NULL;
+        goto END;
+    }
+    memset(cache, 0, sizeof(QPOOL_CACHE_t));
+    atomic_init(&cache->inbox, NULL);
+
+    cache->next_cache = atomic_load(&all_caches);
+    while (!atomic_compare_exchange_weak(&all_caches, &cache->next_cache, cache))
+    {
+    }
+    thread_cache = cache;
+
+END:
+    return cache;
+}
+
+/**
+ * @brief hand a thread's pending batch of freed nodes back to their owner with a single CAS
+ *
+ * @param cache the freeing thread's cache
+ */
+static void qpool_flush_pending(QPOOL_CACHE_p_t cache)
+{
+    QPOOL_CACHE_p_t owner = cache->pending_owner;
+
+    if (NULL == cache->pending)
+    {
+        goto END;
+    }
+
+    cache->pending_tail->next = atomic_load(&owner->inbox);
+    while (!atomic_compare_exchange_weak(&owner->inbox, &cache->pending_tail->next, cache->pending))
+    {
+    }
+    atomic_fetch_add_explicit(&owner->remote_frees, cache->num_pending, memory_order_relaxed);
+
+    cache->pending = NULL;
+    cache->pending_tail = NULL;
+    cache->pending_owner = NULL;
+    cache->num_pending = 0;
+
+END:
+    return;
+}
+
+/**
+ * @brief take a node from the calling thread's cache; refills from returned nodes first, then from a new slab
+ *
+ * @return a node with data and next cleared, or NULL on failure
+ */
+static Q_NODE_p_t qnode_alloc(void)
+{
+    Q_NODE_p_t ret = NULL;
+    Q_NODE_p_t slab = NULL;
+    QPOOL_CACHE_p_t cache = NULL;
+    int count = 0;
+
+    cache = qpool_thread_cache();
+    if (NULL == cache) // no cache for this thread; fall back to a plain allocation
+    {
+        ret = (Q_NODE_t *)calloc(1, sizeof(Q_NODE_t));
+        goto END;
+    }
+
+    if (NULL == cache->free_list)
+    {
+        cache->free_list = atomic_exchange(&cache->inbox, NULL);
+    }
+
+    if (NULL != cache->free_list)
+    {
+        atomic_fetch_add_explicit(&cache->hits, 1, memory_order_relaxed);
+    }
+    else
+    {
+        atomic_fetch_add_explicit(&cache->misses, 1, memory_order_relaxed);
+        slab = (Q_NODE_t *)calloc(QPOOL_SLAB_NODES, sizeof(Q_NODE_t)); // slabs are never returned to the system
+        if (NULL == slab)
+        {
+            log_error("Failed to alloc node slab.");
+            goto END;
+        }
+        for (count = 0; count < QPOOL_SLAB_NODES; count++)
+        {
+            slab[count].owner = cache;
+            slab[count].next = (count + 1 < QPOOL_SLAB_NODES) ? &slab[count + 1] : NULL;
+        }
+        cache->free_list = slab;
+    }
+
+    ret = cache->free_list;
+    cache->free_list = ret->next;
+
+END:
+    if (NULL != ret)
+    {
+        ret->data = NULL;
+        ret->next = NULL;
+    }
+    return ret;
+}
+
+/**
+ * @brief return a node to its owning thread's cache; nodes owned by another thread are batched before handing back
+ *
+ * @param node the node to return
+ */
+static void qnode_free(Q_NODE_p_t node)
+{
+    QPOOL_CACHE_p_t cache = NULL;
+
+    if (NULL == node)
+    {
+        goto END;
+    }
+    if (NULL == node->owner)
+    {
+        free(node);
+        goto END;
+    }
+
+    cache = qpool_thread_cache();
+    if (node->owner == cache)
+    {
+        node->next = cache->free_list;
+        cache->free_list = node;
+        goto END;
+    }
+    if (NULL == cache) // cannot batch without a cache of our own; return this node on its own
+    {
+        node->next = atomic_load(&node->owner->inbox);
+        while (!atomic_compare_exchange_weak(&node->owner->inbox, &node->next, node))
+        {
+        }
+        atomic_fetch_add_explicit(&node->owner->remote_frees, 1, memory_order_relaxed);
+        goto END;
+    }
+
+    if (node->owner != cache->pending_owner)
+    {
+        qpool_flush_pending(cache);
+        cache->pending_owner = node->owner;
+    }
+    node->next = cache->pending;
+    cache->pending = node;
+    if (NULL == cache->pending_tail)
+    {
+        cache->pending_tail = node;
+    }
+    cache->num_pending++;
+    if (QPOOL_BATCH <= cache->num_pending)
+    {
+        qpool_flush_pending(cache);
+    }
+
+END:
+    return;
+}
+
+/**
+ * @brief signal a queue's eventfd after items were enqueued. Only the first enqueue since the last ack writes to the
+ * eventfd, so a burst costs one syscall. The fence orders the item's publication before the wake_pending check, pairing
+ * with the one in queue_wakeup_ack().
+ *
+ * @param wake_fd the queue's eventfd, or -1 when wakeups are not enabled
+ * @param wake_pending the queue's pending wakeup flag
+ */
+static void queue_wakeup(int wake_fd, atomic_int *wake_pending)
+{
+    uint64_t one = 1;
+
+    if (-1 == wake_fd)
+    {
+        goto END;
+    }
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if ((0 != atomic_load_explicit(wake_pending, memory_order_relaxed)) ||
+        (0 != atomic_exchange_explicit(wake_pending, 1, memory_order_relaxed)))
+    {
+        goto END; // a wakeup is already on its way
+    }
+    if (-1 == write(wake_fd, &one, sizeof(one)))
+    {
+        log_perror("write(eventfd)");
+    }
+
+END:
+    return;
+}
+
+/**
+ * @brief clear a queue's eventfd and pending flag. The consumer drains the queue after this, so items published
+ * before the flag was cleared are seen by the drain, and items published after it raise a new wakeup.
+ *
+ * @param wake_fd the queue's eventfd, or -1 when wakeups are not enabled
+ * @param wake_pending the queue's pending wakeup flag
+ */
+static void queue_wakeup_ack(int wake_fd, atomic_int *wake_pending)
+{
+    uint64_t count = 0;
+
+    if (-1 == wake_fd)
+    {
+        goto END;
+    }
+
+    if ((-1 == read(wake_fd, &count, sizeof(count))) && (EAGAIN != errno)) // EAGAIN: another consumer got it first
+    {
+        log_perror("read(eventfd)");
+    }
+    atomic_store_explicit(wake_pending, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+
+END:
+    return;
+}
+
 /**
  * @brief create a queue with items
  * @param items items to initialize queue with (for empty queue pass NULL)
@@ -19,301 +257,957 @@ QUEUE_p_t create_queue(void **items, int numItems)
     }
     if ((0 > numItems) || (MAX_QUEUE_NODES < numItems))
     {
-        fprintf(stderr, "numItems out of range.\n");
+        log_error("numItems out of range.");
         goto FAIL;
     }
 
     new_queue = (QUEUE_t *)calloc(1, sizeof(QUEUE_t));
     if (NULL == new_queue)
     {
-        fprintf(stderr, "Failed to alloc new_queue.\n");
+        log_error("Failed to alloc new_queue.");
+        goto FAIL;
+    }
+    new_queue->head = NULL;
+    new_queue->tail = NULL;
+
+    for (count = 0; count < numItems; count++)
+    {
+        if (-1 == enqueue(ret, &items[count]))
+        {
+            log_error("Failed to enqueue items in create_queue()");
+            goto FAIL;
+        }
+    }
+    ret = new_queue;
+    goto END;
+
+FAIL:
+    free(new_queue);
+    new_queue = NULL;
+
+END:
+    return ret;
+}
+
+/**
+ * @brief create an atomic queue with items
+ *
+ * @param items items to initialize queue with (for empty queue pass NULL)
+ * @param numItems number of items in items
+ * @return pointer to beginning of queue or NULL on failure
+ *
+ */
+AQUEUE_p_t create_aqueue(void **items, int numItems)
+{
+    AQUEUE_p_t ret = NULL;
+    AQUEUE_p_t new_queue = NULL;
+
+    int count = 0;
+    int check = 0;
+
+    // Checks
+    if (NULL == items) // Creates empty queue.
+    {
+    }
+    if ((0 > numItems) || (MAX_QUEUE_NODES < numItems))
+    {
+        log_error("numItems out of range.");
+        goto FAIL;
+    }
+
+    new_queue = (AQUEUE_t *)calloc(1, sizeof(AQUEUE_t));
+    if (NULL == new_queue)
+    {
+        log_error("Failed to alloc new_queue.");
         goto FAIL;
     }
     new_queue->head = NULL;
     new_queue->tail = NULL;
+    new_queue->wake_fd = -1;
+    atomic_init(&new_queue->wake_pending, 0);
+
+    check = pthread_mutex_init(&new_queue->lock, NULL);
+    if (0 != check)
+    {
+        log_error("Error initializing mutex.");
+        goto END;
+    }
+
+    for (count = 0; count < numItems; count++)
+    {
+        if (-1 == aenqueue(ret, &items[count]))
+        {
+            log_error("Failed to enqueue items in create_queue()");
+            goto FAIL;
+        }
+    }
+    ret = new_queue;
+    goto END;
+
+FAIL:
+    free(new_queue);
+    new_queue = NULL;
+
+END:
+    return ret;
+}
+
+/**
+ * @brief create a lock-free ring queue with items
+ *
+ * @param items items to initialize queue with (for empty queue pass NULL)
+ * @param numItems number of items in items
+ * @return pointer to the ring queue or NULL on failure
+ *
+ */
+RQUEUE_p_t create_rqueue(void **items, int numItems)
+{
+    RQUEUE_p_t ret = NULL;
+    RQUEUE_p_t new_queue = NULL;
+    size_t slot = 0;
+    int count = 0;
+
+    if ((0 > numItems) || (MAX_QUEUE_NODES < numItems))
+    {
+        log_error("numItems out of range.");
+        goto FAIL;
+    }
+
+    // head and tail are cache line aligned, so calloc() is not enough here
+    if (0 != posix_memalign((void **)&new_queue, CACHE_LINE_SIZE, sizeof(RQUEUE_t)))
+    {
+        log_error("Failed to alloc new_queue.");
+        new_queue = NULL;
+        goto FAIL;
+    }
+    memset(new_queue, 0, sizeof(RQUEUE_t));
+
+    new_queue->mask = RQUEUE_CAPACITY - 1;
+    for (slot = 0; slot < RQUEUE_CAPACITY; slot++)
+    {
+        atomic_init(&new_queue->slots[slot].sequence, slot);
+        new_queue->slots[slot].data = NULL;
+    }
+    atomic_init(&new_queue->head, 0);
+    atomic_init(&new_queue->tail, 0);
+    atomic_init(&new_queue->wake_pending, 0);
+    new_queue->wake_fd = -1;
 
     for (count = 0; count < numItems; count++)
     {
-        if (-1 == enqueue(ret, &items[count]))
-        {
-            fprintf(stderr, "Failed to enqueue items in create_queue()");
-            goto FAIL;
-        }
+        if (-1 == renqueue(new_queue, items[count]))
+        {
+            log_error("Failed to enqueue items in create_rqueue()");
+            goto FAIL;
+        }
+    }
+    ret = new_queue;
+    goto END;
+
+FAIL:
+    free(new_queue);
+    new_queue = NULL;
+
+END:
+    return ret;
+}
+
+/**
+ * @brief enqueue an item to the tail of a queue
+ *
+ * @param queue queue to add item to
+ * @param item item to add to queue
+ * @return returns 0 on success or -1 on failure
+ */
+int enqueue(QUEUE_p_t queue, void *item)
+{
+    int ret = -1;
+    Q_NODE_p_t newnode = NULL;
+
+    if (NULL == queue)
+    {
+        log_error("Invalid queue passed. Exiting... is null?!");
+        goto FAIL;
+    }
+
+    newnode = qnode_alloc();
+    if (NULL == newnode)
+    {
+        log_error("Failed to alloc newnode.");
+        goto FAIL;
+    }
+    newnode->data = item;
+
+    if (queue->tail != NULL)
+    {
+        queue->tail->next = newnode;
+    }
+
+    queue->tail = newnode; // this was below/ not in this else...
+
+    // Ensures head is set
+    if (queue->head == NULL)
+    {
+        queue->head = newnode;
+    }
+    ret = 0;
+    goto END;
+FAIL:
+    qnode_free(newnode);
+    newnode = NULL;
+END:
+    return ret;
+}
+
+/**
+ * @brief enqueue an item to the tail of an atomic queue
+ *
+ * @param queue queue to add item to
+ * @param item item to add to queue
+ * @return returns 0 on success or -1 on failure
+ */
+int aenqueue(AQUEUE_p_t aqueue, void *item)
+{
+    int ret = -1;
+    int queued = 0;
+    Q_NODE_p_t newnode = NULL;
+
+    if (NULL == aqueue)
+    {
+        log_error("Invalid queue passed.");
+        goto END;
+    }
+
+    newnode = qnode_alloc();
+    if (NULL == newnode)
+    {
+        log_error("Failed to alloc newnode.");
+        goto FAIL;
+    }
+
+    pthread_mutex_lock(&aqueue->lock);
+    if ((NULL == aqueue) || (NULL == item) || (aqueue->num_nodes > MAX_QUEUE_NODES))
+    {
+        log_error("Failed aenqueue()");
+        qnode_free(newnode);
+        newnode = NULL;
+    }
+    else
+    {
+        newnode->data = item;
+
+        if (aqueue->tail != NULL)
+        {
+            aqueue->tail->next = newnode;
+        }
+
+        aqueue->tail = newnode;
+
+        // Ensures head is set
+        if (aqueue->head == NULL)
+        {
+            aqueue->head = newnode;
+        }
+        aqueue->num_nodes++;
+        queued = 1;
+    }
+    pthread_mutex_unlock(&aqueue->lock);
+
+    if (1 == queued)
+    {
+        queue_wakeup(aqueue->wake_fd, &aqueue->wake_pending);
+    }
+
+    ret = 0;
+    goto END;
+
+FAIL:
+    qnode_free(newnode);
+    newnode = NULL;
+
+END:
+    return ret;
+}
+
+/**
+ * @brief enqueue several items to the tail of an atomic queue under a single lock acquisition. The nodes are taken
+ * from the pool and chained before the lock is taken.
+ *
+ * @param aqueue queue to add items to
+ * @param items items to add, in order (none may be NULL)
+ * @param n number of items
+ * @return returns the number of items enqueued (fewer than n if the queue filled up), or -1 on failure
+ */
+int aenqueue_bulk(AQUEUE_p_t aqueue, void **items, size_t n)
+{
+    int ret = -1;
+    Q_NODE_p_t chain_head = NULL;
+    Q_NODE_p_t chain_tail = NULL;
+    Q_NODE_p_t newnode = NULL;
+    size_t count = 0;
+    size_t room = 0;
+
+    if ((NULL == aqueue) || (NULL == items) || (MAX_QUEUE_NODES < n))
+    {
+        log_error("Invalid queue or items passed.");
+        goto END;
+    }
+
+    for (count = 0; count < n; count++)
+    {
+        if (NULL == items[count])
+        {
+            log_error("Failed aenqueue_bulk(). NULL item.");
+            goto FAIL;
+        }
+        newnode = qnode_alloc();
+        if (NULL == newnode)
+        {
+            log_error("Failed to alloc newnode.");
+            goto FAIL;
+        }
+        newnode->data = items[count];
+        if (NULL == chain_tail)
+        {
+            chain_head = newnode;
+        }
+        else
+        {
+            chain_tail->next = newnode;
+        }
+        chain_tail = newnode;
+    }
+
+    pthread_mutex_lock(&aqueue->lock);
+    room = (aqueue->num_nodes > MAX_QUEUE_NODES) ? 0 : ((MAX_QUEUE_NODES + 1) - aqueue->num_nodes);
+    if (room < n) // cut the chain down to what fits; the rest is returned to the pool below
+    {
+        chain_tail = NULL;
+        newnode = chain_head;
+        for (count = 0; count < room; count++)
+        {
+            chain_tail = newnode;
+            newnode = newnode->next;
+        }
+        if (NULL == chain_tail)
+        {
+            chain_head = NULL;
+        }
+        else
+        {
+            chain_tail->next = NULL;
+        }
+        n = room;
+    }
+    else
+    {
+        newnode = NULL;
+    }
+
+    if (NULL != chain_head)
+    {
+        if (aqueue->tail != NULL)
+        {
+            aqueue->tail->next = chain_head;
+        }
+        aqueue->tail = chain_tail;
+        if (aqueue->head == NULL)
+        {
+            aqueue->head = chain_head;
+        }
+        aqueue->num_nodes += (int)n;
+    }
+    pthread_mutex_unlock(&aqueue->lock);
+
+    chain_head = newnode; // nodes that did not fit
+    ret = (int)n;
+    if (0 < n)
+    {
+        queue_wakeup(aqueue->wake_fd, &aqueue->wake_pending);
+    }
+
+FAIL:
+    while (NULL != chain_head)
+    {
+        newnode = chain_head;
+        chain_head = chain_head->next;
+        qnode_free(newnode);
+    }
+    newnode = NULL;
+
+END:
+    return ret;
+}
+
+/**
+ * @brief enqueue an item to the tail of a lock-free ring queue. A slot is free for the producer holding position pos
+ * when its sequence equals pos; the producer claims pos with a CAS on the tail, stores the item, then publishes it by
+ * setting the sequence to pos + 1.
+ *
+ * @param rqueue queue to add item to
+ * @param item item to add to queue (must not be NULL)
+ * @return returns 0 on success or -1 on failure (including a full queue)
+ */
+int renqueue(RQUEUE_p_t rqueue, void *item)
+{
+    int ret = -1;
+    RQ_SLOT_p_t slot = NULL;
+    size_t pos = 0;
+    size_t seq = 0;
+    intptr_t diff = 0;
+
+    if ((NULL == rqueue) || (NULL == item))
+    {
+        log_error("Invalid queue or item passed.");
+        goto END;
+    }
+
+    pos = atomic_load_explicit(&rqueue->tail, memory_order_relaxed);
+    for (;;)
+    {
+        slot = &rqueue->slots[pos & rqueue->mask];
+        seq = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (0 == diff) // slot is free for this position, try to claim it
+        {
+            if (atomic_compare_exchange_weak_explicit(&rqueue->tail, &pos, pos + 1, memory_order_relaxed,
+                                                      memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (0 > diff) // consumer has not released the slot yet; the queue is full
+        {
+            goto END;
+        }
+        else // another producer claimed this position first
+        {
+            pos = atomic_load_explicit(&rqueue->tail, memory_order_relaxed);
+        }
+    }
+
+    slot->data = item;
+    atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+    queue_wakeup(rqueue->wake_fd, &rqueue->wake_pending);
+
+    ret = 0;
+END:
+    return ret;
+}
+
+/**
+ * @brief enqueue several items to the tail of a lock-free ring queue, claiming all of their slots with a single CAS.
+ * Only the run of free slots directly after the tail is claimed, so a slow consumer shortens the batch rather than
+ * stalling it.
+ *
+ * @param rqueue queue to add items to
+ * @param items items to add, in order (none may be NULL)
+ * @param n number of items
+ * @return returns the number of items enqueued (fewer than n if the queue filled up), or -1 on failure
+ */
+int renqueue_bulk(RQUEUE_p_t rqueue, void **items, size_t n)
+{
+    int ret = -1;
+    size_t pos = 0;
+    size_t count = 0;
+    size_t claimed = 0;
+
+    if ((NULL == rqueue) || (NULL == items) || (RQUEUE_CAPACITY < n))
+    {
+        log_error("Invalid queue or items passed.");
+        goto END;
+    }
+    for (count = 0; count < n; count++)
+    {
+        if (NULL == items[count])
+        {
+            log_error("Failed renqueue_bulk(). NULL item.");
+            goto END;
+        }
+    }
+
+    pos = atomic_load_explicit(&rqueue->tail, memory_order_relaxed);
+    for (;;)
+    {
+        for (claimed = 0; claimed < n; claimed++)
+        {
+            if ((pos + claimed) !=
+                atomic_load_explicit(&rqueue->slots[(pos + claimed) & rqueue->mask].sequence, memory_order_acquire))
+            {
+                break;
+            }
+        }
+
+        if (0 == claimed)
+        {
+            if ((intptr_t)atomic_load_explicit(&rqueue->slots[pos & rqueue->mask].sequence, memory_order_acquire) <
+                (intptr_t)pos) // the queue is full
+            {
+                break;
+            }
+            pos = atomic_load_explicit(&rqueue->tail, memory_order_relaxed); // another producer moved the tail
+            continue;
+        }
+
+        if (atomic_compare_exchange_weak_explicit(&rqueue->tail, &pos, pos + claimed, memory_order_relaxed,
+                                                  memory_order_relaxed))
+        {
+            break;
+        }
+    }
+
+    for (count = 0; count < claimed; count++)
+    {
+        rqueue->slots[(pos + count) & rqueue->mask].data = items[count];
+        atomic_store_explicit(&rqueue->slots[(pos + count) & rqueue->mask].sequence, pos + count + 1,
+                              memory_order_release);
+    }
+    if (0 < claimed)
+    {
+        queue_wakeup(rqueue->wake_fd, &rqueue->wake_pending);
+    }
+
+    ret = (int)claimed;
+END:
+    return ret;
+}
+
+/**
+ * @brief dequeue an item from the head of a queue
+ *
+ * @param queue queue to add item to
+ * @param ret_address if set to 1, returns the address of dequeued item. Otherwise returns the item.
+ * @return the item that was at the head of the queue, or NULL if the queue was empty
+ *
+ */
+void *dequeue(QUEUE_p_t queue, int ret_address)
+{
+    void *ret = NULL;
+
+    if (NULL == queue)
+    {
+        goto END;
+    }
+    if (NULL == queue->head) // Check if queue is empty
+    {
+        goto END;
+    }
+
+    Q_NODE_p_t temp = queue->head; // Save the head of queue
+
+    queue->head = queue->head->next; // Remove the head
+    if (NULL == queue->head)
+    {
+        queue->tail = NULL;
+    }
+
+    if (ret_address == 1)
+    {
+        ret = &(temp->data); // the caller owns the node now and returns it with free_qnode()
+    }
+    else
+    {
+        ret = (temp->data);
+        qnode_free(temp);
+        temp = NULL;
+    }
+
+END:
+    return ret;
+}
+
+/**
+ * @brief dequeue an item from the head of an atomic queue
+ *
+ * @param queue queue to add item to
+ * @param ret_address if set to 1, returns the address of dequeued item. Otherwise returns the item.
+ * @return the item that was at the head of the queue, or NULL if the queue was empty
+ *
+ */
+void *adequeue(AQUEUE_p_t aqueue, int ret_address)
+{
+    void *ret = NULL;
+    Q_NODE_p_t temp = NULL;
+
+    if (NULL == aqueue)
+    {
+        goto END;
+    }
+    if (0 == aqueue->num_nodes) // an empty queue is the normal case for a consumer; skip the lock
+    {
+        goto END;
+    }
+
+    pthread_mutex_lock(&aqueue->lock);
+    if ((0 != aqueue->num_nodes) && (NULL != aqueue->head))
+    {
+        temp = aqueue->head; // Save the head of queue
+
+        aqueue->head = aqueue->head->next; // Remove the head
+        if (NULL == aqueue->head)
+        {
+            aqueue->tail = NULL;
+        }
+        aqueue->num_nodes--;
+    }
+    pthread_mutex_unlock(&aqueue->lock);
+
+    if (NULL == temp)
+    {
+        goto END;
+    }
+    if (ret_address == 1)
+    {
+        ret = &(temp->data); // the caller owns the node now and returns it with free_qnode()
+    }
+    else
+    {
+        ret = temp->data;
+        qnode_free(temp); // returned outside the lock
+        temp = NULL;
     }
-    ret = new_queue;
-    goto END;
-
-FAIL:
-    free(new_queue);
-    new_queue = NULL;
 
 END:
     return ret;
 }
 
 /**
- * @brief create an atomic queue with items
- *
- * @param items items to initialize queue with (for empty queue pass NULL)
- * @param numItems number of items in items
- * @return pointer to beginning of queue or NULL on failure
+ * @brief dequeue up to max items from the head of an atomic queue under a single lock acquisition
  *
+ * @param aqueue queue to remove items from
+ * @param out array receiving the items, oldest first
+ * @param max size of out
+ * @return returns the number of items dequeued (0 if the queue was empty), or -1 on failure
  */
-AQUEUE_p_t create_aqueue(void **items, int numItems)
+int adequeue_bulk(AQUEUE_p_t aqueue, void **out, size_t max)
 {
-    AQUEUE_p_t ret = NULL;
-    AQUEUE_p_t new_queue = NULL;
-
-    int count = 0;
-    int check = 0;
+    int ret = -1;
+    Q_NODE_p_t chain = NULL;
+    Q_NODE_p_t temp = NULL;
+    size_t count = 0;
 
-    // Checks
-    if (NULL == items) // Creates empty queue.
+    if ((NULL == aqueue) || (NULL == out))
     {
+        log_error("Invalid queue or out passed.");
+        goto END;
     }
-    if ((0 > numItems) || (MAX_QUEUE_NODES < numItems))
+    if (0 == max) // nothing is detached, so the chain below would still be linked into the queue
     {
-        fprintf(stderr, "numItems out of range.\n");
-        goto FAIL;
+        ret = 0;
+        goto END;
     }
 
-    new_queue = (AQUEUE_t *)calloc(1, sizeof(AQUEUE_t));
-    if (NULL == new_queue)
+    pthread_mutex_lock(&aqueue->lock);
+    chain = aqueue->head;
+    for (count = 0; (count < max) && (NULL != aqueue->head); count++)
     {
-        fprintf(stderr, "Failed to alloc new_queue.\n");
-        goto FAIL;
+        temp = aqueue->head;
+        aqueue->head = aqueue->head->next;
     }
-    new_queue->head = NULL;
-    new_queue->tail = NULL;
-
-    check = pthread_mutex_init(&new_queue->lock, NULL);
-    if (0 != check)
+    if (NULL != temp)
     {
-        fprintf(stderr, "Error initializing mutex.\n");
-        goto END;
+        temp->next = NULL; // detach the taken chain
     }
-
-    for (count = 0; count < numItems; count++)
+    if (NULL == aqueue->head)
     {
-        if (-1 == aenqueue(ret, &items[count]))
-        {
-            fprintf(stderr, "Failed to enqueue items in create_queue()");
-            goto FAIL;
-        }
+        aqueue->tail = NULL;
     }
-    ret = new_queue;
-    goto END;
+    aqueue->num_nodes -= (int)count;
+    pthread_mutex_unlock(&aqueue->lock);
 
-FAIL:
-    free(new_queue);
-    new_queue = NULL;
+    for (count = 0; NULL != chain; count++) // nodes go back to the pool outside the lock
+    {
+        temp = chain;
+        chain = chain->next;
+        out[count] = temp->data;
+        qnode_free(temp);
+    }
+    temp = NULL;
 
+    ret = (int)count;
 END:
     return ret;
 }
 
 /**
- * @brief enqueue an item to the tail of a queue
+ * @brief dequeue an item from the head of a lock-free ring queue. An item is ready for the consumer holding position
+ * pos when the slot's sequence equals pos + 1; after taking it the consumer hands the slot back to producers for the
+ * next lap by setting the sequence to pos + RQUEUE_CAPACITY.
+ *
+ * @param rqueue queue to remove item from
+ * @return the item that was at the head of the queue, or NULL if the queue was empty
  *
- * @param queue queue to add item to
- * @param item item to add to queue
- * @return returns 0 on success or -1 on failure
  */
-int enqueue(QUEUE_p_t queue, void *item)
+void *rdequeue(RQUEUE_p_t rqueue)
 {
-    int ret = -1;
-    Q_NODE_p_t newnode = NULL;
+    void *ret = NULL;
+    RQ_SLOT_p_t slot = NULL;
+    size_t pos = 0;
+    size_t seq = 0;
+    intptr_t diff = 0;
 
-    if (NULL == queue)
+    if (NULL == rqueue)
     {
-        fprintf(stderr, "Invalid queue passed. Exiting... is null?!\n");
-        goto FAIL;
+        goto END;
     }
 
-    newnode = (Q_NODE_t *)calloc(1, sizeof(Q_NODE_t));
-    if (NULL == newnode)
+    pos = atomic_load_explicit(&rqueue->head, memory_order_relaxed);
+    for (;;)
     {
-        fprintf(stderr, "Failed to alloc newnode.\n");
-        goto FAIL;
-    }
-    newnode->data = item;
+        slot = &rqueue->slots[pos & rqueue->mask];
+        seq = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        diff = (intptr_t)seq - (intptr_t)(pos + 1);
 
-    if (queue->tail != NULL)
-    {
-        queue->tail->next = newnode;
+        if (0 == diff) // item is published for this position, try to claim it
+        {
+            if (atomic_compare_exchange_weak_explicit(&rqueue->head, &pos, pos + 1, memory_order_relaxed,
+                                                      memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (0 > diff) // nothing published yet; the queue is empty
+        {
+            goto END;
+        }
+        else // another consumer took this position first
+        {
+            pos = atomic_load_explicit(&rqueue->head, memory_order_relaxed);
+        }
     }
 
-    queue->tail = newnode; // this was below/ not in this else...
+    ret = slot->data;
+    slot->data = NULL;
+    atomic_store_explicit(&slot->sequence, pos + rqueue->mask + 1, memory_order_release);
 
-    // Ensures head is set
-    if (queue->head == NULL)
-    {
-        queue->head = newnode;
-    }
-    ret = 0;
-    goto END;
-FAIL:
-    free(newnode);
-    newnode = NULL;
 END:
     return ret;
 }
 
 /**
- * @brief enqueue an item to the tail of an atomic queue
+ * @brief dequeue up to max items from the head of a lock-free ring queue, claiming them with a single CAS. Only the
+ * run of published items directly at the head is taken.
  *
- * @param queue queue to add item to
- * @param item item to add to queue
- * @return returns 0 on success or -1 on failure
+ * @param rqueue queue to remove items from
+ * @param out array receiving the items, oldest first
+ * @param max size of out
+ * @return returns the number of items dequeued (0 if the queue was empty), or -1 on failure
  */
-int aenqueue(AQUEUE_p_t aqueue, void *item)
+int rdequeue_bulk(RQUEUE_p_t rqueue, void **out, size_t max)
 {
     int ret = -1;
-    Q_NODE_p_t newnode = NULL;
+    RQ_SLOT_p_t slot = NULL;
+    size_t pos = 0;
+    size_t count = 0;
+    size_t claimed = 0;
 
-    if (NULL == aqueue)
+    if ((NULL == rqueue) || (NULL == out))
     {
-        fprintf(stderr, "Invalid queue passed.\n");
+        log_error("Invalid queue or out passed.");
         goto END;
     }
-
-    newnode = (Q_NODE_t *)calloc(1, sizeof(Q_NODE_t));
-    if (NULL == newnode)
+    if (RQUEUE_CAPACITY < max)
     {
-        fprintf(stderr, "Failed to alloc newnode.\n");
-        goto FAIL;
+        max = RQUEUE_CAPACITY;
     }
 
-    pthread_mutex_lock(&aqueue->lock);
-    if ((NULL == aqueue) || (NULL == item) || (aqueue->num_nodes > MAX_QUEUE_NODES))
-    {
-        fprintf(stderr, "Failed aenqueue()\n");
-        free(newnode);
-        newnode = NULL;
-    }
-    else
+    pos = atomic_load_explicit(&rqueue->head, memory_order_relaxed);
+    for (;;)
     {
-        newnode->data = item;
-
-        if (aqueue->tail != NULL)
+        for (claimed = 0; claimed < max; claimed++)
         {
-            aqueue->tail->next = newnode;
+            if ((pos + claimed + 1) !=
+                atomic_load_explicit(&rqueue->slots[(pos + claimed) & rqueue->mask].sequence, memory_order_acquire))
+            {
+                break;
+            }
         }
 
-        aqueue->tail = newnode;
+        if (0 == claimed)
+        {
+            if ((intptr_t)atomic_load_explicit(&rqueue->slots[pos & rqueue->mask].sequence, memory_order_acquire) <
+                (intptr_t)(pos + 1)) // the queue is empty
+            {
+                break;
+            }
+            pos = atomic_load_explicit(&rqueue->head, memory_order_relaxed); // another consumer moved the head
+            continue;
+        }
 
-        // Ensures head is set
-        if (aqueue->head == NULL)
+        if (atomic_compare_exchange_weak_explicit(&rqueue->head, &pos, pos + claimed, memory_order_relaxed,
+                                                  memory_order_relaxed))
         {
-            aqueue->head = newnode;
+            break;
         }
-        aqueue->num_nodes++;
     }
-    pthread_mutex_unlock(&aqueue->lock);
-
-    ret = 0;
-    goto END;
 
-FAIL:
-    free(newnode);
-    newnode = NULL;
+    for (count = 0; count < claimed; count++)
+    {
+        slot = &rqueue->slots[(pos + count) & rqueue->mask];
+        out[count] = slot->data;
+        slot->data = NULL;
+        atomic_store_explicit(&slot->sequence, pos + count + rqueue->mask + 1, memory_order_release);
+    }
 
+    ret = (int)claimed;
 END:
     return ret;
 }
 
 /**
- * @brief dequeue an item from the head of a queue
- *
- * @param queue queue to add item to
- * @param ret_address if set to 1, returns the address of dequeued item. Otherwise returns the item.
- * @return the item that was at the head of the queue, or NULL if the queue was empty
+ * @brief approximate number of items in a lock-free ring queue. Exact when no other thread is using the queue.
  *
+ * @param rqueue queue to count
+ * @return number of items in the queue, or 0 for a NULL queue
  */
-void *dequeue(QUEUE_p_t queue, int ret_address)
+size_t rqueue_count(RQUEUE_p_t rqueue)
 {
-    void *ret = NULL;
+    size_t ret = 0;
+    size_t head = 0;
+    size_t tail = 0;
 
-    if (NULL == queue)
+    if (NULL == rqueue)
     {
         goto END;
     }
-    if (NULL == queue->head) // Check if queue is empty
+
+    head = atomic_load_explicit(&rqueue->head, memory_order_relaxed);
+    tail = atomic_load_explicit(&rqueue->tail, memory_order_relaxed);
+    if (tail > head)
     {
-        goto END;
+        ret = tail - head;
     }
 
-    Q_NODE_p_t temp = queue->head; // Save the head of queue
+END:
+    return ret;
+}
 
-    if (ret_address == 1)
-    {
-        ret = &(temp->data); // Save the address of data to return **** remember this for later? Think inverse of
-                             // sending the address, need to return it!
-    }
-    else
+/**
+ * @brief give an atomic queue an eventfd that becomes readable whenever items are enqueued, so consumers can sleep in
+ * poll()/epoll on it instead of polling the queue. Call once, before the queue is shared.
+ *
+ * @param aqueue queue to enable wakeups on
+ * @return returns the eventfd (owned by the queue, closed by adestroy()), or -1 on failure
+ */
+int aqueue_enable_wakeup(AQUEUE_p_t aqueue)
+{
+    int ret = -1;
+
+    if (NULL == aqueue)
     {
-        ret = (temp->data);
+        log_error("Invalid queue passed.");
+        goto END;
     }
-
-    queue->head = queue->head->next; // Remove the head
-    if (NULL == queue->head)
+    if (-1 == aqueue->wake_fd)
     {
-        queue->tail = NULL;
+        aqueue->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (-1 == aqueue->wake_fd)
+        {
+            log_perror("eventfd()");
+            goto END;
+        }
     }
 
+    ret = aqueue->wake_fd;
 END:
     return ret;
 }
 
 /**
- * @brief dequeue an item from the head of an atomic queue
- *
- * @param queue queue to add item to
- * @param ret_address if set to 1, returns the address of dequeued item. Otherwise returns the item.
- * @return the item that was at the head of the queue, or NULL if the queue was empty
+ * @brief give a lock-free ring queue an eventfd that becomes readable whenever items are enqueued, so consumers can
+ * sleep in poll()/epoll on it instead of polling the queue. Call once, before the queue is shared.
  *
+ * @param rqueue queue to enable wakeups on
+ * @return returns the eventfd (owned by the queue, closed by rdestroy()), or -1 on failure
  */
-void *adequeue(AQUEUE_p_t aqueue, int ret_address)
+int rqueue_enable_wakeup(RQUEUE_p_t rqueue)
 {
-    void *ret = NULL;
+    int ret = -1;
 
-    if (NULL == aqueue)
+    if (NULL == rqueue)
     {
+        log_error("Invalid queue passed.");
         goto END;
     }
-    if (0 == aqueue->num_nodes) // two checks exist to prevent time of use vs time of check issue
+    if (-1 == rqueue->wake_fd)
     {
-        fprintf(stderr, "cannot dequeue with 0 num_nodes.\n");
-        goto END;
+        rqueue->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (-1 == rqueue->wake_fd)
+        {
+            log_perror("eventfd()");
+            goto END;
+        }
     }
 
-    pthread_mutex_lock(&aqueue->lock);
-    if ((NULL == aqueue) || (0 == aqueue->num_nodes) || (NULL == aqueue->head))
+    ret = rqueue->wake_fd;
+END:
+    return ret;
+}
+
+/**
+ * @brief acknowledge a wakeup on an atomic queue's eventfd
+ *
+ * @param aqueue queue whose eventfd was readable
+ */
+void aqueue_wakeup_ack(AQUEUE_p_t aqueue)
+{
+    if (NULL != aqueue)
     {
-        fprintf(stderr, "failed adequeue(). invalid parameters.\n");
+        queue_wakeup_ack(aqueue->wake_fd, &aqueue->wake_pending);
     }
-    else
+}
+
+/**
+ * @brief acknowledge a wakeup on a lock-free ring queue's eventfd
+ *
+ * @param rqueue queue whose eventfd was readable
+ */
+void rqueue_wakeup_ack(RQUEUE_p_t rqueue)
+{
+    if (NULL != rqueue)
     {
-        Q_NODE_p_t temp = aqueue->head; // Save the head of queue
+        queue_wakeup_ack(rqueue->wake_fd, &rqueue->wake_pending);
+    }
+}
 
-        if (ret_address == 1)
-        {
-            ret = &temp; // Save the address of data to return
-        }
-        else
-        {
-            ret = temp;
-        }
+/**
+ * @brief return a node to the node pool. Only needed after dequeue()/adequeue() with ret_address set to 1.
+ *
+ * @param item_address the address returned by dequeue()/adequeue()
+ */
+void free_qnode(void *item_address)
+{
+    // data is the first member of Q_NODE_t, so the item's address is the node's address
+    qnode_free((Q_NODE_p_t)item_address);
+}
 
-        aqueue->head = aqueue->head->next; // Remove the head
-        if (NULL == aqueue->head)
-        {
-            aqueue->tail = NULL;
-        }
-        aqueue->num_nodes--;
+/**
+ * @brief read the node pool counters, summed over every thread's cache
+ *
+ * @param stats struct to fill in
+ * @return returns 0 on success or -1 on failure
+ */
+int qpool_stats(QPOOL_STATS_t *stats)
+{
+    int ret = -1;
+    QPOOL_CACHE_p_t cache = NULL;
+
+    if (NULL == stats)
+    {
+        log_error("Invalid stats passed.");
+        goto END;
     }
-    pthread_mutex_unlock(&aqueue->lock);
 
+    memset(stats, 0, sizeof(QPOOL_STATS_t));
+    for (cache = atomic_load(&all_caches); NULL != cache; cache = cache->next_cache)
+    {
+        stats->hits += atomic_load_explicit(&cache->hits, memory_order_relaxed);
+        stats->misses += atomic_load_explicit(&cache->misses, memory_order_relaxed);
+        stats->remote_frees += atomic_load_explicit(&cache->remote_frees, memory_order_relaxed);
+    }
+
+    ret = 0;
 END:
     return ret;
 }
@@ -332,7 +1226,7 @@ int check_queue(QUEUE_p_t queue, void *data)
 
     if (NULL == queue)
     {
-        fprintf(stderr, "Queue is empty. Exiting check_queue.\n");
+        log_error("Queue is empty. Exiting check_queue.");
         goto END;
     }
     else if (NULL == queue->head) // if queue has no nodes, exit
@@ -367,7 +1261,7 @@ void *peek(QUEUE_p_t queue)
     void *ret = NULL;
     if (NULL == queue->head)
     {
-        perror("Queue is empty. Exiting peek.\n");
+        log_error("Queue is empty. Exiting peek.");
     }
     else
     {
@@ -426,19 +1320,16 @@ void print_int_queue(QUEUE_p_t list)
 int clear(QUEUE_p_t list)
 {
     int ret = -1;
-    Q_NODE_p_t temp = NULL;
 
     if (NULL == list)
     {
-        fprintf(stderr, "Queue is empty. Exiting clear.\n");
+        log_error("Queue is empty. Exiting clear.");
         goto END;
     }
 
     while (list->head != NULL)
     {
-        temp = dequeue(list, 1);
-        free(temp);
-        temp = NULL;
+        dequeue(list, 0); // nodes go back to the pool; the items are the caller's
     }
 
     if (NULL == list->head)
@@ -462,20 +1353,16 @@ int aclear(AQUEUE_p_t list)
 {
     {
         int ret = -1;
-        Q_NODE_p_t temp = NULL;
 
         if (NULL == list)
         {
-            fprintf(stderr, "Queue is empty. Exiting clear.\n");
+            log_error("Queue is empty. Exiting clear.");
             goto END;
         }
 
         while (list->head != NULL)
         {
-            temp = (Q_NODE_p_t)adequeue(list, 0);
-
-            free(temp);
-            temp = NULL;
+            adequeue(list, 0); // nodes go back to the pool; the items are the caller's
         }
 
         if (NULL == list->head)
@@ -501,13 +1388,13 @@ int destroy(QUEUE_p_t queue)
 
     if (NULL == queue)
     {
-        fprintf(stderr, "Queue is empty. Exiting destroy.\n");
+        log_error("Queue is empty. Exiting destroy.");
         goto END;
     }
 
     if (-1 == clear(queue))
     {
-        fprintf(stderr, "Failed to clear queue.\n");
+        log_error("Failed to clear queue.");
         goto END;
     }
 
@@ -533,16 +1420,21 @@ int adestroy(AQUEUE_p_t aqueue)
 
     if (NULL == aqueue)
     {
-        fprintf(stderr, "Queue is empty. Exiting destroy.\n");
+        log_error("Queue is empty. Exiting destroy.");
         goto END;
     }
 
     if (-1 == aclear(aqueue))
     {
-        fprintf(stderr, "Failed to clear queue.\n");
+        log_error("Failed to clear queue.");
         goto END;
     }
     pthread_mutex_destroy(&(aqueue->lock));
+    if (-1 != aqueue->wake_fd)
+    {
+        close(aqueue->wake_fd);
+        aqueue->wake_fd = -1;
+    }
 
     ret = 0;
 END:
@@ -551,4 +1443,33 @@ END:
     return ret;
 }
 
+/**
+ * @brief destroy the lock-free ring queue. Items still in the queue are not freed.
+ *
+ * @param rqueue reference to queue to destroy
+ * @return returns 0 on success or -1 on failure
+ *
+ */
+int rdestroy(RQUEUE_p_t rqueue)
+{
+    int ret = -1;
+
+    if (NULL == rqueue)
+    {
+        log_error("Queue is empty. Exiting destroy.");
+        goto END;
+    }
+    if (-1 != rqueue->wake_fd)
+    {
+        close(rqueue->wake_fd);
+        rqueue->wake_fd = -1;
+    }
+
+    ret = 0;
+END:
+    free(rqueue);
+    rqueue = NULL;
+    return ret;
+}
+
 /*** end of file ***/
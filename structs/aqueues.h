@@ -1,6 +1,7 @@
 #ifndef QUEUES_H
 #define QUEUES_H
 
+#include <errno.h>
 #include <float.h>
 #include <pthread.h>
 #include <stdarg.h>
@@ -9,21 +10,65 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
 
+#include "log.h"
+
 #define MAX_QUEUE_NODES 1000
+#define CACHE_LINE_SIZE 64
+#define RQUEUE_CAPACITY 1024 // must be a power of two and >= MAX_QUEUE_NODES
+#define QPOOL_SLAB_NODES 256 // nodes carved from each chunk when a thread's node cache runs dry
+#define QPOOL_BATCH 32       // nodes freed by another thread are handed back to their owner this many at a time
+
+struct qpool_cache;
 
 /**
  * @brief node for our queues. Linked list implementation that utilizes void pointers.
  *  We will be enqueueing items to the tail of the queue, and dequeueing items from the head of the queue.
+ *  Nodes come from the node pool; owner is the thread cache the node is returned to (NULL for a plain calloc'd node).
  */
 
 typedef struct q_node
 {
     void *data;
     struct q_node *next;
+    struct qpool_cache *owner;
 } Q_NODE_t, *Q_NODE_p_t;
 
+/**
+ * @brief a thread's node cache in the node pool. The owning thread allocates from free_list without synchronization
+ * and refills it from whole slabs of QPOOL_SLAB_NODES nodes. Other threads that free this thread's nodes collect them
+ * into a pending batch and push the whole batch onto inbox with one CAS; the owner takes the inbox when it runs dry.
+ * Caches live for the life of the process so nodes can always be returned to them.
+ */
+
+typedef struct qpool_cache
+{
+    Q_NODE_p_t free_list;
+    Q_NODE_p_t pending; // batch of another cache's nodes freed by this thread
+    Q_NODE_p_t pending_tail;
+    struct qpool_cache *pending_owner;
+    size_t num_pending;
+    atomic_size_t hits;
+    atomic_size_t misses;
+    atomic_size_t remote_frees;
+    struct qpool_cache *next_cache;
+    _Alignas(CACHE_LINE_SIZE) _Atomic(Q_NODE_p_t) inbox;
+} QPOOL_CACHE_t, *QPOOL_CACHE_p_t;
+
+/**
+ * @brief node pool counters, summed over every thread's cache. A hit is an allocation served from a cache, a miss is
+ * one that had to carve a new slab, and remote frees are nodes freed by a thread other than their owner.
+ */
+
+typedef struct qpool_stats
+{
+    size_t hits;
+    size_t misses;
+    size_t remote_frees;
+} QPOOL_STATS_t;
+
 /**
  * @brief a struct to represent our queue
  */
@@ -35,7 +80,8 @@ typedef struct queue
 } QUEUE_t, *QUEUE_p_t;
 
 /**
- * @brief a struct to represent our atomic queue
+ * @brief a struct to represent our atomic queue. With wakeups enabled, wake_fd is an eventfd that becomes readable when
+ * items are enqueued; wake_pending keeps a burst of enqueues down to one eventfd write until a consumer acks it.
  */
 
 typedef struct aqueue
@@ -44,9 +90,39 @@ typedef struct aqueue
     Q_NODE_p_t tail;
     atomic_int num_nodes;
     pthread_mutex_t lock;
+    int wake_fd; // -1 until aqueue_enable_wakeup()
+    atomic_int wake_pending;
 
 } AQUEUE_t, *AQUEUE_p_t;
 
+/**
+ * @brief a slot in our ring queue. The sequence number tells producers and consumers whose turn it is to use the slot,
+ * so no lock is needed to hand the data pointer across threads.
+ */
+
+typedef struct rq_slot
+{
+    atomic_size_t sequence;
+    void *data;
+} RQ_SLOT_t, *RQ_SLOT_p_t;
+
+/**
+ * @brief a struct to represent our lock-free ring queue. A bounded multi-producer/multi-consumer queue with
+ * sequence-numbered slots (RQUEUE_CAPACITY of them). Items are enqueued at the tail and dequeued from the head, each
+ * of which sits on its own cache line so producers and consumers do not false share. No allocation happens per item.
+ * Wakeups work as for AQUEUE_t.
+ */
+
+typedef struct rqueue
+{
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t head;
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t tail;
+    _Alignas(CACHE_LINE_SIZE) atomic_int wake_pending;
+    _Alignas(CACHE_LINE_SIZE) size_t mask;
+    int wake_fd; // -1 until rqueue_enable_wakeup()
+    RQ_SLOT_t slots[RQUEUE_CAPACITY];
+} RQUEUE_t, *RQUEUE_p_t;
+
 /**
  * @brief create a queue with items
  *
@@ -67,6 +143,16 @@ QUEUE_p_t create_queue(void **items, int numItems);
  */
 AQUEUE_p_t create_aqueue(void **items, int numItems);
 
+/**
+ * @brief create a lock-free ring queue with items
+ *
+ * @param items items to initialize queue with (for empty queue pass NULL)
+ * @param numItems number of items in items
+ * @return pointer to the ring queue or NULL on failure
+ *
+ */
+RQUEUE_p_t create_rqueue(void **items, int numItems);
+
 /**
  * @brief enqueue an item to the tail of a queue
  *
@@ -85,11 +171,42 @@ int enqueue(QUEUE_p_t queue, void *item);
  */
 int aenqueue(AQUEUE_p_t aqueue, void *item);
 
+/**
+ * @brief enqueue an item to the tail of a lock-free ring queue
+ *
+ * @param rqueue queue to add item to
+ * @param item item to add to queue (must not be NULL)
+ * @return returns 0 on success or -1 on failure (including a full queue)
+ */
+int renqueue(RQUEUE_p_t rqueue, void *item);
+
+/**
+ * @brief enqueue several items to the tail of an atomic queue under a single lock acquisition. The nodes are taken
+ * from the pool and chained before the lock is taken.
+ *
+ * @param aqueue queue to add items to
+ * @param items items to add, in order (none may be NULL)
+ * @param n number of items
+ * @return returns the number of items enqueued (fewer than n if the queue filled up), or -1 on failure
+ */
+int aenqueue_bulk(AQUEUE_p_t aqueue, void **items, size_t n);
+
+/**
+ * @brief enqueue several items to the tail of a lock-free ring queue, claiming all of their slots with a single CAS
+ *
+ * @param rqueue queue to add items to
+ * @param items items to add, in order (none may be NULL)
+ * @param n number of items
+ * @return returns the number of items enqueued (fewer than n if the queue filled up), or -1 on failure
+ */
+int renqueue_bulk(RQUEUE_p_t rqueue, void **items, size_t n);
+
 /**
  * @brief dequeue an item from the head of a queue
  *
  * @param queue queue to add item to
- * @param ret_address if set to 1, returns the address of dequeued item. Otherwise returns the item.
+ * @param ret_address if set to 1, returns the address of dequeued item inside its node, and the caller must hand the
+ * node back with free_qnode(). Otherwise returns the item and the node goes straight back to the pool.
  * @return the item that was at the head of the queue, or NULL if the queue was empty
  *
  */
@@ -99,12 +216,99 @@ void *dequeue(QUEUE_p_t queue, int ret_address);
  * @brief dequeue an item from the head of an atomic queue
  *
  * @param aqueue queue to add item to
- * @param ret_address if set to 1, returns the address of dequeued item. Otherwise returns the item.
+ * @param ret_address if set to 1, returns the address of dequeued item inside its node, and the caller must hand the
+ * node back with free_qnode(). Otherwise returns the item and the node goes straight back to the pool.
  * @return the item that was at the head of the queue, or NULL if the queue was empty
  *
  */
 void *adequeue(AQUEUE_p_t aqueue, int ret_address);
 
+/**
+ * @brief dequeue an item from the head of a lock-free ring queue
+ *
+ * @param rqueue queue to remove item from
+ * @return the item that was at the head of the queue, or NULL if the queue was empty
+ *
+ */
+void *rdequeue(RQUEUE_p_t rqueue);
+
+/**
+ * @brief dequeue up to max items from the head of an atomic queue under a single lock acquisition
+ *
+ * @param aqueue queue to remove items from
+ * @param out array receiving the items, oldest first
+ * @param max size of out
+ * @return returns the number of items dequeued (0 if the queue was empty), or -1 on failure
+ */
+int adequeue_bulk(AQUEUE_p_t aqueue, void **out, size_t max);
+
+/**
+ * @brief dequeue up to max items from the head of a lock-free ring queue, claiming them with a single CAS
+ *
+ * @param rqueue queue to remove items from
+ * @param out array receiving the items, oldest first
+ * @param max size of out
+ * @return returns the number of items dequeued (0 if the queue was empty), or -1 on failure
+ */
+int rdequeue_bulk(RQUEUE_p_t rqueue, void **out, size_t max);
+
+/**
+ * @brief approximate number of items in a lock-free ring queue. Exact when no other thread is using the queue.
+ *
+ * @param rqueue queue to count
+ * @return number of items in the queue, or 0 for a NULL queue
+ */
+size_t rqueue_count(RQUEUE_p_t rqueue);
+
+/**
+ * @brief give an atomic queue an eventfd that becomes readable whenever items are enqueued, so consumers can sleep in
+ * poll()/epoll on it instead of polling the queue. Call once, before the queue is shared.
+ *
+ * @param aqueue queue to enable wakeups on
+ * @return returns the eventfd (owned by the queue, closed by adestroy()), or -1 on failure
+ */
+int aqueue_enable_wakeup(AQUEUE_p_t aqueue);
+
+/**
+ * @brief give a lock-free ring queue an eventfd that becomes readable whenever items are enqueued, so consumers can
+ * sleep in poll()/epoll on it instead of polling the queue. Call once, before the queue is shared.
+ *
+ * @param rqueue queue to enable wakeups on
+ * @return returns the eventfd (owned by the queue, closed by rdestroy()), or -1 on failure
+ */
+int rqueue_enable_wakeup(RQUEUE_p_t rqueue);
+
+/**
+ * @brief acknowledge a wakeup on an atomic queue's eventfd. Call when the eventfd polls readable, then dequeue until
+ * the queue is empty; anything enqueued after the ack raises a new wakeup.
+ *
+ * @param aqueue queue whose eventfd was readable
+ */
+void aqueue_wakeup_ack(AQUEUE_p_t aqueue);
+
+/**
+ * @brief acknowledge a wakeup on a lock-free ring queue's eventfd. Call when the eventfd polls readable, then dequeue
+ * until the queue is empty; anything enqueued after the ack raises a new wakeup.
+ *
+ * @param rqueue queue whose eventfd was readable
+ */
+void rqueue_wakeup_ack(RQUEUE_p_t rqueue);
+
+/**
+ * @brief return a node to the node pool. Only needed after dequeue()/adequeue() with ret_address set to 1.
+ *
+ * @param item_address the address returned by dequeue()/adequeue()
+ */
+void free_qnode(void *item_address);
+
+/**
+ * @brief read the node pool counters, summed over every thread's cache
+ *
+ * @param stats struct to fill in
+ * @return returns 0 on success or -1 on failure
+ */
+int qpool_stats(QPOOL_STATS_t *stats);
+
 /**
  * @brief checks if an item is already in the queue
  *
@@ -169,4 +373,13 @@ int destroy(QUEUE_p_t queue);
  */
 int adestroy(AQUEUE_p_t aqueue);
 
+/**
+ * @brief destroy the lock-free ring queue. Items still in the queue are not freed.
+ *
+ * @param rqueue reference to queue to destroy
+ * @return returns 0 on success or -1 on failure
+ *
+ */
+int rdestroy(RQUEUE_p_t rqueue);
+
 #endif
@@ -0,0 +1,952 @@
+#include "../include/bench.h"
+
+/**
+ * @brief Reads the monotonic clock.
+ *
+ * @return nanoseconds
+ */
+static uint64_t bench_now(void)
+{
+    struct timespec now = {0};
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * 1000000000u) + (uint64_t)now.tv_nsec;
+}
+
+/**
+ * @brief Steps a thread's xorshift generator.
+ *
+ * @param state the generator
+ * @return the next value
+ */
+static uint64_t bench_rand(uint64_t *state)
+{
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+/**
+ * @brief Adds a latency sample, growing the thread's buffer as needed. A sample that does not fit is dropped rather
+ * than failing the run.
+ *
+ * @param samples the thread's samples
+ * @param ns the latency
+ */
+static void bench_record(bench_samples_t *samples, uint64_t ns)
+{
+    uint64_t *grown = NULL;
+    size_t new_cap = 0;
+
+    if (samples->count == samples->cap)
+    {
+        new_cap = (0 == samples->cap) ? 1024 : samples->cap * 2;
+        grown = realloc(samples->ns, new_cap * sizeof(uint64_t));
+        if (NULL == grown)
+        {
+            goto END;
+        }
+        samples->ns = grown;
+        samples->cap = new_cap;
+    }
+    samples->ns[samples->count++] = ns;
+
+END:
+    return;
+}
+
+/**
+ * @brief Builds the key for index i: the index and a multiplicative hash of it, so keys differ in every byte.
+ *
+ * @param key BENCH_KEY_LEN bytes
+ * @param i the index
+ */
+static void bench_key(char *key, uint64_t i)
+{
+    uint64_t mixed = i * UINT64_C(0x9e3779b97f4a7c15);
+
+    memcpy(key, &i, sizeof(uint64_t));
+    memcpy(key + sizeof(uint64_t), &mixed, sizeof(uint64_t));
+}
+
+/**
+ * @brief Gets the thread count after threads: doubling, but never skipping max_threads.
+ *
+ * @param threads the current count
+ * @param max_threads the largest count
+ * @return the next count, or a count above max_threads when done
+ */
+static int bench_next_threads(int threads, int max_threads)
+{
+    return ((threads < max_threads) && ((threads * 2) > max_threads)) ? max_threads : threads * 2;
+}
+
+static int bench_compare_ns(const void *a, const void *b)
+{
+    uint64_t left = *(const uint64_t *)a;
+    uint64_t right = *(const uint64_t *)b;
+
+    return (left > right) - (left < right);
+}
+
+/**
+ * @brief Merges the workers' samples and fills in the result's percentiles.
+ *
+ * @param result the result
+ * @param run the finished run
+ * @param role only workers with this role are counted, or -1 for all
+ * @param handoffs 1 to use the handoff samples instead of the per-call ones
+ */
+static void bench_percentiles(bench_result_t *result, bench_run_t *run, int role, int handoffs)
+{
+    uint64_t *all = NULL;
+    size_t total = 0;
+    int index = 0;
+    bench_samples_t *samples = NULL;
+
+    for (index = 0; index < run->num_workers; index++)
+    {
+        samples = (1 == handoffs) ? &run->workers[index].handoffs : &run->workers[index].samples;
+        total += ((-1 == role) || (role == run->workers[index].role)) ? samples->count : 0;
+    }
+    if (0 == total)
+    {
+        goto END;
+    }
+    all = malloc(total * sizeof(uint64_t));
+    if (NULL == all)
+    {
+        fprintf(stderr, "Failed to alloc samples.\n");
+        goto END;
+    }
+
+    total = 0;
+    for (index = 0; index < run->num_workers; index++)
+    {
+        samples = (1 == handoffs) ? &run->workers[index].handoffs : &run->workers[index].samples;
+        if ((-1 == role) || (role == run->workers[index].role))
+        {
+            memcpy(all + total, samples->ns, samples->count * sizeof(uint64_t));
+            total += samples->count;
+        }
+    }
+    qsort(all, total, sizeof(uint64_t), bench_compare_ns);
+
+    result->p50_ns = all[(total * 500) / 1000];
+    result->p90_ns = all[(total * 900) / 1000];
+    result->p99_ns = all[(total * 990) / 1000];
+    result->p999_ns = all[(total * 999) / 1000];
+    result->max_ns = all[total - 1];
+
+END:
+    free(all);
+    all = NULL;
+}
+
+/**
+ * @brief Writes a result as one JSON line to out, and a readable line to stdout.
+ *
+ * @param out the results file
+ * @param result the result
+ */
+static void bench_emit(FILE *out, const bench_result_t *result)
+{
+    double seconds = (double)result->elapsed_ns / 1e9;
+    double ops_per_sec = (0.0 < seconds) ? ((double)result->ops / seconds) : 0.0;
+
+    fprintf(out,
+            "{\"suite\":\"%s\",\"op\":\"%s\",\"threads\":%d,\"size\":%zu,\"ops\":%zu,\"seconds\":%.6f,"
+            "\"ops_per_sec\":%.0f,\"p50_ns\":%" PRIu64 ",\"p90_ns\":%" PRIu64 ",\"p99_ns\":%" PRIu64
+            ",\"p999_ns\":%" PRIu64 ",\"max_ns\":%" PRIu64 "}\n",
+            result->suite, result->op, result->threads, result->size, result->ops, seconds, ops_per_sec,
+            result->p50_ns, result->p90_ns, result->p99_ns, result->p999_ns, result->max_ns);
+    fflush(out);
+
+    printf("%-8s %-14s threads %3d size %9zu  %12.0f ops/s  p50 %6" PRIu64 " p99 %7" PRIu64 " p99.9 %8" PRIu64
+           " ns\n",
+           result->suite, result->op, result->threads, result->size, ops_per_sec, result->p50_ns, result->p99_ns,
+           result->p999_ns);
+}
+
+/**
+ * @brief Starts every worker, releases them together and waits for them all.
+ *
+ * @param run the run; workers, num_workers and work are set
+ * @return returns 0 on success, or -1 on failure
+ */
+static int bench_start(bench_run_t *run)
+{
+    int ret = -1;
+    int index = 0;
+    int started = 0;
+    uint64_t begin = 0;
+
+    if (0 != pthread_barrier_init(&run->start, NULL, (unsigned)run->num_workers + 1))
+    {
+        fprintf(stderr, "Failed to init start barrier.\n");
+        goto END;
+    }
+    for (started = 0; started < run->num_workers; started++)
+    {
+        run->workers[started].run = run;
+        run->workers[started].index = started;
+        run->workers[started].rng = UINT64_C(0x2545f4914f6cdd1d) + (uint64_t)started * 7919;
+        if (0 != pthread_create(&run->workers[started].thread, NULL, run->work, &run->workers[started]))
+        {
+            fprintf(stderr, "Failed to start benchmark thread.\n");
+            abort(); // the others are parked on the barrier and cannot be released without it
+        }
+    }
+
+    pthread_barrier_wait(&run->start);
+    begin = bench_now();
+    for (index = 0; index < run->num_workers; index++)
+    {
+        pthread_join(run->workers[index].thread, NULL);
+    }
+    run->elapsed_ns = bench_now() - begin;
+    pthread_barrier_destroy(&run->start);
+
+    ret = 0;
+END:
+    return ret;
+}
+
+/**
+ * @brief Allocates a run's workers.
+ *
+ * @param run the run to set up
+ * @param num_workers number of threads
+ * @param work the thread function
+ * @param target the structure under test
+ * @param size sessions or keys in target
+ * @return returns 0 on success, or -1 on failure
+ */
+static int bench_prepare(bench_run_t *run, int num_workers, void *(*work)(void *arg), void *target, size_t size)
+{
+    int ret = -1;
+
+    memset(run, 0, sizeof(bench_run_t));
+    run->workers = calloc((size_t)num_workers, sizeof(bench_worker_t));
+    if (NULL == run->workers)
+    {
+        fprintf(stderr, "Failed to alloc benchmark workers.\n");
+        goto END;
+    }
+    run->num_workers = num_workers;
+    run->work = work;
+    run->target = target;
+    run->size = size;
+
+    ret = 0;
+END:
+    return ret;
+}
+
+/**
+ * @brief Frees a run's workers and their samples.
+ *
+ * @param run the run
+ */
+static void bench_release(bench_run_t *run)
+{
+    int index = 0;
+
+    for (index = 0; index < run->num_workers; index++)
+    {
+        free(run->workers[index].samples.ns);
+        free(run->workers[index].handoffs.ns);
+    }
+    free(run->workers);
+    run->workers = NULL;
+}
+
+/**
+ * @brief Queue thread. Producers enqueue their share of items, each item being its enqueue timestamp; consumers
+ * dequeue their share, timing the call and the item's time in the queue.
+ *
+ * @param arg the worker
+ * @return NULL
+ */
+static void *bench_queue_work(void *arg)
+{
+    bench_worker_t *worker = arg;
+    AQUEUE_p_t aqueue = worker->run->target;
+    size_t done = 0;
+    uint64_t begin = 0;
+    uint64_t end = 0;
+    void *item = NULL;
+
+    pthread_barrier_wait(&worker->run->start);
+    while (done < worker->ops)
+    {
+        if (0 == worker->role)
+        {
+            while (BENCH_QUEUE_HIGH <= atomic_load(&aqueue->num_nodes))
+            {
+                sched_yield();
+            }
+            begin = bench_now();
+            if (-1 == aenqueue(aqueue, (void *)(uintptr_t)begin))
+            {
+                continue;
+            }
+            if (0 == (done & BENCH_SAMPLE_MASK))
+            {
+                bench_record(&worker->samples, bench_now() - begin);
+            }
+        }
+        else
+        {
+            begin = (0 == (done & BENCH_SAMPLE_MASK)) ? bench_now() : 0;
+            item = adequeue(aqueue, 0);
+            if (NULL == item)
+            {
+                sched_yield();
+                continue;
+            }
+            if (0 != begin)
+            {
+                end = bench_now();
+                bench_record(&worker->samples, end - begin);
+                bench_record(&worker->handoffs, end - (uint64_t)(uintptr_t)item);
+            }
+        }
+        done++;
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Checks adequeue_bulk() against the cases a benchmark run does not reach: a max of 0 on a non-empty queue, and
+ * a max shorter than the queue. Items must come back in order and the rest must stay queued.
+ *
+ * @return returns 0 if the queue behaves, or -1 on failure
+ */
+static int bench_check_queues(void)
+{
+    int ret = -1;
+    int taken = 0;
+    uintptr_t index = 0;
+    void *items[BENCH_CHECK_ITEMS] = {0};
+    void *out[BENCH_CHECK_ITEMS + 1] = {0};
+    AQUEUE_p_t aqueue = NULL;
+
+    for (index = 0; index < BENCH_CHECK_ITEMS; index++)
+    {
+        items[index] = (void *)(index + 1);
+    }
+    aqueue = create_aqueue(NULL, 0);
+    if ((NULL == aqueue) || (-1 == aenqueue_bulk(aqueue, items, BENCH_CHECK_ITEMS)))
+    {
+        goto END;
+    }
+
+    taken = adequeue_bulk(aqueue, out, 0);
+    if ((0 != taken) || (NULL != out[0]) || (BENCH_CHECK_ITEMS != aqueue->num_nodes))
+    {
+        fprintf(stderr, "adequeue_bulk() with max 0 took %d items.\n", taken);
+        goto END;
+    }
+    taken = adequeue_bulk(aqueue, out, 2);
+    if ((2 != taken) || (items[0] != out[0]) || (items[1] != out[1]) || (NULL != out[2]) ||
+        ((BENCH_CHECK_ITEMS - 2) != aqueue->num_nodes))
+    {
+        fprintf(stderr, "adequeue_bulk() with max 2 took %d items.\n", taken);
+        goto END;
+    }
+    taken = adequeue_bulk(aqueue, out, BENCH_CHECK_ITEMS + 1);
+    if (((BENCH_CHECK_ITEMS - 2) != taken) || (items[2] != out[0]) ||
+        (items[BENCH_CHECK_ITEMS - 1] != out[BENCH_CHECK_ITEMS - 3]) || (0 != aqueue->num_nodes) ||
+        (NULL != aqueue->head) || (NULL != aqueue->tail))
+    {
+        fprintf(stderr, "adequeue_bulk() draining the queue took %d items.\n", taken);
+        goto END;
+    }
+
+    ret = 0;
+END:
+    if (NULL != aqueue)
+    {
+        adestroy(aqueue);
+        aqueue = NULL;
+    }
+    return ret;
+}
+
+/**
+ * @brief Opens the snapshot check's table: its image, if one was written, then its log replayed over it.
+ *
+ * @param dir_fd the check's directory
+ * @param wal receives the table's log
+ * @return returns the table, or NULL on failure
+ */
+static shtable_t *bench_check_open(int dir_fd, wal_t **wal)
+{
+    shtable_t *ret = NULL;
+    shtable_t *table = NULL;
+    shimage_t *image = NULL;
+
+    table = create_shtable(NULL);
+    if ((NULL == table) || (-1 == shimage_open(dir_fd, "check.img", &image)))
+    {
+        goto FAIL;
+    }
+    if ((NULL != image) && (-1 == shtable_attach_image(table, image)))
+    {
+        shimage_close(image);
+        goto FAIL;
+    }
+    *wal = wal_open(dir_fd, "check.wal", WAL_SYNC_NONE, shtable_apply_wal, table);
+    if ((NULL == *wal) || (-1 == shtable_attach_wal(table, *wal)))
+    {
+        goto FAIL;
+    }
+
+    ret = table;
+    goto END;
+FAIL:
+    if (NULL != *wal)
+    {
+        wal_close(*wal);
+        *wal = NULL;
+    }
+    if (NULL != table)
+    {
+        destroy_shtable(table);
+        table = NULL;
+    }
+END:
+    return ret;
+}
+
+/**
+ * @brief Snapshot check thread: reads every key over and over, so image keys are promoted while the snapshot runs.
+ *
+ * @param arg the table
+ * @return NULL
+ */
+static void *bench_check_reader(void *arg)
+{
+    shtable_t *table = arg;
+    char key[BENCH_KEY_LEN];
+    char value[BENCH_VALUE_LEN];
+    uint64_t index = 0;
+    int pass = 0;
+
+    for (pass = 0; pass < 4; pass++)
+    {
+        for (index = 0; index < BENCH_CHECK_KEYS; index++)
+        {
+            bench_key(key, index);
+            shtable_get(table, key, BENCH_KEY_LEN, value, sizeof(value));
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Checks that a snapshot loses no image key that reads promote into memory while it runs: writes an image,
+ * reopens it, snapshots again while a thread reads every key, then reopens the new image and log and reads every key
+ * back.
+ *
+ * @return returns 0 if every key survives, or -1 on failure
+ */
+static int bench_check_snapshot(void)
+{
+    int ret = -1;
+    int dir_fd = -1;
+    int round = 0;
+    int started = 0;
+    uint64_t index = 0;
+    char dir_name[] = BENCH_CHECK_DIR;
+    char key[BENCH_KEY_LEN];
+    char value[BENCH_VALUE_LEN];
+    shtable_t *table = NULL;
+    wal_t *wal = NULL;
+    pthread_t reader;
+
+    if ((NULL == mkdtemp(dir_name)) || (-1 == (dir_fd = open(dir_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC))))
+    {
+        perror("snapshot check directory");
+        goto END;
+    }
+
+    for (round = 0; round < 3; round++) // fill and image it, image it again under reads, then read it back
+    {
+        table = bench_check_open(dir_fd, &wal);
+        if (NULL == table)
+        {
+            goto END;
+        }
+        if (0 == round)
+        {
+            for (index = 0; index < BENCH_CHECK_KEYS; index++)
+            {
+                bench_key(key, index);
+                if (-1 == shtable_put(table, key, BENCH_KEY_LEN, key, BENCH_VALUE_LEN))
+                {
+                    goto END;
+                }
+            }
+        }
+        if (1 == round)
+        {
+            started = (0 == pthread_create(&reader, NULL, bench_check_reader, table)) ? 1 : 0;
+        }
+        if ((2 > round) && (-1 == shtable_snapshot(table, dir_fd, "check.img")))
+        {
+            goto END;
+        }
+        if (1 == started)
+        {
+            pthread_join(reader, NULL);
+            started = 0;
+        }
+        if (2 == round)
+        {
+            for (index = 0; index < BENCH_CHECK_KEYS; index++)
+            {
+                bench_key(key, index);
+                if ((BENCH_VALUE_LEN != shtable_get(table, key, BENCH_KEY_LEN, value, sizeof(value))) ||
+                    (0 != memcmp(key, value, BENCH_VALUE_LEN)))
+                {
+                    fprintf(stderr, "Snapshot lost key %" PRIu64 ".\n", index);
+                    goto END;
+                }
+            }
+        }
+        wal_close(wal);
+        wal = NULL;
+        destroy_shtable(table);
+        table = NULL;
+    }
+
+    ret = 0;
+END:
+    if (1 == started)
+    {
+        pthread_join(reader, NULL);
+    }
+    if (NULL != wal)
+    {
+        wal_close(wal);
+        wal = NULL;
+    }
+    if (NULL != table)
+    {
+        destroy_shtable(table);
+        table = NULL;
+    }
+    if (-1 != dir_fd)
+    {
+        unlinkat(dir_fd, "check.img", 0);
+        unlinkat(dir_fd, "check.wal", 0);
+        close(dir_fd);
+        rmdir(dir_name);
+    }
+    return ret;
+}
+
+/**
+ * @brief Runs the atomic queue with 1..max_threads producers and as many consumers.
+ *
+ * @param out the results file
+ * @param max_threads the most producers
+ * @return returns 0 on success, or -1 on failure
+ */
+static int bench_queues(FILE *out, int max_threads)
+{
+    int ret = -1;
+    int threads = 0;
+    int index = 0;
+    AQUEUE_p_t aqueue = NULL;
+    bench_run_t run = {0};
+    bench_result_t result = {0};
+
+    for (threads = 1; threads <= max_threads; threads = bench_next_threads(threads, max_threads))
+    {
+        aqueue = create_aqueue(NULL, 0);
+        if ((NULL == aqueue) || (-1 == bench_prepare(&run, threads * 2, bench_queue_work, aqueue, 0)))
+        {
+            goto END;
+        }
+        for (index = 0; index < threads * 2; index++)
+        {
+            run.workers[index].role = index % 2;
+            run.workers[index].ops = BENCH_QUEUE_ITEMS / (size_t)threads;
+        }
+        if (-1 == bench_start(&run))
+        {
+            goto END;
+        }
+
+        result = (bench_result_t){.suite = "aqueue", .op = "aenqueue", .threads = threads,
+                                  .ops = run.workers[0].ops * (size_t)threads, .elapsed_ns = run.elapsed_ns};
+        bench_percentiles(&result, &run, 0, 0);
+        bench_emit(out, &result);
+        result.op = "adequeue";
+        bench_percentiles(&result, &run, 1, 0);
+        bench_emit(out, &result);
+        result.op = "handoff";
+        bench_percentiles(&result, &run, 1, 1);
+        bench_emit(out, &result);
+
+        bench_release(&run);
+        adestroy(aqueue);
+        aqueue = NULL;
+    }
+
+    ret = 0;
+END:
+    if (NULL != aqueue)
+    {
+        bench_release(&run);
+        adestroy(aqueue);
+        aqueue = NULL;
+    }
+    return ret;
+}
+
+/**
+ * @brief Sessions thread: looks up random existing sessions with check_session(), or copy_session() when role is 1.
+ *
+ * @param arg the worker
+ * @return NULL
+ */
+static void *bench_session_work(void *arg)
+{
+    bench_worker_t *worker = arg;
+    sessions_t *p_sessions = worker->run->target;
+    const uint32_t *ids = worker->run->data;
+    size_t done = 0;
+    uint64_t begin = 0;
+    uint32_t session_id = 0;
+    int found = 0;
+    session_t match = {0};
+
+    pthread_barrier_wait(&worker->run->start);
+    for (done = 0; done < worker->ops; done++)
+    {
+        session_id = ids[bench_rand(&worker->rng) % worker->run->size];
+        begin = (0 == (done & BENCH_SAMPLE_MASK)) ? bench_now() : 0;
+        found = (0 == worker->role) ? (0 != check_session(session_id, p_sessions))
+                                    : (0 == copy_session(session_id, p_sessions, &match));
+        free(match.username); // taken by value under the table lock; the copy is the caller's
+        match.username = NULL;
+        if (0 != begin)
+        {
+            bench_record(&worker->samples, bench_now() - begin);
+        }
+        if (0 == found)
+        {
+            fprintf(stderr, "Session %" PRIu32 " went missing.\n", session_id);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Runs the sessions table at 10..MAX_SESSIONS sessions: fills it, then looks sessions up from 1..max_threads
+ * threads.
+ *
+ * @param out the results file
+ * @param max_threads the most lookup threads
+ * @return returns 0 on success, or -1 on failure
+ */
+static int bench_sessions(FILE *out, int max_threads)
+{
+    int ret = -1;
+    int threads = 0;
+    int role = 0;
+    int index = 0;
+    size_t size = 0;
+    size_t added = 0;
+    uint64_t begin = 0;
+    uint64_t op_begin = 0;
+    uint32_t *ids = NULL;
+    sessions_t *p_sessions = NULL;
+    bench_run_t run = {0};
+    bench_result_t result = {0};
+    bench_samples_t adds = {0};
+
+    for (size = 10; size <= MAX_SESSIONS; size *= 10)
+    {
+        p_sessions = create_sessions_table();
+        ids = calloc(size, sizeof(uint32_t));
+        if ((NULL == p_sessions) || (NULL == ids))
+        {
+            fprintf(stderr, "Failed to set up sessions benchmark.\n");
+            goto END;
+        }
+
+        // every add is timed: they are few, and slow enough that the clock reads do not dominate
+        adds.count = 0;
+        begin = bench_now();
+        for (added = 0; (added < size) && (added < (MAX_SESSIONS - 1)); added++)
+        {
+            op_begin = bench_now();
+            ids[added] = add_session(1, p_sessions, NULL, 0);
+            bench_record(&adds, bench_now() - op_begin);
+            if (0 == ids[added])
+            {
+                goto END;
+            }
+        }
+        result = (bench_result_t){.suite = "sessions", .op = "add_session", .threads = 1, .size = added,
+                                  .ops = added, .elapsed_ns = bench_now() - begin};
+        run = (bench_run_t){.workers = &(bench_worker_t){.samples = adds}, .num_workers = 1};
+        bench_percentiles(&result, &run, -1, 0);
+        bench_emit(out, &result);
+
+        for (threads = 1; threads <= max_threads; threads = bench_next_threads(threads, max_threads))
+        {
+            for (role = 0; role < 2; role++)
+            {
+                if (-1 == bench_prepare(&run, threads, bench_session_work, p_sessions, added))
+                {
+                    goto END;
+                }
+                run.data = ids;
+                for (index = 0; index < threads; index++)
+                {
+                    run.workers[index].role = role;
+                    run.workers[index].ops = BENCH_SESSION_LOOKUPS / (size_t)threads;
+                }
+                if (-1 == bench_start(&run))
+                {
+                    bench_release(&run);
+                    goto END;
+                }
+
+                result = (bench_result_t){.suite = "sessions", .op = (0 == role) ? "check_session" : "copy_session",
+                                          .threads = threads, .size = added,
+                                          .ops = run.workers[0].ops * (size_t)threads, .elapsed_ns = run.elapsed_ns};
+                bench_percentiles(&result, &run, -1, 0);
+                bench_emit(out, &result);
+                bench_release(&run);
+            }
+        }
+
+        destroy_sessions(p_sessions);
+        p_sessions = NULL;
+        free(ids);
+        ids = NULL;
+    }
+
+    ret = 0;
+END:
+    if (NULL != p_sessions)
+    {
+        destroy_sessions(p_sessions);
+        p_sessions = NULL;
+    }
+    free(ids);
+    ids = NULL;
+    free(adds.ns);
+    adds.ns = NULL;
+    return ret;
+}
+
+/**
+ * @brief Table thread: gets random existing keys, or overwrites their values when role is 1.
+ *
+ * @param arg the worker
+ * @return NULL
+ */
+static void *bench_table_work(void *arg)
+{
+    bench_worker_t *worker = arg;
+    shtable_t *table = worker->run->target;
+    size_t done = 0;
+    uint64_t begin = 0;
+    uint64_t index = 0;
+    int failed = 0;
+    char key[BENCH_KEY_LEN];
+    char value[BENCH_VALUE_LEN];
+
+    pthread_barrier_wait(&worker->run->start);
+    for (done = 0; done < worker->ops; done++)
+    {
+        index = bench_rand(&worker->rng) % worker->run->size;
+        bench_key(key, index);
+        memset(value, (int)(index & 0xff), sizeof(value));
+        begin = (0 == (done & BENCH_SAMPLE_MASK)) ? bench_now() : 0;
+        failed = (0 == worker->role)
+                     ? (BENCH_VALUE_LEN != shtable_get(table, key, sizeof(key), value, sizeof(value)))
+                     : (-1 == shtable_put(table, key, sizeof(key), value, sizeof(value)));
+        if (0 != begin)
+        {
+            bench_record(&worker->samples, bench_now() - begin);
+        }
+        if (0 != failed)
+        {
+            fprintf(stderr, "Table operation on key %" PRIu64 " failed.\n", index);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Runs the storage table at BENCH_TABLE_MIN_KEYS..max_keys keys, ten times more each step: loads it from one
+ * thread, then gets and updates keys from 1..max_threads threads.
+ *
+ * @param out the results file
+ * @param max_threads the most threads
+ * @param max_keys the largest table
+ * @return returns 0 on success, or -1 on failure
+ */
+static int bench_tables(FILE *out, int max_threads, size_t max_keys)
+{
+    int ret = -1;
+    int threads = 0;
+    int role = 0;
+    int index = 0;
+    size_t size = 0;
+    uint64_t key_index = 0;
+    uint64_t begin = 0;
+    uint64_t op_begin = 0;
+    shtable_t *table = NULL;
+    bench_run_t run = {0};
+    bench_result_t result = {0};
+    bench_samples_t loads = {0};
+    char key[BENCH_KEY_LEN];
+    char value[BENCH_VALUE_LEN];
+
+    for (size = BENCH_TABLE_MIN_KEYS; size <= max_keys; size *= 10)
+    {
+        table = create_shtable(NULL);
+        if (NULL == table)
+        {
+            goto END;
+        }
+
+        loads.count = 0;
+        begin = bench_now();
+        for (key_index = 0; key_index < size; key_index++)
+        {
+            bench_key(key, key_index);
+            memset(value, (int)(key_index & 0xff), sizeof(value));
+            op_begin = (0 == (key_index & BENCH_SAMPLE_MASK)) ? bench_now() : 0;
+            if (-1 == shtable_put(table, key, sizeof(key), value, sizeof(value)))
+            {
+                goto END;
+            }
+            if (0 != op_begin)
+            {
+                bench_record(&loads, bench_now() - op_begin);
+            }
+        }
+        result = (bench_result_t){.suite = "shtable", .op = "shtable_put", .threads = 1, .size = size, .ops = size,
+                                  .elapsed_ns = bench_now() - begin};
+        run = (bench_run_t){.workers = &(bench_worker_t){.samples = loads}, .num_workers = 1};
+        bench_percentiles(&result, &run, -1, 0);
+        bench_emit(out, &result);
+
+        for (threads = 1; threads <= max_threads; threads = bench_next_threads(threads, max_threads))
+        {
+            for (role = 0; role < 2; role++)
+            {
+                if (-1 == bench_prepare(&run, threads, bench_table_work, table, size))
+                {
+                    goto END;
+                }
+                for (index = 0; index < threads; index++)
+                {
+                    run.workers[index].role = role;
+                    run.workers[index].ops = BENCH_TABLE_LOOKUPS / (size_t)threads;
+                }
+                if (-1 == bench_start(&run))
+                {
+                    bench_release(&run);
+                    goto END;
+                }
+
+                result = (bench_result_t){.suite = "shtable", .op = (0 == role) ? "shtable_get" : "shtable_update",
+                                          .threads = threads, .size = size,
+                                          .ops = run.workers[0].ops * (size_t)threads, .elapsed_ns = run.elapsed_ns};
+                bench_percentiles(&result, &run, -1, 0);
+                bench_emit(out, &result);
+                bench_release(&run);
+            }
+        }
+
+        destroy_shtable(table);
+        table = NULL;
+    }
+
+    ret = 0;
+END:
+    if (NULL != table)
+    {
+        destroy_shtable(table);
+        table = NULL;
+    }
+    free(loads.ns);
+    loads.ns = NULL;
+    return ret;
+}
+
+/**
+ * @brief Benchmarks the structures every request goes through: the atomic queues, the sessions table and the storage
+ * table. Results go to BENCH_OUTPUT_NAME as one JSON object per line, to be kept as a baseline and compared against.
+ *
+ * usage: bench [max_threads] [max_table_keys]
+ * max_threads defaults to the number of online CPUs and max_table_keys to BENCH_TABLE_MAX_KEYS.
+ */
+int main(int argc, char **argv)
+{
+    int ret = EXIT_FAILURE;
+    int max_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    size_t max_keys = BENCH_TABLE_MAX_KEYS;
+    FILE *out = NULL;
+
+    if (1 < argc)
+    {
+        max_threads = atoi(argv[1]);
+    }
+    if (2 < argc)
+    {
+        max_keys = strtoull(argv[2], NULL, 10);
+    }
+    if (1 > max_threads)
+    {
+        fprintf(stderr, "usage: %s [max_threads] [max_table_keys]\n", argv[0]);
+        goto END;
+    }
+
+    out = fopen(BENCH_OUTPUT_NAME, "w");
+    if (NULL == out)
+    {
+        perror("fopen()");
+        goto END;
+    }
+    fprintf(out, "{\"suite\":\"meta\",\"max_threads\":%d,\"max_table_keys\":%zu,\"cpus\":%ld,\"sample_every\":%d}\n",
+            max_threads, max_keys, sysconf(_SC_NPROCESSORS_ONLN), BENCH_SAMPLE_MASK + 1);
+
+    if ((-1 == bench_check_queues()) || (-1 == bench_check_snapshot()) || (-1 == bench_queues(out, max_threads)) ||
+        (-1 == bench_sessions(out, max_threads)) || (-1 == bench_tables(out, max_threads, max_keys)))
+    {
+        fprintf(stderr, "Benchmark failed.\n");
+        goto END;
+    }
+
+    ret = EXIT_SUCCESS;
+END:
+    if (NULL != out)
+    {
+        fclose(out);
+        out = NULL;
+    }
+    return ret;
+}
+
+/*** end of file ***/
@@ -0,0 +1,96 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aqueues.h"
+#include "sessions.h"
+#include "shtable.h"
+
+#define BENCH_OUTPUT_NAME "bench_output.txt"   // one JSON object per line, written to the working directory
+#define BENCH_SAMPLE_MASK 63                   // every 64th operation is timed on its own for the latency percentiles
+#define BENCH_QUEUE_ITEMS (1 << 20)            // items moved through the queue per run, split across producers
+#define BENCH_QUEUE_HIGH (MAX_QUEUE_NODES / 2) // producers back off here, so aenqueue() never finds the queue full
+#define BENCH_CHECK_ITEMS 5                    // items queued by the adequeue_bulk() check run before the benchmarks
+#define BENCH_CHECK_KEYS 20000                 // keys in the table the snapshot check promotes during a snapshot
+#define BENCH_CHECK_DIR "/tmp/bench.XXXXXX"    // the snapshot check's image and log, removed afterwards
+#define BENCH_SESSION_LOOKUPS (1 << 20)        // lookups per run, split across threads
+#define BENCH_TABLE_LOOKUPS (1 << 21)          // gets or updates per run, split across threads
+#define BENCH_TABLE_MIN_KEYS 1000
+#define BENCH_TABLE_MAX_KEYS 10000000          // default upper size; the second argument lowers it
+#define BENCH_KEY_LEN 16
+#define BENCH_VALUE_LEN 16
+
+/**
+ * @brief latency samples one thread took during a run
+ */
+typedef struct bench_samples
+{
+    uint64_t *ns;
+    size_t count;
+    size_t cap;
+} bench_samples_t;
+
+struct bench_run;
+
+/**
+ * @brief one benchmark thread. Workers count their own operations and samples, so nothing is shared on the hot path
+ * except the structure under test.
+ */
+typedef struct bench_worker
+{
+    pthread_t thread;
+    int index;
+    int role;     // queue runs: 0 for a producer, 1 for a consumer
+    size_t ops;   // operations this thread is to do, or did
+    uint64_t rng; // xorshift state for picking keys
+    bench_samples_t samples;
+    bench_samples_t handoffs; // queue consumers: enqueue to dequeue latency
+    struct bench_run *run;
+} bench_worker_t;
+
+/**
+ * @brief a timed run: num_workers threads started together on work, with the structure under test in target
+ */
+typedef struct bench_run
+{
+    void *(*work)(void *arg);
+    void *target;
+    void *data;  // sessions runs: the IDs to look up
+    size_t size; // sessions or keys in the structure
+    pthread_barrier_t start;
+    bench_worker_t *workers;
+    int num_workers;
+    uint64_t elapsed_ns; // wall time from the start barrier to the last join
+} bench_run_t;
+
+/**
+ * @brief one line of results
+ */
+typedef struct bench_result
+{
+    const char *suite;
+    const char *op;
+    int threads;
+    size_t size;
+    size_t ops;
+    uint64_t elapsed_ns;
+    uint64_t p50_ns;
+    uint64_t p90_ns;
+    uint64_t p99_ns;
+    uint64_t p999_ns;
+    uint64_t max_ns;
+} bench_result_t;
+
+#endif
+
+/*** end of file ***/
@@ -0,0 +1,778 @@
+#include "../include/conns.h"
+
+/**
+ * @brief Grows the fd -> connection map so fd is a valid index.
+ *
+ * @param set the set to grow
+ * @param fd the fd that must fit
+ * @return returns 0 on success. Otherwise returns -1.
+ */
+static int conns_grow(conns_t *set, int fd)
+{
+    int ret = -1;
+    conn_t **new_map = NULL;
+    size_t new_size = set->by_fd_size;
+
+    while (new_size <= (size_t)fd)
+    {
+        new_size *= 2;
+    }
+
+    new_map = realloc(set->by_fd, new_size * sizeof(conn_t *));
+    if (NULL == new_map)
+    {
+        log_error("Failed to grow connection map.");
+        goto END;
+    }
+    memset(&new_map[set->by_fd_size], 0, (new_size - set->by_fd_size) * sizeof(conn_t *));
+    set->by_fd = new_map;
+    set->by_fd_size = new_size;
+
+    ret = 0;
+END:
+    return ret;
+}
+
+/**
+ * @brief Frees a connection's buffers, its handler state and the connection.
+ *
+ * @param conn the connection
+ */
+static void conn_free(conn_t *conn)
+{
+    size_t index = 0;
+    conn_seg_t *seg = NULL;
+
+    for (index = 0; index < conn->seg_count; index++) // payloads never written are still the caller's to release
+    {
+        seg = &conn->segs[conn->seg_head + index];
+        if ((NULL != seg->ref) && (NULL != seg->release))
+        {
+            seg->release(seg->arg);
+        }
+    }
+    if ((NULL != conn->proto) && (NULL != conn->proto_free))
+    {
+        conn->proto_free(conn->proto);
+    }
+    free(conn->in);
+    free(conn->out);
+    free(conn->segs);
+    free(conn);
+}
+
+/**
+ * @brief Makes room for one more segment at the tail of the queue, sliding the queue to the front before growing it.
+ *
+ * @param conn the connection
+ * @return the free segment, or NULL on failure
+ */
+static conn_seg_t *conn_seg_append(conn_t *conn)
+{
+    conn_seg_t *ret = NULL;
+    conn_seg_t *grown = NULL;
+    size_t new_cap = 0;
+
+    if ((conn->seg_head + conn->seg_count) == conn->seg_cap)
+    {
+        if (0 != conn->seg_head)
+        {
+            memmove(conn->segs, conn->segs + conn->seg_head, conn->seg_count * sizeof(conn_seg_t));
+            conn->seg_head = 0;
+        }
+        else
+        {
+            new_cap = (0 == conn->seg_cap) ? CONN_MIN_SEGS : conn->seg_cap * 2;
+            grown = realloc(conn->segs, new_cap * sizeof(conn_seg_t));
+            if (NULL == grown)
+            {
+                log_error("Failed to grow connection output queue.");
+                goto END;
+            }
+            conn->segs = grown;
+            conn->seg_cap = new_cap;
+        }
+    }
+
+    ret = &conn->segs[conn->seg_head + conn->seg_count];
+    memset(ret, 0, sizeof(conn_seg_t));
+    conn->seg_count++;
+END:
+    return ret;
+}
+
+/**
+ * @brief Drops written bytes from the front of the output queue, releasing referenced payloads as they finish.
+ *
+ * @param conn the connection
+ * @param sent number of bytes written
+ */
+static void conn_consume(conn_t *conn, size_t sent)
+{
+    conn_seg_t *seg = NULL;
+    size_t left = 0;
+
+    conn->pending -= sent;
+    while (0 != sent)
+    {
+        seg = &conn->segs[conn->seg_head];
+        left = seg->len - conn->seg_sent;
+        if (sent < left)
+        {
+            conn->seg_sent += sent;
+            break;
+        }
+
+        sent -= left;
+        if (NULL == seg->ref)
+        {
+            conn->out_sent = seg->off + seg->len;
+        }
+        else if (NULL != seg->release)
+        {
+            seg->release(seg->arg);
+        }
+        conn->seg_head++;
+        conn->seg_count--;
+        conn->seg_sent = 0;
+    }
+
+    if (0 == conn->seg_count)
+    {
+        conn->seg_head = 0;
+        conn->out_len = 0;
+        conn->out_sent = 0;
+    }
+}
+
+/**
+ * @brief Makes room for more input, doubling the buffer up to CONN_IN_MAX. Buffers are allocated on first use, so
+ * idle connections cost no buffer memory.
+ *
+ * @param conn the connection
+ * @return returns 0 on success, or -1 if the buffer is full at CONN_IN_MAX or could not grow
+ */
+static int conn_reserve_in(conn_t *conn)
+{
+    int ret = -1;
+    char *grown = NULL;
+    size_t new_cap = (0 == conn->in_cap) ? CONN_IN_MIN : conn->in_cap * 2;
+
+    if (conn->in_len < conn->in_cap)
+    {
+        ret = 0;
+        goto END;
+    }
+    if (CONN_IN_MAX < new_cap)
+    {
+        log_error("Request larger than %d bytes; closing connection.", CONN_IN_MAX);
+        goto END;
+    }
+
+    grown = realloc(conn->in, new_cap);
+    if (NULL == grown)
+    {
+        log_error("Failed to grow connection input.");
+        goto END;
+    }
+    conn->in = grown;
+    conn->in_cap = new_cap;
+
+    ret = 0;
+END:
+    return ret;
+}
+
+/**
+ * @brief Runs the handler over the unparsed input until it needs more, asks to close, starts a transfer or queues
+ * CONN_OUT_HIGH bytes of output, then moves what is left to the front of the buffer.
+ *
+ * @param set the set
+ * @param conn the connection
+ * @param resumed 1 to call the handler even with no input, after a transfer finished
+ * @return returns 0 to keep the connection, or -1 to close it
+ */
+static int conn_process(conns_t *set, conn_t *conn, int resumed)
+{
+    int ret = -1;
+    size_t used = 0;
+    ssize_t consumed = 0;
+
+    while ((CONN_READING == conn->state) && (NULL == transfer_find(set->transfers, conn->fd)) &&
+           (CONN_OUT_HIGH > conn_pending(conn)) && ((used < conn->in_len) || (1 == resumed)))
+    {
+        resumed = 0;
+        trace_point(TRACE_HANDLER_START, conn->fd);
+        consumed = set->handler(conn, conn->in + used, conn->in_len - used, set->ctx);
+        trace_point(TRACE_HANDLER_END, conn->fd);
+        if ((-1 == consumed) || ((size_t)consumed > (conn->in_len - used)))
+        {
+            goto END;
+        }
+        if (0 == consumed) // the rest is an unfinished request
+        {
+            break;
+        }
+        used += (size_t)consumed;
+    }
+
+    if (0 != used)
+    {
+        memmove(conn->in, conn->in + used, conn->in_len - used);
+        conn->in_len -= used;
+    }
+
+    ret = 0;
+END:
+    return ret;
+}
+
+/**
+ * @brief Points the poller at what the connection can do next: write while output is queued, read while it is taking
+ * requests and its output is under CONN_OUT_HIGH. Left alone while a transfer owns the socket.
+ *
+ * @param set the set
+ * @param conn the connection
+ * @return returns 0 to keep the connection, or -1 to close it (it was closing and its output is written)
+ */
+static int conn_update_interest(conns_t *set, conn_t *conn)
+{
+    int ret = -1;
+    uint32_t interest = 0;
+    size_t pending = conn_pending(conn);
+
+    if (NULL != transfer_find(set->transfers, conn->fd))
+    {
+        ret = 0;
+        goto END;
+    }
+    if ((CONN_CLOSING == conn->state) && (0 == pending))
+    {
+        goto END;
+    }
+
+    interest |= (0 != pending) ? POLLER_OUT : 0;
+    interest |= ((CONN_READING == conn->state) && (CONN_OUT_HIGH > pending)) ? POLLER_IN : 0;
+    if (interest != conn->interest)
+    {
+        if (-1 == poller_mod(set->poller, conn->fd, interest))
+        {
+            goto END;
+        }
+        conn->interest = interest;
+    }
+
+    ret = 0;
+END:
+    return ret;
+}
+
+/**
+ * @brief Reads until the socket is drained, handing input to the handler as it arrives. Stops early while the
+ * connection cannot take more requests; the poller is pointed back at the socket once it can.
+ *
+ * @param set the set
+ * @param conn the connection
+ * @return returns 0 to keep the connection, or -1 to close it
+ */
+static int conn_read(conns_t *set, conn_t *conn)
+{
+    int ret = -1;
+    ssize_t bytes_read = 0;
+
+    while ((CONN_READING == conn->state) && (NULL == transfer_find(set->transfers, conn->fd)) &&
+           (CONN_OUT_HIGH > conn_pending(conn)))
+    {
+        if (-1 == conn_reserve_in(conn))
+        {
+            goto END;
+        }
+
+        bytes_read = recv(conn->fd, conn->in + conn->in_len, conn->in_cap - conn->in_len, 0);
+        if (-1 == bytes_read)
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+            if ((EAGAIN == errno) || (EWOULDBLOCK == errno))
+            {
+                break;
+            }
+            log_perror("recv()");
+            goto END;
+        }
+        if (0 == bytes_read) // end of input, e.g. shutdown(SHUT_WR) after pipelining; answer what came before it
+        {
+            conn_close_after(conn); // conn_update_interest() closes it once the queued responses are written
+            break;
+        }
+
+        conn->in_len += (size_t)bytes_read;
+        if (-1 == conn_process(set, conn, 0))
+        {
+            goto END;
+        }
+    }
+
+    ret = 0;
+END:
+    return ret;
+}
+
+/**
+ * @brief Creates a poller thread's connection set.
+ *
+ * @param poller the thread's poller
+ * @param transfers the thread's transfers
+ * @param handler the request handler
+ * @param ctx server state passed through to handler
+ * @return returns pointer to the set on success. Otherwise returns NULL.
+ */
+conns_t *create_conns(poller_t *poller, transfers_t *transfers, conn_handler_func handler, void *ctx)
+{
+    conns_t *ret = NULL;
+    conns_t *new_set = NULL;
+
+    if ((NULL == poller) || (NULL == transfers) || (NULL == handler))
+    {
+        log_error("Invalid poller, transfers or handler passed.");
+        goto END;
+    }
+
+    new_set = calloc(1, sizeof(conns_t));
+    if (NULL == new_set)
+    {
+        log_error("Failed to alloc connection set.");
+        goto END;
+    }
+    new_set->by_fd = calloc(CONN_MIN_SLOTS, sizeof(conn_t *));
+    if (NULL == new_set->by_fd)
+    {
+        log_error("Failed to alloc connection map.");
+        free(new_set);
+        new_set = NULL;
+        goto END;
+    }
+    new_set->by_fd_size = CONN_MIN_SLOTS;
+    new_set->poller = poller;
+    new_set->transfers = transfers;
+    new_set->handler = handler;
+    new_set->ctx = ctx;
+
+    ret = new_set;
+END:
+    return ret;
+}
+
+/**
+ * @brief Starts tracking a connection registered with the set's poller for POLLER_IN, and makes it non-blocking.
+ *
+ * @param set the set
+ * @param fd the client socket
+ * @return returns 0 on success, or -1 on failure
+ */
+int conn_open(conns_t *set, int fd)
+{
+    int ret = -1;
+    int flags = 0;
+    conn_t *conn = NULL;
+
+    if ((NULL == set) || (0 > fd))
+    {
+        log_error("Invalid connection set or fd passed.");
+        goto END;
+    }
+    if (((size_t)fd >= set->by_fd_size) && (-1 == conns_grow(set, fd)))
+    {
+        goto END;
+    }
+    if (NULL != set->by_fd[fd])
+    {
+        log_error("fd already has a connection.");
+        goto END;
+    }
+
+    flags = fcntl(fd, F_GETFL);
+    if ((-1 == flags) || (-1 == fcntl(fd, F_SETFL, flags | O_NONBLOCK)))
+    {
+        log_perror("fcntl()");
+        goto END;
+    }
+
+    conn = calloc(1, sizeof(conn_t));
+    if (NULL == conn)
+    {
+        log_error("Failed to alloc connection.");
+        goto END;
+    }
+    conn->fd = fd;
+    conn->state = CONN_READING;
+    conn->interest = POLLER_IN;
+    set->by_fd[fd] = conn;
+    set->count++;
+
+    ret = 0;
+END:
+    return ret;
+}
+
+/**
+ * @brief Gets the connection on a socket.
+ *
+ * @param set the set
+ * @param fd the client socket
+ * @return the connection, or NULL if the socket is not tracked
+ */
+conn_t *conn_find(conns_t *set, int fd)
+{
+    conn_t *ret = NULL;
+
+    if ((NULL != set) && (0 <= fd) && ((size_t)fd < set->by_fd_size))
+    {
+        ret = set->by_fd[fd];
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Queues output on a connection. Nothing is written until the handler returns to the poller.
+ *
+ * @param conn the connection
+ * @param data the bytes
+ * @param len number of bytes
+ * @return returns 0 on success, or -1 on failure
+ */
+int conn_write(conn_t *conn, const void *data, size_t len)
+{
+    int ret = -1;
+    char *grown = NULL;
+    size_t new_cap = 0;
+    size_t index = 0;
+    conn_seg_t *seg = NULL;
+
+    if ((NULL == conn) || ((NULL == data) && (0 != len)))
+    {
+        log_error("Invalid connection or data passed.");
+        goto END;
+    }
+    if (0 == len)
+    {
+        ret = 0;
+        goto END;
+    }
+
+    if ((0 != conn->out_sent) && (len > (conn->out_cap - conn->out_len))) // reclaim the written front first
+    {
+        memmove(conn->out, conn->out + conn->out_sent, conn->out_len - conn->out_sent);
+        for (index = 0; index < conn->seg_count; index++)
+        {
+            seg = &conn->segs[conn->seg_head + index];
+            seg->off -= (NULL == seg->ref) ? conn->out_sent : 0;
+        }
+        conn->out_len -= conn->out_sent;
+        conn->out_sent = 0;
+    }
+    if (len > (conn->out_cap - conn->out_len))
+    {
+        for (new_cap = (0 == conn->out_cap) ? CONN_OUT_MIN : conn->out_cap; len > (new_cap - conn->out_len);
+             new_cap *= 2)
+        {
+        }
+        grown = realloc(conn->out, new_cap);
+        if (NULL == grown)
+        {
+            log_error("Failed to grow connection output.");
+            goto END;
+        }
+        conn->out = grown;
+        conn->out_cap = new_cap;
+    }
+
+    // a response right behind another copied one joins its segment, so a pipeline of small replies is one iovec
+    seg = (0 == conn->seg_count) ? NULL : &conn->segs[conn->seg_head + conn->seg_count - 1];
+    if ((NULL == seg) || (NULL != seg->ref) || ((seg->off + seg->len) != conn->out_len))
+    {
+        seg = conn_seg_append(conn);
+        if (NULL == seg)
+        {
+            goto END;
+        }
+        seg->off = conn->out_len;
+    }
+    memcpy(conn->out + conn->out_len, data, len);
+    conn->out_len += len;
+    seg->len += len;
+    conn->pending += len;
+
+    ret = 0;
+END:
+    return ret;
+}
+
+/**
+ * @brief Queues a payload on a connection without copying it, for large values and file contents already in memory.
+ * The payload must stay valid until release is called, which happens once it is written or the connection closes.
+ * Payloads under CONN_REF_MIN are copied and released at once.
+ *
+ * @param conn the connection
+ * @param data the payload
+ * @param len number of bytes
+ * @param release called with arg when the connection is done with the payload; may be NULL
+ * @param arg passed through to release
+ * @return returns 0 on success, or -1 on failure (release is not called)
+ */
+int conn_write_ref(conn_t *conn, const void *data, size_t len, void (*release)(void *arg), void *arg)
+{
+    int ret = -1;
+    conn_seg_t *seg = NULL;
+
+    if ((NULL == conn) || ((NULL == data) && (0 != len)))
+    {
+        log_error("Invalid connection or data passed.");
+        goto END;
+    }
+
+    if (CONN_REF_MIN > len)
+    {
+        if (-1 == conn_write(conn, data, len))
+        {
+            goto END;
+        }
+        if (NULL != release)
+        {
+            release(arg);
+        }
+        ret = 0;
+        goto END;
+    }
+
+    seg = conn_seg_append(conn);
+    if (NULL == seg)
+    {
+        goto END;
+    }
+    seg->ref = data;
+    seg->len = len;
+    seg->release = release;
+    seg->arg = arg;
+    conn->pending += len;
+
+    ret = 0;
+END:
+    return ret;
+}
+
+/**
+ * @brief Marks a connection to be closed once its queued output is written, e.g. after an error response.
+ *
+ * @param conn the connection
+ */
+void conn_close_after(conn_t *conn)
+{
+    if (NULL != conn)
+    {
+        conn->state = CONN_CLOSING;
+    }
+}
+
+/**
+ * @brief Gets the number of queued output bytes not yet written.
+ *
+ * @param conn the connection
+ * @return the number of bytes
+ */
+size_t conn_pending(const conn_t *conn)
+{
+    return conn->pending;
+}
+
+/**
+ * @brief Handles a readiness event: reads what the socket holds, runs the handler over it and writes what it can of
+ * the output, without blocking.
+ *
+ * @param set the set
+ * @param conn the connection
+ * @param events the POLLER_* events reported
+ * @return returns 0 to keep the connection, or -1 to close it
+ */
+int conn_ready(conns_t *set, conn_t *conn, uint32_t events)
+{
+    int ret = -1;
+
+    if ((NULL == set) || (NULL == conn))
+    {
+        log_error("Invalid connection set or connection passed.");
+        goto END;
+    }
+
+    // a hangup is read as end of input, so requests that arrived before it are still answered
+    if (((POLLER_IN | POLLER_HUP | POLLER_RDHUP) & events) && (-1 == conn_read(set, conn)))
+    {
+        goto END;
+    }
+    ret = conn_flush(set, conn);
+
+END:
+    return ret;
+}
+
+/**
+ * @brief Writes queued output until the socket would block. While the connection has a transfer, the transfer keeps
+ * control of the socket's poller interest.
+ *
+ * @param set the set
+ * @param conn the connection
+ * @return returns 0 to keep the connection, or -1 to close it
+ */
+int conn_flush(conns_t *set, conn_t *conn)
+{
+    int ret = -1;
+    ssize_t sent = 0;
+    struct iovec iov[CONN_IOV_MAX];
+    struct msghdr msg = {0};
+    size_t index = 0;
+    conn_seg_t *seg = NULL;
+    int flushed = 0;
+
+    if ((NULL == set) || (NULL == conn))
+    {
+        log_error("Invalid connection set or connection passed.");
+        goto END;
+    }
+
+    while (0 != conn_pending(conn))
+    {
+        for (index = 0; (index < conn->seg_count) && (index < CONN_IOV_MAX); index++)
+        {
+            seg = &conn->segs[conn->seg_head + index];
+            iov[index].iov_base = (char *)((NULL == seg->ref) ? (conn->out + seg->off) : seg->ref);
+            iov[index].iov_len = seg->len;
+        }
+        iov[0].iov_base = (char *)iov[0].iov_base + conn->seg_sent;
+        iov[0].iov_len -= conn->seg_sent;
+        msg.msg_iov = iov;
+        msg.msg_iovlen = index;
+
+        sent = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+        if (-1 == sent)
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+            if ((EAGAIN == errno) || (EWOULDBLOCK == errno))
+            {
+                break;
+            }
+            if (EPIPE != errno)
+            {
+                log_perror("sendmsg()");
+            }
+            goto END;
+        }
+        conn_consume(conn, (size_t)sent);
+        flushed = 1;
+    }
+    if ((1 == flushed) && (0 == conn_pending(conn)))
+    {
+        trace_point(TRACE_FLUSH, conn->fd);
+    }
+
+    // output dropping under CONN_OUT_HIGH frees the handler to take the requests already buffered
+    if ((CONN_OUT_HIGH > conn_pending(conn)) && (0 != conn->in_len) && (-1 == conn_process(set, conn, 0)))
+    {
+        goto END;
+    }
+    ret = conn_update_interest(set, conn);
+
+END:
+    return ret;
+}
+
+/**
+ * @brief Picks a connection up again after its transfer finished: lets the handler queue a response and go on with
+ * any input that arrived behind the transfer.
+ *
+ * @param set the set
+ * @param conn the connection
+ * @return returns 0 to keep the connection, or -1 to close it
+ */
+int conn_resume(conns_t *set, conn_t *conn)
+{
+    int ret = -1;
+
+    if ((NULL == set) || (NULL == conn))
+    {
+        log_error("Invalid connection set or connection passed.");
+        goto END;
+    }
+
+    conn->interest = POLLER_IN; // what the finished transfer left the poller watching
+    if (-1 == conn_process(set, conn, 1))
+    {
+        goto END;
+    }
+    ret = conn_flush(set, conn);
+
+END:
+    return ret;
+}
+
+/**
+ * @brief Stops tracking a connection and frees its state. The socket is not closed.
+ *
+ * @param set the set
+ * @param fd the client socket
+ */
+void conn_close(conns_t *set, int fd)
+{
+    conn_t *conn = conn_find(set, fd);
+
+    if (NULL != conn)
+    {
+        set->by_fd[fd] = NULL;
+        set->count--;
+        conn_free(conn);
+        conn = NULL;
+    }
+}
+
+/**
+ * @brief Frees every connection's state and the set. Sockets are not closed.
+ *
+ * @param set the set
+ * @return returns 0 on success. Otherwise returns -1.
+ */
+int destroy_conns(conns_t *set)
+{
+    int ret = -1;
+    size_t fd = 0;
+
+    if (NULL == set)
+    {
+        log_error("Connection set is already NULL. Exiting.");
+        goto END;
+    }
+
+    for (fd = 0; (fd < set->by_fd_size) && (0 != set->count); fd++)
+    {
+        if (NULL != set->by_fd[fd])
+        {
+            conn_free(set->by_fd[fd]);
+            set->by_fd[fd] = NULL;
+            set->count--;
+        }
+    }
+    free(set->by_fd);
+    set->by_fd = NULL;
+    free(set);
+    set = NULL;
+
+    ret = 0;
+END:
+    return ret;
+}
+
+/*** end of file ***/
@@ -0,0 +1,219 @@
+#ifndef CONNS_H
+#define CONNS_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "poller.h"
+#include "trace.h"
+#include "transfers.h"
+
+#define CONN_READING 0 // parsing requests as input arrives
+#define CONN_CLOSING 1 // a handler asked to close; input is ignored and the connection closes once output drains
+
+#define CONN_IN_MIN 4096        // initial input buffer size
+#define CONN_IN_MAX (1 << 20)   // most unparsed input kept; a request that needs more closes the connection
+#define CONN_OUT_MIN 4096       // initial output buffer size
+#define CONN_OUT_HIGH (1 << 20) // queued output at which input stops being read until the client catches up
+#define CONN_MIN_SLOTS 64       // initial size of the fd -> connection map
+#define CONN_MIN_SEGS 8         // initial size of a connection's output segment queue
+#define CONN_IOV_MAX 64         // most segments handed to one sendmsg()
+#define CONN_REF_MIN 4096       // payloads smaller than this are copied; an extra iovec costs more than the memcpy
+
+typedef struct conn conn_t;
+
+/**
+ * @brief a run of queued output: bytes copied into the connection's out buffer, or a caller's payload queued by
+ * reference and released once written
+ */
+typedef struct conn_seg
+{
+    const char *ref; // the payload, or NULL for copied bytes
+    size_t off;      // copied bytes: where they start in out
+    size_t len;
+    void (*release)(void *arg); // called once a referenced payload is written or dropped; may be NULL
+    void *arg;
+} conn_seg_t;
+
+/**
+ * @brief a request handler written as a resumable state machine. Called with a connection's unparsed input, it
+ * handles as many whole requests as it can, queues responses with conn_write(), keeps the state of a request it has
+ * only partly seen in conn->proto and returns how many input bytes it is done with. It must never block: a request
+ * that needs more input returns what it consumed so far (0 included), and the poller moves on to other connections
+ * until more arrives. It is also called with no input once a transfer it started finishes, to queue its response.
+ *
+ * @param conn the connection
+ * @param data the unparsed input
+ * @param len number of bytes in data
+ * @param ctx the server state passed to create_conns()
+ * @return the number of bytes consumed, or -1 to close the connection at once
+ */
+typedef ssize_t (*conn_handler_func)(conn_t *conn, const char *data, size_t len, void *ctx);
+
+/**
+ * @brief one client connection and everything needed to resume it: unparsed input, queued output and the handler's
+ * parse state. The socket is non-blocking for the connection's life. Responses to pipelined requests queue up as
+ * segments, consecutive small ones coalescing in out, and all of them go out in one sendmsg() per pass.
+ */
+struct conn
+{
+    int fd;
+    int state;
+    uint32_t interest; // events the poller watches the socket for
+    char *in;
+    size_t in_len;
+    size_t in_cap;
+    char *out;
+    size_t out_len;
+    size_t out_sent; // bytes at the front of out whose segments are written
+    size_t out_cap;
+    conn_seg_t *segs; // queued output in order, from seg_head
+    size_t seg_head;
+    size_t seg_count;
+    size_t seg_cap;
+    size_t seg_sent;            // bytes of the head segment already written
+    size_t pending;             // queued bytes not yet written
+    void *proto;                // the handler's state for the request in progress
+    void (*proto_free)(void *); // frees proto when the connection closes; NULL for none
+};
+
+/**
+ * @brief a poller thread's connections, found by fd
+ */
+typedef struct conns
+{
+    poller_t *poller;
+    transfers_t *transfers; // a socket with a transfer belongs to the transfer until it finishes
+    conn_handler_func handler;
+    void *ctx;
+    conn_t **by_fd;
+    size_t by_fd_size;
+    size_t count;
+} conns_t;
+
+/**
+ * @brief Creates a poller thread's connection set.
+ *
+ * @param poller the thread's poller
+ * @param transfers the thread's transfers
+ * @param handler the request handler
+ * @param ctx server state passed through to handler
+ * @return returns pointer to the set on success. Otherwise returns NULL.
+ */
+conns_t *create_conns(poller_t *poller, transfers_t *transfers, conn_handler_func handler, void *ctx);
+
+/**
+ * @brief Starts tracking a connection registered with the set's poller for POLLER_IN, and makes it non-blocking.
+ *
+ * @param set the set
+ * @param fd the client socket
+ * @return returns 0 on success, or -1 on failure
+ */
+int conn_open(conns_t *set, int fd);
+
+/**
+ * @brief Gets the connection on a socket.
+ *
+ * @param set the set
+ * @param fd the client socket
+ * @return the connection, or NULL if the socket is not tracked
+ */
+conn_t *conn_find(conns_t *set, int fd);
+
+/**
+ * @brief Queues output on a connection. Nothing is written until the handler returns to the poller.
+ *
+ * @param conn the connection
+ * @param data the bytes
+ * @param len number of bytes
+ * @return returns 0 on success, or -1 on failure
+ */
+int conn_write(conn_t *conn, const void *data, size_t len);
+
+/**
+ * @brief Queues a payload on a connection without copying it, for large values and file contents already in memory.
+ * The payload must stay valid until release is called, which happens once it is written or the connection closes.
+ * Payloads under CONN_REF_MIN are copied and released at once.
+ *
+ * @param conn the connection
+ * @param data the payload
+ * @param len number of bytes
+ * @param release called with arg when the connection is done with the payload; may be NULL
+ * @param arg passed through to release
+ * @return returns 0 on success, or -1 on failure (release is not called)
+ */
+int conn_write_ref(conn_t *conn, const void *data, size_t len, void (*release)(void *arg), void *arg);
+
+/**
+ * @brief Marks a connection to be closed once its queued output is written, e.g. after an error response.
+ *
+ * @param conn the connection
+ */
+void conn_close_after(conn_t *conn);
+
+/**
+ * @brief Gets the number of queued output bytes not yet written.
+ *
+ * @param conn the connection
+ * @return the number of bytes
+ */
+size_t conn_pending(const conn_t *conn);
+
+/**
+ * @brief Handles a readiness event: reads what the socket holds, runs the handler over it and writes what it can of
+ * the output, without blocking.
+ *
+ * @param set the set
+ * @param conn the connection
+ * @param events the POLLER_* events reported
+ * @return returns 0 to keep the connection, or -1 to close it
+ */
+int conn_ready(conns_t *set, conn_t *conn, uint32_t events);
+
+/**
+ * @brief Writes queued output until the socket would block, up to CONN_IOV_MAX segments per sendmsg(). While the
+ * connection has a transfer, the transfer keeps control of the socket's poller interest.
+ *
+ * @param set the set
+ * @param conn the connection
+ * @return returns 0 to keep the connection, or -1 to close it
+ */
+int conn_flush(conns_t *set, conn_t *conn);
+
+/**
+ * @brief Picks a connection up again after its transfer finished: lets the handler queue a response and go on with
+ * any input that arrived behind the transfer.
+ *
+ * @param set the set
+ * @param conn the connection
+ * @return returns 0 to keep the connection, or -1 to close it
+ */
+int conn_resume(conns_t *set, conn_t *conn);
+
+/**
+ * @brief Stops tracking a connection and frees its state. The socket is not closed.
+ *
+ * @param set the set
+ * @param fd the client socket
+ */
+void conn_close(conns_t *set, int fd);
+
+/**
+ * @brief Frees every connection's state and the set. Sockets are not closed.
+ *
+ * @param set the set
+ * @return returns 0 on success. Otherwise returns -1.
+ */
+int destroy_conns(conns_t *set);
+
+#endif
+
+/*** end of file ***/
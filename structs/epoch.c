@@ -0,0 +1,197 @@
+#include "../include/epoch.h"
+
+static _Alignas(CACHE_LINE_SIZE) atomic_uint_fast64_t global_epoch = 1;
+static _Atomic(epoch_record_t *) all_records = NULL; // every record ever created, scanned to advance the epoch
+static _Thread_local epoch_record_t *thread_record = NULL;
+
+/**
+ * @brief get the calling thread's epoch record, creating and registering it on first use
+ *
+ * @return the record, or NULL if it could not be allocated
+ */
+static epoch_record_t *epoch_thread_record(void)
+{
+    epoch_record_t *record = thread_record;
+
+    if (NULL != record)
+    {
+        goto END;
+    }
+
+    if (0 != posix_memalign((void **)&record, CACHE_LINE_SIZE, sizeof(epoch_record_t)))
+    {
+        log_error("Failed to alloc epoch record.");
+        record = NULL;
+        goto END;
+    }
+    memset(record, 0, sizeof(epoch_record_t));
+    atomic_init(&record->announce, 0);
+
+    record->next_record = atomic_load(&all_records);
+    while (!atomic_compare_exchange_weak(&all_records, &record->next_record, record))
+    {
+    }
+    thread_record = record;
+
+END:
+    return record;
+}
+
+/**
+ * @brief advance the global epoch by one if every thread inside a read section has announced the current epoch
+ *
+ * @return the global epoch after the attempt
+ */
+static uint64_t epoch_try_advance(void)
+{
+    uint64_t epoch = atomic_load(&global_epoch);
+    uint64_t announce = 0;
+    epoch_record_t *record = NULL;
+
+    for (record = atomic_load(&all_records); NULL != record; record = record->next_record)
+    {
+        announce = atomic_load(&record->announce);
+        if ((0 != (announce & 1)) && ((announce >> 1) != epoch)) // a reader is still in an older epoch
+        {
+            goto END;
+        }
+    }
+
+    if (atomic_compare_exchange_strong(&global_epoch, &epoch, epoch + 1))
+    {
+        epoch++;
+    }
+
+END:
+    return epoch;
+}
+
+/**
+ * @brief Enters a read section. Objects reachable from shared structures when the section starts are not freed until
+ * it ends. Sections nest.
+ *
+ * @return returns 0 on success, or -1 if the thread's record could not be allocated (the section was not entered)
+ */
+int epoch_enter(void)
+{
+    int ret = -1;
+    epoch_record_t *record = epoch_thread_record();
+
+    if (NULL == record)
+    {
+        goto END;
+    }
+    if (0 == record->depth++)
+    {
+        // seq_cst orders the announcement before every read made inside the section
+        atomic_store(&record->announce, (atomic_load(&global_epoch) << 1) | 1);
+    }
+
+    ret = 0;
+END:
+    return ret;
+}
+
+/**
+ * @brief Leaves a read section.
+ */
+void epoch_exit(void)
+{
+    epoch_record_t *record = thread_record;
+
+    if ((NULL != record) && (0 == --record->depth))
+    {
+        atomic_store_explicit(&record->announce, 0, memory_order_release);
+    }
+}
+
+/**
+ * @brief Hands an object that has been unlinked from every shared structure to the reclaimer. free_fn is called on it
+ * once every read section that could have seen it has ended. An object is safe two epochs after it was retired: any
+ * reader that saw it announced an epoch no later than the retire epoch, and holds the global epoch back until it exits.
+ *
+ * @param ptr the unlinked object
+ * @param free_fn the function that frees it
+ */
+void epoch_retire(void *ptr, epoch_free_func free_fn)
+{
+    epoch_record_t *record = NULL;
+    epoch_garbage_t *garbage = NULL;
+
+    if ((NULL == ptr) || (NULL == free_fn))
+    {
+        goto END;
+    }
+
+    record = epoch_thread_record();
+    garbage = malloc(sizeof(epoch_garbage_t));
+    if ((NULL == record) || (NULL == garbage))
+    {
+        log_error("Failed to retire object. Leaking it."); // freeing now could pull it out from under a reader
+        free(garbage);
+        garbage = NULL;
+        goto END;
+    }
+
+    garbage->ptr = ptr;
+    garbage->free_fn = free_fn;
+    garbage->epoch = atomic_load(&global_epoch);
+    garbage->next = NULL;
+    if (NULL == record->limbo_tail)
+    {
+        record->limbo_head = garbage;
+    }
+    else
+    {
+        record->limbo_tail->next = garbage;
+    }
+    record->limbo_tail = garbage;
+    record->num_limbo++;
+
+    if (EPOCH_RETIRE_BATCH <= record->num_limbo)
+    {
+        epoch_reclaim();
+    }
+
+END:
+    return;
+}
+
+/**
+ * @brief Tries to advance the global epoch and frees whatever the calling thread retired that is now safe to free.
+ *
+ * @return the number of objects freed
+ */
+size_t epoch_reclaim(void)
+{
+    size_t ret = 0;
+    uint64_t epoch = 0;
+    epoch_record_t *record = thread_record;
+    epoch_garbage_t *garbage = NULL;
+
+    if ((NULL == record) || (NULL == record->limbo_head))
+    {
+        goto END;
+    }
+
+    epoch = epoch_try_advance();
+    while ((NULL != record->limbo_head) && ((record->limbo_head->epoch + 2) <= epoch)) // the list is oldest first
+    {
+        garbage = record->limbo_head;
+        record->limbo_head = garbage->next;
+        garbage->free_fn(garbage->ptr);
+        free(garbage);
+        record->num_limbo--;
+        ret++;
+    }
+    if (NULL == record->limbo_head)
+    {
+        record->limbo_tail = NULL;
+    }
+    garbage = NULL;
+
+END:
+    return ret;
+}
+
+/*** end of file ***/
@@ -0,0 +1,73 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aqueues.h"
+
+#define EPOCH_RETIRE_BATCH 64 // objects a thread retires before it tries to advance the epoch and free its garbage
+
+typedef void (*epoch_free_func)(void *ptr);
+
+/**
+ * @brief an object unlinked from a shared structure, waiting until no reader can still hold it
+ */
+typedef struct epoch_garbage
+{
+    void *ptr;
+    epoch_free_func free_fn;
+    uint64_t epoch; // global epoch when the object was retired
+    struct epoch_garbage *next;
+} epoch_garbage_t;
+
+/**
+ * @brief a thread's epoch record. announce is (epoch << 1) | 1 while the thread is inside a read section and 0 outside
+ * one; only the owner writes it. The limbo list holds the thread's retired objects, oldest first. Records live for the
+ * life of the process, like the queue node caches.
+ */
+typedef struct epoch_record
+{
+    _Alignas(CACHE_LINE_SIZE) atomic_uint_fast64_t announce;
+    int depth; // read section nesting
+    epoch_garbage_t *limbo_head;
+    epoch_garbage_t *limbo_tail;
+    size_t num_limbo;
+    struct epoch_record *next_record;
+} epoch_record_t;
+
+/**
+ * @brief Enters a read section. Objects reachable from shared structures when the section starts are not freed until
+ * it ends. Sections nest.
+ *
+ * @return returns 0 on success, or -1 if the thread's record could not be allocated (the section was not entered)
+ */
+int epoch_enter(void);
+
+/**
+ * @brief Leaves a read section.
+ */
+void epoch_exit(void);
+
+/**
+ * @brief Hands an object that has been unlinked from every shared structure to the reclaimer. free_fn is called on it
+ * once every read section that could have seen it has ended.
+ *
+ * @param ptr the unlinked object
+ * @param free_fn the function that frees it
+ */
+void epoch_retire(void *ptr, epoch_free_func free_fn);
+
+/**
+ * @brief Tries to advance the global epoch and frees whatever the calling thread retired that is now safe to free.
+ *
+ * @return the number of objects freed
+ */
+size_t epoch_reclaim(void);
+
+#endif
+
+/*** end of file ***/
@@ -0,0 +1,238 @@
+#include "../include/hashes.h"
+
+#define SIP_ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+#define SIP_ROUND(v0, v1, v2, v3)                                                                                      \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        v0 += v1;                                                                                                      \
+        v1 = SIP_ROTL(v1, 13);                                                                                         \
+        v1 ^= v0;                                                                                                      \
+        v0 = SIP_ROTL(v0, 32);                                                                                         \
+        v2 += v3;                                                                                                      \
+        v3 = SIP_ROTL(v3, 16);                                                                                         \
+        v3 ^= v2;                                                                                                      \
+        v0 += v3;                                                                                                      \
+        v3 = SIP_ROTL(v3, 21);                                                                                         \
+        v3 ^= v0;                                                                                                      \
+        v2 += v1;                                                                                                      \
+        v1 = SIP_ROTL(v1, 17);                                                                                         \
+        v1 ^= v2;                                                                                                      \
+        v2 = SIP_ROTL(v2, 32);                                                                                         \
+    } while (0)
+
+static const uint64_t wy_secret[4] = {0xa0761d6478bd642fULL, 0xe7037ed1a0b428dbULL, 0x8ebc6af09c88c6e3ULL,
+                                      0x589965cc75374cc3ULL};
+
+static hash_seed_t process_seed = {0};
+static pthread_once_t process_seed_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief fills the per-process hash key from the kernel's random source, falling back to the clock and pid
+ */
+static void hash_init_process_seed(void)
+{
+    struct timespec now = {0};
+
+    if (sizeof(process_seed) == getrandom(&process_seed, sizeof(process_seed), 0))
+    {
+        goto END;
+    }
+
+    log_perror("getrandom()");
+    log_warn("Hash key falls back to the clock. Tables are not collision resistant.");
+    clock_gettime(CLOCK_REALTIME, &now);
+    process_seed.k0 = ((uint64_t)now.tv_sec * 1000000007ULL) ^ (uint64_t)now.tv_nsec;
+    process_seed.k1 = ((uint64_t)getpid() << 32) ^ (uint64_t)now.tv_nsec ^ wy_secret[0];
+
+END:
+    return;
+}
+
+/**
+ * @brief 64x64 to 128 bit multiply; returns the low half in a and the high half in b
+ */
+static inline void wy_mum(uint64_t *a, uint64_t *b)
+{
+    __uint128_t product = (__uint128_t)*a * *b;
+
+    *a = (uint64_t)product;
+    *b = (uint64_t)(product >> 64);
+}
+
+/**
+ * @brief multiplies and folds the 128 bit product
+ */
+static inline uint64_t wy_mix(uint64_t a, uint64_t b)
+{
+    wy_mum(&a, &b);
+    return a ^ b;
+}
+
+static inline uint64_t wy_read8(const uint8_t *p)
+{
+    uint64_t value = 0;
+
+    memcpy(&value, p, sizeof(value));
+    return le64toh(value);
+}
+
+static inline uint64_t wy_read4(const uint8_t *p)
+{
+    uint32_t value = 0;
+
+    memcpy(&value, p, sizeof(value));
+    return le32toh(value);
+}
+
+/**
+ * @brief reads 1 to 3 bytes as the first, middle and last byte
+ */
+static inline uint64_t wy_read3(const uint8_t *p, size_t len)
+{
+    return (((uint64_t)p[0]) << 16) | (((uint64_t)p[len >> 1]) << 8) | p[len - 1];
+}
+
+/**
+ * @brief Gets the per-process random hash key, reading it from the kernel on first use.
+ *
+ * @return the key
+ */
+const hash_seed_t *hash_process_seed(void)
+{
+    pthread_once(&process_seed_once, hash_init_process_seed);
+    return &process_seed;
+}
+
+/**
+ * @brief wyhash: a fast multiply-mix hash that reads 8-16 bytes per step. Seeded with seed->k0; good distribution,
+ * but not designed to resist an attacker who can observe hash values.
+ *
+ * @param key the bytes to hash
+ * @param key_len number of bytes
+ * @param seed the hash key
+ * @return the 64 bit hash
+ */
+uint64_t hash_wyhash(const void *key, size_t key_len, const hash_seed_t *seed)
+{
+    const uint8_t *p = key;
+    uint64_t state = seed->k0;
+    uint64_t a = 0;
+    uint64_t b = 0;
+    uint64_t state1 = 0;
+    uint64_t state2 = 0;
+    size_t remaining = key_len;
+
+    state ^= wy_mix(state ^ wy_secret[0], wy_secret[1]);
+    if (16 >= key_len)
+    {
+        if (4 <= key_len)
+        {
+            a = (wy_read4(p) << 32) | wy_read4(p + ((key_len >> 3) << 2));
+            b = (wy_read4(p + key_len - 4) << 32) | wy_read4(p + key_len - 4 - ((key_len >> 3) << 2));
+        }
+        else if (0 < key_len)
+        {
+            a = wy_read3(p, key_len);
+        }
+    }
+    else
+    {
+        if (48 < remaining)
+        {
+            state1 = state;
+            state2 = state;
+            do
+            {
+                state = wy_mix(wy_read8(p) ^ wy_secret[1], wy_read8(p + 8) ^ state);
+                state1 = wy_mix(wy_read8(p + 16) ^ wy_secret[2], wy_read8(p + 24) ^ state1);
+                state2 = wy_mix(wy_read8(p + 32) ^ wy_secret[3], wy_read8(p + 40) ^ state2);
+                p += 48;
+                remaining -= 48;
+            } while (48 < remaining);
+            state ^= state1 ^ state2;
+        }
+        while (16 < remaining)
+        {
+            state = wy_mix(wy_read8(p) ^ wy_secret[1], wy_read8(p + 8) ^ state);
+            p += 16;
+            remaining -= 16;
+        }
+        a = wy_read8(p + remaining - 16);
+        b = wy_read8(p + remaining - 8);
+    }
+
+    a ^= wy_secret[1];
+    b ^= state;
+    wy_mum(&a, &b);
+    return wy_mix(a ^ wy_secret[0] ^ key_len, b ^ wy_secret[1]);
+}
+
+/**
+ * @brief SipHash-1-3: a keyed PRF, so collisions cannot be precomputed without the key. Slower than wyhash on long
+ * keys, about the same on the short keys the server tables hold.
+ *
+ * @param key the bytes to hash
+ * @param key_len number of bytes
+ * @param seed the 128 bit key
+ * @return the 64 bit hash
+ */
+uint64_t hash_siphash13(const void *key, size_t key_len, const hash_seed_t *seed)
+{
+    const uint8_t *p = key;
+    const uint8_t *end = p + (key_len & ~(size_t)7);
+    uint64_t v0 = seed->k0 ^ 0x736f6d6570736575ULL;
+    uint64_t v1 = seed->k1 ^ 0x646f72616e646f6dULL;
+    uint64_t v2 = seed->k0 ^ 0x6c7967656e657261ULL;
+    uint64_t v3 = seed->k1 ^ 0x7465646279746573ULL;
+    uint64_t block = 0;
+    int round = 0;
+
+    for (; p != end; p += 8)
+    {
+        block = wy_read8(p);
+        v3 ^= block;
+        SIP_ROUND(v0, v1, v2, v3);
+        v0 ^= block;
+    }
+
+    block = ((uint64_t)key_len) << 56;
+    switch (key_len & 7)
+    {
+    case 7:
+        block |= ((uint64_t)p[6]) << 48;
+        /* fall through */
+    case 6:
+        block |= ((uint64_t)p[5]) << 40;
+        /* fall through */
+    case 5:
+        block |= ((uint64_t)p[4]) << 32;
+        /* fall through */
+    case 4:
+        block |= ((uint64_t)p[3]) << 24;
+        /* fall through */
+    case 3:
+        block |= ((uint64_t)p[2]) << 16;
+        /* fall through */
+    case 2:
+        block |= ((uint64_t)p[1]) << 8;
+        /* fall through */
+    case 1:
+        block |= ((uint64_t)p[0]);
+        break;
+    default:
+        break;
+    }
+    v3 ^= block;
+    SIP_ROUND(v0, v1, v2, v3);
+    v0 ^= block;
+
+    v2 ^= 0xff;
+    for (round = 0; round < 3; round++)
+    {
+        SIP_ROUND(v0, v1, v2, v3);
+    }
+
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/*** end of file ***/
@@ -0,0 +1,59 @@
+#ifndef HASHES_H
+#define HASHES_H
+
+#include <endian.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/random.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+/**
+ * @brief a 128 bit hash key. Tables hash with the per-process key from hash_process_seed(), so a client cannot pick
+ * keys that collide without knowing it.
+ */
+typedef struct hash_seed
+{
+    uint64_t k0;
+    uint64_t k1;
+} hash_seed_t;
+
+typedef uint64_t (*keyed_hash_func)(const void *key, size_t key_len, const hash_seed_t *seed);
+
+/**
+ * @brief Gets the per-process random hash key, reading it from the kernel on first use.
+ *
+ * @return the key
+ */
+const hash_seed_t *hash_process_seed(void);
+
+/**
+ * @brief wyhash: a fast multiply-mix hash that reads 8-16 bytes per step. Seeded with seed->k0; good distribution,
+ * but not designed to resist an attacker who can observe hash values.
+ *
+ * @param key the bytes to hash
+ * @param key_len number of bytes
+ * @param seed the hash key
+ * @return the 64 bit hash
+ */
+uint64_t hash_wyhash(const void *key, size_t key_len, const hash_seed_t *seed);
+
+/**
+ * @brief SipHash-1-3: a keyed PRF, so collisions cannot be precomputed without the key. Slower than wyhash on long
+ * keys, about the same on the short keys the server tables hold.
+ *
+ * @param key the bytes to hash
+ * @param key_len number of bytes
+ * @param seed the 128 bit key
+ * @return the 64 bit hash
+ */
+uint64_t hash_siphash13(const void *key, size_t key_len, const hash_seed_t *seed);
+
+#endif
+
+/*** end of file ***/
@@ -0,0 +1,276 @@
+#include "../include/hdrhist.h"
+
+/**
+ * @brief Finds the count a value goes in. Bucket 0 holds 0..2^(sub_bits + 1) - 1 one per sub-bucket; bucket n above
+ * it holds the next power of two range, 2^n values per sub-bucket, in the upper half of its sub-buckets only (the
+ * lower half would repeat the bucket below).
+ *
+ * @param hist the histogram
+ * @param value the value, at most hist->highest
+ * @return the index into counts
+ */
+static size_t hdr_index(const hdr_hist_t *hist, uint64_t value)
+{
+    return hdr_count_index(hist->sub_bits, value);
+}
+
+/**
+ * @brief Gets the highest value counted at an index.
+ *
+ * @param hist the histogram
+ * @param index the index into counts
+ * @return the value
+ */
+static uint64_t hdr_value_at(const hdr_hist_t *hist, size_t index)
+{
+    size_t sub_count = (size_t)2 << hist->sub_bits;
+    int bucket = 0;
+    uint64_t sub = index;
+
+    if (index >= sub_count)
+    {
+        bucket = (int)(index >> hist->sub_bits) - 1;
+        sub = index - ((size_t)bucket << hist->sub_bits);
+    }
+    return (sub << bucket) + ((UINT64_C(1) << bucket) - 1);
+}
+
+/**
+ * @brief Finds the count a value goes in for a given precision, so counts kept elsewhere (e.g. per thread) can be laid
+ * out like a histogram's and added into one later with hdr_add_counts().
+ *
+ * @param sub_bits the precision the counts are kept at
+ * @param value the value
+ * @return the index into counts
+ */
+size_t hdr_count_index(int sub_bits, uint64_t value)
+{
+    uint64_t mask = (UINT64_C(2) << sub_bits) - 1;
+    int bucket = (63 - __builtin_clzll(value | mask)) - sub_bits;
+
+    return ((size_t)bucket << sub_bits) + (size_t)(value >> bucket);
+}
+
+/**
+ * @brief Creates an empty histogram.
+ *
+ * @param highest the largest value to tell apart, at least 2^(sub_bits + 1)
+ * @param sub_bits precision: each bucket has 2^(sub_bits + 1) sub-buckets, 1..20
+ * @return returns pointer to the histogram on success. Otherwise returns NULL.
+ */
+hdr_hist_t *create_hdr_hist(uint64_t highest, int sub_bits)
+{
+    hdr_hist_t *ret = NULL;
+    hdr_hist_t *hist = NULL;
+
+    if ((1 > sub_bits) || (20 < sub_bits) || (highest < (UINT64_C(2) << sub_bits)) || ((UINT64_MAX >> 1) < highest))
+    {
+        log_error("Invalid histogram range or precision passed.");
+        goto END;
+    }
+
+    hist = calloc(1, sizeof(hdr_hist_t));
+    if (NULL == hist)
+    {
+        log_error("Failed to alloc histogram.");
+        goto END;
+    }
+    hist->sub_bits = sub_bits;
+    hist->highest = highest;
+    hist->counts_len = hdr_index(hist, highest) + 1;
+    hist->counts = calloc(hist->counts_len, sizeof(uint64_t));
+    if (NULL == hist->counts)
+    {
+        log_error("Failed to alloc histogram counts.");
+        free(hist);
+        hist = NULL;
+        goto END;
+    }
+    hist->min = UINT64_MAX;
+
+    ret = hist;
+END:
+    return ret;
+}
+
+/**
+ * @brief Counts one value.
+ *
+ * @param hist the histogram
+ * @param value the value
+ */
+void hdr_record(hdr_hist_t *hist, uint64_t value)
+{
+    value = (value > hist->highest) ? hist->highest : value;
+    hist->counts[hdr_index(hist, value)]++;
+    hist->total++;
+    hist->sum += value;
+    hist->min = (value < hist->min) ? value : hist->min;
+    hist->max = (value > hist->max) ? value : hist->max;
+}
+
+/**
+ * @brief Adds every count of src into dst. Both must have been created with the same highest and sub_bits.
+ *
+ * @param dst the histogram added to
+ * @param src the histogram added
+ * @return returns 0 on success, or -1 if the two are shaped differently
+ */
+int hdr_merge(hdr_hist_t *dst, const hdr_hist_t *src)
+{
+    int ret = -1;
+    size_t index = 0;
+
+    if ((NULL == dst) || (NULL == src) || (dst->sub_bits != src->sub_bits) || (dst->counts_len != src->counts_len))
+    {
+        log_error("Invalid or mismatched histograms passed.");
+        goto END;
+    }
+
+    for (index = 0; index < src->counts_len; index++)
+    {
+        dst->counts[index] += src->counts[index];
+    }
+    dst->total += src->total;
+    dst->sum += src->sum;
+    dst->min = (src->min < dst->min) ? src->min : dst->min;
+    dst->max = (src->max > dst->max) ? src->max : dst->max;
+
+    ret = 0;
+END:
+    return ret;
+}
+
+/**
+ * @brief Adds counts laid out by hdr_count_index() at the histogram's precision. Only bucket positions are known, so
+ * min and max become the edges of the lowest and highest buckets counted.
+ *
+ * @param hist the histogram added to
+ * @param counts the counts, indexed by hdr_count_index(hist->sub_bits, value)
+ * @param counts_len number of counts; at most hist->counts_len
+ * @param sum the sum of the values counted, for the mean
+ * @return returns 0 on success, or -1 if the counts do not fit the histogram
+ */
+int hdr_add_counts(hdr_hist_t *hist, const uint64_t *counts, size_t counts_len, uint64_t sum)
+{
+    int ret = -1;
+    size_t index = 0;
+    uint64_t low = 0;
+
+    if ((NULL == hist) || (NULL == counts) || (counts_len > hist->counts_len))
+    {
+        log_error("Invalid or mismatched counts passed.");
+        goto END;
+    }
+
+    for (index = 0; index < counts_len; index++)
+    {
+        if (0 == counts[index])
+        {
+            continue;
+        }
+        hist->counts[index] += counts[index];
+        hist->total += counts[index];
+        low = (0 == index) ? 0 : (hdr_value_at(hist, index - 1) + 1);
+        hist->min = (low < hist->min) ? low : hist->min;
+        hist->max = (hdr_value_at(hist, index) > hist->max) ? hdr_value_at(hist, index) : hist->max;
+    }
+    hist->sum += sum;
+
+    ret = 0;
+END:
+    return ret;
+}
+
+/**
+ * @brief Gets the value at a percentile: the highest value that could have been counted in the bucket holding it.
+ *
+ * @param hist the histogram
+ * @param percentile 0..100
+ * @return the value, or 0 if the histogram is empty
+ */
+uint64_t hdr_percentile(const hdr_hist_t *hist, double percentile)
+{
+    uint64_t ret = 0;
+    uint64_t target = 0;
+    uint64_t seen = 0;
+    size_t index = 0;
+
+    if ((NULL == hist) || (0 == hist->total))
+    {
+        goto END;
+    }
+
+    percentile = (100.0 < percentile) ? 100.0 : percentile;
+    target = (uint64_t)((percentile / 100.0) * (double)hist->total + 0.5);
+    target = (0 == target) ? 1 : target;
+    for (index = 0; index < hist->counts_len; index++)
+    {
+        seen += hist->counts[index];
+        if (seen >= target)
+        {
+            ret = hdr_value_at(hist, index);
+            break;
+        }
+    }
+    ret = (ret > hist->max) ? hist->max : ret; // the bucket's top may lie past anything recorded
+
+END:
+    return ret;
+}
+
+/**
+ * @brief Gets the mean of the recorded values.
+ *
+ * @param hist the histogram
+ * @return the mean, or 0 if the histogram is empty
+ */
+double hdr_mean(const hdr_hist_t *hist)
+{
+    return ((NULL == hist) || (0 == hist->total)) ? 0.0 : ((double)hist->sum / (double)hist->total);
+}
+
+/**
+ * @brief Empties a histogram.
+ *
+ * @param hist the histogram
+ */
+void hdr_reset(hdr_hist_t *hist)
+{
+    if (NULL != hist)
+    {
+        memset(hist->counts, 0, hist->counts_len * sizeof(uint64_t));
+        hist->total = 0;
+        hist->sum = 0;
+        hist->min = UINT64_MAX;
+        hist->max = 0;
+    }
+}
+
+/**
+ * @brief Frees a histogram.
+ *
+ * @param hist the histogram
+ * @return returns 0 on success. Otherwise returns -1.
+ */
+int destroy_hdr_hist(hdr_hist_t *hist)
+{
+    int ret = -1;
+
+    if (NULL == hist)
+    {
+        log_error("Histogram is already NULL. Exiting.");
+        goto END;
+    }
+
+    free(hist->counts);
+    hist->counts = NULL;
+    free(hist);
+    hist = NULL;
+
+    ret = 0;
+END:
+    return ret;
+}
+
+/*** end of file ***/
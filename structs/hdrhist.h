@@ -0,0 +1,115 @@
+#ifndef HDRHIST_H
+#define HDRHIST_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+
+#define HDR_DEFAULT_SUB_BITS 10               // 2048 sub-buckets per power of two: three significant digits
+#define HDR_DEFAULT_HIGHEST (UINT64_C(1) << 36) // about 68 seconds in nanoseconds
+
+/**
+ * @brief A high dynamic range histogram. Values are counted in log-linear buckets: every power of two range is split
+ * into the same number of linear sub-buckets, so any recorded value is reported within a fixed relative error (about
+ * 1 / 2^sub_bits) whether it is 50 ns or 50 s. Recording is an index calculation and an increment. A histogram has
+ * one writer; readers merge copies.
+ */
+typedef struct hdr_hist
+{
+    int sub_bits;       // log2 of half the sub-buckets per bucket
+    uint64_t highest;   // values above this are recorded as this
+    uint64_t *counts;
+    size_t counts_len;
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    uint64_t sum;       // for the mean; wraps only after 2^64 ns of recorded latency
+} hdr_hist_t;
+
+/**
+ * @brief Finds the count a value goes in for a given precision, so counts kept elsewhere (e.g. per thread) can be laid
+ * out like a histogram's and added into one later with hdr_add_counts().
+ *
+ * @param sub_bits the precision the counts are kept at
+ * @param value the value
+ * @return the index into counts
+ */
+size_t hdr_count_index(int sub_bits, uint64_t value);
+
+/**
+ * @brief Creates an empty histogram.
+ *
+ * @param highest the largest value to tell apart, at least 2^(sub_bits + 1)
+ * @param sub_bits precision: each bucket has 2^(sub_bits + 1) sub-buckets, 1..20
+ * @return returns pointer to the histogram on success. Otherwise returns NULL.
+ */
+hdr_hist_t *create_hdr_hist(uint64_t highest, int sub_bits);
+
+/**
+ * @brief Counts one value.
+ *
+ * @param hist the histogram
+ * @param value the value
+ */
+void hdr_record(hdr_hist_t *hist, uint64_t value);
+
+/**
+ * @brief Adds every count of src into dst. Both must have been created with the same highest and sub_bits.
+ *
+ * @param dst the histogram added to
+ * @param src the histogram added
+ * @return returns 0 on success, or -1 if the two are shaped differently
+ */
+int hdr_merge(hdr_hist_t *dst, const hdr_hist_t *src);
+
+/**
+ * @brief Adds counts laid out by hdr_count_index() at the histogram's precision. Only bucket positions are known, so
+ * min and max become the edges of the lowest and highest buckets counted.
+ *
+ * @param hist the histogram added to
+ * @param counts the counts, indexed by hdr_count_index(hist->sub_bits, value)
+ * @param counts_len number of counts; at most hist->counts_len
+ * @param sum the sum of the values counted, for the mean
+ * @return returns 0 on success, or -1 if the counts do not fit the histogram
+ */
+int hdr_add_counts(hdr_hist_t *hist, const uint64_t *counts, size_t counts_len, uint64_t sum);
+
+/**
+ * @brief Gets the value at a percentile: the highest value that could have been counted in the bucket holding it.
+ *
+ * @param hist the histogram
+ * @param percentile 0..100
+ * @return the value, or 0 if the histogram is empty
+ */
+uint64_t hdr_percentile(const hdr_hist_t *hist, double percentile);
+
+/**
+ * @brief Gets the mean of the recorded values.
+ *
+ * @param hist the histogram
+ * @return the mean, or 0 if the histogram is empty
+ */
+double hdr_mean(const hdr_hist_t *hist);
+
+/**
+ * @brief Empties a histogram.
+ *
+ * @param hist the histogram
+ */
+void hdr_reset(hdr_hist_t *hist);
+
+/**
+ * @brief Frees a histogram.
+ *
+ * @param hist the histogram
+ * @return returns 0 on success. Otherwise returns -1.
+ */
+int destroy_hdr_hist(hdr_hist_t *hist);
+
+#endif
+
+/*** end of file ***/
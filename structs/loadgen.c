@@ -0,0 +1,1240 @@
+#include "../include/loadgen.h"
+
+static const char *lg_op_names[LG_NUM_OPS] = {"login", "session", "put", "get", "file_get", "file_put"};
+
+/**
+ * @brief Reads the monotonic clock.
+ *
+ * @return nanoseconds
+ */
+static uint64_t lg_now(void)
+{
+    struct timespec now = {0};
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * 1000000000u) + (uint64_t)now.tv_nsec;
+}
+
+/**
+ * @brief Steps a thread's xorshift generator.
+ *
+ * @param state the generator
+ * @return the next value
+ */
+static uint64_t lg_rand(uint64_t *state)
+{
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+static void lg_put32(char *out, uint32_t value)
+{
+    value = htonl(value);
+    memcpy(out, &value, sizeof(uint32_t));
+}
+
+static uint32_t lg_get32(const char *data)
+{
+    uint32_t value = 0;
+
+    memcpy(&value, data, sizeof(uint32_t));
+    return ntohl(value);
+}
+
+/**
+ * @brief Encodes a request in the bundled framing.
+ *
+ * @param config the run
+ * @param conn the connection sending it
+ * @param op LG_OP_*
+ * @param key the random key for puts and gets
+ * @param out buffer for the header, the key and any small payload
+ * @param cap size of out
+ * @param body_len set to the payload bytes that follow out
+ * @return the bytes written to out, or -1 if they do not fit
+ */
+static ssize_t lg_frame_encode(const lg_config_t *config, const lg_conn_t *conn, int op, uint64_t key, char *out,
+                               size_t cap, uint64_t *body_len)
+{
+    ssize_t ret = -1;
+    char name[LG_OUT_MAX];
+    const char *inline_data = NULL;
+    size_t inline_len = 0;
+    size_t name_len = 0;
+    uint64_t body = 0;
+
+    switch (op)
+    {
+    case LG_OP_LOGIN:
+        name_len = (size_t)snprintf(name, sizeof(name), "%s", config->user);
+        inline_data = config->password;
+        inline_len = strlen(config->password);
+        break;
+    case LG_OP_PUT:
+        body = config->value_len;
+        // fall through
+    case LG_OP_GET:
+        name_len = (size_t)snprintf(name, sizeof(name), "key:%" PRIu64, key);
+        break;
+    case LG_OP_FILE_GET:
+        name_len = (size_t)snprintf(name, sizeof(name), "%s", config->file_name);
+        break;
+    case LG_OP_FILE_PUT:
+        name_len = (size_t)snprintf(name, sizeof(name), "%s.%d", config->file_name, conn->id);
+        body = config->file_len;
+        break;
+    default:
+        break;
+    }
+    if ((16 + name_len + inline_len) > cap)
+    {
+        fprintf(stderr, "Request does not fit in %zu bytes.\n", cap);
+        goto END;
+    }
+
+    memset(out, 0, 16);
+    out[0] = (char)op;
+    lg_put32(out + 4, conn->session_id);
+    lg_put32(out + 8, (uint32_t)name_len);
+    lg_put32(out + 12, (uint32_t)(body + inline_len));
+    memcpy(out + 16, name, name_len);
+    if (0 != inline_len)
+    {
+        memcpy(out + 16 + name_len, inline_data, inline_len);
+    }
+    *body_len = body;
+
+    ret = (ssize_t)(16 + name_len + inline_len);
+END:
+    return ret;
+}
+
+/**
+ * @brief Reads a response header in the bundled framing.
+ *
+ * @param data the bytes received so far
+ * @param len number of bytes
+ * @param body_len set to the response body's length
+ * @param status set to the response status
+ * @param session_id set to the session the response carries
+ * @return the header's length once it is complete, or 0 while more is needed
+ */
+static ssize_t lg_frame_parse(const char *data, size_t len, uint64_t *body_len, int *status, uint32_t *session_id)
+{
+    ssize_t ret = 0;
+
+    if (16 <= len)
+    {
+        *status = (uint8_t)data[0];
+        *session_id = lg_get32(data + 4);
+        *body_len = ((uint64_t)lg_get32(data + 8) << 32) | lg_get32(data + 12);
+        ret = 16;
+    }
+
+    return ret;
+}
+
+const lg_proto_t lg_frame_proto = {.name = "frame", .encode = lg_frame_encode, .parse = lg_frame_parse};
+
+/**
+ * @brief Picks a request's operation by the configured weights.
+ *
+ * @param thread the thread
+ * @return LG_OP_*
+ */
+static int lg_pick_op(lg_thread_t *thread)
+{
+    int op = 0;
+    uint64_t total = 0;
+    uint64_t pick = 0;
+
+    for (op = 0; op < LG_NUM_OPS; op++)
+    {
+        total += thread->config->weights[op];
+    }
+    pick = lg_rand(&thread->rng) % total;
+    for (op = 0; op < (LG_NUM_OPS - 1); op++)
+    {
+        if (pick < thread->config->weights[op])
+        {
+            break;
+        }
+        pick -= thread->config->weights[op];
+    }
+
+    return op;
+}
+
+/**
+ * @brief Points the poller at what a connection waits for. Idle connections still watch for input, so a server that
+ * hangs up on them is noticed.
+ *
+ * @param thread the thread
+ * @param conn the connection
+ * @param interest POLLER_* events
+ * @return returns 0 on success, or -1 on failure
+ */
+static int lg_watch(lg_thread_t *thread, lg_conn_t *conn, uint32_t interest)
+{
+    int ret = 0;
+
+    if (interest != conn->interest)
+    {
+        ret = poller_mod(thread->poller, conn->fd, interest);
+        conn->interest = interest;
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Closes a connection and queues it to connect again.
+ *
+ * @param thread the thread
+ * @param conn the connection
+ */
+static void lg_close(lg_thread_t *thread, lg_conn_t *conn)
+{
+    int index = (int)(conn - thread->conns);
+    int slot = 0;
+
+    if (LG_CONN_IDLE == conn->state)
+    {
+        for (slot = 0; slot < thread->num_free; slot++) // only on a hangup while idle, so a scan is fine
+        {
+            if (index == thread->free_conns[slot])
+            {
+                thread->free_conns[slot] = thread->free_conns[--thread->num_free];
+                break;
+            }
+        }
+    }
+    if (-1 != conn->fd)
+    {
+        poller_del(thread->poller, conn->fd);
+        thread->by_fd[conn->fd] = NULL;
+        close(conn->fd);
+        conn->fd = -1;
+    }
+    conn->state = LG_CONN_CLOSED;
+    thread->closed_conns[thread->num_closed++] = index;
+}
+
+/**
+ * @brief Drops a connection after an error, counting the request it had in flight as failed.
+ *
+ * @param thread the thread
+ * @param conn the connection
+ */
+static void lg_drop(lg_thread_t *thread, lg_conn_t *conn)
+{
+    if ((LG_CONN_BUSY == conn->state) || (LG_CONN_LOGIN == conn->state))
+    {
+        thread->stats.errors[conn->op]++;
+        thread->stats.disconnects++;
+    }
+    lg_close(thread, conn);
+}
+
+/**
+ * @brief Sends what the socket takes of a connection's request: the encoded header, then the payload.
+ *
+ * @param thread the thread
+ * @param conn the connection
+ * @return returns 0 on success, or -1 on failure
+ */
+static int lg_send(lg_thread_t *thread, lg_conn_t *conn)
+{
+    int ret = -1;
+    int unsent = 0;
+    ssize_t sent = 0;
+    size_t offset = 0;
+    uint64_t chunk = 0;
+
+    while ((conn->out_sent < conn->out_len) || (conn->body_sent < conn->body_len))
+    {
+        if (conn->out_sent < conn->out_len)
+        {
+            sent = send(conn->fd, conn->out + conn->out_sent, conn->out_len - conn->out_sent, MSG_NOSIGNAL);
+        }
+        else
+        {
+            offset = (size_t)(conn->body_sent % LG_PAYLOAD_LEN);
+            chunk = conn->body_len - conn->body_sent;
+            chunk = (chunk > (LG_PAYLOAD_LEN - offset)) ? (LG_PAYLOAD_LEN - offset) : chunk;
+            sent = send(conn->fd, thread->payload + offset, (size_t)chunk, MSG_NOSIGNAL);
+        }
+        if (-1 == sent)
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+            if ((EAGAIN == errno) || (EWOULDBLOCK == errno))
+            {
+                break;
+            }
+            goto END;
+        }
+        thread->stats.bytes_out += (uint64_t)sent;
+        if (conn->out_sent < conn->out_len)
+        {
+            conn->out_sent += (size_t)sent;
+        }
+        else
+        {
+            conn->body_sent += (uint64_t)sent;
+        }
+    }
+
+    unsent = (conn->out_sent < conn->out_len) || (conn->body_sent < conn->body_len);
+    ret = lg_watch(thread, conn, POLLER_IN | ((0 != unsent) ? POLLER_OUT : 0));
+END:
+    return ret;
+}
+
+/**
+ * @brief Starts a request on a connection.
+ *
+ * @param thread the thread
+ * @param conn the connection, connected and with nothing in flight
+ * @param op LG_OP_*
+ * @param intended when the request should have been sent
+ * @return returns 0 on success, or -1 if the connection was dropped
+ */
+static int lg_issue(lg_thread_t *thread, lg_conn_t *conn, int op, uint64_t intended)
+{
+    int ret = -1;
+    ssize_t encoded = 0;
+
+    encoded = thread->proto->encode(thread->config, conn, op, lg_rand(&thread->rng) % thread->config->keys, conn->out,
+                                    sizeof(conn->out), &conn->body_len);
+    if (-1 == encoded)
+    {
+        goto END;
+    }
+    conn->op = op;
+    conn->intended = intended;
+    conn->out_len = (size_t)encoded;
+    conn->out_sent = 0;
+    conn->body_sent = 0;
+    conn->hdr_len = 0;
+    conn->hdr_done = 0;
+    conn->resp_left = 0;
+    conn->state = ((LG_OP_LOGIN == op) && (LG_CONN_LOGIN == conn->state)) ? LG_CONN_LOGIN : LG_CONN_BUSY;
+    if (-1 == lg_send(thread, conn))
+    {
+        goto END;
+    }
+
+    ret = 0;
+END:
+    if (-1 == ret)
+    {
+        conn->op = op;
+        lg_drop(thread, conn);
+    }
+    return ret;
+}
+
+/**
+ * @brief Records a finished request and frees its connection for the next one, or closes it when it has sent its
+ * share under churn.
+ *
+ * @param thread the thread
+ * @param conn the connection
+ * @param now the current time
+ */
+static void lg_finish(lg_thread_t *thread, lg_conn_t *conn, uint64_t now)
+{
+    int was_busy = (LG_CONN_BUSY == conn->state);
+
+    hdr_record(thread->stats.latency[conn->op], now - conn->intended);
+    thread->stats.done[conn->op]++;
+    thread->stats.errors[conn->op] += (0 != conn->status) ? 1 : 0;
+
+    if ((conn->out_sent < conn->out_len) || (conn->body_sent < conn->body_len)) // answered early; the stream is lost
+    {
+        lg_close(thread, conn);
+        goto END;
+    }
+
+    conn->requests += (1 == was_busy) ? 1 : 0;
+    conn->state = LG_CONN_IDLE;
+    if ((0 != thread->config->churn) && (conn->requests >= (size_t)thread->config->churn))
+    {
+        lg_close(thread, conn);
+        goto END;
+    }
+    if (0 == conn->is_idle)
+    {
+        thread->free_conns[thread->num_free++] = (int)(conn - thread->conns);
+    }
+
+END:
+    return;
+}
+
+/**
+ * @brief Reads a connection's response: the header through the protocol's parser, then the body, which is dropped.
+ *
+ * @param thread the thread
+ * @param conn the connection
+ * @return returns 0 on success, or -1 if the connection must be dropped
+ */
+static int lg_read(lg_thread_t *thread, lg_conn_t *conn)
+{
+    int ret = -1;
+    ssize_t bytes_read = 0;
+    ssize_t hdr_len = 0;
+    uint64_t body_len = 0;
+    uint32_t session_id = 0;
+
+    if ((LG_CONN_BUSY != conn->state) && (LG_CONN_LOGIN != conn->state)) // input with nothing in flight
+    {
+        goto END;
+    }
+
+    for (;;)
+    {
+        if (0 == conn->hdr_done)
+        {
+            bytes_read = recv(conn->fd, conn->hdr + conn->hdr_len, LG_HDR_MAX - conn->hdr_len, 0);
+        }
+        else
+        {
+            bytes_read = recv(conn->fd, thread->scratch,
+                              (conn->resp_left > LG_SCRATCH_LEN) ? LG_SCRATCH_LEN : (size_t)conn->resp_left, 0);
+        }
+        if (-1 == bytes_read)
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+            ret = ((EAGAIN == errno) || (EWOULDBLOCK == errno)) ? 0 : -1;
+            goto END;
+        }
+        if (0 == bytes_read)
+        {
+            goto END;
+        }
+        thread->stats.bytes_in += (uint64_t)bytes_read;
+
+        if (0 == conn->hdr_done)
+        {
+            conn->hdr_len += (size_t)bytes_read;
+            hdr_len = thread->proto->parse(conn->hdr, conn->hdr_len, &body_len, &conn->status, &session_id);
+            if (0 == hdr_len)
+            {
+                if (LG_HDR_MAX == conn->hdr_len)
+                {
+                    goto END;
+                }
+                continue;
+            }
+            if ((-1 == hdr_len) || ((conn->hdr_len - (size_t)hdr_len) > body_len)) // more than one response
+            {
+                goto END;
+            }
+            conn->hdr_done = 1;
+            conn->resp_left = body_len - (conn->hdr_len - (size_t)hdr_len);
+            if ((LG_OP_LOGIN == conn->op) && (0 == conn->status))
+            {
+                conn->session_id = session_id;
+            }
+        }
+        else
+        {
+            conn->resp_left -= (uint64_t)bytes_read;
+        }
+
+        if (0 == conn->resp_left)
+        {
+            lg_finish(thread, conn, lg_now());
+            ret = 0;
+            goto END;
+        }
+    }
+
+END:
+    return ret;
+}
+
+/**
+ * @brief Starts connecting a closed connection.
+ *
+ * @param thread the thread
+ * @param conn the connection
+ * @return returns 0 on success, or -1 on failure (the connection stays closed)
+ */
+static int lg_connect(lg_thread_t *thread, lg_conn_t *conn)
+{
+    int ret = -1;
+    int fd = -1;
+    int one = 1;
+    lg_conn_t **grown = NULL;
+    size_t new_size = 0;
+
+    fd = socket(thread->addr->ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (-1 == fd)
+    {
+        perror("socket()");
+        goto END;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if ((size_t)fd >= thread->by_fd_size)
+    {
+        for (new_size = (0 == thread->by_fd_size) ? 1024 : thread->by_fd_size; new_size <= (size_t)fd; new_size *= 2)
+        {
+        }
+        grown = realloc(thread->by_fd, new_size * sizeof(lg_conn_t *));
+        if (NULL == grown)
+        {
+            fprintf(stderr, "Failed to grow connection map.\n");
+            goto END;
+        }
+        memset(&grown[thread->by_fd_size], 0, (new_size - thread->by_fd_size) * sizeof(lg_conn_t *));
+        thread->by_fd = grown;
+        thread->by_fd_size = new_size;
+    }
+
+    conn->connect_start = lg_now();
+    if ((-1 == connect(fd, (const struct sockaddr *)thread->addr, thread->addr_len)) && (EINPROGRESS != errno))
+    {
+        thread->stats.connect_errors++;
+        goto END;
+    }
+    if (-1 == poller_add(thread->poller, fd, POLLER_OUT))
+    {
+        goto END;
+    }
+
+    conn->fd = fd;
+    conn->interest = POLLER_OUT;
+    conn->state = LG_CONN_CONNECTING;
+    conn->requests = 0;
+    conn->session_id = 0;
+    thread->by_fd[fd] = conn;
+    fd = -1;
+
+    ret = 0;
+END:
+    if (-1 != fd)
+    {
+        close(fd);
+        fd = -1;
+    }
+    return ret;
+}
+
+/**
+ * @brief Finishes a connect() and starts the connection's login.
+ *
+ * @param thread the thread
+ * @param conn the connection
+ * @param events the POLLER_* events reported
+ */
+static void lg_connected(lg_thread_t *thread, lg_conn_t *conn, uint32_t events)
+{
+    int error = 0;
+    socklen_t error_len = sizeof(error);
+    uint64_t now = lg_now();
+
+    if ((0 != ((POLLER_ERR | POLLER_HUP) & events)) ||
+        (-1 == getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &error_len)) || (0 != error))
+    {
+        thread->stats.connect_errors++;
+        lg_close(thread, conn);
+        goto END;
+    }
+
+    hdr_record(thread->stats.connect, now - conn->connect_start);
+    thread->stats.connects++;
+    conn->state = LG_CONN_LOGIN;
+    lg_issue(thread, conn, LG_OP_LOGIN, now);
+
+END:
+    return;
+}
+
+/**
+ * @brief Handles a readiness event on a connection.
+ *
+ * @param thread the thread
+ * @param conn the connection
+ * @param events the POLLER_* events reported
+ */
+static void lg_event(lg_thread_t *thread, lg_conn_t *conn, uint32_t events)
+{
+    if (LG_CONN_CONNECTING == conn->state)
+    {
+        lg_connected(thread, conn, events);
+        goto END;
+    }
+
+    if ((POLLER_OUT & events) && (-1 == lg_send(thread, conn)))
+    {
+        lg_drop(thread, conn);
+        goto END;
+    }
+    if (((POLLER_IN | POLLER_HUP | POLLER_RDHUP | POLLER_ERR) & events) && (-1 == lg_read(thread, conn)))
+    {
+        lg_drop(thread, conn);
+        goto END;
+    }
+
+END:
+    return;
+}
+
+/**
+ * @brief Queues an intended send time until a connection is free. Past LG_BACKLOG_MAX the send is counted as missed.
+ *
+ * @param thread the thread
+ * @param intended the time
+ */
+static void lg_backlog_push(lg_thread_t *thread, uint64_t intended)
+{
+    if (LG_BACKLOG_MAX == thread->backlog_count)
+    {
+        thread->stats.missed++;
+    }
+    else
+    {
+        thread->backlog[(thread->backlog_head + thread->backlog_count) % LG_BACKLOG_MAX] = intended;
+        thread->backlog_count++;
+    }
+}
+
+/**
+ * @brief Runs one load thread until the configured duration has passed. Under a rate, requests are scheduled at fixed
+ * intervals whether or not the server keeps up, and latency is measured from the scheduled time, so a stall shows up
+ * in every request it delays rather than in one slow sample.
+ *
+ * @param arg the thread
+ * @return NULL
+ */
+static void *lg_run(void *arg)
+{
+    lg_thread_t *thread = arg;
+    const lg_config_t *config = thread->config;
+    poller_event_t events[POLLER_MAX_EVENTS];
+    uint64_t now = lg_now();
+    uint64_t end = now + ((uint64_t)config->duration * 1000000000u);
+    uint64_t next = now;
+    uint64_t interval = (0.0 < config->rate) ? (uint64_t)((1e9 * config->threads) / config->rate) : 0;
+    uint64_t intended = 0;
+    int num_events = 0;
+    int index = 0;
+    int timeout = 0;
+    lg_conn_t *conn = NULL;
+
+    interval = ((0.0 < config->rate) && (0 == interval)) ? 1 : interval;
+    for (; now < end; now = lg_now())
+    {
+        for (index = 0; (index < LG_CONNECT_BATCH) && (0 != thread->num_closed); index++)
+        {
+            conn = &thread->conns[thread->closed_conns[--thread->num_closed]];
+            if (-1 == lg_connect(thread, conn))
+            {
+                thread->closed_conns[thread->num_closed++] = (int)(conn - thread->conns);
+                break;
+            }
+        }
+
+        for (; (0 != interval) && (next <= now); next += interval)
+        {
+            lg_backlog_push(thread, next);
+        }
+        while ((0 != thread->num_free) && ((0 == interval) || (0 != thread->backlog_count)))
+        {
+            intended = now;
+            if (0 != interval)
+            {
+                intended = thread->backlog[thread->backlog_head];
+                thread->backlog_head = (thread->backlog_head + 1) % LG_BACKLOG_MAX;
+                thread->backlog_count--;
+            }
+            conn = &thread->conns[thread->free_conns[--thread->num_free]];
+            lg_issue(thread, conn, lg_pick_op(thread), intended);
+        }
+
+        timeout = 10;
+        if (0 != interval)
+        {
+            timeout = (next > now) ? (int)((next - now) / 1000000u) : 0;
+        }
+        if (0 != thread->num_closed)
+        {
+            timeout = (timeout > 1) ? 1 : timeout; // connections still to open, without spinning on a refused port
+        }
+
+        num_events = poller_wait(thread->poller, events, POLLER_MAX_EVENTS, timeout);
+        for (index = 0; index < num_events; index++)
+        {
+            conn = ((size_t)events[index].fd < thread->by_fd_size) ? thread->by_fd[events[index].fd] : NULL;
+            if (NULL != conn)
+            {
+                lg_event(thread, conn, events[index].events);
+            }
+        }
+    }
+
+    // sends the server held up past the end were due all the same; dropping them would hide the stall that delayed
+    // them, so each counts as waiting until the end of the run
+    for (; 0 != thread->backlog_count; thread->backlog_count--)
+    {
+        hdr_record(thread->stats.latency[lg_pick_op(thread)], end - thread->backlog[thread->backlog_head]);
+        thread->backlog_head = (thread->backlog_head + 1) % LG_BACKLOG_MAX;
+        thread->stats.late++;
+    }
+
+    for (index = 0; index < thread->num_conns; index++)
+    {
+        if (-1 != thread->conns[index].fd)
+        {
+            poller_del(thread->poller, thread->conns[index].fd);
+            close(thread->conns[index].fd);
+            thread->conns[index].fd = -1;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Sets up one load thread's connections, histograms and buffers.
+ *
+ * @param thread the thread; index, config, proto, addr, addr_len and payload are set
+ * @param num_active active connections
+ * @param num_idle idle connections
+ * @param first_id id of the thread's first connection
+ * @return returns 0 on success, or -1 on failure
+ */
+static int lg_thread_init(lg_thread_t *thread, int num_active, int num_idle, int first_id)
+{
+    int ret = -1;
+    int index = 0;
+    int op = 0;
+
+    thread->num_conns = num_active + num_idle;
+    thread->rng = UINT64_C(0x9e3779b97f4a7c15) * (uint64_t)(thread->index + 1);
+    thread->poller = create_poller(POLLER_NO_URING);
+    thread->conns = calloc((size_t)thread->num_conns + 1, sizeof(lg_conn_t));
+    thread->free_conns = calloc((size_t)thread->num_conns + 1, sizeof(int));
+    thread->closed_conns = calloc((size_t)thread->num_conns + 1, sizeof(int));
+    thread->backlog = (0.0 < thread->config->rate) ? calloc(LG_BACKLOG_MAX, sizeof(uint64_t)) : NULL;
+    thread->scratch = malloc(LG_SCRATCH_LEN);
+    thread->stats.connect = create_hdr_hist(LG_HIST_HIGHEST, HDR_DEFAULT_SUB_BITS);
+    if ((NULL == thread->poller) || (NULL == thread->conns) || (NULL == thread->free_conns) ||
+        (NULL == thread->closed_conns) || ((0.0 < thread->config->rate) && (NULL == thread->backlog)) ||
+        (NULL == thread->scratch) || (NULL == thread->stats.connect))
+    {
+        fprintf(stderr, "Failed to alloc load thread.\n");
+        goto END;
+    }
+    for (op = 0; op < LG_NUM_OPS; op++)
+    {
+        thread->stats.latency[op] = create_hdr_hist(LG_HIST_HIGHEST, HDR_DEFAULT_SUB_BITS);
+        if (NULL == thread->stats.latency[op])
+        {
+            goto END;
+        }
+    }
+
+    for (index = thread->num_conns - 1; index >= 0; index--) // reversed, so the stack opens them in order
+    {
+        thread->conns[index].fd = -1;
+        thread->conns[index].id = first_id + index;
+        thread->conns[index].is_idle = (index >= num_active);
+        thread->conns[index].state = LG_CONN_CLOSED;
+        thread->closed_conns[thread->num_closed++] = index;
+    }
+
+    ret = 0;
+END:
+    return ret;
+}
+
+/**
+ * @brief Frees what lg_thread_init() set up.
+ *
+ * @param thread the thread
+ */
+static void lg_thread_free(lg_thread_t *thread)
+{
+    int op = 0;
+
+    if (NULL != thread->poller)
+    {
+        destroy_poller(thread->poller);
+        thread->poller = NULL;
+    }
+    for (op = 0; op < LG_NUM_OPS; op++)
+    {
+        if (NULL != thread->stats.latency[op])
+        {
+            destroy_hdr_hist(thread->stats.latency[op]);
+            thread->stats.latency[op] = NULL;
+        }
+    }
+    if (NULL != thread->stats.connect)
+    {
+        destroy_hdr_hist(thread->stats.connect);
+        thread->stats.connect = NULL;
+    }
+    free(thread->conns);
+    free(thread->by_fd);
+    free(thread->free_conns);
+    free(thread->closed_conns);
+    free(thread->backlog);
+    free(thread->scratch);
+}
+
+/**
+ * @brief Prints one histogram's line of the report, and writes it to the results file if there is one.
+ *
+ * @param out the results file, or NULL
+ * @param name what was measured
+ * @param hist the latencies
+ * @param errors failed requests among them
+ * @param seconds the run's length
+ */
+static void lg_report_line(FILE *out, const char *name, const hdr_hist_t *hist, uint64_t errors, double seconds)
+{
+    double per_sec = (0.0 < seconds) ? ((double)hist->total / seconds) : 0.0;
+
+    printf("%-9s %10" PRIu64 " %8" PRIu64 " %11.0f %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %10.1f\n", name, hist->total,
+           errors, per_sec, hdr_mean(hist) / 1e3, hdr_percentile(hist, 50.0) / 1e3, hdr_percentile(hist, 90.0) / 1e3,
+           hdr_percentile(hist, 99.0) / 1e3, hdr_percentile(hist, 99.9) / 1e3, hdr_percentile(hist, 99.99) / 1e3,
+           hdr_percentile(hist, 100.0) / 1e3);
+    if (NULL != out)
+    {
+        fprintf(out,
+                "{\"op\":\"%s\",\"count\":%" PRIu64 ",\"errors\":%" PRIu64 ",\"per_sec\":%.1f,\"mean_ns\":%.0f,"
+                "\"p50_ns\":%" PRIu64 ",\"p90_ns\":%" PRIu64 ",\"p99_ns\":%" PRIu64 ",\"p999_ns\":%" PRIu64
+                ",\"p9999_ns\":%" PRIu64 ",\"max_ns\":%" PRIu64 "}\n",
+                name, hist->total, errors, per_sec, hdr_mean(hist), hdr_percentile(hist, 50.0),
+                hdr_percentile(hist, 90.0), hdr_percentile(hist, 99.0), hdr_percentile(hist, 99.9),
+                hdr_percentile(hist, 99.99), hdr_percentile(hist, 100.0));
+    }
+}
+
+/**
+ * @brief Merges every thread's results and prints them: latency per operation, over all operations and for
+ * connecting, then the rates.
+ *
+ * @param config the run
+ * @param threads the finished threads
+ * @param seconds the run's length
+ * @return returns 0 on success, or -1 on failure
+ */
+static int lg_report(const lg_config_t *config, lg_thread_t *threads, double seconds)
+{
+    int ret = -1;
+    int index = 0;
+    int op = 0;
+    uint64_t all_errors = 0;
+    hdr_hist_t *merged = NULL;
+    hdr_hist_t *all = NULL;
+    lg_stats_t totals = {0};
+    FILE *out = NULL;
+
+    merged = create_hdr_hist(LG_HIST_HIGHEST, HDR_DEFAULT_SUB_BITS);
+    all = create_hdr_hist(LG_HIST_HIGHEST, HDR_DEFAULT_SUB_BITS);
+    if ((NULL == merged) || (NULL == all))
+    {
+        goto END;
+    }
+    if (NULL != config->output)
+    {
+        out = fopen(config->output, "w");
+        if (NULL == out)
+        {
+            perror("fopen()");
+            goto END;
+        }
+    }
+
+    for (index = 0; index < config->threads; index++)
+    {
+        for (op = 0; op < LG_NUM_OPS; op++)
+        {
+            totals.errors[op] += threads[index].stats.errors[op];
+        }
+        totals.connects += threads[index].stats.connects;
+        totals.connect_errors += threads[index].stats.connect_errors;
+        totals.disconnects += threads[index].stats.disconnects;
+        totals.missed += threads[index].stats.missed;
+        totals.late += threads[index].stats.late;
+        totals.bytes_in += threads[index].stats.bytes_in;
+        totals.bytes_out += threads[index].stats.bytes_out;
+    }
+
+    printf("%-9s %10s %8s %11s %9s %9s %9s %9s %9s %9s %10s  (latency in us)\n", "op", "count", "errors", "per sec",
+           "mean", "p50", "p90", "p99", "p99.9", "p99.99", "max");
+    for (op = 0; op < LG_NUM_OPS; op++)
+    {
+        hdr_reset(merged);
+        for (index = 0; index < config->threads; index++)
+        {
+            hdr_merge(merged, threads[index].stats.latency[op]);
+        }
+        hdr_merge(all, merged);
+        all_errors += totals.errors[op];
+        if (0 != merged->total)
+        {
+            lg_report_line(out, lg_op_names[op], merged, totals.errors[op], seconds);
+        }
+    }
+    lg_report_line(out, "all", all, all_errors, seconds);
+
+    hdr_reset(merged);
+    for (index = 0; index < config->threads; index++)
+    {
+        hdr_merge(merged, threads[index].stats.connect);
+    }
+    lg_report_line(out, "connect", merged, totals.connect_errors, seconds);
+
+    printf("\n%.0f connections/sec, %.0f requests/sec, %" PRIu64 " dropped mid-request, %" PRIu64
+           " sends missed, %" PRIu64 " late at the end, %.1f MB/s out, %.1f MB/s in\n",
+           (double)totals.connects / seconds, (double)(all->total - totals.late) / seconds, totals.disconnects,
+           totals.missed, totals.late, (double)totals.bytes_out / seconds / 1e6,
+           (double)totals.bytes_in / seconds / 1e6);
+    if (NULL != out)
+    {
+        fprintf(out,
+                "{\"op\":\"summary\",\"seconds\":%.3f,\"connects\":%" PRIu64 ",\"disconnects\":%" PRIu64
+                ",\"missed\":%" PRIu64 ",\"late\":%" PRIu64 ",\"bytes_out\":%" PRIu64 ",\"bytes_in\":%" PRIu64 "}\n",
+                seconds, totals.connects, totals.disconnects, totals.missed, totals.late, totals.bytes_out,
+                totals.bytes_in);
+    }
+
+    ret = 0;
+END:
+    if (NULL != out)
+    {
+        fclose(out);
+        out = NULL;
+    }
+    if (NULL != merged)
+    {
+        destroy_hdr_hist(merged);
+        merged = NULL;
+    }
+    if (NULL != all)
+    {
+        destroy_hdr_hist(all);
+        all = NULL;
+    }
+    return ret;
+}
+
+/**
+ * @brief Applies a named scenario's settings. Options given after it override them.
+ *
+ * mix: the default; mostly gets, some puts, session checks and small file transfers over long-lived connections.
+ * accept: an accept storm; every connection logs in, sends one request and reconnects.
+ * idle: ten thousand logged-in connections sit idle while a small set runs the mix.
+ * transfer: large uploads and downloads over a few connections.
+ *
+ * @param config the settings to change
+ * @param name the scenario
+ * @return returns 0 on success, or -1 for an unknown scenario
+ */
+static int lg_scenario(lg_config_t *config, const char *name)
+{
+    int ret = 0;
+    static const unsigned mix[LG_NUM_OPS] = {0, 10, 20, 60, 5, 5};
+
+    memcpy(config->weights, mix, sizeof(mix));
+    if (0 == strcmp(name, "accept"))
+    {
+        memset(config->weights, 0, sizeof(config->weights));
+        config->weights[LG_OP_SESSION] = 1;
+        config->churn = 1;
+    }
+    else if (0 == strcmp(name, "idle"))
+    {
+        config->conns = 64;
+        config->idle_conns = 10000;
+    }
+    else if (0 == strcmp(name, "transfer"))
+    {
+        memset(config->weights, 0, sizeof(config->weights));
+        config->weights[LG_OP_FILE_GET] = 1;
+        config->weights[LG_OP_FILE_PUT] = 1;
+        config->conns = 16;
+        config->file_len = 64 << 20;
+    }
+    else if (0 != strcmp(name, "mix"))
+    {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Reads an operation mix such as "get=60,put=20,session=20". Operations not named get weight 0.
+ *
+ * @param config the settings to change
+ * @param mix the mix
+ * @return returns 0 on success, or -1 if it names an unknown operation or has no weight at all
+ */
+static int lg_parse_mix(lg_config_t *config, const char *mix)
+{
+    int ret = -1;
+    int op = 0;
+    unsigned total = 0;
+    size_t name_len = 0;
+    const char *cursor = mix;
+    char *end = NULL;
+
+    memset(config->weights, 0, sizeof(config->weights));
+    while ('\0' != *cursor)
+    {
+        name_len = strcspn(cursor, "=");
+        for (op = 0; op < LG_NUM_OPS; op++)
+        {
+            if ((strlen(lg_op_names[op]) == name_len) && (0 == strncmp(cursor, lg_op_names[op], name_len)))
+            {
+                break;
+            }
+        }
+        if ((LG_NUM_OPS == op) || ('=' != cursor[name_len]))
+        {
+            fprintf(stderr, "Unknown operation in mix: %s\n", cursor);
+            goto END;
+        }
+        config->weights[op] = (unsigned)strtoul(cursor + name_len + 1, &end, 10);
+        total += config->weights[op];
+        cursor = (',' == *end) ? end + 1 : end;
+        if ((',' != end[0]) && ('\0' != end[0]))
+        {
+            fprintf(stderr, "Bad weight in mix: %s\n", mix);
+            goto END;
+        }
+    }
+    if (0 == total)
+    {
+        fprintf(stderr, "Mix has no weight.\n");
+        goto END;
+    }
+
+    ret = 0;
+END:
+    return ret;
+}
+
+static void lg_usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [-s mix|accept|idle|transfer] [-H host] [-p port] [-t threads] [-c conns] [-i idle_conns]\n"
+            "          [-r rate] [-d seconds] [-m op=weight,...] [-k churn] [-K keys] [-v value_len] [-f file_len]\n"
+            "          [-n file_name] [-u user] [-w password] [-o results.json]\n"
+            "ops: login session put get file_get file_put. -r 0 runs closed loop.\n",
+            name);
+}
+
+/**
+ * @brief Load generator for the threadpoll server. Opens the configured connections over loopback (or to -H), logs
+ * each in and drives a weighted mix of requests at a fixed rate or closed loop, then reports latency percentiles per
+ * operation from HDR histograms with connections and requests per second. Scenarios cover steady mixed load, accept
+ * storms, many idle connections and large transfers.
+ */
+int main(int argc, char **argv)
+{
+    int ret = EXIT_FAILURE;
+    int opt = 0;
+    int index = 0;
+    int started = 0;
+    int next_id = 0;
+    int num_active = 0;
+    int num_idle = 0;
+    uint64_t begin = 0;
+    char *payload = NULL;
+    lg_thread_t *threads = NULL;
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    struct addrinfo *resolved = NULL;
+    struct sockaddr_storage addr = {0};
+    struct rlimit files = {0};
+    lg_config_t config = {.host = LG_DEFAULT_HOST,
+                          .port = LG_DEFAULT_PORT,
+                          .user = LG_DEFAULT_USER,
+                          .password = LG_DEFAULT_PASSWORD,
+                          .file_name = LG_DEFAULT_FILE_NAME,
+                          .threads = LG_DEFAULT_THREADS,
+                          .conns = LG_DEFAULT_CONNS,
+                          .duration = LG_DEFAULT_DURATION,
+                          .keys = LG_DEFAULT_KEYS,
+                          .value_len = LG_DEFAULT_VALUE_LEN,
+                          .file_len = LG_DEFAULT_FILE_LEN};
+    const char *options = "s:H:p:t:c:i:r:d:m:k:K:v:f:n:u:w:o:";
+
+    lg_scenario(&config, "mix");
+    while (-1 != (opt = getopt(argc, argv, options))) // the scenario first, so the other options override it
+    {
+        if (('s' == opt) && (-1 == lg_scenario(&config, optarg)))
+        {
+            lg_usage(argv[0]);
+            goto END;
+        }
+    }
+    for (optind = 1; -1 != (opt = getopt(argc, argv, options));)
+    {
+        switch (opt)
+        {
+        case 's':
+            break;
+        case 'H':
+            config.host = optarg;
+            break;
+        case 'p':
+            config.port = optarg;
+            break;
+        case 't':
+            config.threads = atoi(optarg);
+            break;
+        case 'c':
+            config.conns = atoi(optarg);
+            break;
+        case 'i':
+            config.idle_conns = atoi(optarg);
+            break;
+        case 'r':
+            config.rate = atof(optarg);
+            break;
+        case 'd':
+            config.duration = atoi(optarg);
+            break;
+        case 'm':
+            if (-1 == lg_parse_mix(&config, optarg))
+            {
+                goto END;
+            }
+            break;
+        case 'k':
+            config.churn = atoi(optarg);
+            break;
+        case 'K':
+            config.keys = strtoull(optarg, NULL, 10);
+            break;
+        case 'v':
+            config.value_len = strtoull(optarg, NULL, 10);
+            break;
+        case 'f':
+            config.file_len = strtoull(optarg, NULL, 10);
+            break;
+        case 'n':
+            config.file_name = optarg;
+            break;
+        case 'u':
+            config.user = optarg;
+            break;
+        case 'w':
+            config.password = optarg;
+            break;
+        case 'o':
+            config.output = optarg;
+            break;
+        default:
+            lg_usage(argv[0]);
+            goto END;
+        }
+    }
+    if ((1 > config.threads) || (1 > config.conns) || (0 > config.idle_conns) || (1 > config.duration) ||
+        (0.0 > config.rate) || (0 > config.churn) || (0 == config.keys) || (UINT32_MAX < config.value_len) ||
+        (UINT32_MAX < config.file_len))
+    {
+        lg_usage(argv[0]);
+        goto END;
+    }
+
+    if (0 != getaddrinfo(config.host, config.port, &hints, &resolved))
+    {
+        fprintf(stderr, "Failed to resolve %s:%s.\n", config.host, config.port);
+        goto END;
+    }
+    memcpy(&addr, resolved->ai_addr, resolved->ai_addrlen);
+
+    // every connection is an fd; ask for as many as the hard limit allows
+    if (0 == getrlimit(RLIMIT_NOFILE, &files))
+    {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
+
+    payload = malloc(LG_PAYLOAD_LEN);
+    threads = calloc((size_t)config.threads, sizeof(lg_thread_t));
+    if ((NULL == payload) || (NULL == threads))
+    {
+        fprintf(stderr, "Failed to alloc load threads.\n");
+        goto END;
+    }
+    memset(payload, 'x', LG_PAYLOAD_LEN);
+
+    for (index = 0; index < config.threads; index++)
+    {
+        threads[index].index = index;
+        threads[index].config = &config;
+        threads[index].proto = &lg_frame_proto;
+        threads[index].addr = &addr;
+        threads[index].addr_len = resolved->ai_addrlen;
+        threads[index].payload = payload;
+        num_active = (config.conns / config.threads) + (index < (config.conns % config.threads));
+        num_idle = (config.idle_conns / config.threads) + (index < (config.idle_conns % config.threads));
+        if (-1 == lg_thread_init(&threads[index], num_active, num_idle, next_id))
+        {
+            goto END;
+        }
+        next_id += num_active + num_idle;
+    }
+
+    begin = lg_now();
+    for (started = 0; started < config.threads; started++)
+    {
+        if (0 != pthread_create(&threads[started].thread, NULL, lg_run, &threads[started]))
+        {
+            fprintf(stderr, "Failed to start load thread.\n");
+            break;
+        }
+    }
+    for (index = 0; index < started; index++)
+    {
+        pthread_join(threads[index].thread, NULL);
+    }
+    if ((started == config.threads) &&
+        (0 == lg_report(&config, threads, (double)(lg_now() - begin) / 1e9)))
+    {
+        ret = EXIT_SUCCESS;
+    }
+
+END:
+    if (NULL != threads)
+    {
+        for (index = 0; index < config.threads; index++)
+        {
+            lg_thread_free(&threads[index]);
+        }
+        free(threads);
+        threads = NULL;
+    }
+    if (NULL != resolved)
+    {
+        freeaddrinfo(resolved);
+        resolved = NULL;
+    }
+    free(payload);
+    payload = NULL;
+    return ret;
+}
+
+/*** end of file ***/
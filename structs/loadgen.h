@@ -0,0 +1,182 @@
+#ifndef LOADGEN_H
+#define LOADGEN_H
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hdrhist.h"
+#include "poller.h"
+
+#define LG_OP_LOGIN 0     // log in and take a session
+#define LG_OP_SESSION 1   // session-authenticated request with no payload
+#define LG_OP_PUT 2       // store value_len bytes under a random key
+#define LG_OP_GET 3       // fetch a random key
+#define LG_OP_FILE_GET 4  // download file_name
+#define LG_OP_FILE_PUT 5  // upload file_len bytes
+#define LG_NUM_OPS 6
+
+#define LG_CONN_CONNECTING 0 // connect() in progress
+#define LG_CONN_LOGIN 1      // connected; the login that every connection starts with is in flight
+#define LG_CONN_IDLE 2       // logged in, free for the next request
+#define LG_CONN_BUSY 3       // a request is in flight
+#define LG_CONN_CLOSED 4     // waiting to reconnect
+
+#define LG_DEFAULT_HOST "127.0.0.1"
+#define LG_DEFAULT_PORT "8989"
+#define LG_DEFAULT_THREADS 4
+#define LG_DEFAULT_CONNS 1000
+#define LG_DEFAULT_DURATION 10 // seconds
+#define LG_DEFAULT_KEYS 100000
+#define LG_DEFAULT_VALUE_LEN 100
+#define LG_DEFAULT_FILE_LEN (64 << 10)
+#define LG_DEFAULT_FILE_NAME "loadgen.bin" // downloads fetch this file; it must exist under the server's root
+#define LG_DEFAULT_USER "loadgen"
+#define LG_DEFAULT_PASSWORD "loadgen"
+
+#define LG_CONNECT_BATCH 256       // connections opened per loop pass, so an accept storm still services responses
+#define LG_BACKLOG_MAX (1 << 20)   // intended send times a thread holds for a free connection; later ones are missed
+#define LG_OUT_MAX 512             // request header, key and any small inline payload
+#define LG_HDR_MAX 64              // most response header bytes a protocol may need
+#define LG_PAYLOAD_LEN (1 << 20)   // shared bytes that large request bodies are sent from, repeatedly
+#define LG_SCRATCH_LEN (256 << 10) // response bodies are read into this and dropped
+#define LG_HIST_HIGHEST (UINT64_C(1) << 36)
+
+/**
+ * @brief what to run. Weights pick each request's operation; rate 0 runs closed loop, every connection sending its
+ * next request as soon as the last is answered.
+ */
+typedef struct lg_config
+{
+    const char *host;
+    const char *port;
+    const char *user;
+    const char *password;
+    const char *file_name;
+    const char *output; // JSON lines results file, or NULL
+    int threads;
+    int conns;      // active connections, spread over the threads
+    int idle_conns; // connections that log in and then sit idle for the whole run
+    double rate;    // requests per second over all threads; 0 for closed loop
+    int duration;
+    int churn; // requests a connection sends before closing and reconnecting; 0 keeps connections open
+    unsigned weights[LG_NUM_OPS];
+    uint64_t keys;
+    size_t value_len;
+    uint64_t file_len;
+} lg_config_t;
+
+typedef struct lg_conn lg_conn_t;
+
+/**
+ * @brief the wire format. encode() writes the request header and anything small into out and reports the bytes that
+ * follow it (sent from a shared payload); parse() reads a response header. Only these two know the format, so pointing
+ * the generator at a server with different framing means supplying another lg_proto_t.
+ */
+typedef struct lg_proto
+{
+    const char *name;
+    ssize_t (*encode)(const lg_config_t *config, const lg_conn_t *conn, int op, uint64_t key, char *out, size_t cap,
+                      uint64_t *body_len);
+    ssize_t (*parse)(const char *data, size_t len, uint64_t *body_len, int *status, uint32_t *session_id);
+} lg_proto_t;
+
+/**
+ * @brief one client connection with at most one request in flight
+ */
+struct lg_conn
+{
+    int fd;
+    int state;
+    uint32_t interest; // events the poller watches the socket for
+    int id;            // unique over the run; names the connection's uploads
+    int is_idle;       // one of the config's idle connections
+    int op;
+    uint32_t session_id;
+    uint64_t intended; // when the request in flight should have been sent; latency is measured from here
+    uint64_t connect_start;
+    size_t requests; // requests sent since connecting
+    char out[LG_OUT_MAX];
+    size_t out_len;
+    size_t out_sent;
+    uint64_t body_len; // payload bytes after out
+    uint64_t body_sent;
+    char hdr[LG_HDR_MAX];
+    size_t hdr_len;
+    int hdr_done;
+    int status;
+    uint64_t resp_left; // response body bytes still to read
+};
+
+/**
+ * @brief one thread's results. Histograms are in nanoseconds.
+ */
+typedef struct lg_stats
+{
+    hdr_hist_t *latency[LG_NUM_OPS];
+    hdr_hist_t *connect;
+    uint64_t done[LG_NUM_OPS];
+    uint64_t errors[LG_NUM_OPS];
+    uint64_t connects;
+    uint64_t connect_errors;
+    uint64_t disconnects; // connections lost with a request in flight
+    uint64_t missed;      // intended sends dropped because the backlog was full
+    uint64_t late;        // intended sends still waiting when the run ended; recorded as latency up to the end
+    uint64_t bytes_out;
+    uint64_t bytes_in;
+} lg_stats_t;
+
+/**
+ * @brief one load thread: its share of the connections, driven from its own poller
+ */
+typedef struct lg_thread
+{
+    pthread_t thread;
+    int index;
+    const lg_config_t *config;
+    const lg_proto_t *proto;
+    const struct sockaddr_storage *addr;
+    socklen_t addr_len;
+    poller_t *poller;
+    lg_conn_t *conns;
+    int num_conns;
+    lg_conn_t **by_fd;
+    size_t by_fd_size;
+    int *free_conns; // logged in and idle, by index, used as a stack
+    int num_free;
+    uint64_t *backlog; // intended send times with no connection free yet, a ring
+    size_t backlog_head;
+    size_t backlog_count;
+    int *closed_conns; // waiting to connect, by index, used as a stack
+    int num_closed;
+    uint64_t rng;
+    const char *payload;
+    char *scratch;
+    lg_stats_t stats;
+} lg_thread_t;
+
+/**
+ * @brief The bundled wire format. A request is a 16 byte header (op, 3 reserved bytes, session ID, key length, body
+ * length, all big-endian) followed by the key and the body. A response is a 16 byte header (status, 3 reserved
+ * bytes, session ID, body length as 64 bits) followed by the body. Status 0 is success.
+ */
+extern const lg_proto_t lg_frame_proto;
+
+#endif
+
+/*** end of file ***/
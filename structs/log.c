@@ -0,0 +1,379 @@
+#include "../include/log.h"
+
+atomic_int log_level = LOG_DEFAULT_LEVEL;
+static _Atomic(log_ring_t *) all_rings = NULL; // every ring ever created, drained by the writer
+static _Thread_local log_ring_t *thread_ring = NULL;
+static atomic_bool writer_running = false;
+static atomic_bool writer_stop = false;
+static int writer_fd = -1;
+static pthread_t writer_thread;
+
+static const char *const level_names[] = {"OFF", "ERROR", "WARN", "INFO", "DEBUG"};
+
+/**
+ * @brief get the calling thread's ring, creating and registering it on first use
+ *
+ * @return the ring, or NULL if it could not be allocated
+ */
+static log_ring_t *log_thread_ring(void)
+{
+    log_ring_t *ring = thread_ring;
+
+    if (NULL != ring)
+    {
+        goto END;
+    }
+
+    if (0 != posix_memalign((void **)&ring, CACHE_LINE_SIZE, sizeof(log_ring_t)))
+    {
+        ring = NULL; // nowhere to report it but the synchronous path the caller falls back to
+        goto END;
+    }
+    memset(ring, 0, sizeof(log_ring_t));
+    ring->tid = (int)syscall(SYS_gettid);
+
+    ring->next_ring = atomic_load(&all_rings);
+    while (!atomic_compare_exchange_weak(&all_rings, &ring->next_ring, ring))
+    {
+    }
+    thread_ring = ring;
+
+END:
+    return ring;
+}
+
+/**
+ * @brief render one message as a line: UTC time, level, thread, source location and text
+ *
+ * @param buf buffer receiving the line
+ * @param buf_len size of buf
+ * @param record the message
+ * @param tid the thread that logged it
+ * @return the length of the line, cut to fit buf
+ */
+static size_t log_render(char *buf, size_t buf_len, const log_record_t *record, int tid)
+{
+    time_t seconds = (time_t)(record->ts / 1000000000ULL);
+    struct tm utc = {0};
+    const char *file = strrchr(record->file, '/');
+    size_t len = 0;
+    int printed = 0;
+
+    gmtime_r(&seconds, &utc);
+    len = strftime(buf, buf_len, "%Y-%m-%dT%H:%M:%S", &utc);
+    printed = snprintf(buf + len, buf_len - len, ".%06uZ %-5s [%d] %s:%d: %s\n",
+                       (unsigned)((record->ts % 1000000000ULL) / 1000), level_names[record->level], tid,
+                       (NULL == file) ? record->file : (file + 1), record->line, record->msg);
+    len += (0 > printed) ? 0 : (size_t)printed;
+    if (len >= buf_len) // cut; keep the line ending
+    {
+        len = buf_len - 1;
+        buf[len - 1] = '\n';
+    }
+    return len;
+}
+
+/**
+ * @brief write a whole buffer, retrying short writes
+ *
+ * @param fd the descriptor
+ * @param buf the bytes
+ * @param len number of bytes
+ */
+static void log_write_all(int fd, const char *buf, size_t len)
+{
+    ssize_t num_written = 0;
+    size_t total_written = 0;
+
+    while (total_written < len)
+    {
+        num_written = write(fd, buf + total_written, len - total_written);
+        if (-1 == num_written)
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+            break; // the log itself is failing; there is nowhere left to say so
+        }
+        total_written += (size_t)num_written;
+    }
+}
+
+/**
+ * @brief queue one record in the calling thread's ring, or write it at once without a writer
+ *
+ * @param record the record, with its text formatted
+ */
+static void log_submit(const log_record_t *record)
+{
+    log_ring_t *ring = NULL;
+    size_t head = 0;
+    char line[LOG_MSG_MAX + 128];
+
+    if (true == atomic_load_explicit(&writer_running, memory_order_acquire))
+    {
+        ring = log_thread_ring();
+    }
+    if (NULL == ring)
+    {
+        // one write() per line: lines from different threads never interleave, and no stdio lock is taken
+        log_write_all(STDERR_FILENO, line, log_render(line, sizeof(line), record, (int)syscall(SYS_gettid)));
+        goto END;
+    }
+
+    head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (LOG_RING_RECORDS <= (head - atomic_load_explicit(&ring->tail, memory_order_acquire)))
+    {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed); // never wait on the writer
+        goto END;
+    }
+    memcpy(&ring->records[head & (LOG_RING_RECORDS - 1)], record, sizeof(log_record_t));
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+END:
+    return;
+}
+
+/**
+ * @brief Queues a message for the writer, or writes it at once if the writer is not running. Use the log_ macros,
+ * which skip disabled levels before the arguments are evaluated.
+ *
+ * @param level a LOG_LEVEL_
+ * @param site the call site's rate limit state
+ * @param file source file of the call
+ * @param line source line of the call
+ * @param format printf format of the message
+ */
+void log_write(int level, log_site_t *site, const char *file, int line, const char *format, ...)
+{
+    va_list args;
+    log_record_t record;
+    struct timespec now = {0};
+    uint64_t now_ns = 0;
+    size_t msg_len = 0;
+
+    if ((LOG_LEVEL_ERROR > level) || (LOG_LEVEL_DEBUG < level) || (NULL == site) || (NULL == format))
+    {
+        goto END;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    now_ns = ((uint64_t)now.tv_sec * 1000000000ULL) + (uint64_t)now.tv_nsec;
+    record.ts = now_ns;
+    record.file = file;
+    record.line = line;
+    record.level = level;
+
+    if (LOG_RATE_WINDOW_NS <= (now_ns - site->window_start)) // a new window; say what the last one held back
+    {
+        if (0 != site->suppressed)
+        {
+            snprintf(record.msg, sizeof(record.msg), "%u similar messages suppressed", site->suppressed);
+            log_submit(&record);
+        }
+        site->window_start = now_ns;
+        site->count = 0;
+        site->suppressed = 0;
+    }
+    if (LOG_RATE_BURST <= site->count)
+    {
+        site->suppressed++;
+        goto END;
+    }
+    site->count++;
+
+    va_start(args, format);
+    vsnprintf(record.msg, sizeof(record.msg), format, args);
+    va_end(args);
+    msg_len = strlen(record.msg);
+    while ((0 < msg_len) && ('\n' == record.msg[msg_len - 1])) // the writer ends every line itself
+    {
+        record.msg[--msg_len] = '\0';
+    }
+    log_submit(&record);
+
+END:
+    return;
+}
+
+/**
+ * @brief Sets the most detailed level logged.
+ *
+ * @param level a LOG_LEVEL_
+ */
+void log_set_level(int level)
+{
+    level = (LOG_LEVEL_OFF > level) ? LOG_LEVEL_OFF : level;
+    level = (LOG_LEVEL_DEBUG < level) ? LOG_LEVEL_DEBUG : level;
+    atomic_store_explicit(&log_level, level, memory_order_relaxed);
+}
+
+/**
+ * @brief Parses a level name: off, error, warn, info or debug.
+ *
+ * @param name the name
+ * @return the LOG_LEVEL_, or -1 if the name is not a level
+ */
+int log_level_from_name(const char *name)
+{
+    int ret = -1;
+    int level = 0;
+
+    if (NULL == name)
+    {
+        goto END;
+    }
+    for (level = LOG_LEVEL_OFF; level <= LOG_LEVEL_DEBUG; level++)
+    {
+        if (0 == strcasecmp(name, level_names[level]))
+        {
+            ret = level;
+            break;
+        }
+    }
+
+END:
+    return ret;
+}
+
+/**
+ * @brief add one rendered record to the writer's batch, writing the batch out first if the line might not fit
+ *
+ * @param out the batch buffer, LOG_OUT_BUF bytes
+ * @param out_len bytes already in the batch; advanced past the line
+ * @param record the record
+ * @param tid the thread that logged it
+ */
+static void log_drain_line(char *out, size_t *out_len, const log_record_t *record, int tid)
+{
+    if ((LOG_OUT_BUF - *out_len) < (LOG_MSG_MAX + 128))
+    {
+        log_write_all(writer_fd, out, *out_len);
+        *out_len = 0;
+    }
+    *out_len += log_render(out + *out_len, LOG_OUT_BUF - *out_len, record, tid);
+}
+
+/**
+ * @brief move every queued record from every ring into batches and write them out
+ *
+ * @param out the batch buffer, LOG_OUT_BUF bytes
+ * @return the number of records written
+ */
+static size_t log_drain(char *out)
+{
+    size_t ret = 0;
+    size_t out_len = 0;
+    size_t head = 0;
+    size_t tail = 0;
+    size_t dropped = 0;
+    log_ring_t *ring = NULL;
+    log_record_t notice = {0};
+    struct timespec now = {0};
+
+    for (ring = atomic_load(&all_rings); NULL != ring; ring = ring->next_ring)
+    {
+        head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        for (tail = atomic_load_explicit(&ring->tail, memory_order_relaxed); tail != head; tail++)
+        {
+            log_drain_line(out, &out_len, &ring->records[tail & (LOG_RING_RECORDS - 1)], ring->tid);
+            ret++;
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release); // the slots may be reused from here
+        dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+        if (0 != dropped) // after the ring's records, which were all queued before it filled
+        {
+            clock_gettime(CLOCK_REALTIME, &now);
+            notice.ts = ((uint64_t)now.tv_sec * 1000000000ULL) + (uint64_t)now.tv_nsec;
+            notice.file = __FILE__;
+            notice.line = __LINE__;
+            notice.level = LOG_LEVEL_WARN;
+            snprintf(notice.msg, sizeof(notice.msg), "%zu messages dropped; the thread's log ring was full", dropped);
+            log_drain_line(out, &out_len, &notice, ring->tid);
+        }
+    }
+    log_write_all(writer_fd, out, out_len);
+
+    return ret;
+}
+
+/**
+ * @brief the writer thread: drains the rings until stopped, sleeping only while they are all empty
+ *
+ * @param args unused
+ * @return NULL
+ */
+static void *log_writer(void *args)
+{
+    char *out = NULL;
+    struct timespec idle = {.tv_sec = 0, .tv_nsec = LOG_FLUSH_NS};
+
+    (void)args;
+    out = malloc(LOG_OUT_BUF);
+    if (NULL == out)
+    {
+        goto END;
+    }
+
+    while (false == atomic_load(&writer_stop))
+    {
+        if (0 == log_drain(out))
+        {
+            nanosleep(&idle, NULL);
+        }
+    }
+    log_drain(out); // what was queued before the stop
+
+END:
+    free(out);
+    out = NULL;
+    return NULL;
+}
+
+/**
+ * @brief Starts the background writer. From then on logging only copies the message into the calling thread's ring,
+ * and the writer formats the records and writes them out in batches.
+ *
+ * @param fd where the log goes, e.g. STDERR_FILENO
+ * @return returns 0 on success, or -1 on failure (messages are then written synchronously)
+ */
+int log_start(int fd)
+{
+    int ret = -1;
+    int check = 0;
+
+    if ((0 > fd) || (true == atomic_load(&writer_running)))
+    {
+        log_error("Invalid log fd passed, or the log writer is already running.");
+        goto END;
+    }
+
+    writer_fd = fd;
+    atomic_store(&writer_stop, false);
+    check = pthread_create(&writer_thread, NULL, log_writer, NULL);
+    if (0 != check)
+    {
+        log_error("pthread_create(): %s", strerror(check));
+        goto END;
+    }
+    atomic_store_explicit(&writer_running, true, memory_order_release);
+
+    ret = 0;
+END:
+    return ret;
+}
+
+/**
+ * @brief Stops the background writer after it writes out everything queued. Later messages are written synchronously.
+ */
+void log_stop(void)
+{
+    if (true == atomic_exchange(&writer_running, false))
+    {
+        atomic_store(&writer_stop, true);
+        pthread_join(writer_thread, NULL);
+    }
+}
+
+/*** end of file ***/
@@ -0,0 +1,140 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOG_LEVEL_OFF 0
+#define LOG_LEVEL_ERROR 1 // an operation failed
+#define LOG_LEVEL_WARN 2  // something is degraded but the server carries on
+#define LOG_LEVEL_INFO 3  // lifecycle: startup, shutdown, snapshots
+#define LOG_LEVEL_DEBUG 4 // per-request detail; what debug_printf() used to print in DEBUG builds
+#define LOG_DEFAULT_LEVEL LOG_LEVEL_INFO
+
+#define LOG_RING_RECORDS 256        // messages a thread can have waiting for the writer; a power of two
+#define LOG_MSG_MAX 216             // longest message kept; longer ones are cut
+#define LOG_OUT_BUF (64 << 10)      // the writer's batch; one write() per batch
+#define LOG_FLUSH_NS 10000000L      // the writer's sleep when every ring is empty (10 ms)
+#define LOG_RATE_WINDOW_NS 1000000000ULL // a call site logs at most LOG_RATE_BURST messages per thread per window
+#define LOG_RATE_BURST 10
+
+#ifndef CACHE_LINE_SIZE
+#define CACHE_LINE_SIZE 64
+#endif
+
+/**
+ * @brief a call site's rate limit state. Each site keeps one per thread, so checking it shares nothing.
+ */
+typedef struct log_site
+{
+    uint64_t window_start;
+    uint32_t count;      // messages logged in the window
+    uint32_t suppressed; // messages dropped in the window, reported when the next one is let through
+} log_site_t;
+
+/**
+ * @brief a message waiting for the writer. Only the message text is formatted by the caller; the header fields are
+ * kept binary and the writer renders them.
+ */
+typedef struct log_record
+{
+    uint64_t ts; // CLOCK_REALTIME nanoseconds
+    const char *file;
+    int line;
+    int level;
+    char msg[LOG_MSG_MAX];
+} log_record_t;
+
+/**
+ * @brief a thread's messages: a single-producer single-consumer ring between the thread and the writer. A full ring
+ * drops the message and counts it; the logging thread never waits. Rings live for the life of the process, like the
+ * epoch records.
+ */
+typedef struct log_ring
+{
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t head; // written by the owning thread
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t tail; // written by the writer
+    atomic_size_t dropped;
+    int tid;
+    log_record_t records[LOG_RING_RECORDS];
+    struct log_ring *next_ring;
+} log_ring_t;
+
+extern atomic_int log_level; // messages above this level are skipped at the call site
+
+/**
+ * @brief Logs a message at a level, if the level is enabled. Arguments are not evaluated otherwise.
+ */
+#define LOG_AT(level, ...)                                                                                             \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        static _Thread_local log_site_t log_site_;                                                                     \
+        if ((level) <= atomic_load_explicit(&log_level, memory_order_relaxed))                                         \
+        {                                                                                                              \
+            log_write((level), &log_site_, __FILE__, __LINE__, __VA_ARGS__);                                           \
+        }                                                                                                              \
+    } while (0)
+
+#define log_error(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_warn(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_info(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_debug(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define log_perror(what) log_error("%s: %s", (what), strerror(errno)) // for where perror() was used
+
+/**
+ * @brief Queues a message for the writer, or writes it at once if the writer is not running. Use the log_ macros,
+ * which skip disabled levels before the arguments are evaluated.
+ *
+ * @param level a LOG_LEVEL_
+ * @param site the call site's rate limit state
+ * @param file source file of the call
+ * @param line source line of the call
+ * @param format printf format of the message
+ */
+void log_write(int level, log_site_t *site, const char *file, int line, const char *format, ...)
+    __attribute__((format(printf, 5, 6)));
+
+/**
+ * @brief Sets the most detailed level logged.
+ *
+ * @param level a LOG_LEVEL_
+ */
+void log_set_level(int level);
+
+/**
+ * @brief Parses a level name: off, error, warn, info or debug.
+ *
+ * @param name the name
+ * @return the LOG_LEVEL_, or -1 if the name is not a level
+ */
+int log_level_from_name(const char *name);
+
+/**
+ * @brief Starts the background writer. From then on logging only copies the message into the calling thread's ring,
+ * and the writer formats the records and writes them out in batches.
+ *
+ * @param fd where the log goes, e.g. STDERR_FILENO
+ * @return returns 0 on success, or -1 on failure (messages are then written synchronously)
+ */
+int log_start(int fd);
+
+/**
+ * @brief Stops the background writer after it writes out everything queued. Later messages are written synchronously.
+ */
+void log_stop(void);
+
+#endif
+
+/*** end of file ***/
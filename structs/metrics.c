@@ -0,0 +1,554 @@
+#include "../include/metrics.h"
+
+static _Atomic(metrics_shard_t *) all_shards = NULL; // every shard ever created, summed on read
+static _Thread_local metrics_shard_t *thread_shard = NULL;
+static _Alignas(CACHE_LINE_SIZE) atomic_int_fast64_t gauges[METRIC_NUM_GAUGES];
+static metrics_probe_t probes[METRICS_MAX_PROBES];
+static atomic_int num_probes = 0;
+static pthread_mutex_t probes_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *const counter_names[METRIC_NUM_COUNTERS] = {
+    "accepts_total",          "dispatch_drops_total",   "poll_wakeups_total",   "poll_events_total",
+    "poll_timeouts_total",    "conns_closed_total",     "session_hits_total",   "session_misses_total",
+    "sessions_created_total", "sessions_expired_total", "table_get_hits_total", "table_get_misses_total",
+    "table_puts_total",       "table_deletes_total",
+};
+static const char *const counter_help[METRIC_NUM_COUNTERS] = {
+    "Connections accepted.",
+    "Accepted connections closed because their poller's queue was full.",
+    "Poller wakeups.",
+    "Events delivered to the pollers.",
+    "Poller wakeups with no events.",
+    "Client connections closed by the pollers.",
+    "Session lookups that found the session.",
+    "Session lookups that did not find the session.",
+    "Sessions created at login.",
+    "Sessions removed by timeout or eviction.",
+    "Storage table reads that found the key.",
+    "Storage table reads that did not find the key.",
+    "Storage table writes.",
+    "Storage table deletes that removed a key.",
+};
+static const char *const gauge_names[METRIC_NUM_GAUGES] = {"sessions_live"};
+static const char *const gauge_help[METRIC_NUM_GAUGES] = {"Sessions in the sessions table."};
+static const char *const hist_names[METRIC_NUM_HISTS] = {"accept_batch", "poll_events_per_wakeup", "poll_busy_ns"};
+static const char *const hist_help[METRIC_NUM_HISTS] = {
+    "Connections accepted per main loop wakeup.",
+    "Events per poller wakeup that had any.",
+    "Nanoseconds a poller spends serving one wakeup's events.",
+};
+
+/**
+ * @brief get the calling thread's shard, creating and registering it on first use
+ *
+ * @return the shard, or NULL if it could not be allocated
+ */
+static metrics_shard_t *metrics_thread_shard(void)
+{
+    metrics_shard_t *shard = thread_shard;
+
+    if (NULL != shard)
+    {
+        goto END;
+    }
+
+    if (0 != posix_memalign((void **)&shard, CACHE_LINE_SIZE, sizeof(metrics_shard_t)))
+    {
+        log_error("Failed to alloc metrics shard.");
+        shard = NULL;
+        goto END;
+    }
+    memset(shard, 0, sizeof(metrics_shard_t)); // all-zero is a valid state for the lock-free atomics
+
+    shard->next_shard = atomic_load(&all_shards);
+    while (!atomic_compare_exchange_weak(&all_shards, &shard->next_shard, shard))
+    {
+    }
+    thread_shard = shard;
+
+END:
+    return shard;
+}
+
+/**
+ * @brief add to a value only the calling thread writes. A relaxed load and store rather than a fetch-add: readers on
+ * other threads still see a whole value, and the hot path takes no locked instruction.
+ *
+ * @param value the value
+ * @param amount the amount added
+ */
+static void metrics_bump(atomic_uint_fast64_t *value, uint64_t amount)
+{
+    atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + amount, memory_order_relaxed);
+}
+
+/**
+ * @brief Adds to a counter in the calling thread's shard.
+ *
+ * @param counter a METRIC_ counter
+ * @param amount the amount added
+ */
+void metrics_add(int counter, uint64_t amount)
+{
+    metrics_shard_t *shard = metrics_thread_shard();
+
+    if ((NULL != shard) && (0 <= counter) && (METRIC_NUM_COUNTERS > counter))
+    {
+        metrics_bump(&shard->counters[counter], amount);
+    }
+}
+
+/**
+ * @brief Sets a gauge.
+ *
+ * @param gauge a METRIC_ gauge
+ * @param value the new value
+ */
+void metrics_set(int gauge, int64_t value)
+{
+    if ((0 <= gauge) && (METRIC_NUM_GAUGES > gauge))
+    {
+        atomic_store_explicit(&gauges[gauge], value, memory_order_relaxed);
+    }
+}
+
+/**
+ * @brief Moves a gauge up or down.
+ *
+ * @param gauge a METRIC_ gauge
+ * @param delta the amount added; negative moves it down
+ */
+void metrics_move(int gauge, int64_t delta)
+{
+    if ((0 <= gauge) && (METRIC_NUM_GAUGES > gauge))
+    {
+        atomic_fetch_add_explicit(&gauges[gauge], delta, memory_order_relaxed);
+    }
+}
+
+/**
+ * @brief Counts one value in a histogram in the calling thread's shard.
+ *
+ * @param hist a METRIC_ histogram
+ * @param value the value; nanoseconds for the _NS histograms
+ */
+void metrics_record(int hist, uint64_t value)
+{
+    metrics_shard_t *shard = metrics_thread_shard();
+
+    if ((NULL != shard) && (0 <= hist) && (METRIC_NUM_HISTS > hist))
+    {
+        value = ((UINT64_C(1) << METRICS_HIST_BITS) < value) ? (UINT64_C(1) << METRICS_HIST_BITS) : value;
+        metrics_bump(&shard->hists[hist][hdr_count_index(METRICS_HIST_SUB_BITS, value)], 1);
+        metrics_bump(&shard->hist_sums[hist], value);
+    }
+}
+
+/**
+ * @brief Reads the monotonic clock, for timing what goes into the _NS histograms.
+ *
+ * @return nanoseconds since an arbitrary start
+ */
+uint64_t metrics_now(void)
+{
+    struct timespec now = {0};
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * 1000000000ULL) + (uint64_t)now.tv_nsec;
+}
+
+/**
+ * @brief Registers a value to be read from the server's own structures whenever the metrics are read. The probe is
+ * called from the thread reading the metrics, so whatever it reads must outlive every read (the server reads them
+ * only from its stats job, which stops before the structures are freed).
+ *
+ * @param name the metric name, labels included, e.g. poller_conns{worker="0"}
+ * @param help one line describing the value; not copied
+ * @param probe the function returning the value
+ * @param arg passed to probe
+ * @return returns 0 on success, or -1 if the name is too long or the registry is full
+ */
+int metrics_add_probe(const char *name, const char *help, metrics_probe_func probe, void *arg)
+{
+    int ret = -1;
+    int probe_index = 0;
+
+    if ((NULL == name) || (METRICS_NAME_MAX <= strlen(name)) || (NULL == probe))
+    {
+        log_error("Invalid metrics probe passed.");
+        goto END;
+    }
+
+    pthread_mutex_lock(&probes_lock);
+    probe_index = atomic_load_explicit(&num_probes, memory_order_relaxed);
+    if (METRICS_MAX_PROBES <= probe_index)
+    {
+        log_error("Metrics probes full. Dropping %s.", name);
+        goto UNLOCK;
+    }
+    strcpy(probes[probe_index].name, name);
+    probes[probe_index].help = help;
+    probes[probe_index].probe = probe;
+    probes[probe_index].arg = arg;
+    atomic_store_explicit(&num_probes, probe_index + 1, memory_order_release); // readers see the probe whole
+    ret = 0;
+
+UNLOCK:
+    pthread_mutex_unlock(&probes_lock);
+END:
+    return ret;
+}
+
+/**
+ * @brief Drops every registered probe. Call once nothing reads the metrics any more, before freeing what they read.
+ */
+void metrics_clear_probes(void)
+{
+    pthread_mutex_lock(&probes_lock);
+    atomic_store_explicit(&num_probes, 0, memory_order_release);
+    pthread_mutex_unlock(&probes_lock);
+}
+
+/**
+ * @brief Sums a counter over every thread's shard.
+ *
+ * @param counter a METRIC_ counter
+ * @return the total
+ */
+uint64_t metrics_counter_value(int counter)
+{
+    uint64_t ret = 0;
+    metrics_shard_t *shard = NULL;
+
+    if ((0 > counter) || (METRIC_NUM_COUNTERS <= counter))
+    {
+        goto END;
+    }
+
+    for (shard = atomic_load(&all_shards); NULL != shard; shard = shard->next_shard)
+    {
+        ret += atomic_load_explicit(&shard->counters[counter], memory_order_relaxed);
+    }
+
+END:
+    return ret;
+}
+
+/**
+ * @brief Merges a histogram over every thread's shard.
+ *
+ * @param hist a METRIC_ histogram
+ * @return a new histogram the caller destroys with destroy_hdr_hist(), or NULL on failure
+ */
+hdr_hist_t *metrics_hist_value(int hist)
+{
+    hdr_hist_t *ret = NULL;
+    hdr_hist_t *merged = NULL;
+    metrics_shard_t *shard = NULL;
+    uint64_t counts[METRICS_HIST_COUNTS];
+    size_t index = 0;
+
+    if ((0 > hist) || (METRIC_NUM_HISTS <= hist))
+    {
+        log_error("Invalid metrics histogram passed.");
+        goto END;
+    }
+
+    merged = create_hdr_hist(UINT64_C(1) << METRICS_HIST_BITS, METRICS_HIST_SUB_BITS);
+    if (NULL == merged)
+    {
+        goto END;
+    }
+
+    for (shard = atomic_load(&all_shards); NULL != shard; shard = shard->next_shard)
+    {
+        for (index = 0; index < METRICS_HIST_COUNTS; index++)
+        {
+            counts[index] = atomic_load_explicit(&shard->hists[hist][index], memory_order_relaxed);
+        }
+        hdr_add_counts(merged, counts, METRICS_HIST_COUNTS,
+                       atomic_load_explicit(&shard->hist_sums[hist], memory_order_relaxed));
+    }
+
+    ret = merged;
+END:
+    return ret;
+}
+
+/**
+ * @brief append one formatted line to the output, or nothing if the whole line does not fit
+ *
+ * @param buf the output buffer
+ * @param buf_len size of buf
+ * @param used bytes already in buf; advanced past the line
+ * @param format printf format of the line
+ */
+static void metrics_append(char *buf, size_t buf_len, size_t *used, const char *format, ...)
+{
+    va_list args;
+    int len = 0;
+
+    va_start(args, format);
+    len = vsnprintf(buf + *used, buf_len - *used, format, args);
+    va_end(args);
+    if ((0 < len) && ((size_t)len < (buf_len - *used)))
+    {
+        *used += (size_t)len;
+    }
+    else
+    {
+        buf[*used] = '\0'; // cut at the last whole line
+    }
+}
+
+/**
+ * @brief get the name a probe is documented under: its name without labels, so each HELP and TYPE is written once
+ *
+ * @param name the probe name
+ * @param base receives the name up to any '{'
+ * @param base_len size of base
+ */
+static void metrics_base_name(const char *name, char *base, size_t base_len)
+{
+    size_t len = strcspn(name, "{");
+
+    len = (len < base_len) ? len : (base_len - 1);
+    memcpy(base, name, len);
+    base[len] = '\0';
+}
+
+/**
+ * @brief Renders every metric in the Prometheus text format: counters and gauges as single values, histograms as
+ * summaries (p50, p90, p99, p99.9, max, count and sum).
+ *
+ * @param buf buffer receiving the text
+ * @param buf_len size of buf
+ * @return returns the number of bytes written, or -1 on failure. Output that does not fit is cut at a line.
+ */
+ssize_t metrics_format(char *buf, size_t buf_len)
+{
+    static const double quantiles[] = {50.0, 90.0, 99.0, 99.9, 100.0};
+    ssize_t ret = -1;
+    size_t used = 0;
+    int index = 0;
+    int quantile_index = 0;
+    int probe_count = 0;
+    char base[METRICS_NAME_MAX];
+    char last_base[METRICS_NAME_MAX] = {0};
+    hdr_hist_t *hist = NULL;
+
+    if ((NULL == buf) || (0 == buf_len))
+    {
+        log_error("Invalid metrics buffer passed.");
+        goto END;
+    }
+    buf[0] = '\0';
+
+    for (index = 0; index < METRIC_NUM_COUNTERS; index++)
+    {
+        metrics_append(buf, buf_len, &used, "# HELP %s %s\n# TYPE %s counter\n%s %" PRIu64 "\n", counter_names[index],
+                       counter_help[index], counter_names[index], counter_names[index], metrics_counter_value(index));
+    }
+    for (index = 0; index < METRIC_NUM_GAUGES; index++)
+    {
+        metrics_append(buf, buf_len, &used, "# HELP %s %s\n# TYPE %s gauge\n%s %" PRId64 "\n", gauge_names[index],
+                       gauge_help[index], gauge_names[index], gauge_names[index],
+                       (int64_t)atomic_load_explicit(&gauges[index], memory_order_relaxed));
+    }
+    for (index = 0; index < METRIC_NUM_HISTS; index++)
+    {
+        hist = metrics_hist_value(index);
+        if (NULL == hist)
+        {
+            continue;
+        }
+        metrics_append(buf, buf_len, &used, "# HELP %s %s\n# TYPE %s summary\n", hist_names[index], hist_help[index],
+                       hist_names[index]);
+        for (quantile_index = 0; quantile_index < (int)(sizeof(quantiles) / sizeof(quantiles[0])); quantile_index++)
+        {
+            metrics_append(buf, buf_len, &used, "%s{quantile=\"%g\"} %" PRIu64 "\n", hist_names[index],
+                           quantiles[quantile_index] / 100.0, hdr_percentile(hist, quantiles[quantile_index]));
+        }
+        metrics_append(buf, buf_len, &used, "%s_sum %" PRIu64 "\n%s_count %" PRIu64 "\n", hist_names[index],
+                       hist->sum, hist_names[index], hist->total);
+        destroy_hdr_hist(hist);
+        hist = NULL;
+    }
+
+    probe_count = atomic_load_explicit(&num_probes, memory_order_acquire);
+    for (index = 0; index < probe_count; index++) // probes sharing a name differ only in labels; document them once
+    {
+        metrics_base_name(probes[index].name, base, sizeof(base));
+        if (0 != strcmp(base, last_base))
+        {
+            metrics_append(buf, buf_len, &used, "# HELP %s %s\n# TYPE %s gauge\n", base,
+                           (NULL == probes[index].help) ? "" : probes[index].help, base);
+            strcpy(last_base, base);
+        }
+        metrics_append(buf, buf_len, &used, "%s %" PRId64 "\n", probes[index].name,
+                       probes[index].probe(probes[index].arg));
+    }
+
+    ret = (ssize_t)used;
+END:
+    return ret;
+}
+
+/**
+ * @brief Renders every metric and writes it to a file descriptor.
+ *
+ * @param fd the descriptor, e.g. STDOUT_FILENO or an accepted stats connection
+ * @return returns 0 on success, or -1 on failure
+ */
+int metrics_write(int fd)
+{
+    int ret = -1;
+    char *out = NULL;
+    ssize_t out_len = 0;
+    ssize_t num_written = 0;
+    size_t total_written = 0;
+    int is_socket = 1; // until send() says otherwise
+
+    out = malloc(METRICS_OUT_MAX);
+    if (NULL == out)
+    {
+        log_error("Failed to alloc metrics output.");
+        goto END;
+    }
+    out_len = metrics_format(out, METRICS_OUT_MAX);
+    if (-1 == out_len)
+    {
+        goto END;
+    }
+
+    while (total_written < (size_t)out_len)
+    {
+        // a stats client that closes early must fail the send, not raise SIGPIPE; write() is left for the stdout dump
+        num_written = (1 == is_socket) ? send(fd, out + total_written, (size_t)out_len - total_written, MSG_NOSIGNAL)
+                                       : write(fd, out + total_written, (size_t)out_len - total_written);
+        if (-1 == num_written)
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+            if ((1 == is_socket) && (ENOTSOCK == errno))
+            {
+                is_socket = 0;
+                continue;
+            }
+            log_perror((1 == is_socket) ? "send()" : "write()");
+            goto END;
+        }
+        total_written += (size_t)num_written;
+    }
+
+    ret = 0;
+END:
+    free(out);
+    out = NULL;
+    return ret;
+}
+
+/**
+ * @brief Opens the stats listener, bound to the loopback address only so the metrics never leave the host.
+ *
+ * @param port the port to listen on
+ * @return returns the non-blocking listening socket, or -1 on failure
+ */
+int metrics_listen(const char *port)
+{
+    int ret = -1;
+    int sockfd = -1;
+    int opt = 1;
+    long port_num = 0;
+    char *p_end = NULL;
+    struct sockaddr_in addr = {0};
+
+    if (NULL == port)
+    {
+        log_error("Invalid stats port passed.");
+        goto END;
+    }
+    port_num = strtol(port, &p_end, 10);
+    if ((0 != *p_end) || (0 >= port_num) || (65535 < port_num))
+    {
+        log_error("Invalid stats port passed.");
+        goto END;
+    }
+
+    sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (-1 == sockfd)
+    {
+        log_perror("socket()");
+        goto END;
+    }
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)port_num);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK); // never reachable from off the host
+    if ((-1 == setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) ||
+        (-1 == bind(sockfd, (struct sockaddr *)&addr, sizeof(addr))) || (-1 == listen(sockfd, 16)))
+    {
+        log_perror("Failed to open the stats listener");
+        close(sockfd);
+        goto END;
+    }
+
+    ret = sockfd;
+END:
+    return ret;
+}
+
+/**
+ * @brief Answers every pending connection on the stats listener with the rendered metrics, then closes it. Requests
+ * are not read; connecting is the request, so `nc 127.0.0.1 8990` or curl both work.
+ *
+ * @param listen_fd the listener from metrics_listen()
+ * @return returns the number of connections answered, or -1 on failure
+ */
+int metrics_serve(int listen_fd)
+{
+    static const char header[] = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n\r\n";
+    int ret = -1;
+    int num_served = 0;
+    int client_fd = -1;
+    char drain[1024];
+    struct timeval send_timeout = {.tv_sec = 1, .tv_usec = 0};
+
+    if (-1 == listen_fd)
+    {
+        log_error("Invalid stats listener passed.");
+        goto END;
+    }
+
+    for (;;)
+    {
+        client_fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (-1 == client_fd)
+        {
+            if ((EAGAIN != errno) && (EWOULDBLOCK != errno) && (EINTR != errno))
+            {
+                log_perror("accept4()");
+            }
+            break;
+        }
+
+        // a reader that stops reading holds the stats job for at most the timeout
+        setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
+        recv(client_fd, drain, sizeof(drain), MSG_DONTWAIT); // an HTTP request left unread would reset the reply
+        if ((sizeof(header) - 1 == (size_t)send(client_fd, header, sizeof(header) - 1, MSG_NOSIGNAL)) &&
+            (0 == metrics_write(client_fd)))
+        {
+            num_served++;
+        }
+        shutdown(client_fd, SHUT_WR);
+        close(client_fd);
+        client_fd = -1;
+    }
+
+    ret = num_served;
+END:
+    return ret;
+}
+
+/*** end of file ***/
@@ -0,0 +1,202 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // accept4()
+#endif
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aqueues.h"
+#include "hdrhist.h"
+
+// counters: per-thread shards, summed on read
+#define METRIC_ACCEPTS 0           // connections accepted
+#define METRIC_DISPATCH_DROPS 1    // accepted connections closed because their poller's queue was full
+#define METRIC_POLL_WAKEUPS 2      // poller_wait() returns
+#define METRIC_POLL_EVENTS 3       // events those returns carried
+#define METRIC_POLL_TIMEOUTS 4     // returns with no events
+#define METRIC_CONNS_CLOSED 5      // client connections closed by the pollers
+#define METRIC_SESSION_HITS 6      // session lookups that found the session
+#define METRIC_SESSION_MISSES 7    // session lookups that did not
+#define METRIC_SESSIONS_CREATED 8  // logins given a session
+#define METRIC_SESSIONS_EXPIRED 9  // sessions removed by their timeout or for being the oldest
+#define METRIC_TABLE_GET_HITS 10   // storage table reads that found the key
+#define METRIC_TABLE_GET_MISSES 11 // storage table reads that did not
+#define METRIC_TABLE_PUTS 12       // storage table writes
+#define METRIC_TABLE_DELETES 13    // storage table deletes that removed a key
+#define METRIC_NUM_COUNTERS 14
+
+// gauges: one shared value each, set or moved by whoever owns the quantity
+#define METRIC_SESSIONS_LIVE 0 // sessions in the sessions table
+#define METRIC_NUM_GAUGES 1
+
+// histograms: per-thread log-linear counts, merged on read
+#define METRIC_ACCEPT_BATCH 0      // connections accepted per main loop wakeup
+#define METRIC_EVENTS_PER_WAKEUP 1 // events per poller_wait() return that had any
+#define METRIC_POLL_BUSY_NS 2      // time a poller spends serving one wakeup's events
+#define METRIC_NUM_HISTS 3
+
+#define METRICS_MAX_PROBES 256    // values read from the server's own structures when the metrics are read
+#define METRICS_NAME_MAX 64       // longest metric name, labels included
+#define METRICS_HIST_SUB_BITS 3   // 16 sub-buckets per power of two: within about 6%, in 2 KB per histogram per thread
+#define METRICS_HIST_BITS 36      // values above 2^36 (about 68 seconds in nanoseconds) are counted as 2^36
+#define METRICS_HIST_COUNTS ((((METRICS_HIST_BITS) - (METRICS_HIST_SUB_BITS) + 1) << (METRICS_HIST_SUB_BITS)) + 1)
+#define METRICS_OUT_MAX (64 << 10) // one rendering of every metric
+#define METRICS_DEFAULT_PORT "8990" // loopback stats port
+#define METRICS_DUMP_SIGNAL SIGUSR1 // dumps the metrics to stdout
+
+typedef int64_t (*metrics_probe_func)(void *arg);
+
+/**
+ * @brief a thread's share of the counters and histograms. Only the owning thread writes it, with plain relaxed loads
+ * and stores (no locked instructions), and readers sum every shard. Shards live for the life of the process, like the
+ * epoch records, so a reader never races a free.
+ */
+typedef struct metrics_shard
+{
+    _Alignas(CACHE_LINE_SIZE) atomic_uint_fast64_t counters[METRIC_NUM_COUNTERS];
+    atomic_uint_fast64_t hist_sums[METRIC_NUM_HISTS];
+    atomic_uint_fast64_t hists[METRIC_NUM_HISTS][METRICS_HIST_COUNTS];
+    struct metrics_shard *next_shard;
+} metrics_shard_t;
+
+/**
+ * @brief a value computed only when the metrics are read, e.g. a queue depth or a table size, so keeping it costs the
+ * hot path nothing
+ */
+typedef struct metrics_probe
+{
+    char name[METRICS_NAME_MAX];
+    const char *help;
+    metrics_probe_func probe;
+    void *arg;
+} metrics_probe_t;
+
+/**
+ * @brief Adds to a counter in the calling thread's shard.
+ *
+ * @param counter a METRIC_ counter
+ * @param amount the amount added
+ */
+void metrics_add(int counter, uint64_t amount);
+
+/**
+ * @brief Sets a gauge.
+ *
+ * @param gauge a METRIC_ gauge
+ * @param value the new value
+ */
+void metrics_set(int gauge, int64_t value);
+
+/**
+ * @brief Moves a gauge up or down.
+ *
+ * @param gauge a METRIC_ gauge
+ * @param delta the amount added; negative moves it down
+ */
+void metrics_move(int gauge, int64_t delta);
+
+/**
+ * @brief Counts one value in a histogram in the calling thread's shard.
+ *
+ * @param hist a METRIC_ histogram
+ * @param value the value; nanoseconds for the _NS histograms
+ */
+void metrics_record(int hist, uint64_t value);
+
+/**
+ * @brief Reads the monotonic clock, for timing what goes into the _NS histograms.
+ *
+ * @return nanoseconds since an arbitrary start
+ */
+uint64_t metrics_now(void);
+
+/**
+ * @brief Registers a value to be read from the server's own structures whenever the metrics are read. The probe is
+ * called from the thread reading the metrics, so whatever it reads must outlive every read (the server reads them
+ * only from its stats job, which stops before the structures are freed).
+ *
+ * @param name the metric name, labels included, e.g. poller_conns{worker="0"}
+ * @param help one line describing the value; not copied
+ * @param probe the function returning the value
+ * @param arg passed to probe
+ * @return returns 0 on success, or -1 if the name is too long or the registry is full
+ */
+int metrics_add_probe(const char *name, const char *help, metrics_probe_func probe, void *arg);
+
+/**
+ * @brief Drops every registered probe. Call once nothing reads the metrics any more, before freeing what they read.
+ */
+void metrics_clear_probes(void);
+
+/**
+ * @brief Sums a counter over every thread's shard.
+ *
+ * @param counter a METRIC_ counter
+ * @return the total
+ */
+uint64_t metrics_counter_value(int counter);
+
+/**
+ * @brief Merges a histogram over every thread's shard.
+ *
+ * @param hist a METRIC_ histogram
+ * @return a new histogram the caller destroys with destroy_hdr_hist(), or NULL on failure
+ */
+hdr_hist_t *metrics_hist_value(int hist);
+
+/**
+ * @brief Renders every metric in the Prometheus text format: counters and gauges as single values, histograms as
+ * summaries (p50, p90, p99, p99.9, max, count and sum).
+ *
+ * @param buf buffer receiving the text
+ * @param buf_len size of buf
+ * @return returns the number of bytes written, or -1 on failure. Output that does not fit is cut at a line.
+ */
+ssize_t metrics_format(char *buf, size_t buf_len);
+
+/**
+ * @brief Renders every metric and writes it to a file descriptor.
+ *
+ * @param fd the descriptor, e.g. STDOUT_FILENO or an accepted stats connection
+ * @return returns 0 on success, or -1 on failure
+ */
+int metrics_write(int fd);
+
+/**
+ * @brief Opens the stats listener, bound to the loopback address only so the metrics never leave the host.
+ *
+ * @param port the port to listen on
+ * @return returns the non-blocking listening socket, or -1 on failure
+ */
+int metrics_listen(const char *port);
+
+/**
+ * @brief Answers every pending connection on the stats listener with the rendered metrics, then closes it. Requests
+ * are not read; connecting is the request, so `nc 127.0.0.1 8990` or curl both work.
+ *
+ * @param listen_fd the listener from metrics_listen()
+ * @return returns the number of connections answered, or -1 on failure
+ */
+int metrics_serve(int listen_fd);
+
+#endif
+
+/*** end of file ***/
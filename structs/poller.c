@@ -0,0 +1,890 @@
+#include "../include/poller.h"
+
+#ifdef USE_POLL
+
+/**
+ * @brief Converts POLLER_* interest bits to poll() events.
+ *
+ * @param events POLLER_IN and/or POLLER_OUT
+ * @return the poll() events mask
+ */
+static short poller_to_poll(uint32_t events)
+{
+    short ret = POLLERR;
+
+    if (POLLER_IN & events)
+    {
+        ret |= POLLIN | POLLRDHUP;
+    }
+    if (POLLER_OUT & events)
+    {
+        ret |= POLLOUT;
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Grows the fd -> slot map so fd is a valid index.
+ *
+ * @param poller the poller to grow
+ * @param fd the fd that must fit
+ * @return returns 0 on success. Otherwise returns -1.
+ */
+static int poller_grow_fd_slots(poller_t *poller, int fd)
+{
+    int ret = -1;
+    int *new_slots = NULL;
+    size_t new_size = poller->fd_slots_size;
+    size_t index = 0;
+
+    while (new_size <= (size_t)fd)
+    {
+        new_size *= 2;
+    }
+
+    new_slots = realloc(poller->fd_slots, new_size * sizeof(int));
+    if (NULL == new_slots)
+    {
+        log_error("Failed to grow poller fd slots.");
+        goto END;
+    }
+    for (index = poller->fd_slots_size; index < new_size; index++)
+    {
+        new_slots[index] = -1;
+    }
+    poller->fd_slots = new_slots;
+    poller->fd_slots_size = new_size;
+
+    ret = 0;
+END:
+    return ret;
+}
+
+#else
+
+/**
+ * @brief Converts POLLER_* interest bits to epoll events.
+ *
+ * @param poller the poller, for its trigger mode
+ * @param events POLLER_IN and/or POLLER_OUT
+ * @return the epoll events mask
+ */
+static uint32_t poller_to_epoll(poller_t *poller, uint32_t events)
+{
+    uint32_t ret = 0;
+
+    // the peer's shutdown is end of input, so it is watched with input only: it stays raised once seen, and a
+    // connection writing out its last responses would otherwise be woken for it without end
+    if (POLLER_IN & events)
+    {
+        ret |= EPOLLIN | EPOLLRDHUP;
+    }
+    if (POLLER_OUT & events)
+    {
+        ret |= EPOLLOUT;
+    }
+    if (POLLER_EDGE & poller->flags)
+    {
+        ret |= EPOLLET;
+    }
+
+    return ret;
+}
+
+#endif
+
+#ifdef USE_IO_URING
+
+#define POLLER_URING_REMOVE_TAG (UINT64_C(1) << 63) // user_data of poll removals; their completions are ignored
+
+/**
+ * @brief Packs an fd and its registration generation into a poll request's user_data.
+ *
+ * @param fd the polled fd
+ * @param gen the fd's current generation
+ * @return the user_data value
+ */
+static uint64_t poller_uring_data(int fd, uint32_t gen)
+{
+    return ((uint64_t)gen << 32) | (uint32_t)fd;
+}
+
+/**
+ * @brief Gets a submission queue entry, flushing the queue to the kernel first if it is full.
+ *
+ * @param poller the poller owning the ring
+ * @return the entry, or NULL on failure
+ */
+static struct io_uring_sqe *poller_uring_sqe(poller_t *poller)
+{
+    struct io_uring_sqe *sqe = NULL;
+
+    sqe = io_uring_get_sqe(&poller->ring);
+    if (NULL == sqe)
+    {
+        io_uring_submit(&poller->ring);
+        sqe = io_uring_get_sqe(&poller->ring);
+    }
+    if (NULL == sqe)
+    {
+        log_error("Failed to get an io_uring sqe.");
+    }
+
+    return sqe;
+}
+
+/**
+ * @brief Grows the per-fd io_uring state so fd is a valid index.
+ *
+ * @param poller the poller to grow
+ * @param fd the fd that must fit
+ * @return returns 0 on success. Otherwise returns -1.
+ */
+static int poller_uring_grow_fds(poller_t *poller, int fd)
+{
+    int ret = -1;
+    poller_uring_fd_t *new_fds = NULL;
+    size_t new_size = poller->uring_fds_size;
+
+    while (new_size <= (size_t)fd)
+    {
+        new_size *= 2;
+    }
+
+    new_fds = realloc(poller->uring_fds, new_size * sizeof(poller_uring_fd_t));
+    if (NULL == new_fds)
+    {
+        log_error("Failed to grow poller uring fds.");
+        goto END;
+    }
+    memset(&new_fds[poller->uring_fds_size], 0, (new_size - poller->uring_fds_size) * sizeof(poller_uring_fd_t));
+    poller->uring_fds = new_fds;
+    poller->uring_fds_size = new_size;
+
+    ret = 0;
+END:
+    return ret;
+}
+
+/**
+ * @brief Queues a poll request for a registered fd. It reaches the kernel with the next submit.
+ *
+ * @param poller the poller owning the ring
+ * @param fd the fd to poll
+ * @return returns 0 on success. Otherwise returns -1.
+ */
+static int poller_uring_arm(poller_t *poller, int fd)
+{
+    int ret = -1;
+    struct io_uring_sqe *sqe = NULL;
+    poller_uring_fd_t *state = &poller->uring_fds[fd];
+
+    sqe = poller_uring_sqe(poller);
+    if (NULL == sqe)
+    {
+        goto END;
+    }
+
+    if (POLLER_EDGE & poller->flags)
+    {
+        io_uring_prep_poll_multishot(sqe, fd, state->poll_mask);
+    }
+    else
+    {
+        io_uring_prep_poll_add(sqe, fd, state->poll_mask);
+    }
+    io_uring_sqe_set_data64(sqe, poller_uring_data(fd, state->gen));
+    state->armed = 1;
+
+    ret = 0;
+END:
+    return ret;
+}
+
+/**
+ * @brief Sets up the io_uring backend if it is enabled and the kernel supports it.
+ *
+ * @param poller the poller to set up
+ * @return returns 0 if the poller now uses io_uring. Otherwise returns -1 and the caller falls back.
+ */
+static int poller_uring_create(poller_t *poller)
+{
+    int ret = -1;
+    int check = 0;
+
+    if ((POLLER_NO_URING & poller->flags) || (0 == poller_uring_supported()))
+    {
+        goto END;
+    }
+
+    poller->uring_fds = calloc(POLLER_MIN_SLOTS, sizeof(poller_uring_fd_t));
+    poller->rearm_fds = calloc(POLLER_MIN_SLOTS, sizeof(int));
+    if ((NULL == poller->uring_fds) || (NULL == poller->rearm_fds))
+    {
+        log_error("Failed to alloc poller uring arrays.");
+        goto FAIL;
+    }
+    poller->uring_fds_size = POLLER_MIN_SLOTS;
+    poller->rearm_size = POLLER_MIN_SLOTS;
+
+    check = io_uring_queue_init(POLLER_URING_ENTRIES, &poller->ring, 0);
+    if (0 > check)
+    {
+        log_warn("io_uring_queue_init(): %s. Falling back.", strerror(-check));
+        goto FAIL;
+    }
+    poller->backend = POLLER_BACKEND_URING;
+
+    ret = 0;
+    goto END;
+
+FAIL:
+    free(poller->uring_fds);
+    poller->uring_fds = NULL;
+    free(poller->rearm_fds);
+    poller->rearm_fds = NULL;
+
+END:
+    return ret;
+}
+
+/**
+ * @brief io_uring backend of poller_add()
+ *
+ * @param poller the poller to add to
+ * @param fd the fd to watch
+ * @param events POLLER_IN and/or POLLER_OUT
+ * @return returns 0 on success. Otherwise returns -1.
+ */
+static int poller_uring_add(poller_t *poller, int fd, uint32_t events)
+{
+    int ret = -1;
+    poller_uring_fd_t *state = NULL;
+
+    if (((size_t)fd >= poller->uring_fds_size) && (-1 == poller_uring_grow_fds(poller, fd)))
+    {
+        goto END;
+    }
+    state = &poller->uring_fds[fd];
+    if (state->registered)
+    {
+        log_error("fd already registered with poller.");
+        goto END;
+    }
+
+    state->registered = 1;
+    state->rearm = 0;
+    state->poll_mask = (POLLER_IN & events) ? (POLLIN | POLLRDHUP) : 0; // as poller_to_epoll()
+    state->poll_mask |= (POLLER_OUT & events) ? POLLOUT : 0;
+    if (-1 == poller_uring_arm(poller, fd))
+    {
+        state->registered = 0;
+        goto END;
+    }
+
+    ret = 0;
+END:
+    return ret;
+}
+
+/**
+ * @brief io_uring backend of poller_del()
+ *
+ * @param poller the poller to remove from
+ * @param fd the fd to stop watching
+ * @return returns 0 on success. Otherwise returns -1.
+ */
+static int poller_uring_del(poller_t *poller, int fd)
+{
+    int ret = -1;
+    struct io_uring_sqe *sqe = NULL;
+    poller_uring_fd_t *state = NULL;
+
+    if (((size_t)fd >= poller->uring_fds_size) || (0 == poller->uring_fds[fd].registered))
+    {
+        goto END;
+    }
+    state = &poller->uring_fds[fd];
+
+    if (state->armed)
+    {
+        sqe = poller_uring_sqe(poller);
+        if (NULL != sqe)
+        {
+            io_uring_prep_poll_remove(sqe, poller_uring_data(fd, state->gen));
+            io_uring_sqe_set_data64(sqe, POLLER_URING_REMOVE_TAG);
+        }
+    }
+    state->gen++; // anything still in flight for the old registration is now stale
+    state->registered = 0;
+    state->armed = 0;
+    state->rearm = 0;
+
+    ret = 0;
+END:
+    return ret;
+}
+
+/**
+ * @brief io_uring backend of poller_wait(). Queued re-arms are submitted in the same syscall that waits.
+ *
+ * @param poller the poller to wait on
+ * @param events array receiving the ready fds
+ * @param max_events size of events
+ * @param timeout_ms how long to wait in milliseconds, or -1 to wait forever
+ * @return returns the number of ready fds (0 on timeout), or -1 on failure with errno set
+ */
+static int poller_uring_wait(poller_t *poller, poller_event_t *events, int max_events, int timeout_ms)
+{
+    int ret = -1;
+    int check = 0;
+    int index = 0;
+    int fd = -1;
+    unsigned head = 0;
+    unsigned seen = 0;
+    size_t rearm_index = 0;
+    uint64_t data = 0;
+    struct io_uring_cqe *cqe = NULL;
+    struct __kernel_timespec timeout = {0};
+    poller_uring_fd_t *state = NULL;
+    int *new_rearm = NULL;
+
+    for (rearm_index = 0; rearm_index < poller->num_rearm; rearm_index++) // level-triggered fds handled since last wait
+    {
+        fd = poller->rearm_fds[rearm_index];
+        state = &poller->uring_fds[fd];
+        if (state->registered && state->rearm && (0 == state->armed))
+        {
+            poller_uring_arm(poller, fd);
+        }
+        state->rearm = 0;
+    }
+    poller->num_rearm = 0;
+
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+    check = io_uring_submit_and_wait_timeout(&poller->ring, &cqe, 1, (0 > timeout_ms) ? NULL : &timeout, NULL);
+    if ((0 > check) && (-ETIME != check))
+    {
+        errno = -check;
+        goto END;
+    }
+
+    io_uring_for_each_cqe(&poller->ring, head, cqe)
+    {
+        if (index >= max_events)
+        {
+            break;
+        }
+        seen++;
+
+        data = io_uring_cqe_get_data64(cqe);
+        if (POLLER_URING_REMOVE_TAG & data)
+        {
+            continue;
+        }
+        fd = (int)(uint32_t)data;
+        if (((size_t)fd >= poller->uring_fds_size) || (0 == poller->uring_fds[fd].registered) ||
+            ((uint32_t)(data >> 32) != poller->uring_fds[fd].gen))
+        {
+            continue; // completion for a removed registration
+        }
+        state = &poller->uring_fds[fd];
+
+        if (0 == (IORING_CQE_F_MORE & cqe->flags))
+        {
+            state->armed = 0;
+        }
+
+        events[index].fd = fd;
+        events[index].events = 0;
+        if (0 > cqe->res)
+        {
+            events[index].events = POLLER_ERR;
+            index++;
+            continue;
+        }
+        events[index].events |= (POLLIN & cqe->res) ? POLLER_IN : 0;
+        events[index].events |= (POLLOUT & cqe->res) ? POLLER_OUT : 0;
+        events[index].events |= (POLLHUP & cqe->res) ? POLLER_HUP : 0;
+        events[index].events |= (POLLRDHUP & cqe->res) ? POLLER_RDHUP : 0;
+        events[index].events |= ((POLLERR | POLLNVAL) & cqe->res) ? POLLER_ERR : 0;
+        index++;
+
+        if (state->armed)
+        {
+            continue;
+        }
+        if (POLLER_EDGE & poller->flags) // the kernel ended the multishot poll; start a new one
+        {
+            poller_uring_arm(poller, fd);
+            continue;
+        }
+
+        // level-triggered: poll again once the caller has handled this event
+        if (poller->num_rearm == poller->rearm_size)
+        {
+            new_rearm = realloc(poller->rearm_fds, poller->rearm_size * 2 * sizeof(int));
+            if (NULL == new_rearm)
+            {
+                log_error("Failed to grow rearm_fds.");
+                poller_uring_arm(poller, fd);
+                continue;
+            }
+            poller->rearm_fds = new_rearm;
+            poller->rearm_size *= 2;
+        }
+        state->rearm = 1;
+        poller->rearm_fds[poller->num_rearm] = fd;
+        poller->num_rearm++;
+    }
+    io_uring_cq_advance(&poller->ring, seen);
+
+    ret = index;
+END:
+    return ret;
+}
+
+#endif
+
+/**
+ * @brief Checks whether the running kernel supports what the io_uring paths need (multishot poll and accept).
+ *
+ * @return returns 1 if io_uring can be used, otherwise returns 0 (always 0 without USE_IO_URING)
+ */
+int poller_uring_supported(void)
+{
+    int ret = 0;
+#ifdef USE_IO_URING
+    static atomic_int supported = -1; // probed once per process
+    struct io_uring probe_ring;
+    struct io_uring_probe *probe = NULL;
+
+    ret = atomic_load(&supported);
+    if (-1 != ret)
+    {
+        goto END;
+    }
+
+    ret = 0;
+    if (0 == io_uring_queue_init(2, &probe_ring, 0))
+    {
+        // IORING_OP_SOCKET arrived in 5.19 alongside multishot accept, and multishot poll predates both
+        probe = io_uring_get_probe_ring(&probe_ring);
+        if ((NULL != probe) && io_uring_opcode_supported(probe, IORING_OP_SOCKET))
+        {
+            ret = 1;
+        }
+        io_uring_free_probe(probe);
+        probe = NULL;
+        io_uring_queue_exit(&probe_ring);
+    }
+    atomic_store(&supported, ret);
+
+END:
+#endif
+    return ret;
+}
+
+/**
+ * @brief Creates an empty poller.
+ *
+ * @param flags 0 for level-triggered, or POLLER_EDGE for edge-triggered readiness, optionally with POLLER_NO_URING
+ * @return returns pointer to the poller on success. Otherwise returns NULL.
+ */
+poller_t *create_poller(int flags)
+{
+    poller_t *ret = NULL;
+    poller_t *new_poller = NULL;
+
+    new_poller = calloc(1, sizeof(poller_t));
+    if (NULL == new_poller)
+    {
+        log_error("Failed to alloc new_poller.");
+        goto FAIL;
+    }
+    new_poller->flags = flags;
+    new_poller->backend = POLLER_BACKEND_DEFAULT;
+
+#ifdef USE_IO_URING
+    if (0 == poller_uring_create(new_poller))
+    {
+        ret = new_poller;
+        goto END;
+    }
+#endif
+
+#ifdef USE_POLL
+    new_poller->poll_fds = calloc(POLLER_MIN_SLOTS, sizeof(struct pollfd));
+    new_poller->fd_slots = malloc(POLLER_MIN_SLOTS * sizeof(int));
+    if ((NULL == new_poller->poll_fds) || (NULL == new_poller->fd_slots))
+    {
+        log_error("Failed to alloc poller arrays.");
+        goto FAIL;
+    }
+    new_poller->poll_fds_size = POLLER_MIN_SLOTS;
+    new_poller->fd_slots_size = POLLER_MIN_SLOTS;
+    memset(new_poller->fd_slots, -1, POLLER_MIN_SLOTS * sizeof(int));
+#else
+    new_poller->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (-1 == new_poller->epoll_fd)
+    {
+        log_perror("epoll_create1()");
+        goto FAIL;
+    }
+#endif
+
+    ret = new_poller;
+    goto END;
+
+FAIL:
+    if (NULL != new_poller)
+    {
+#ifdef USE_POLL
+        free(new_poller->poll_fds);
+        new_poller->poll_fds = NULL;
+        free(new_poller->fd_slots);
+        new_poller->fd_slots = NULL;
+#endif
+        free(new_poller);
+        new_poller = NULL;
+    }
+
+END:
+    return ret;
+}
+
+/**
+ * @brief Registers an fd with the poller.
+ *
+ * @param poller the poller to add to
+ * @param fd the fd to watch
+ * @param events POLLER_IN and/or POLLER_OUT; hangups and errors are always reported
+ * @return returns 0 on success. Otherwise returns -1.
+ */
+int poller_add(poller_t *poller, int fd, uint32_t events)
+{
+    int ret = -1;
+#ifdef USE_POLL
+    struct pollfd *new_fds = NULL;
+#else
+    struct epoll_event event = {0};
+#endif
+
+    if ((NULL == poller) || (0 > fd))
+    {
+        log_error("Invalid poller or fd passed.");
+        goto END;
+    }
+
+#ifdef USE_IO_URING
+    if (POLLER_BACKEND_URING == poller->backend)
+    {
+        if (-1 == poller_uring_add(poller, fd, events))
+        {
+            goto END;
+        }
+        poller->num_fds++;
+        ret = 0;
+        goto END;
+    }
+#endif
+
+#ifdef USE_POLL
+    if (((size_t)fd >= poller->fd_slots_size) && (-1 == poller_grow_fd_slots(poller, fd)))
+    {
+        goto END;
+    }
+    if (-1 != poller->fd_slots[fd])
+    {
+        log_error("fd already registered with poller.");
+        goto END;
+    }
+    if (poller->num_fds == poller->poll_fds_size)
+    {
+        new_fds = realloc(poller->poll_fds, poller->poll_fds_size * 2 * sizeof(struct pollfd));
+        if (NULL == new_fds)
+        {
+            log_error("Failed to grow poll_fds.");
+            goto END;
+        }
+        poller->poll_fds = new_fds;
+        poller->poll_fds_size *= 2;
+    }
+
+    poller->poll_fds[poller->num_fds].fd = fd;
+    poller->poll_fds[poller->num_fds].events = poller_to_poll(events);
+    poller->poll_fds[poller->num_fds].revents = 0;
+    poller->fd_slots[fd] = (int)poller->num_fds;
+#else
+    event.events = poller_to_epoll(poller, events);
+    event.data.fd = fd;
+    if (-1 == epoll_ctl(poller->epoll_fd, EPOLL_CTL_ADD, fd, &event))
+    {
+        log_perror("epoll_ctl(ADD)");
+        goto END;
+    }
+#endif
+    poller->num_fds++;
+
+    ret = 0;
+END:
+    return ret;
+}
+
+/**
+ * @brief Removes an fd from the poller. Call before closing the fd.
+ *
+ * @param poller the poller to remove from
+ * @param fd the fd to stop watching
+ * @return returns 0 on success. Otherwise returns -1.
+ */
+int poller_del(poller_t *poller, int fd)
+{
+    int ret = -1;
+#ifdef USE_POLL
+    int slot = -1;
+    size_t last = 0;
+#endif
+
+    if ((NULL == poller) || (0 > fd))
+    {
+        log_error("Invalid poller or fd passed.");
+        goto END;
+    }
+
+#ifdef USE_IO_URING
+    if (POLLER_BACKEND_URING == poller->backend)
+    {
+        if (-1 == poller_uring_del(poller, fd))
+        {
+            goto END;
+        }
+        poller->num_fds--;
+        ret = 0;
+        goto END;
+    }
+#endif
+
+#ifdef USE_POLL
+    if (((size_t)fd >= poller->fd_slots_size) || (-1 == (slot = poller->fd_slots[fd])))
+    {
+        goto END;
+    }
+
+    // move the last entry into the freed slot to keep the array packed
+    last = poller->num_fds - 1;
+    poller->poll_fds[slot] = poller->poll_fds[last];
+    poller->fd_slots[poller->poll_fds[slot].fd] = slot;
+    poller->fd_slots[fd] = -1;
+#else
+    if (-1 == epoll_ctl(poller->epoll_fd, EPOLL_CTL_DEL, fd, NULL))
+    {
+        log_perror("epoll_ctl(DEL)");
+        goto END;
+    }
+#endif
+    poller->num_fds--;
+
+    ret = 0;
+END:
+    return ret;
+}
+
+/**
+ * @brief Changes which events a registered fd is watched for.
+ *
+ * @param poller the poller the fd is registered with
+ * @param fd the registered fd
+ * @param events POLLER_IN and/or POLLER_OUT; hangups and errors are always reported
+ * @return returns 0 on success. Otherwise returns -1.
+ */
+int poller_mod(poller_t *poller, int fd, uint32_t events)
+{
+    int ret = -1;
+#ifndef USE_POLL
+    struct epoll_event event = {0};
+#endif
+
+    if ((NULL == poller) || (0 > fd))
+    {
+        log_error("Invalid poller or fd passed.");
+        goto END;
+    }
+
+#ifdef USE_IO_URING
+    if (POLLER_BACKEND_URING == poller->backend)
+    {
+        // a poll request's mask is fixed once queued; cancel it and poll again (the new generation drops stale results)
+        if ((-1 == poller_uring_del(poller, fd)) || (-1 == poller_uring_add(poller, fd, events)))
+        {
+            goto END;
+        }
+        ret = 0;
+        goto END;
+    }
+#endif
+
+#ifdef USE_POLL
+    if (((size_t)fd >= poller->fd_slots_size) || (-1 == poller->fd_slots[fd]))
+    {
+        goto END;
+    }
+    poller->poll_fds[poller->fd_slots[fd]].events = poller_to_poll(events);
+#else
+    event.events = poller_to_epoll(poller, events);
+    event.data.fd = fd;
+    if (-1 == epoll_ctl(poller->epoll_fd, EPOLL_CTL_MOD, fd, &event))
+    {
+        log_perror("epoll_ctl(MOD)");
+        goto END;
+    }
+#endif
+
+    ret = 0;
+END:
+    return ret;
+}
+
+/**
+ * @brief Waits for registered fds to become ready.
+ *
+ * @param poller the poller to wait on
+ * @param events array receiving the ready fds
+ * @param max_events size of events
+ * @param timeout_ms how long to wait in milliseconds, or -1 to wait forever
+ * @return returns the number of ready fds (0 on timeout), or -1 on failure with errno set
+ */
+int poller_wait(poller_t *poller, poller_event_t *events, int max_events, int timeout_ms)
+{
+    int ret = -1;
+    int num_ready = 0;
+    int index = 0;
+#ifdef USE_POLL
+    size_t scanned = 0;
+    size_t slot = 0;
+    short revents = 0;
+#else
+    struct epoll_event epoll_events[POLLER_MAX_EVENTS];
+#endif
+
+    if ((NULL == poller) || (NULL == events) || (0 >= max_events))
+    {
+        errno = EINVAL;
+        goto END;
+    }
+
+#ifdef USE_IO_URING
+    if (POLLER_BACKEND_URING == poller->backend)
+    {
+        ret = poller_uring_wait(poller, events, max_events, timeout_ms);
+        goto END;
+    }
+#endif
+
+#ifdef USE_POLL
+    num_ready = poll(poller->poll_fds, poller->num_fds, timeout_ms);
+    if (0 >= num_ready)
+    {
+        ret = num_ready;
+        goto END;
+    }
+
+    for (scanned = 0; (scanned < poller->num_fds) && (index < max_events) && (index < num_ready); scanned++)
+    {
+        slot = (poller->scan_start + scanned) % poller->num_fds;
+        revents = poller->poll_fds[slot].revents;
+        if (0 == revents)
+        {
+            continue;
+        }
+
+        events[index].fd = poller->poll_fds[slot].fd;
+        events[index].events = 0;
+        events[index].events |= (POLLIN & revents) ? POLLER_IN : 0;
+        events[index].events |= (POLLOUT & revents) ? POLLER_OUT : 0;
+        events[index].events |= (POLLHUP & revents) ? POLLER_HUP : 0;
+        events[index].events |= (POLLRDHUP & revents) ? POLLER_RDHUP : 0;
+        events[index].events |= ((POLLERR | POLLNVAL) & revents) ? POLLER_ERR : 0;
+        index++;
+    }
+    poller->scan_start = (poller->scan_start + scanned) % poller->num_fds;
+#else
+    if (POLLER_MAX_EVENTS < max_events)
+    {
+        max_events = POLLER_MAX_EVENTS;
+    }
+
+    num_ready = epoll_wait(poller->epoll_fd, epoll_events, max_events, timeout_ms);
+    if (0 >= num_ready)
+    {
+        ret = num_ready;
+        goto END;
+    }
+
+    for (index = 0; index < num_ready; index++)
+    {
+        events[index].fd = epoll_events[index].data.fd;
+        events[index].events = 0;
+        events[index].events |= (EPOLLIN & epoll_events[index].events) ? POLLER_IN : 0;
+        events[index].events |= (EPOLLOUT & epoll_events[index].events) ? POLLER_OUT : 0;
+        events[index].events |= (EPOLLHUP & epoll_events[index].events) ? POLLER_HUP : 0;
+        events[index].events |= (EPOLLRDHUP & epoll_events[index].events) ? POLLER_RDHUP : 0;
+        events[index].events |= (EPOLLERR & epoll_events[index].events) ? POLLER_ERR : 0;
+    }
+#endif
+
+    ret = index;
+END:
+    return ret;
+}
+
+/**
+ * @brief Frees the poller. Registered fds are not closed.
+ *
+ * @param poller the poller to destroy
+ * @return returns 0 on success. Otherwise returns -1.
+ */
+int destroy_poller(poller_t *poller)
+{
+    int ret = -1;
+
+    if (NULL == poller)
+    {
+        log_error("Poller is already NULL. Exiting.");
+        goto END;
+    }
+
+#ifdef USE_IO_URING
+    if (POLLER_BACKEND_URING == poller->backend)
+    {
+        io_uring_queue_exit(&poller->ring);
+        free(poller->uring_fds);
+        poller->uring_fds = NULL;
+        free(poller->rearm_fds);
+        poller->rearm_fds = NULL;
+        free(poller);
+        poller = NULL;
+        ret = 0;
+        goto END;
+    }
+#endif
+
+#ifdef USE_POLL
+    free(poller->poll_fds);
+    poller->poll_fds = NULL;
+    free(poller->fd_slots);
+    poller->fd_slots = NULL;
+#else
+    close(poller->epoll_fd);
+#endif
+    free(poller);
+    poller = NULL;
+
+    ret = 0;
+END:
+    return ret;
+}
+
+/*** end of file ***/
@@ -0,0 +1,169 @@
+#ifndef POLLER_H
+#define POLLER_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // POLLRDHUP for the poll() backend
+#endif
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef USE_POLL
+#include <poll.h>
+#else
+#include <sys/epoll.h>
+#endif
+
+#ifdef USE_IO_URING
+#include <liburing.h>
+#include <poll.h>
+#endif
+
+#include "log.h"
+
+#define POLLER_IN 0x1     // fd is readable
+#define POLLER_OUT 0x2    // fd is writable
+#define POLLER_HUP 0x4    // peer hung up
+#define POLLER_ERR 0x8    // error on the fd
+#define POLLER_RDHUP 0x10 // peer shut down its side: no more input, though it may still be reading
+
+#define POLLER_EDGE 0x1     // create flag: edge-triggered readiness; handlers must then read until EAGAIN
+#define POLLER_NO_URING 0x2 // create flag: never use the io_uring backend, even when built with USE_IO_URING
+
+#define POLLER_MAX_EVENTS 64  // events returned per poller_wait() call by the poll loops
+#define POLLER_MIN_SLOTS 64   // initial pollfd array size for the poll() backend
+#define POLLER_URING_ENTRIES 256 // submission queue size for the io_uring backend
+
+#define POLLER_BACKEND_DEFAULT 0 // epoll, or poll() under USE_POLL
+#define POLLER_BACKEND_URING 1
+
+#ifdef USE_IO_URING
+/**
+ * @brief io_uring backend state for one fd. gen is bumped on every removal and carried in each poll request's
+ * user_data, so completions for an old registration are dropped even if the fd number is reused.
+ */
+typedef struct poller_uring_fd
+{
+    uint32_t gen;
+    short poll_mask;
+    uint8_t registered;
+    uint8_t armed; // a poll request is in flight
+    uint8_t rearm; // level-triggered: poll again on the next poller_wait()
+} poller_uring_fd_t;
+#endif
+
+/**
+ * @brief a ready fd reported by poller_wait()
+ */
+typedef struct poller_event
+{
+    int fd;
+    uint32_t events;
+} poller_event_t;
+
+/**
+ * @brief a per-thread readiness poller. Built on epoll by default, so a wakeup costs O(ready fds) however many fds are
+ * registered. Building with USE_POLL falls back to poll() over a packed, growable pollfd array: removed fds are
+ * replaced by the last entry so the scan only covers live fds.
+ *
+ * Building with USE_IO_URING adds an io_uring backend, used when the running kernel supports it: readiness arrives as
+ * poll completions (multishot when edge-triggered, re-armed single shots when level-triggered), and every add, remove
+ * and re-arm since the last wakeup goes to the kernel in the same syscall that waits for completions.
+ */
+typedef struct poller
+{
+    int flags;
+    int backend;
+    size_t num_fds;
+#ifdef USE_IO_URING
+    struct io_uring ring;
+    poller_uring_fd_t *uring_fds; // indexed by fd
+    size_t uring_fds_size;
+    int *rearm_fds;
+    size_t num_rearm;
+    size_t rearm_size;
+#endif
+#ifdef USE_POLL
+    struct pollfd *poll_fds;
+    size_t poll_fds_size;
+    int *fd_slots; // fd -> index into poll_fds, or -1
+    size_t fd_slots_size;
+    size_t scan_start; // rotates so fds late in the array are not starved when more than max_events are ready
+#else
+    int epoll_fd;
+#endif
+} poller_t;
+
+/**
+ * @brief Creates an empty poller.
+ *
+ * @param flags 0 for level-triggered, or POLLER_EDGE for edge-triggered readiness, optionally with POLLER_NO_URING
+ * @return returns pointer to the poller on success. Otherwise returns NULL.
+ */
+poller_t *create_poller(int flags);
+
+/**
+ * @brief Checks whether the running kernel supports what the io_uring paths need (multishot poll and accept).
+ *
+ * @return returns 1 if io_uring can be used, otherwise returns 0 (always 0 without USE_IO_URING)
+ */
+int poller_uring_supported(void);
+
+/**
+ * @brief Registers an fd with the poller.
+ *
+ * @param poller the poller to add to
+ * @param fd the fd to watch
+ * @param events POLLER_IN and/or POLLER_OUT; hangups and errors are always reported, the peer's shutdown of its
+ * side only along with POLLER_IN
+ * @return returns 0 on success. Otherwise returns -1.
+ */
+int poller_add(poller_t *poller, int fd, uint32_t events);
+
+/**
+ * @brief Removes an fd from the poller. Call before closing the fd.
+ *
+ * @param poller the poller to remove from
+ * @param fd the fd to stop watching
+ * @return returns 0 on success. Otherwise returns -1.
+ */
+int poller_del(poller_t *poller, int fd);
+
+/**
+ * @brief Changes which events a registered fd is watched for.
+ *
+ * @param poller the poller the fd is registered with
+ * @param fd the registered fd
+ * @param events POLLER_IN and/or POLLER_OUT; hangups and errors are always reported, the peer's shutdown of its
+ * side only along with POLLER_IN
+ * @return returns 0 on success. Otherwise returns -1.
+ */
+int poller_mod(poller_t *poller, int fd, uint32_t events);
+
+/**
+ * @brief Waits for registered fds to become ready.
+ *
+ * @param poller the poller to wait on
+ * @param events array receiving the ready fds
+ * @param max_events size of events
+ * @param timeout_ms how long to wait in milliseconds, or -1 to wait forever
+ * @return returns the number of ready fds (0 on timeout), or -1 on failure with errno set
+ */
+int poller_wait(poller_t *poller, poller_event_t *events, int max_events, int timeout_ms);
+
+/**
+ * @brief Frees the poller. Registered fds are not closed.
+ *
+ * @param poller the poller to destroy
+ * @return returns 0 on success. Otherwise returns -1.
+ */
+int destroy_poller(poller_t *poller);
+
+#endif
+
+/*** end of file ***/
@@ -2,233 +2,681 @@
 
 #define _GNU_SOURCE
 
-atomic_int session_number = 1;
+/**
+ * @brief Mixes a session ID into a table index. Session IDs are sequential runs from a random start, so the bits are
+ * scrambled (murmur3 finalizer) to keep neighbouring IDs from clustering into one probe run.
+ *
+ * @param session_id the ID to hash
+ * @param mask the table size minus one
+ * @return the home slot index for the ID
+ */
+static size_t session_slot_index(uint32_t session_id, size_t mask)
+{
+    uint32_t hash = session_id;
+
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bU;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35U;
+    hash ^= hash >> 16;
+
+    return (size_t)hash & mask;
+}
 
 /**
- * @brief Initializes an empty sessions queue.
+ * @brief Finds the slot holding session_id, or the empty slot that ends its probe run. Caller holds the lock.
  *
- * @return returns pointer to the sessions queue on success. Otherwise returns NULL.
+ * @param p_sessions The sessions table holding session objects
+ * @param session_id the ID to look up
+ * @return index of the matching slot, or of the empty slot where it would be inserted
  */
-QUEUE_t *create_sessions_queue(void)
+static size_t session_probe(sessions_t *p_sessions, uint32_t session_id)
 {
-    QUEUE_t *p_ret = NULL;
-    QUEUE_t *p_sessions = NULL;
+    size_t index = session_slot_index(session_id, p_sessions->mask);
 
-    p_sessions = create_queue(NULL, 0);
-    if (NULL == p_sessions)
+    while ((NULL != p_sessions->slots[index].p_session) && (session_id != p_sessions->slots[index].session_id))
+    {
+        index = (index + 1) & p_sessions->mask;
+    }
+
+    return index;
+}
+
+/**
+ * @brief Doubles the number of slots and reinserts every session. Caller holds the lock.
+ *
+ * @param p_sessions The sessions table holding session objects
+ * @return returns 0 on success. Otherwise returns -1
+ */
+static int sessions_grow(sessions_t *p_sessions)
+{
+    int ret = -1;
+    session_slot_t *old_slots = p_sessions->slots;
+    size_t old_size = p_sessions->mask + 1;
+    session_slot_t *new_slots = NULL;
+    size_t index = 0;
+
+    new_slots = calloc(old_size * 2, sizeof(session_slot_t));
+    if (NULL == new_slots)
     {
-        fprintf(stderr, "Failed to create sessions queue. Exiting.\n");
+        log_error("Failed to alloc sessions table slots.");
         goto END;
     }
 
+    p_sessions->slots = new_slots;
+    p_sessions->mask = (old_size * 2) - 1;
+    for (index = 0; index < old_size; index++)
+    {
+        if (NULL != old_slots[index].p_session)
+        {
+            p_sessions->slots[session_probe(p_sessions, old_slots[index].session_id)] = old_slots[index];
+        }
+    }
+    free(old_slots);
+    old_slots = NULL;
+
+    ret = 0;
+END:
+    return ret;
+}
+
+/**
+ * @brief Removes the session in slot index. Later members of the probe run are shifted back into the hole so lookups
+ * never need tombstones. Caller holds the lock.
+ *
+ * @param p_sessions The sessions table holding session objects
+ * @param index the slot to clear
+ */
+static void sessions_remove_slot(sessions_t *p_sessions, size_t index)
+{
+    size_t hole = index;
+    size_t next = index;
+    size_t home = 0;
+
+    for (;;)
+    {
+        next = (next + 1) & p_sessions->mask;
+        if (NULL == p_sessions->slots[next].p_session)
+        {
+            break;
+        }
+
+        // the entry at next may fill the hole only if its home slot is not cyclically within (hole, next]
+        home = session_slot_index(p_sessions->slots[next].session_id, p_sessions->mask);
+        if (((next - home) & p_sessions->mask) >= ((next - hole) & p_sessions->mask))
+        {
+            p_sessions->slots[hole] = p_sessions->slots[next];
+            hole = next;
+        }
+    }
+
+    p_sessions->slots[hole].p_session = NULL;
+    p_sessions->slots[hole].session_id = 0;
+    p_sessions->count--;
+}
+
+/**
+ * @brief Unlinks a session from the oldest to newest chain. Caller holds the lock.
+ *
+ * @param p_sessions The sessions table holding session objects
+ * @param p_session the session to unlink
+ */
+static void sessions_unlink(sessions_t *p_sessions, session_t *p_session)
+{
+    if (NULL != p_session->older)
+    {
+        p_session->older->newer = p_session->newer;
+    }
+    else
+    {
+        p_sessions->oldest = p_session->newer;
+    }
+
+    if (NULL != p_session->newer)
+    {
+        p_session->newer->older = p_session->older;
+    }
+    else
+    {
+        p_sessions->newest = p_session->older;
+    }
+
+    p_session->older = NULL;
+    p_session->newer = NULL;
+}
+
+/**
+ * @brief Reads the monotonic clock in whole seconds, the tick unit of the sessions timing wheel.
+ *
+ * @return the current tick
+ */
+static uint64_t session_now(void)
+{
+    struct timespec now = {0};
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec;
+}
+
+/**
+ * @brief Moves a session's timer to the earlier of its idle and absolute deadlines, leaving it alone when the deadline
+ * has not changed since the last request in the same tick. Caller holds the lock.
+ *
+ * @param p_sessions The sessions table holding session objects
+ * @param p_session the session to (re)arm
+ */
+static void session_arm(sessions_t *p_sessions, session_t *p_session)
+{
+    uint64_t deadline = 0;
+
+    if (0 != p_sessions->idle_timeout)
+    {
+        deadline = p_sessions->wheel.now + p_sessions->idle_timeout;
+    }
+    if ((0 != p_sessions->absolute_timeout) &&
+        ((0 == deadline) || ((p_session->created + p_sessions->absolute_timeout) < deadline)))
+    {
+        deadline = p_session->created + p_sessions->absolute_timeout;
+    }
+
+    if (0 == deadline)
+    {
+        tw_cancel(&p_sessions->wheel, &p_session->timer);
+    }
+    else if ((0 == tw_armed(&p_session->timer)) || (deadline != p_session->timer.expires))
+    {
+        tw_arm(&p_sessions->wheel, &p_session->timer, deadline);
+    }
+}
+
+/**
+ * @brief Initializes an empty sessions table.
+ *
+ * @return returns pointer to the sessions table on success. Otherwise returns NULL.
+ */
+sessions_t *create_sessions_table(void)
+{
+    sessions_t *p_ret = NULL;
+    sessions_t *p_sessions = NULL;
+
+    p_sessions = calloc(1, sizeof(sessions_t));
+    if (NULL == p_sessions)
+    {
+        log_error("Failed to create sessions table. Exiting.");
+        goto FAIL;
+    }
+
+    p_sessions->slots = calloc(SESSIONS_MIN_SLOTS, sizeof(session_slot_t));
+    if (NULL == p_sessions->slots)
+    {
+        log_error("Failed to alloc sessions table slots. Exiting.");
+        goto FAIL;
+    }
+    p_sessions->mask = SESSIONS_MIN_SLOTS - 1;
+    p_sessions->idle_timeout = SESSION_IDLE_TIMEOUT;
+    p_sessions->absolute_timeout = SESSION_ABSOLUTE_TIMEOUT;
+    tw_init(&p_sessions->wheel, session_now());
+    atomic_init(&p_sessions->last_tick, p_sessions->wheel.now);
+
+    if (0 != pthread_mutex_init(&p_sessions->lock, NULL))
+    {
+        log_error("Error initializing sessions mutex.");
+        goto FAIL;
+    }
+
     p_ret = p_sessions;
+    goto END;
+
+FAIL:
+    if (NULL != p_sessions)
+    {
+        free(p_sessions->slots);
+        p_sessions->slots = NULL;
+    }
+    free(p_sessions);
+    p_sessions = NULL;
+
 END:
     return p_ret;
 }
 
 /**
- * @brief When a user successfully authenticates, this function adds a session to the sessions queue. Sessions IDs are
- * pulled from an atomic integer. The session is only added if its integer value is not already in the queue. Otherwise
- * its number iterates until an available ID is found.
+ * @brief Sets the timeouts applied to sessions. Existing sessions pick up the new values on their next request.
+ *
+ * @param p_sessions The sessions table holding session objects
+ * @param idle_timeout seconds without a request before a session expires, or 0 for no idle timeout
+ * @param absolute_timeout seconds after login that a session expires, or 0 for no absolute timeout
+ * @return returns 0 on success. Otherwise returns -1
+ */
+int set_session_timeouts(sessions_t *p_sessions, uint32_t idle_timeout, uint32_t absolute_timeout)
+{
+    int ret = -1;
+
+    if (NULL == p_sessions)
+    {
+        log_error("Sessions table is NULL. Exiting set_session_timeouts.");
+        goto END;
+    }
+
+    pthread_mutex_lock(&p_sessions->lock);
+    p_sessions->idle_timeout = idle_timeout;
+    p_sessions->absolute_timeout = absolute_timeout;
+    pthread_mutex_unlock(&p_sessions->lock);
+
+    ret = 0;
+END:
+    return ret;
+}
+
+/**
+ * @brief When a user successfully authenticates, this function adds a session to the sessions table. Session IDs start
+ * from a random number. The session is only added if its ID is not already in the table. Otherwise its number iterates
+ * until an available ID is found.
  *
  * @param permissions The authenticated user's permission level for the session
- * @param sessions The sessions queue holding session objects
+ * @param p_sessions The sessions table holding session objects
  * @param username The username of the session user
  * @param username_len length of the username
  * @return returns a session ID number or 0 on failure
  */
-uint32_t add_session(uint8_t permissions, QUEUE_t *p_sessions, char *username, int username_len)
+uint32_t add_session(uint8_t permissions, sessions_t *p_sessions, char *username, int username_len)
 {
-    debug_printf(("Creating new session.\n"));
+    log_debug("Creating new session.");
 
     uint32_t ret = 0;
-    int random_num = 0;
+    uint32_t session_number = 0;
+    size_t index = 0;
     session_t *new_session = NULL;
 
-    random_num = random();
-    session_number = random_num % MAX_SESSIONS;
-
-    while (1 == check_queue(p_sessions, &session_number)) // This prevents reusing same session_id
+    if (NULL == p_sessions)
     {
-        session_number = ((session_number + 1) % MAX_SESSIONS); // move to next possible ID
-        debug_printf(("session already exists. Incremented to %d\n", session_number));
+        log_error("Sessions table is NULL. Exiting add_session.");
+        goto END;
     }
 
     new_session = calloc(1, sizeof(session_t));
     if (NULL == new_session)
     {
-        fprintf(stderr, "Failed to alloc new_session.\n");
+        log_error("Failed to alloc new_session.");
         goto END;
     }
 
+    session_number = random() % MAX_SESSIONS;
+
+    pthread_mutex_lock(&p_sessions->lock);
+    if ((MAX_SESSIONS - 1) <= p_sessions->count) // ID 0 is reserved for failure
+    {
+        log_error("Sessions table full.");
+        goto UNLOCK;
+    }
+    if (((p_sessions->count + 1) * 2) > (p_sessions->mask + 1)) // keep the load factor at or under one half
+    {
+        if (-1 == sessions_grow(p_sessions))
+        {
+            goto UNLOCK;
+        }
+    }
+
+    for (;;) // This prevents reusing same session_id
+    {
+        if (0 != session_number)
+        {
+            index = session_probe(p_sessions, session_number);
+            if (NULL == p_sessions->slots[index].p_session)
+            {
+                break;
+            }
+            log_debug("session already exists. Incremented to %d", session_number + 1);
+        }
+        session_number = ((session_number + 1) % MAX_SESSIONS); // move to next possible ID
+    }
+
     new_session->session_id = session_number;
     new_session->permissions = permissions;
     new_session->username = username;
     new_session->username_len = username_len;
-    if (-1 == enqueue(p_sessions, new_session))
+    new_session->created = p_sessions->wheel.now;
+    tw_timer_init(&new_session->timer);
+    session_arm(p_sessions, new_session);
+
+    p_sessions->slots[index].session_id = session_number;
+    p_sessions->slots[index].p_session = new_session;
+    p_sessions->count++;
+
+    new_session->older = p_sessions->newest;
+    if (NULL != p_sessions->newest)
     {
-        fprintf(stderr, "Failed enqueue()\n");
-        goto END;
+        p_sessions->newest->newer = new_session;
     }
-    debug_printf(("\nSession(%d) created.\n", session_number));
+    else
+    {
+        p_sessions->oldest = new_session;
+    }
+    p_sessions->newest = new_session;
+    new_session = NULL;
+    metrics_add(METRIC_SESSIONS_CREATED, 1);
+    metrics_move(METRIC_SESSIONS_LIVE, 1);
+
+    log_debug("Session(%d) created.", session_number);
     ret = session_number;
-    session_number = ((session_number + 1) % MAX_SESSIONS); // increment next ID
 
-    debug_printf(("RETURNING - Session(%d).\n", ret));
+UNLOCK:
+    pthread_mutex_unlock(&p_sessions->lock);
+    free(new_session);
+    new_session = NULL;
+
+    log_debug("RETURNING - Session(%d).", ret);
 
 END:
     return ret;
 }
 
 /**
- * @brief Dequeues a session from the sessions queue.
+ * @brief Removes the oldest session from the sessions table.
  *
- * @param sessions The sessions queue holding session objects
+ * @param p_sessions The sessions table holding session objects
  * @return returns 0 on a successful session dequeue. Otherwise returns -1;
  */
-int dequeue_session(QUEUE_t *p_sessions)
+int dequeue_session(sessions_t *p_sessions)
 {
     int ret = -1;
 
     session_t *expired_session = NULL;
 
-    expired_session = (session_t *)dequeue(p_sessions, 1);
+    if (NULL == p_sessions)
+    {
+        log_error("Sessions table is NULL. Exiting dequeue_session.");
+        goto END;
+    }
+
+    pthread_mutex_lock(&p_sessions->lock);
+    expired_session = p_sessions->oldest;
+    if (NULL != expired_session)
+    {
+        sessions_remove_slot(p_sessions, session_probe(p_sessions, expired_session->session_id));
+        sessions_unlink(p_sessions, expired_session);
+        tw_cancel(&p_sessions->wheel, &expired_session->timer);
+    }
+    pthread_mutex_unlock(&p_sessions->lock);
 
     if (NULL == expired_session)
     {
-        debug_printf(("Failed to dequeue the session.\n"));
+        log_debug("Failed to dequeue the session.");
     }
     else
     {
+        free(expired_session->username);
+        expired_session->username = NULL;
         free(expired_session);
         expired_session = NULL;
+        metrics_add(METRIC_SESSIONS_EXPIRED, 1);
+        metrics_move(METRIC_SESSIONS_LIVE, -1);
         ret = 0;
     }
+
+END:
+    return ret;
+}
+
+/**
+ * @brief Looks a session up and pushes its idle deadline back. Call with the table lock held, and count the lookup
+ * with session_count_lookup() once it is dropped.
+ *
+ * @param p_sessions The sessions table holding session objects
+ * @param session_id the ID to look up
+ * @return the session, or NULL if it does not exist
+ */
+static session_t *session_touch(sessions_t *p_sessions, uint32_t session_id)
+{
+    session_t *ret = p_sessions->slots[session_probe(p_sessions, session_id)].p_session;
+
+    if (NULL != ret)
+    {
+        session_arm(p_sessions, ret); // sliding refresh of the idle deadline
+    }
+
     return ret;
 }
 
 /**
- * @brief Checks if session exists on the queue.
+ * @brief Counts a session lookup as a hit or a miss.
  *
- * @param p_sessions The sessions queue holding session objects
+ * @param found whether the session existed
+ * @param permissions its permission level, if it did
+ */
+static void session_count_lookup(int found, uint8_t permissions)
+{
+    if (0 == found)
+    {
+        metrics_add(METRIC_SESSION_MISSES, 1);
+        log_debug("Session not found.");
+    }
+    else
+    {
+        metrics_add(METRIC_SESSION_HITS, 1);
+        log_debug("Session found. Returning perms: %d", permissions);
+    }
+}
+
+/**
+ * @brief Checks if session exists in the table. A found session's idle deadline is pushed back. Its permissions are
+ * read under the table lock, so nothing is copied or allocated.
+ *
+ * @param session_id the ID to verify
+ * @param p_sessions The sessions table holding session objects
  * @return If the session exists, returns the associated permission level or 0 on failure
  */
-uint8_t check_session(uint32_t session_id, QUEUE_t *p_sessions)
+uint8_t check_session(uint32_t session_id, sessions_t *p_sessions)
 {
     uint8_t ret = 0;
-    Q_NODE_t *temp = NULL;
     session_t *match = NULL;
 
     if (NULL == p_sessions)
     {
-        fprintf(stderr, "Queue is empty. Exiting check_queue.\n");
+        log_error("Sessions table is NULL. Exiting check_session.");
+        goto END;
     }
-    else if (NULL == p_sessions->head)
+
+    pthread_mutex_lock(&p_sessions->lock);
+    match = session_touch(p_sessions, session_id);
+    if (NULL != match)
     {
-        debug_printf(("Queue is empty check_queue. Exiting.\n"));
+        ret = match->permissions;
     }
-    else
-    {
-        temp = p_sessions->head;
-        while (temp != p_sessions->tail->next)
-        {
-            match = (session_t *)temp->data;
-            debug_printf(("Comparing (%d) to sessions_table %d value.\n", session_id, match->session_id));
-            if (match->session_id == session_id)
-            {
-                ret = match->permissions;
-                debug_printf(("Session found. Returning perms: %d\n", ret));
-                goto END;
-            }
-            temp = temp->next;
-        }
-    }
-    debug_printf(("Session not found.\n"));
+    pthread_mutex_unlock(&p_sessions->lock);
+    session_count_lookup(NULL != match, ret);
 
 END:
     return ret;
 }
 
 /**
- * @brief Checks if session exists on the queue.
+ * @brief Checks if session exists in the table. A found session's idle deadline is pushed back.
+ *
+ * The session can be expired by any poller once the table lock is dropped, so the pointer is only safe to follow
+ * where the caller knows the session outlives its use; use copy_session() otherwise.
  *
  * @param session_id the ID to look up/ verify
- * @param p_sessions The sessions queue holding session objects
+ * @param p_sessions The sessions table holding session objects
  * @return If the session exists, returns the associated session struct, or NULL on failure
  */
-session_t *find_session(uint32_t session_id, QUEUE_t *p_sessions)
+session_t *find_session(uint32_t session_id, sessions_t *p_sessions)
 {
     session_t *ret = NULL;
-    Q_NODE_t *temp = NULL;
-    session_t *match = NULL;
+    uint8_t permissions = 0;
 
     if (NULL == p_sessions)
     {
-        fprintf(stderr, "Queue is empty. Exiting check_queue.\n");
+        log_error("Sessions table is NULL. Exiting find_session.");
+        goto END;
     }
-    else if (NULL == p_sessions->head)
+
+    pthread_mutex_lock(&p_sessions->lock);
+    ret = session_touch(p_sessions, session_id);
+    permissions = (NULL != ret) ? ret->permissions : 0;
+    pthread_mutex_unlock(&p_sessions->lock);
+    session_count_lookup(NULL != ret, permissions);
+
+END:
+    return ret;
+}
+
+/**
+ * @brief Checks if session exists in the table and copies it out under the table lock, so the copy stays valid
+ * after the session expires. A found session's idle deadline is pushed back.
+ *
+ * @param session_id the ID to look up/ verify
+ * @param p_sessions The sessions table holding session objects
+ * @param out receives a copy of the session's ID, permissions, username and creation tick; its links and timer are
+ * cleared. username is a copy the caller frees, or NULL if the session has none.
+ * @return returns 0 if the session exists, or -1 if it does not or on failure
+ */
+int copy_session(uint32_t session_id, sessions_t *p_sessions, session_t *out)
+{
+    int ret = -1;
+    session_t *match = NULL;
+    char *username = NULL;
+
+    if ((NULL == p_sessions) || (NULL == out))
     {
-        debug_printf(("Queue is empty check_queue. Exiting.\n"));
+        log_error("Sessions table or out is NULL. Exiting copy_session.");
+        goto END;
     }
-    else
+    memset(out, 0, sizeof(session_t));
+
+    pthread_mutex_lock(&p_sessions->lock);
+    match = session_touch(p_sessions, session_id);
+    if (NULL != match)
     {
-        temp = p_sessions->head;
-        while (temp != p_sessions->tail->next)
+        if ((NULL != match->username) && (0 <= match->username_len))
         {
-            match = (session_t *)temp->data;
-            debug_printf(("Comparing (%d) to sessions_table %d value.\n", session_id, match->session_id));
-            if (match->session_id == session_id)
+            username = malloc((size_t)match->username_len + 1);
+            if (NULL == username)
             {
-                ret = match;
-                debug_printf(("Session found. Returning perms: %d\n", match->permissions));
+                pthread_mutex_unlock(&p_sessions->lock);
+                log_error("Failed to alloc session username copy.");
                 goto END;
             }
-            temp = temp->next;
+            memcpy(username, match->username, (size_t)match->username_len);
+            username[match->username_len] = '\0';
         }
+        out->session_id = match->session_id;
+        out->permissions = match->permissions;
+        out->username = username;
+        out->username_len = match->username_len;
+        out->created = match->created;
+        username = NULL;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&p_sessions->lock);
+    session_count_lookup(0 == ret, out->permissions);
+
+END:
+    return ret;
+}
+
+/**
+ * @brief Removes every session whose deadline has passed. Meant to be called from the poller loops: at most one caller
+ * does the work per tick, and the others return immediately without blocking.
+ *
+ * @param p_sessions The sessions table holding session objects
+ * @return returns the number of sessions expired, or -1 on failure
+ */
+int expire_sessions(sessions_t *p_sessions)
+{
+    int ret = -1;
+    uint64_t now = 0;
+    tw_timer_t *fired = NULL;
+    session_t *expired_session = NULL;
+    session_t *expired_list = NULL;
+
+    if (NULL == p_sessions)
+    {
+        log_error("Sessions table is NULL. Exiting expire_sessions.");
+        goto END;
+    }
+
+    ret = 0;
+    now = session_now();
+    if (now <= atomic_load_explicit(&p_sessions->last_tick, memory_order_relaxed)) // this tick is already done
+    {
+        goto END;
+    }
+    if (0 != pthread_mutex_trylock(&p_sessions->lock)) // another poller is expiring or the table is busy
+    {
+        goto END;
+    }
+
+    fired = tw_advance(&p_sessions->wheel, now);
+    while (NULL != fired)
+    {
+        expired_session = (session_t *)((char *)fired - offsetof(session_t, timer));
+        fired = fired->next;
+
+        sessions_remove_slot(p_sessions, session_probe(p_sessions, expired_session->session_id));
+        sessions_unlink(p_sessions, expired_session);
+        expired_session->newer = expired_list; // freed after the lock is dropped
+        expired_list = expired_session;
+        ret++;
+    }
+    atomic_store_explicit(&p_sessions->last_tick, p_sessions->wheel.now, memory_order_relaxed);
+    pthread_mutex_unlock(&p_sessions->lock);
+    if (0 < ret)
+    {
+        metrics_add(METRIC_SESSIONS_EXPIRED, (uint64_t)ret);
+        metrics_move(METRIC_SESSIONS_LIVE, -ret);
+    }
+
+    while (NULL != expired_list)
+    {
+        expired_session = expired_list;
+        expired_list = expired_list->newer;
+        log_debug("Session(%d) expired.", expired_session->session_id);
+
+        free(expired_session->username);
+        expired_session->username = NULL;
+        free(expired_session);
+        expired_session = NULL;
     }
-    debug_printf(("Session not found.\n"));
 
 END:
     return ret;
 }
 
 /**
- * @brief Frees the allocated sessions queue from memory
+ * @brief Frees the allocated sessions table and every session in it from memory
  *
- * @param p_sessions The sessions queue holding session objects
+ * @param p_sessions The sessions table holding session objects
  * @return returns 0 on successful free. Otherwise returns -1
  */
-int destroy_sessions(QUEUE_t *p_sessions)
+int destroy_sessions(sessions_t *p_sessions)
 {
     int ret = -1;
-    Q_NODE_t *temp_node = NULL;
     session_t *temp_session = NULL;
-    Q_NODE_t *start = NULL;
+    session_t *start = NULL;
 
     if (NULL == p_sessions)
     {
-        fprintf(stderr, "Sessions queue is already NULL. Exiting.\n");
+        log_error("Sessions table is already NULL. Exiting.");
         goto END;
     }
 
-    start = p_sessions->head;
+    start = p_sessions->oldest;
     while (start != NULL)
     {
-        temp_node = start;
-        start = start->next;
+        temp_session = start;
+        start = start->newer;
 
-        temp_session = (session_t *)temp_node->data;
-        if (temp_session)
-        {
-            free(temp_session->username);
-            temp_session->username = NULL;
-            free(temp_session);
-            temp_session = NULL;
-        }
-        free(temp_node);
-        temp_node = NULL;
+        free(temp_session->username);
+        temp_session->username = NULL;
+        free(temp_session);
+        temp_session = NULL;
     }
 
+    metrics_move(METRIC_SESSIONS_LIVE, -(int64_t)p_sessions->count);
+    pthread_mutex_destroy(&p_sessions->lock);
+    free(p_sessions->slots);
+    p_sessions->slots = NULL;
     free(p_sessions);
     p_sessions = NULL;
 
@@ -1,28 +1,32 @@
 #ifndef SESSIONS_H
 #define SESSIONS_H
 
+#include <pthread.h>
 #include <signal.h> /* for signal */
 #include <stdatomic.h>
 #include <stdint.h>
-#include <time.h> /* for setitimer */
+#include <time.h> /* for clock_gettime */
 
 #include "aqueues.h"
+#include "metrics.h"
+#include "timerwheel.h"
 
-#ifdef DEBUG
-#define debug_printf(x) printf x
-#else
-#define debug_printf(x) ;
-#endif
+#define debug_printf(x) log_debug x // kept for callers not yet moved to the log_ macros
 
 #define MAX_SESSIONS 100000
+#define SESSIONS_MIN_SLOTS 1024 // initial table size, must be a power of two
+#define SESSION_IDLE_TIMEOUT 900      // seconds without a request before a session expires (0 disables)
+#define SESSION_ABSOLUTE_TIMEOUT 28800 // seconds after login that a session expires regardless of use (0 disables)
 
 /**
- * @brief The temporal session object to be added to the sessions table. Each session exists for the set timeout length
- * before being removed from the sessions queue. On a successful login, a session is created, added to the sessions
- * queue, and sent back to the user. Whenever a request is received from the client, the received session id is also
- * looked up in the sessions queue. If found, the session's permissions value is referenced for operations permissions.
+ * @brief The temporal session object to be added to the sessions table. Each session exists until it has been idle
+ * for the idle timeout, or has existed for the absolute timeout, before being removed from the sessions table. On a
+ * successful login, a session is created, added to the sessions table, and sent back to the user. Whenever a request
+ * is received from the client, the received session id is also looked up in the sessions table. If found, the
+ * session's permissions value is referenced for operations permissions.
  *
- * Contains session ID, permissions, username, and username length
+ * Contains session ID, permissions, username, and username length, plus links to the next older and newer sessions so
+ * the oldest session can be removed without a scan, and the expiry timer with the tick the session was created on.
  */
 typedef struct _session_t
 {
@@ -30,61 +34,126 @@ typedef struct _session_t
     uint8_t permissions;
     char *username;
     int username_len;
+    tw_timer_t timer;
+    uint64_t created;
+    struct _session_t *older;
+    struct _session_t *newer;
 } session_t;
 
 /**
- * @brief Initializes an empty sessions queue.
+ * @brief A slot in the sessions table. The ID is kept next to the pointer so probing never touches the session itself.
+ * An empty slot has a NULL p_session.
+ */
+typedef struct _session_slot_t
+{
+    uint32_t session_id;
+    session_t *p_session;
+} session_slot_t;
+
+/**
+ * @brief The sessions table. A flat, open-addressed (linear probing) hash table keyed by session ID, giving O(1)
+ * insert, lookup and removal. Sessions are also chained oldest to newest so dequeue_session can expire the oldest one
+ * in O(1). Each session's deadline sits on a timing wheel ticking once a second, which expire_sessions advances.
+ */
+typedef struct _sessions_t
+{
+    session_slot_t *slots;
+    size_t mask;
+    size_t count;
+    session_t *oldest;
+    session_t *newest;
+    timer_wheel_t wheel;
+    uint32_t idle_timeout;
+    uint32_t absolute_timeout;
+    atomic_uint_fast64_t last_tick;
+    pthread_mutex_t lock;
+} sessions_t;
+
+/**
+ * @brief Initializes an empty sessions table.
  *
- * @return returns pointer to the sessions queue on success. Otherwise returns NULL.
+ * @return returns pointer to the sessions table on success. Otherwise returns NULL.
  */
-QUEUE_t *create_sessions_queue(void);
+sessions_t *create_sessions_table(void);
 
 /**
- * @brief When a user successfully authenticates, this function adds a session to the sessions queue. Sessions IDs are
- * pulled from an atomic integer. The session is only added if its integer value is not already in the queue. Otherwise
- * its number iterates until an available ID is found.
+ * @brief Sets the timeouts applied to sessions. Existing sessions pick up the new values on their next request.
+ *
+ * @param p_sessions The sessions table holding session objects
+ * @param idle_timeout seconds without a request before a session expires, or 0 for no idle timeout
+ * @param absolute_timeout seconds after login that a session expires, or 0 for no absolute timeout
+ * @return returns 0 on success. Otherwise returns -1
+ */
+int set_session_timeouts(sessions_t *p_sessions, uint32_t idle_timeout, uint32_t absolute_timeout);
+
+/**
+ * @brief When a user successfully authenticates, this function adds a session to the sessions table. Session IDs start
+ * from a random number. The session is only added if its ID is not already in the table. Otherwise its number iterates
+ * until an available ID is found.
  *
  * @param permissions The authenticated user's permission level for the session
- * @param sessions The sessions queue holding session objects
+ * @param p_sessions The sessions table holding session objects
  * @param username The username of the session user
  * @param username_len length of the username
- * @return returns a session ID number
+ * @return returns a session ID number or 0 on failure
  */
-uint32_t add_session(uint8_t permissions, QUEUE_t *sessions, char *username, int username_len);
+uint32_t add_session(uint8_t permissions, sessions_t *p_sessions, char *username, int username_len);
 
 /**
- * @brief Dequeues a session from the sessions queue.
+ * @brief Removes the oldest session from the sessions table.
  *
- * @param sessions The sessions queue holding session objects
+ * @param p_sessions The sessions table holding session objects
  * @return returns 0 on a successful session dequeue. Otherwise returns -1;
  */
-int dequeue_session(QUEUE_t *p_sessions);
+int dequeue_session(sessions_t *p_sessions);
 
 /**
- * @brief Checks if session exists on the queue.
+ * @brief Checks if session exists in the table. A found session's idle deadline is pushed back.
  *
  * @param session_id the ID to verify
- * @param p_sessions The sessions queue holding session objects
+ * @param p_sessions The sessions table holding session objects
  * @return If the session exists, returns the associated permission level, or 0 on failure
  */
-uint8_t check_session(uint32_t session_id, QUEUE_t *p_sessions);
+uint8_t check_session(uint32_t session_id, sessions_t *p_sessions);
 
 /**
- * @brief Checks if session exists on the queue.
+ * @brief Checks if session exists in the table. A found session's idle deadline is pushed back. The session can be
+ * expired by any poller once the table lock is dropped; use copy_session() unless it is known to outlive its use.
  *
  * @param session_id the ID to look up/ verify
- * @param p_sessions The sessions queue holding session objects
+ * @param p_sessions The sessions table holding session objects
  * @return If the session exists, returns the associated session struct, or NULL on failure
  */
-session_t *find_session(uint32_t session_id, QUEUE_t *p_sessions);
+session_t *find_session(uint32_t session_id, sessions_t *p_sessions);
+
+/**
+ * @brief Checks if session exists in the table and copies it out under the table lock, so the copy stays valid
+ * after the session expires. A found session's idle deadline is pushed back.
+ *
+ * @param session_id the ID to look up/ verify
+ * @param p_sessions The sessions table holding session objects
+ * @param out receives a copy of the session's ID, permissions, username and creation tick; its links and timer are
+ * cleared. username is a copy the caller frees, or NULL if the session has none.
+ * @return returns 0 if the session exists, or -1 if it does not or on failure
+ */
+int copy_session(uint32_t session_id, sessions_t *p_sessions, session_t *out);
+
+/**
+ * @brief Removes every session whose deadline has passed. Meant to be called from the poller loops: at most one caller
+ * does the work per tick, and the others return immediately without blocking.
+ *
+ * @param p_sessions The sessions table holding session objects
+ * @return returns the number of sessions expired, or -1 on failure
+ */
+int expire_sessions(sessions_t *p_sessions);
 
 /**
- * @brief Frees the allocated sessions queue from memory
+ * @brief Frees the allocated sessions table and every session in it from memory
  *
- * @param p_sessions The sessions queue holding session objects
+ * @param p_sessions The sessions table holding session objects
  * @return returns 0 on successful free. Otherwise returns -1
  */
-int destroy_sessions(QUEUE_t *p_sessions);
+int destroy_sessions(sessions_t *p_sessions);
 
 #endif
 
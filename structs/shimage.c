@@ -0,0 +1,525 @@
+#include "../include/shimage.h"
+
+static uint64_t shimage_get_u64(const char *p)
+{
+    uint64_t value = 0;
+
+    memcpy(&value, p, sizeof(value));
+    return le64toh(value);
+}
+
+static uint32_t shimage_get_u32(const char *p)
+{
+    uint32_t value = 0;
+
+    memcpy(&value, p, sizeof(value));
+    return le32toh(value);
+}
+
+static void shimage_put_u64(char *p, uint64_t value)
+{
+    value = htole64(value);
+    memcpy(p, &value, sizeof(value));
+}
+
+static void shimage_put_u32(char *p, uint32_t value)
+{
+    value = htole32(value);
+    memcpy(p, &value, sizeof(value));
+}
+
+/**
+ * @brief Decodes and checks the record at offset.
+ *
+ * @return returns 0 on success, or -1 if the record runs past the records area or fails its checksum
+ */
+static int shimage_record(const shimage_t *image, uint64_t offset, const char **key, size_t *key_len,
+                          const char **value, size_t *value_len)
+{
+    int ret = -1;
+    const char *record = image->map + offset;
+    uint64_t record_len = 0;
+
+    // the index is not covered by the header checksum, so an offset past the records area must not wrap the lengths
+    if ((SHIMAGE_HEADER_SIZE > offset) || (offset > image->index_offset) ||
+        (WAL_RECORD_HEADER > (image->index_offset - offset)))
+    {
+        goto FAIL;
+    }
+    *key_len = shimage_get_u32(record + 4);
+    *value_len = shimage_get_u32(record + 8);
+    record_len = WAL_RECORD_SIZE(*key_len, *value_len);
+    if ((record_len > (image->index_offset - offset)) ||
+        (shimage_get_u32(record) != wal_checksum(record + 4, record_len - 4)))
+    {
+        goto FAIL;
+    }
+    *key = record + WAL_RECORD_HEADER;
+    *value = *key + *key_len;
+
+    ret = 0;
+    goto END;
+FAIL:
+    log_error("Corrupt image record at offset %lu.", (unsigned long)offset);
+END:
+    return ret;
+}
+
+/**
+ * @brief Maps an image and checks its header.
+ *
+ * @param dir_fd directory holding the image (an O_PATH fd is fine)
+ * @param name the image's file name
+ * @param image receives the image, or NULL if there is no such file
+ * @return returns 0 on success (including a missing file), or -1 if the file could not be mapped or is not a valid
+ * image
+ */
+int shimage_open(int dir_fd, const char *name, shimage_t **image)
+{
+    int ret = -1;
+    int fd = -1;
+    shimage_t *new_image = NULL;
+    struct stat file_stat = {0};
+    char header[SHIMAGE_HEADER_SIZE] = {0};
+    void *map = MAP_FAILED;
+    uint64_t index_slots = 0;
+
+    if ((NULL == name) || (NULL == image))
+    {
+        log_error("Invalid image name passed.");
+        goto END;
+    }
+    *image = NULL;
+
+    fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+    if (-1 == fd)
+    {
+        if (ENOENT == errno)
+        {
+            ret = 0;
+            goto END;
+        }
+        log_perror("image openat()");
+        goto END;
+    }
+    if (-1 == fstat(fd, &file_stat))
+    {
+        log_perror("image fstat()");
+        goto END;
+    }
+    if (SHIMAGE_HEADER_SIZE > file_stat.st_size)
+    {
+        log_error("%s is too short to be an image.", name);
+        goto END;
+    }
+    map = mmap(NULL, (size_t)file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (MAP_FAILED == map)
+    {
+        log_perror("image mmap()");
+        goto END;
+    }
+
+    memcpy(header, map, SHIMAGE_HEADER_SIZE);
+    memset(header + 12, 0, 4);
+    index_slots = shimage_get_u64(header + 24);
+    if ((0 != memcmp(header, SHIMAGE_MAGIC, 8)) || (SHIMAGE_VERSION != shimage_get_u32(header + 8)) ||
+        (shimage_get_u32((const char *)map + 12) != wal_checksum(header, SHIMAGE_HEADER_SIZE)) ||
+        ((uint64_t)file_stat.st_size != shimage_get_u64(header + 40)) || (0 == index_slots) ||
+        (0 != (index_slots & (index_slots - 1))) || (SHIMAGE_HEADER_SIZE > shimage_get_u64(header + 32)) ||
+        ((index_slots * SHIMAGE_SLOT_SIZE) != ((uint64_t)file_stat.st_size - shimage_get_u64(header + 32))) ||
+        (index_slots < shimage_get_u64(header + 16))) // more entries than slots cannot be an index
+    {
+        log_error("%s is not a valid version %d image.", name, SHIMAGE_VERSION);
+        goto END;
+    }
+
+    new_image = calloc(1, sizeof(shimage_t));
+    if (NULL == new_image)
+    {
+        log_error("Failed to alloc image.");
+        goto END;
+    }
+    new_image->map = map;
+    new_image->map_len = (size_t)file_stat.st_size;
+    new_image->num_entries = shimage_get_u64(header + 16);
+    new_image->index_mask = index_slots - 1;
+    new_image->index_offset = shimage_get_u64(header + 32);
+    new_image->index = new_image->map + new_image->index_offset;
+    new_image->seed.k0 = shimage_get_u64(header + 48);
+    new_image->seed.k1 = shimage_get_u64(header + 56);
+    madvise(map, (size_t)file_stat.st_size, MADV_RANDOM); // lookups jump around; read-ahead would only evict
+    map = MAP_FAILED;
+
+    *image = new_image;
+    new_image = NULL;
+    ret = 0;
+END:
+    if (MAP_FAILED != map)
+    {
+        munmap(map, (size_t)file_stat.st_size);
+    }
+    if (-1 != fd)
+    {
+        close(fd); // the mapping keeps the file
+    }
+    return ret;
+}
+
+/**
+ * @brief Looks a key up in place.
+ *
+ * @param image the image
+ * @param key the key
+ * @param key_len length of the key
+ * @param value receives a pointer to the value inside the mapping; may be NULL
+ * @param value_len receives the value's length; may be NULL
+ * @return returns 0 if the key is in the image, or -1 if it is not (or its record is corrupt)
+ */
+int shimage_lookup(const shimage_t *image, const void *key, size_t key_len, const char **value, size_t *value_len)
+{
+    int ret = -1;
+    uint64_t hash = 0;
+    uint64_t index = 0;
+    uint64_t probes = 0;
+    uint64_t offset = 0;
+    const char *slot = NULL;
+    const char *record_key = NULL;
+    const char *record_value = NULL;
+    size_t record_key_len = 0;
+    size_t record_value_len = 0;
+
+    if ((NULL == image) || (NULL == key))
+    {
+        goto END;
+    }
+
+    hash = hash_siphash13(key, key_len, &image->seed);
+    index = hash & image->index_mask;
+    for (probes = 0;; probes++, index = (index + 1) & image->index_mask)
+    {
+        slot = image->index + (index * SHIMAGE_SLOT_SIZE);
+        offset = shimage_get_u64(slot + 8);
+        if ((0 == offset) || (probes > image->index_mask)) // the second test only stops a damaged, full index
+        {
+            goto END;
+        }
+        if ((hash == shimage_get_u64(slot)) &&
+            (0 == shimage_record(image, offset, &record_key, &record_key_len, &record_value, &record_value_len)) &&
+            (record_key_len == key_len) && (0 == memcmp(record_key, key, key_len)))
+        {
+            break;
+        }
+    }
+
+    if (NULL != value)
+    {
+        *value = record_value;
+    }
+    if (NULL != value_len)
+    {
+        *value_len = record_value_len;
+    }
+    ret = 0;
+END:
+    return ret;
+}
+
+/**
+ * @brief Calls visit for every record in the image.
+ *
+ * @param image the image
+ * @param visit the visitor
+ * @param arg passed through to visit
+ * @return returns 0 on success, 1 if visit stopped the walk, or -1 if a record is corrupt
+ */
+int shimage_foreach(const shimage_t *image, shimage_visit_func visit, void *arg)
+{
+    int ret = -1;
+    uint64_t index = 0;
+    uint64_t offset = 0;
+    const char *key = NULL;
+    const char *value = NULL;
+    size_t key_len = 0;
+    size_t value_len = 0;
+
+    if ((NULL == image) || (NULL == visit))
+    {
+        log_error("Invalid image or visitor passed.");
+        goto END;
+    }
+
+    ret = 0;
+    for (index = 0; (index <= image->index_mask) && (0 == ret); index++)
+    {
+        offset = shimage_get_u64(image->index + (index * SHIMAGE_SLOT_SIZE) + 8);
+        if (0 == offset)
+        {
+            continue;
+        }
+        if (-1 == shimage_record(image, offset, &key, &key_len, &value, &value_len))
+        {
+            ret = -1;
+        }
+        else if (0 != visit(key, key_len, value, value_len, arg))
+        {
+            ret = 1;
+        }
+    }
+
+END:
+    return ret;
+}
+
+/**
+ * @brief Unmaps an image.
+ *
+ * @param image the image
+ */
+void shimage_close(shimage_t *image)
+{
+    if (NULL != image)
+    {
+        munmap((void *)image->map, image->map_len);
+        free(image);
+        image = NULL;
+    }
+}
+
+/**
+ * @brief Starts writing an image as name.tmp under dir_fd.
+ *
+ * @param dir_fd directory to write the image in (an O_PATH fd is fine)
+ * @param name the image's file name
+ * @return the writer, or NULL on failure
+ */
+shimage_writer_t *shimage_writer_open(int dir_fd, const char *name)
+{
+    shimage_writer_t *ret = NULL;
+    shimage_writer_t *writer = NULL;
+
+    writer = calloc(1, sizeof(shimage_writer_t));
+    if (NULL == writer)
+    {
+        log_error("Failed to alloc image writer.");
+        goto END;
+    }
+    writer->fd = -1;
+    if ((NULL == name) || (PATH_MAX <= snprintf(writer->tmp_name, sizeof(writer->tmp_name), "%s.tmp", name)))
+    {
+        log_error("Invalid image name passed.");
+        goto FAIL;
+    }
+    writer->buf = malloc(WAL_BUF_SIZE);
+    if (NULL == writer->buf)
+    {
+        log_error("Failed to alloc image buffer.");
+        goto FAIL;
+    }
+    writer->fd = openat(dir_fd, writer->tmp_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (-1 == writer->fd)
+    {
+        log_perror("image openat()");
+        goto FAIL;
+    }
+    writer->offset = SHIMAGE_HEADER_SIZE; // the header is written last, once the index is known
+    if (-1 == lseek(writer->fd, SHIMAGE_HEADER_SIZE, SEEK_SET))
+    {
+        log_perror("image lseek()");
+        goto FAIL;
+    }
+    writer->seed = *hash_process_seed();
+
+    ret = writer;
+    goto END;
+FAIL:
+    shimage_writer_abort(writer, dir_fd);
+END:
+    return ret;
+}
+
+/**
+ * @brief Adds a record. Keys must be unique.
+ *
+ * @param writer the writer
+ * @param key the key
+ * @param key_len length of the key
+ * @param value the value
+ * @param value_len length of the value
+ * @return returns 0 on success, or -1 on failure
+ */
+int shimage_writer_add(shimage_writer_t *writer, const void *key, size_t key_len, const void *value, size_t value_len)
+{
+    int ret = -1;
+    size_t record_len = WAL_RECORD_SIZE(key_len, value_len);
+    uint64_t *grown = NULL;
+    char *record = NULL;
+
+    if ((NULL == writer) || (NULL == key) || ((NULL == value) && (0 != value_len)) || (UINT32_MAX < key_len) ||
+        (UINT32_MAX < value_len))
+    {
+        log_error("Invalid image writer, key or value passed.");
+        goto END;
+    }
+
+    if (writer->num_entries == writer->slots_cap)
+    {
+        writer->slots_cap = (0 == writer->slots_cap) ? SHIMAGE_MIN_SLOTS : writer->slots_cap * 2;
+        grown = realloc(writer->slots, writer->slots_cap * 2 * sizeof(uint64_t));
+        if (NULL == grown)
+        {
+            log_error("Failed to grow image index.");
+            goto END;
+        }
+        writer->slots = grown;
+    }
+
+    if ((record_len > (WAL_BUF_SIZE - writer->buf_len)) && (0 != writer->buf_len))
+    {
+        if (-1 == wal_write_all(writer->fd, writer->buf, writer->buf_len))
+        {
+            goto END;
+        }
+        writer->buf_len = 0;
+    }
+    if (record_len > WAL_BUF_SIZE) // bigger than the whole buffer; encode it on its own
+    {
+        record = malloc(record_len);
+        if (NULL == record)
+        {
+            log_error("Failed to alloc image record.");
+            goto END;
+        }
+        wal_encode_record(record, WAL_OP_PUT, key, key_len, value, value_len);
+        if (-1 == wal_write_all(writer->fd, record, record_len))
+        {
+            goto END;
+        }
+    }
+    else
+    {
+        wal_encode_record(writer->buf + writer->buf_len, WAL_OP_PUT, key, key_len, value, value_len);
+        writer->buf_len += record_len;
+    }
+
+    writer->slots[writer->num_entries * 2] = hash_siphash13(key, key_len, &writer->seed);
+    writer->slots[(writer->num_entries * 2) + 1] = writer->offset;
+    writer->num_entries++;
+    writer->offset += record_len;
+
+    ret = 0;
+END:
+    free(record);
+    record = NULL;
+    return ret;
+}
+
+/**
+ * @brief Writes the index and header, makes the image durable and renames it over name. Frees the writer either way.
+ *
+ * @param writer the writer
+ * @param dir_fd the directory passed to shimage_writer_open()
+ * @param name the name passed to shimage_writer_open()
+ * @return returns 0 on success, or -1 on failure
+ */
+int shimage_writer_commit(shimage_writer_t *writer, int dir_fd, const char *name)
+{
+    int ret = -1;
+    char header[SHIMAGE_HEADER_SIZE] = {0};
+    char *index = NULL;
+    uint64_t index_slots = SHIMAGE_MIN_SLOTS;
+    uint64_t entry_index = 0;
+    uint64_t slot = 0;
+
+    if (NULL == writer)
+    {
+        log_error("Invalid image writer passed.");
+        goto END;
+    }
+    if ((0 != writer->buf_len) && (-1 == wal_write_all(writer->fd, writer->buf, writer->buf_len)))
+    {
+        goto FAIL;
+    }
+
+    while (index_slots < (writer->num_entries * 2)) // at most half full keeps probes short
+    {
+        index_slots *= 2;
+    }
+    index = calloc(index_slots, SHIMAGE_SLOT_SIZE);
+    if (NULL == index)
+    {
+        log_error("Failed to alloc image index.");
+        goto FAIL;
+    }
+    for (entry_index = 0; entry_index < writer->num_entries; entry_index++)
+    {
+        slot = writer->slots[entry_index * 2] & (index_slots - 1);
+        while (0 != shimage_get_u64(index + (slot * SHIMAGE_SLOT_SIZE) + 8))
+        {
+            slot = (slot + 1) & (index_slots - 1);
+        }
+        shimage_put_u64(index + (slot * SHIMAGE_SLOT_SIZE), writer->slots[entry_index * 2]);
+        shimage_put_u64(index + (slot * SHIMAGE_SLOT_SIZE) + 8, writer->slots[(entry_index * 2) + 1]);
+    }
+    if (-1 == wal_write_all(writer->fd, index, index_slots * SHIMAGE_SLOT_SIZE))
+    {
+        goto FAIL;
+    }
+
+    memcpy(header, SHIMAGE_MAGIC, 8);
+    shimage_put_u32(header + 8, SHIMAGE_VERSION);
+    shimage_put_u64(header + 16, writer->num_entries);
+    shimage_put_u64(header + 24, index_slots);
+    shimage_put_u64(header + 32, writer->offset);
+    shimage_put_u64(header + 40, writer->offset + (index_slots * SHIMAGE_SLOT_SIZE));
+    shimage_put_u64(header + 48, writer->seed.k0);
+    shimage_put_u64(header + 56, writer->seed.k1);
+    shimage_put_u32(header + 12, wal_checksum(header, SHIMAGE_HEADER_SIZE));
+    if (SHIMAGE_HEADER_SIZE != pwrite(writer->fd, header, SHIMAGE_HEADER_SIZE, 0))
+    {
+        log_perror("image pwrite()");
+        goto FAIL;
+    }
+    if (-1 == wal_install_file(dir_fd, writer->fd, writer->tmp_name, name))
+    {
+        goto FAIL;
+    }
+
+    close(writer->fd);
+    writer->fd = -1;
+    free(writer->buf);
+    free(writer->slots);
+    free(writer);
+    writer = NULL;
+    ret = 0;
+    goto END;
+FAIL:
+    shimage_writer_abort(writer, dir_fd);
+END:
+    free(index);
+    index = NULL;
+    return ret;
+}
+
+/**
+ * @brief Drops a half written image and frees the writer.
+ *
+ * @param writer the writer
+ * @param dir_fd the directory passed to shimage_writer_open()
+ */
+void shimage_writer_abort(shimage_writer_t *writer, int dir_fd)
+{
+    if (NULL != writer)
+    {
+        if (-1 != writer->fd)
+        {
+            close(writer->fd);
+            unlinkat(dir_fd, writer->tmp_name, 0);
+        }
+        free(writer->buf);
+        free(writer->slots);
+        free(writer);
+        writer = NULL;
+    }
+}
+
+/*** end of file ***/
@@ -0,0 +1,163 @@
+#ifndef SHIMAGE_H
+#define SHIMAGE_H
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "hashes.h"
+#include "wal.h"
+
+#define SHIMAGE_MAGIC "SHTIMAGE" // 8 bytes, no terminator on disk
+#define SHIMAGE_VERSION 1
+#define SHIMAGE_HEADER_SIZE 64 // records start right after the header
+#define SHIMAGE_SLOT_SIZE 16   // index slot: u64 hash, u64 record offset (0 = empty)
+#define SHIMAGE_MIN_SLOTS 16
+
+/*
+ * On-disk layout, all integers little-endian:
+ *
+ *   0   magic[8] "SHTIMAGE"
+ *   8   u32 version
+ *   12  u32 header crc32c, computed with this field zeroed
+ *   16  u64 num_entries
+ *   24  u64 index_slots (a power of two)
+ *   32  u64 index_offset
+ *   40  u64 file_size
+ *   48  u64 seed k0, u64 seed k1: the SipHash-1-3 key the index was built with
+ *   64  records, each encoded like a log record (crc32c, key_len, value_len, op, key, value)
+ *   index_offset: index_slots slots, open addressing with linear probing
+ *
+ * Opening checks only the header, so it costs the same for any size. Each record carries its own checksum, verified
+ * when a lookup reaches it.
+ */
+
+/**
+ * @brief called by shimage_foreach() for each record
+ *
+ * @return 0 to keep going, anything else to stop
+ */
+typedef int (*shimage_visit_func)(const void *key, size_t key_len, const void *value, size_t value_len, void *arg);
+
+/**
+ * @brief a table image mapped read-only. Pages fault in as lookups touch them, so resident memory follows the keys
+ * actually read, and the mapping stays valid after a newer image is renamed over the file.
+ */
+typedef struct shimage
+{
+    const char *map;
+    size_t map_len;
+    const char *index;
+    uint64_t num_entries;
+    uint64_t index_mask;
+    uint64_t index_offset;
+    hash_seed_t seed;
+} shimage_t;
+
+/**
+ * @brief an image being written: records stream out through buf, and their hashes and offsets are kept to build the
+ * index once the last record is in
+ */
+typedef struct shimage_writer
+{
+    int fd;
+    char *buf;
+    size_t buf_len;
+    uint64_t offset; // file offset of the next record
+    uint64_t *slots; // hash, offset pairs in record order
+    size_t num_entries;
+    size_t slots_cap;
+    hash_seed_t seed;
+    char tmp_name[PATH_MAX];
+} shimage_writer_t;
+
+/**
+ * @brief Maps an image and checks its header.
+ *
+ * @param dir_fd directory holding the image (an O_PATH fd is fine)
+ * @param name the image's file name
+ * @param image receives the image, or NULL if there is no such file
+ * @return returns 0 on success (including a missing file), or -1 if the file could not be mapped or is not a valid
+ * image
+ */
+int shimage_open(int dir_fd, const char *name, shimage_t **image);
+
+/**
+ * @brief Looks a key up in place.
+ *
+ * @param image the image
+ * @param key the key
+ * @param key_len length of the key
+ * @param value receives a pointer to the value inside the mapping; may be NULL
+ * @param value_len receives the value's length; may be NULL
+ * @return returns 0 if the key is in the image, or -1 if it is not (or its record is corrupt)
+ */
+int shimage_lookup(const shimage_t *image, const void *key, size_t key_len, const char **value, size_t *value_len);
+
+/**
+ * @brief Calls visit for every record in the image.
+ *
+ * @param image the image
+ * @param visit the visitor
+ * @param arg passed through to visit
+ * @return returns 0 on success, 1 if visit stopped the walk, or -1 if a record is corrupt
+ */
+int shimage_foreach(const shimage_t *image, shimage_visit_func visit, void *arg);
+
+/**
+ * @brief Unmaps an image.
+ *
+ * @param image the image
+ */
+void shimage_close(shimage_t *image);
+
+/**
+ * @brief Starts writing an image as name.tmp under dir_fd.
+ *
+ * @param dir_fd directory to write the image in (an O_PATH fd is fine)
+ * @param name the image's file name
+ * @return the writer, or NULL on failure
+ */
+shimage_writer_t *shimage_writer_open(int dir_fd, const char *name);
+
+/**
+ * @brief Adds a record. Keys must be unique.
+ *
+ * @param writer the writer
+ * @param key the key
+ * @param key_len length of the key
+ * @param value the value
+ * @param value_len length of the value
+ * @return returns 0 on success, or -1 on failure
+ */
+int shimage_writer_add(shimage_writer_t *writer, const void *key, size_t key_len, const void *value, size_t value_len);
+
+/**
+ * @brief Writes the index and header, makes the image durable and renames it over name. Frees the writer either way.
+ *
+ * @param writer the writer
+ * @param dir_fd the directory passed to shimage_writer_open()
+ * @param name the name passed to shimage_writer_open()
+ * @return returns 0 on success, or -1 on failure
+ */
+int shimage_writer_commit(shimage_writer_t *writer, int dir_fd, const char *name);
+
+/**
+ * @brief Drops a half written image and frees the writer.
+ *
+ * @param writer the writer
+ * @param dir_fd the directory passed to shimage_writer_open()
+ */
+void shimage_writer_abort(shimage_writer_t *writer, int dir_fd);
+
+#endif
+
+/*** end of file ***/
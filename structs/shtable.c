@@ -0,0 +1,1181 @@
+#include "../include/shtable.h"
+
+/**
+ * @brief Picks the shard for a hash from its top bits.
+ *
+ * @param table the table
+ * @param hash the key's hash
+ * @return the shard
+ */
+static sh_shard_t *sh_shard_for(shtable_t *table, uint64_t hash)
+{
+    return &table->shards[hash >> (64 - SHTABLE_SHARD_BITS)];
+}
+
+/**
+ * @brief The control byte a full slot gets for a hash.
+ */
+static inline uint8_t sh_ctrl_byte(uint64_t hash)
+{
+    return (uint8_t)(hash & 0x7f);
+}
+
+/**
+ * @brief Compares every control byte in a group with byte.
+ *
+ * @param ctrl the group's first control byte; aligned to SHTABLE_GROUP_WIDTH
+ * @param byte the control byte to look for
+ * @return a bitmask with bit i set when slot i of the group matches
+ */
+static inline uint32_t sh_group_match(const uint8_t *ctrl, uint8_t byte)
+{
+#ifdef __SSE2__
+    return (uint32_t)_mm_movemask_epi8(
+        _mm_cmpeq_epi8(_mm_load_si128((const __m128i *)ctrl), _mm_set1_epi8((char)byte)));
+#else
+    uint32_t ret = 0;
+    int index = 0;
+
+    for (index = 0; index < SHTABLE_GROUP_WIDTH; index++)
+    {
+        if (byte == __atomic_load_n(&ctrl[index], __ATOMIC_RELAXED))
+        {
+            ret |= 1U << index;
+        }
+    }
+    return ret;
+#endif
+}
+
+/**
+ * @brief Finds the slots of a group that are empty or tombstones, the two control bytes with the high bit set.
+ *
+ * @param ctrl the group's first control byte; aligned to SHTABLE_GROUP_WIDTH
+ * @return a bitmask with bit i set when slot i of the group is free
+ */
+static inline uint32_t sh_group_match_free(const uint8_t *ctrl)
+{
+#ifdef __SSE2__
+    return (uint32_t)_mm_movemask_epi8(_mm_load_si128((const __m128i *)ctrl));
+#else
+    uint32_t ret = 0;
+    int index = 0;
+
+    for (index = 0; index < SHTABLE_GROUP_WIDTH; index++)
+    {
+        if (0x80 & __atomic_load_n(&ctrl[index], __ATOMIC_RELAXED))
+        {
+            ret |= 1U << index;
+        }
+    }
+    return ret;
+#endif
+}
+
+/**
+ * @brief Allocates a layout with every slot empty.
+ *
+ * @param num_slots number of slots; a power of two, at least SHTABLE_GROUP_WIDTH
+ * @return the layout, or NULL on failure
+ */
+static sh_layout_t *sh_layout_new(size_t num_slots)
+{
+    sh_layout_t *ret = NULL;
+    size_t index = 0;
+
+    // ctrl groups are loaded with aligned SIMD loads, so calloc() is not enough here
+    if (0 != posix_memalign((void **)&ret, CACHE_LINE_SIZE,
+                            sizeof(sh_layout_t) + num_slots + (num_slots * sizeof(ret->slots[0]))))
+    {
+        log_error("Failed to alloc table slots.");
+        ret = NULL;
+        goto END;
+    }
+    ret->mask = num_slots - 1;
+    atomic_init(&ret->prev, NULL);
+    memset(ret->ctrl, SH_CTRL_EMPTY, num_slots);
+    ret->slots = (_Atomic(sh_entry_t *) *)(ret->ctrl + num_slots);
+    for (index = 0; index < num_slots; index++)
+    {
+        atomic_init(&ret->slots[index], NULL);
+    }
+
+END:
+    return ret;
+}
+
+/**
+ * @brief Allocates an entry holding copies of the key and value.
+ *
+ * @return the entry, or NULL on failure
+ */
+static sh_entry_t *sh_entry_new(uint64_t hash, const void *key, size_t key_len, const void *value, size_t value_len)
+{
+    sh_entry_t *ret = NULL;
+
+    ret = malloc(sizeof(sh_entry_t) + key_len + value_len);
+    if (NULL == ret)
+    {
+        log_error("Failed to alloc table entry.");
+        goto END;
+    }
+    ret->hash = hash;
+    ret->key_len = (uint32_t)key_len;
+    ret->value_len = (uint32_t)value_len;
+    memcpy(ret->data, key, key_len);
+    if (0 != value_len)
+    {
+        memcpy(ret->data + key_len, value, value_len);
+    }
+
+END:
+    return ret;
+}
+
+/**
+ * @brief Finds the slot holding a key. Probes whole groups, triangular steps from the group picked by the hash, and
+ * stops at the first group with an empty slot. Safe for lock-free readers inside an epoch read section: a control
+ * byte match is only a hint, and the entry's full hash and key decide.
+ *
+ * @param layout the shard's layout
+ * @param hash the key's hash
+ * @param key the key
+ * @param key_len length of the key
+ * @return the slot index, or -1 if the key is not in the layout
+ */
+static ssize_t sh_find(sh_layout_t *layout, uint64_t hash, const void *key, size_t key_len)
+{
+    ssize_t ret = -1;
+    size_t group_mask = (layout->mask + 1) / SHTABLE_GROUP_WIDTH - 1;
+    size_t group = (hash >> 7) & group_mask;
+    size_t step = 0;
+    size_t slot = 0;
+    uint32_t matches = 0;
+    uint8_t ctrl = sh_ctrl_byte(hash);
+    sh_entry_t *entry = NULL;
+
+    for (step = 0; step <= group_mask; step++)
+    {
+        matches = sh_group_match(&layout->ctrl[group * SHTABLE_GROUP_WIDTH], ctrl);
+        atomic_thread_fence(memory_order_acquire); // slot pointers are read after the control bytes that led to them
+        while (0 != matches)
+        {
+            slot = (group * SHTABLE_GROUP_WIDTH) + (size_t)__builtin_ctz(matches);
+            matches &= matches - 1;
+            entry = atomic_load_explicit(&layout->slots[slot], memory_order_acquire);
+            if ((NULL != entry) && (entry->hash == hash) && (entry->key_len == key_len) &&
+                (0 == memcmp(entry->data, key, key_len)))
+            {
+                ret = (ssize_t)slot;
+                goto END;
+            }
+        }
+        if (0 != sh_group_match(&layout->ctrl[group * SHTABLE_GROUP_WIDTH], SH_CTRL_EMPTY))
+        {
+            goto END;
+        }
+        group = (group + step + 1) & group_mask;
+    }
+
+END:
+    return ret;
+}
+
+/**
+ * @brief Finds a key's entry in one layout. For lock-free readers; the entry may be gone by the time it is loaded.
+ *
+ * @return the entry, or NULL if the key is not in the layout
+ */
+static sh_entry_t *sh_lookup(sh_layout_t *layout, uint64_t hash, const void *key, size_t key_len)
+{
+    sh_entry_t *ret = NULL;
+    ssize_t slot = sh_find(layout, hash, key, key_len);
+
+    if (-1 != slot)
+    {
+        ret = atomic_load_explicit(&layout->slots[slot], memory_order_acquire);
+    }
+    return ret;
+}
+
+/**
+ * @brief Finds the first empty or tombstone slot on a hash's probe sequence. The load limit guarantees there is one.
+ * Caller holds the shard lock.
+ *
+ * @param layout the shard's layout
+ * @param hash the key's hash
+ * @return the slot index
+ */
+static size_t sh_find_free(sh_layout_t *layout, uint64_t hash)
+{
+    size_t group_mask = (layout->mask + 1) / SHTABLE_GROUP_WIDTH - 1;
+    size_t group = (hash >> 7) & group_mask;
+    size_t step = 0;
+    uint32_t free_slots = 0;
+
+    for (step = 0;; step++)
+    {
+        free_slots = sh_group_match_free(&layout->ctrl[group * SHTABLE_GROUP_WIDTH]);
+        if (0 != free_slots)
+        {
+            break;
+        }
+        group = (group + step + 1) & group_mask;
+    }
+
+    return (group * SHTABLE_GROUP_WIDTH) + (size_t)__builtin_ctz(free_slots);
+}
+
+/**
+ * @brief Publishes an entry in a free slot: the slot pointer first, then the control byte that leads readers to it.
+ * Caller holds the shard lock.
+ */
+static void sh_slot_fill(sh_layout_t *layout, size_t slot, sh_entry_t *entry)
+{
+    atomic_store_explicit(&layout->slots[slot], entry, memory_order_release);
+    __atomic_store_n(&layout->ctrl[slot], sh_ctrl_byte(entry->hash), __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Turns a full slot into a tombstone. Caller holds the shard lock.
+ */
+static void sh_slot_clear(sh_layout_t *layout, size_t slot)
+{
+    atomic_store_explicit(&layout->slots[slot], NULL, memory_order_release);
+    __atomic_store_n(&layout->ctrl[slot], SH_CTRL_DELETED, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Moves up to max_slots slots of a running resize from the old layout into the current one, and retires the
+ * old layout once it is empty. Each entry is published in the new layout before it is cleared from the old one, so a
+ * reader that checks the old layout first always finds it. Caller holds the shard lock.
+ *
+ * @param shard the shard
+ * @param max_slots number of old slots to move; SIZE_MAX finishes the resize
+ */
+static void sh_shard_migrate(sh_shard_t *shard, size_t max_slots)
+{
+    sh_layout_t *layout = atomic_load_explicit(&shard->layout, memory_order_relaxed);
+    sh_layout_t *old_layout = atomic_load_explicit(&layout->prev, memory_order_relaxed);
+    sh_entry_t *entry = NULL;
+
+    if (NULL == old_layout)
+    {
+        goto END;
+    }
+
+    for (; (0 != max_slots) && (shard->migrate_pos <= old_layout->mask); max_slots--, shard->migrate_pos++)
+    {
+        entry = atomic_load_explicit(&old_layout->slots[shard->migrate_pos], memory_order_relaxed);
+        if (NULL != entry) // growth_left was charged for it when the resize started
+        {
+            sh_slot_fill(layout, sh_find_free(layout, entry->hash), entry);
+            sh_slot_clear(old_layout, shard->migrate_pos);
+        }
+    }
+
+    if (shard->migrate_pos > old_layout->mask)
+    {
+        atomic_store_explicit(&layout->prev, NULL, memory_order_release);
+        shard->migrate_pos = 0;
+        epoch_retire(old_layout, free);
+    }
+
+END:
+    return;
+}
+
+/**
+ * @brief Starts a resize once a shard's load limit is used up. The new layout is published at once, empty and pointing
+ * at the old one; writers then move SHTABLE_MIGRATE_SLOTS old slots per operation. The new layout doubles when live
+ * entries and delete markers would fill more than half of its load limit, and otherwise keeps its size and only drops
+ * tombstones. Either way it holds at least 7/16 of its slots in spare room, which outlasts the migration. Caller holds
+ * the shard lock.
+ *
+ * @param shard the shard to resize
+ * @return returns 0 on success, or -1 on failure (the shard is left as it was)
+ */
+static int sh_shard_resize(sh_shard_t *shard)
+{
+    int ret = -1;
+    sh_layout_t *old_layout = NULL;
+    sh_layout_t *new_layout = NULL;
+    size_t count = atomic_load_explicit(&shard->count, memory_order_relaxed) + shard->num_markers; // slots to move
+    size_t num_slots = 0;
+
+    sh_shard_migrate(shard, SIZE_MAX); // only when writes outran the previous resize, which the room above prevents
+    old_layout = atomic_load_explicit(&shard->layout, memory_order_relaxed);
+    num_slots = old_layout->mask + 1;
+    if ((count * SHTABLE_MAX_LOAD_DEN * 2) >= (num_slots * SHTABLE_MAX_LOAD_NUM))
+    {
+        num_slots *= 2;
+    }
+    new_layout = sh_layout_new(num_slots);
+    if (NULL == new_layout)
+    {
+        goto END;
+    }
+
+    atomic_store_explicit(&new_layout->prev, old_layout, memory_order_relaxed); // published with the layout
+    atomic_store_explicit(&shard->layout, new_layout, memory_order_release);
+    shard->growth_left = ((num_slots * SHTABLE_MAX_LOAD_NUM) / SHTABLE_MAX_LOAD_DEN) - count;
+    shard->migrate_pos = 0;
+
+    ret = 0;
+END:
+    return ret;
+}
+
+/**
+ * @brief Finds a key in the current layout of a shard, or in the layout it is migrating from. Caller holds the shard
+ * lock.
+ *
+ * @param shard the shard
+ * @param hash the key's hash
+ * @param key the key
+ * @param key_len length of the key
+ * @param layout receives the layout holding the key
+ * @return the slot index, or -1 if the key is not in the shard
+ */
+static ssize_t sh_shard_find(sh_shard_t *shard, uint64_t hash, const void *key, size_t key_len,
+                             sh_layout_t **layout)
+{
+    ssize_t ret = -1;
+    sh_layout_t *old_layout = NULL;
+
+    *layout = atomic_load_explicit(&shard->layout, memory_order_relaxed);
+    ret = sh_find(*layout, hash, key, key_len);
+    if (-1 != ret)
+    {
+        goto END;
+    }
+
+    old_layout = atomic_load_explicit(&(*layout)->prev, memory_order_relaxed);
+    if (NULL != old_layout)
+    {
+        ret = sh_find(old_layout, hash, key, key_len);
+        *layout = old_layout;
+    }
+
+END:
+    return ret;
+}
+
+/**
+ * @brief Whether an entry is a delete marker: an entry that hides a key deleted from the table's image.
+ */
+static inline int sh_is_delete_marker(const sh_entry_t *entry)
+{
+    return (SH_DELETE_MARKER == entry->value_len) ? 1 : 0;
+}
+
+/**
+ * @brief Whether the table's image holds a key. The image never changes, so this needs no lock.
+ */
+static int sh_image_has(shtable_t *table, const void *key, size_t key_len)
+{
+    return ((NULL != table->image) && (0 == shimage_lookup(table->image, key, key_len, NULL, NULL))) ? 1 : 0;
+}
+
+/**
+ * @brief Makes room for a new key in a shard, starting a resize if its load limit is used up. Caller holds the shard
+ * lock.
+ *
+ * @return returns 0 on success, or -1 on failure
+ */
+static int sh_shard_reserve(sh_shard_t *shard)
+{
+    return (0 == shard->growth_left) ? sh_shard_resize(shard) : 0;
+}
+
+/**
+ * @brief Publishes entry as its key's entry, retiring the one it replaces. Caller holds the shard lock; layout and
+ * slot are what sh_shard_find() returned for the key, and a new key (slot -1) must have had room reserved.
+ *
+ * @param shard the shard
+ * @param layout the layout holding the key's current entry
+ * @param slot the current entry's slot, or -1 for a new key
+ * @param entry the new entry
+ */
+static void sh_shard_store(sh_shard_t *shard, sh_layout_t *layout, ssize_t slot, sh_entry_t *entry)
+{
+    sh_layout_t *new_layout = atomic_load_explicit(&shard->layout, memory_order_relaxed);
+    sh_entry_t *current = NULL;
+    size_t free_slot = 0;
+
+    if (-1 == slot)
+    {
+        free_slot = sh_find_free(new_layout, entry->hash);
+        if (SH_CTRL_EMPTY == new_layout->ctrl[free_slot]) // reusing a tombstone does not use up the load limit
+        {
+            shard->growth_left--;
+        }
+        sh_slot_fill(new_layout, free_slot, entry);
+        goto END;
+    }
+
+    current = atomic_load_explicit(&layout->slots[slot], memory_order_relaxed);
+    if (layout == new_layout)
+    {
+        // replace in place; the control byte already matches
+        atomic_store_explicit(&layout->slots[slot], entry, memory_order_release);
+    }
+    else
+    {
+        // not migrated yet: the new entry goes straight to the new layout, which was charged for it
+        sh_slot_fill(new_layout, sh_find_free(new_layout, entry->hash), entry);
+        sh_slot_clear(layout, (size_t)slot);
+    }
+    epoch_retire(current, free);
+
+END:
+    return;
+}
+
+/**
+ * @brief Finds a key's entry without a lock. Caller is inside an epoch read section.
+ *
+ * @return the entry (possibly a delete marker), or NULL if the key has none
+ */
+static sh_entry_t *sh_shard_lookup(sh_shard_t *shard, uint64_t hash, const void *key, size_t key_len)
+{
+    sh_layout_t *layout = NULL;
+    sh_layout_t *old_layout = NULL;
+    sh_entry_t *ret = NULL;
+
+    do
+    {
+        // a key being migrated is published in the new layout before it leaves the old one, so check the old first
+        layout = atomic_load_explicit(&shard->layout, memory_order_acquire);
+        old_layout = atomic_load_explicit(&layout->prev, memory_order_acquire);
+        ret = (NULL == old_layout) ? NULL : sh_lookup(old_layout, hash, key, key_len);
+        if (NULL == ret)
+        {
+            ret = sh_lookup(layout, hash, key, key_len);
+        }
+        // a miss may mean a resize started after layout was loaded and moved the key on; look again if so
+    } while ((NULL == ret) && (layout != atomic_load_explicit(&shard->layout, memory_order_acquire)));
+
+    return ret;
+}
+
+/**
+ * @brief Copies a key read from the image into memory, unless a writer got to the key first or a snapshot is running.
+ * Not logged: the image already holds it.
+ */
+static void sh_promote(shtable_t *table, uint64_t hash, const void *key, size_t key_len, const void *value,
+                       size_t value_len)
+{
+    ssize_t slot = -1;
+    sh_shard_t *shard = sh_shard_for(table, hash);
+    sh_layout_t *layout = NULL;
+    sh_entry_t *entry = NULL;
+
+    entry = sh_entry_new(hash, key, key_len, value, value_len);
+    if (NULL == entry)
+    {
+        goto END;
+    }
+
+    pthread_mutex_lock(&shard->lock);
+    sh_shard_migrate(shard, SHTABLE_MIGRATE_SLOTS);
+    slot = sh_shard_find(shard, hash, key, key_len, &layout);
+    // checked under the shard lock, which the snapshot takes after raising the count: a key promoted after its shard
+    // was copied would be skipped by the image pass too, and with promotion unlogged the compaction would lose it
+    if ((-1 == slot) && (0 == atomic_load_explicit(&table->snapshots, memory_order_relaxed)) &&
+        (0 == sh_shard_reserve(shard)))
+    {
+        sh_shard_store(shard, layout, slot, entry);
+        atomic_fetch_add_explicit(&shard->count, 1, memory_order_relaxed);
+        atomic_fetch_sub_explicit(&table->image_live, 1, memory_order_relaxed);
+        entry = NULL;
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+END:
+    free(entry); // the key was written or deleted since it was read, or a snapshot is running
+    entry = NULL;
+}
+
+/**
+ * @brief what sh_visit_image_entry() passes the entries it does not skip to
+ */
+typedef struct sh_image_visit
+{
+    shtable_t *table;
+    sh_visit_func visit;
+    void *arg;
+} sh_image_visit_t;
+
+/**
+ * @brief A shimage_visit_func that skips image entries hidden by an entry in memory and passes the rest on.
+ */
+static int sh_visit_image_entry(const void *key, size_t key_len, const void *value, size_t value_len, void *arg)
+{
+    int ret = 0;
+    sh_image_visit_t *image_visit = arg;
+    uint64_t hash = image_visit->table->hash(key, key_len, &image_visit->table->seed);
+    sh_entry_t *entry = NULL;
+
+    if (-1 == epoch_enter())
+    {
+        ret = 1;
+        goto END;
+    }
+    entry = sh_shard_lookup(sh_shard_for(image_visit->table, hash), hash, key, key_len);
+    epoch_exit();
+
+    if (NULL == entry)
+    {
+        ret = image_visit->visit(key, key_len, value, value_len, image_visit->arg);
+    }
+
+END:
+    return ret;
+}
+
+/**
+ * @brief Creates an empty sharded table.
+ *
+ * @param hash the key hash function (hash_siphash13, hash_wyhash), or NULL for SHTABLE_DEFAULT_HASH. It is keyed with
+ * the per-process random seed.
+ * @return returns the table, or NULL on failure
+ */
+shtable_t *create_shtable(sh_hash_func hash)
+{
+    shtable_t *ret = NULL;
+    shtable_t *table = NULL;
+    int shard_index = 0;
+    int num_locks = 0;
+
+    // shards are cache line aligned, so calloc() is not enough here
+    if (0 != posix_memalign((void **)&table, CACHE_LINE_SIZE, sizeof(shtable_t)))
+    {
+        log_error("Failed to alloc table.");
+        table = NULL;
+        goto END;
+    }
+    memset(table, 0, sizeof(shtable_t));
+    table->hash = (NULL == hash) ? SHTABLE_DEFAULT_HASH : hash;
+    table->seed = *hash_process_seed();
+    atomic_init(&table->image_live, 0);
+    atomic_init(&table->snapshots, 0);
+
+    for (shard_index = 0; shard_index < SHTABLE_SHARDS; shard_index++)
+    {
+        if (0 != pthread_mutex_init(&table->shards[shard_index].lock, NULL))
+        {
+            log_error("Error initializing shard mutex.");
+            goto FAIL;
+        }
+        num_locks++;
+        atomic_init(&table->shards[shard_index].count, 0);
+        atomic_init(&table->shards[shard_index].layout, sh_layout_new(SHTABLE_MIN_SLOTS));
+        if (NULL == atomic_load(&table->shards[shard_index].layout))
+        {
+            goto FAIL;
+        }
+        table->shards[shard_index].growth_left = (SHTABLE_MIN_SLOTS * SHTABLE_MAX_LOAD_NUM) / SHTABLE_MAX_LOAD_DEN;
+    }
+
+    ret = table;
+    goto END;
+
+FAIL:
+    for (shard_index = 0; shard_index < num_locks; shard_index++)
+    {
+        free(atomic_load(&table->shards[shard_index].layout));
+        pthread_mutex_destroy(&table->shards[shard_index].lock);
+    }
+    free(table);
+    table = NULL;
+
+END:
+    return ret;
+}
+
+/**
+ * @brief Makes a table durable: from now on every put and delete is logged to wal before it returns, as durably as
+ * the log's sync policy promises. Replay the log into the table with shtable_apply_wal() first.
+ *
+ * @param table the table
+ * @param wal the log; it must outlive the table's writers
+ * @return returns 0 on success, or -1 on failure
+ */
+int shtable_attach_wal(shtable_t *table, wal_t *wal)
+{
+    int ret = -1;
+
+    if ((NULL == table) || (NULL == wal))
+    {
+        log_error("Invalid table or WAL passed.");
+        goto END;
+    }
+    table->wal = wal;
+
+    ret = 0;
+END:
+    return ret;
+}
+
+/**
+ * @brief A wal_apply_func that replays a logged put or delete into the shtable_t passed as arg.
+ *
+ * @return returns 0 on success, or -1 on failure
+ */
+int shtable_apply_wal(uint8_t op, const void *key, size_t key_len, const void *value, size_t value_len, void *arg)
+{
+    int ret = -1;
+
+    switch (op)
+    {
+    case WAL_OP_PUT:
+        ret = shtable_put(arg, key, key_len, value, value_len);
+        break;
+    case WAL_OP_DELETE:
+        shtable_delete(arg, key, key_len); // a delete logged for a key that is already gone is not an error
+        ret = 0;
+        break;
+    default:
+        log_error("Unknown WAL op %u.", op);
+        break;
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Maps a table to an image of its earlier contents, loaded with shimage_open(). Keys are then read from the
+ * image in place and copied into memory the first time they are read, so opening costs the same for any image and
+ * memory holds only the keys in use. Attach before replaying the log and before any other use. The table owns the
+ * image from then on.
+ *
+ * @param table the table, still empty
+ * @param image the image
+ * @return returns 0 on success, or -1 on failure
+ */
+int shtable_attach_image(shtable_t *table, shimage_t *image)
+{
+    int ret = -1;
+
+    if ((NULL == table) || (NULL == image) || (NULL != table->image) || (0 != shtable_count(table)))
+    {
+        log_error("Invalid table or image passed.");
+        goto END;
+    }
+    table->image = image;
+    atomic_store_explicit(&table->image_live, image->num_entries, memory_order_relaxed);
+
+    ret = 0;
+END:
+    return ret;
+}
+
+/**
+ * @brief Inserts a key, or replaces its value if it is already in the table. The key and value are copied. The new
+ * entry is fully built before it is published with a release store, so lock-free readers see either the old value or
+ * the new one, never a mix.
+ *
+ * @param table the table
+ * @param key the key
+ * @param key_len length of the key
+ * @param value the value
+ * @param value_len length of the value
+ * @return returns 0 on success, or -1 on failure
+ */
+int shtable_put(shtable_t *table, const void *key, size_t key_len, const void *value, size_t value_len)
+{
+    int ret = -1;
+    uint64_t hash = 0;
+    ssize_t slot = -1;
+    sh_shard_t *shard = NULL;
+    sh_layout_t *layout = NULL;
+    sh_entry_t *entry = NULL;
+    uint64_t lsn = 0;
+
+    if ((NULL == table) || (NULL == key) || ((NULL == value) && (0 != value_len)) || (UINT32_MAX < key_len) ||
+        (SH_DELETE_MARKER <= value_len))
+    {
+        log_error("Invalid table, key or value passed.");
+        goto END;
+    }
+
+    hash = table->hash(key, key_len, &table->seed);
+    entry = sh_entry_new(hash, key, key_len, value, value_len); // built outside the lock
+    if (NULL == entry)
+    {
+        goto END;
+    }
+
+    shard = sh_shard_for(table, hash);
+    pthread_mutex_lock(&shard->lock);
+    sh_shard_migrate(shard, SHTABLE_MIGRATE_SLOTS);
+    slot = sh_shard_find(shard, hash, key, key_len, &layout);
+    if ((-1 == slot) && (-1 == sh_shard_reserve(shard)))
+    {
+        goto UNLOCK;
+    }
+    // logged under the shard lock, so the log orders writes to a key the way the table applied them
+    if ((NULL != table->wal) && (-1 == wal_append(table->wal, WAL_OP_PUT, key, key_len, value, value_len, &lsn)))
+    {
+        goto UNLOCK;
+    }
+
+    if (-1 == slot)
+    {
+        if (1 == sh_image_has(table, key, key_len)) // from now on the entry in memory hides the image's
+        {
+            atomic_fetch_sub_explicit(&table->image_live, 1, memory_order_relaxed);
+        }
+        atomic_fetch_add_explicit(&shard->count, 1, memory_order_relaxed);
+    }
+    else if (1 == sh_is_delete_marker(atomic_load_explicit(&layout->slots[slot], memory_order_relaxed)))
+    {
+        atomic_fetch_add_explicit(&shard->count, 1, memory_order_relaxed);
+        shard->num_markers--;
+    }
+    sh_shard_store(shard, layout, slot, entry);
+    entry = NULL;
+
+UNLOCK:
+    pthread_mutex_unlock(&shard->lock);
+    if (NULL != entry) // not published
+    {
+        free(entry);
+        entry = NULL;
+        goto END;
+    }
+
+    metrics_add(METRIC_TABLE_PUTS, 1);
+
+    // the group commit wait happens outside the shard lock so other writers to the shard can join the batch
+    if ((NULL != table->wal) && (-1 == wal_sync(table->wal, lsn)))
+    {
+        goto END;
+    }
+
+    ret = 0;
+END:
+    return ret;
+}
+
+/**
+ * @brief Looks up a key without taking a lock and copies its value out. A key found only in the image is read in
+ * place and then promoted into memory.
+ *
+ * @param table the table
+ * @param key the key
+ * @param key_len length of the key
+ * @param buf buffer receiving the value; at most buf_len bytes are copied
+ * @param buf_len size of buf
+ * @return returns the full length of the value (which may exceed buf_len), or -1 if the key is not in the table
+ */
+ssize_t shtable_get(shtable_t *table, const void *key, size_t key_len, void *buf, size_t buf_len)
+{
+    ssize_t ret = -1;
+    uint64_t hash = 0;
+    sh_entry_t *entry = NULL;
+    const char *image_value = NULL;
+    size_t image_value_len = 0;
+
+    if ((NULL == table) || (NULL == key) || ((NULL == buf) && (0 != buf_len)))
+    {
+        log_error("Invalid table or key passed.");
+        goto END;
+    }
+
+    hash = table->hash(key, key_len, &table->seed);
+    if (-1 == epoch_enter())
+    {
+        goto END;
+    }
+
+    entry = sh_shard_lookup(sh_shard_for(table, hash), hash, key, key_len);
+    if (NULL != entry)
+    {
+        if (0 == sh_is_delete_marker(entry))
+        {
+            memcpy(buf, entry->data + entry->key_len, (entry->value_len < buf_len) ? entry->value_len : buf_len);
+            ret = entry->value_len;
+        }
+    }
+    else if ((NULL != table->image) &&
+             (0 == shimage_lookup(table->image, key, key_len, &image_value, &image_value_len)))
+    {
+        memcpy(buf, image_value, (image_value_len < buf_len) ? image_value_len : buf_len);
+        ret = (ssize_t)image_value_len;
+    }
+
+    epoch_exit();
+    metrics_add((-1 == ret) ? METRIC_TABLE_GET_MISSES : METRIC_TABLE_GET_HITS, 1);
+
+    if (NULL != image_value)
+    {
+        sh_promote(table, hash, key, key_len, image_value, image_value_len);
+    }
+
+END:
+    return ret;
+}
+
+/**
+ * @brief Removes a key from the table. The slot becomes a tombstone, and the entry is freed once no reader can still
+ * be on it. A key that is also in the image is replaced by a delete marker instead, which hides the image's entry.
+ *
+ * @param table the table
+ * @param key the key
+ * @param key_len length of the key
+ * @return returns 0 if the key was removed, or -1 if it was not in the table or the delete could not be logged
+ */
+int shtable_delete(shtable_t *table, const void *key, size_t key_len)
+{
+    int ret = -1;
+    int in_image = 0;
+    ssize_t slot = -1;
+    uint64_t hash = 0;
+    sh_shard_t *shard = NULL;
+    sh_layout_t *layout = NULL;
+    sh_entry_t *current = NULL;
+    sh_entry_t *marker = NULL;
+    uint64_t lsn = 0;
+
+    if ((NULL == table) || (NULL == key) || (UINT32_MAX < key_len))
+    {
+        log_error("Invalid table or key passed.");
+        goto END;
+    }
+
+    hash = table->hash(key, key_len, &table->seed);
+    if (NULL != table->image) // built outside the lock in case the key turns out to be in the image
+    {
+        marker = sh_entry_new(hash, key, key_len, NULL, 0);
+        if (NULL == marker)
+        {
+            goto END;
+        }
+        marker->value_len = SH_DELETE_MARKER;
+    }
+
+    shard = sh_shard_for(table, hash);
+    pthread_mutex_lock(&shard->lock);
+    sh_shard_migrate(shard, SHTABLE_MIGRATE_SLOTS);
+    slot = sh_shard_find(shard, hash, key, key_len, &layout);
+    current = (-1 == slot) ? NULL : atomic_load_explicit(&layout->slots[slot], memory_order_relaxed);
+    in_image = sh_image_has(table, key, key_len);
+    if (((NULL != current) && (1 == sh_is_delete_marker(current))) || ((NULL == current) && (0 == in_image)))
+    {
+        goto UNLOCK; // not in the table
+    }
+    if ((-1 == slot) && (-1 == sh_shard_reserve(shard)))
+    {
+        goto UNLOCK;
+    }
+    if ((NULL != table->wal) && (-1 == wal_append(table->wal, WAL_OP_DELETE, key, key_len, NULL, 0, &lsn)))
+    {
+        goto UNLOCK;
+    }
+
+    if (NULL == current) // only in the image
+    {
+        atomic_fetch_sub_explicit(&table->image_live, 1, memory_order_relaxed);
+    }
+    else
+    {
+        atomic_fetch_sub_explicit(&shard->count, 1, memory_order_relaxed);
+    }
+    if (1 == in_image)
+    {
+        sh_shard_store(shard, layout, slot, marker);
+        shard->num_markers++;
+        marker = NULL;
+    }
+    else
+    {
+        sh_slot_clear(layout, (size_t)slot);
+        epoch_retire(current, free);
+    }
+    metrics_add(METRIC_TABLE_DELETES, 1);
+    ret = 0;
+
+UNLOCK:
+    pthread_mutex_unlock(&shard->lock);
+    free(marker);
+    marker = NULL;
+
+    if ((0 == ret) && (NULL != table->wal) && (-1 == wal_sync(table->wal, lsn)))
+    {
+        ret = -1;
+    }
+
+END:
+    return ret;
+}
+
+/**
+ * @brief Counts the entries in the table. Exact when no writer is running.
+ *
+ * @param table the table
+ * @return the number of entries
+ */
+size_t shtable_count(shtable_t *table)
+{
+    size_t ret = 0;
+    int shard_index = 0;
+
+    if (NULL == table)
+    {
+        goto END;
+    }
+
+    for (shard_index = 0; shard_index < SHTABLE_SHARDS; shard_index++)
+    {
+        ret += atomic_load_explicit(&table->shards[shard_index].count, memory_order_relaxed);
+    }
+    ret += atomic_load_explicit(&table->image_live, memory_order_relaxed); // image keys not read, written or deleted
+
+END:
+    return ret;
+}
+
+/**
+ * @brief Calls visit for every entry, one shard at a time with that shard's writer lock held, so each shard is seen
+ * as a consistent whole, and then for the image's entries that nothing in memory hides. visit must not write to the
+ * table.
+ *
+ * @param table the table
+ * @param visit the visitor
+ * @param arg passed through to visit
+ * @return returns 0 on success, 1 if visit stopped the walk, or -1 on failure
+ */
+int shtable_foreach(shtable_t *table, sh_visit_func visit, void *arg)
+{
+    int ret = -1;
+    int shard_index = 0;
+    size_t index = 0;
+    sh_layout_t *layout = NULL;
+    sh_entry_t *entry = NULL;
+    sh_image_visit_t image_visit = {0};
+
+    if ((NULL == table) || (NULL == visit))
+    {
+        log_error("Invalid table or visitor passed.");
+        goto END;
+    }
+
+    ret = 0;
+    for (shard_index = 0; (shard_index < SHTABLE_SHARDS) && (0 == ret); shard_index++)
+    {
+        pthread_mutex_lock(&table->shards[shard_index].lock);
+        // a resize in progress splits the shard between the current layout and prev; each key is in one of them
+        for (layout = atomic_load_explicit(&table->shards[shard_index].layout, memory_order_relaxed);
+             (NULL != layout) && (0 == ret); layout = atomic_load_explicit(&layout->prev, memory_order_relaxed))
+        {
+            for (index = 0; (index <= layout->mask) && (0 == ret); index++)
+            {
+                entry = atomic_load_explicit(&layout->slots[index], memory_order_relaxed);
+                if ((NULL != entry) && (0 == sh_is_delete_marker(entry)) &&
+                    (0 != visit(entry->data, entry->key_len, entry->data + entry->key_len, entry->value_len, arg)))
+                {
+                    ret = 1;
+                }
+            }
+        }
+        pthread_mutex_unlock(&table->shards[shard_index].lock);
+    }
+
+    if ((0 == ret) && (NULL != table->image))
+    {
+        image_visit.table = table;
+        image_visit.visit = visit;
+        image_visit.arg = arg;
+        ret = shimage_foreach(table->image, sh_visit_image_entry, &image_visit);
+    }
+
+END:
+    return ret;
+}
+
+/**
+ * @brief A sh_visit_func that adds an entry to the image being written.
+ */
+static int sh_snapshot_add(const void *key, size_t key_len, const void *value, size_t value_len, void *arg)
+{
+    return (-1 == shimage_writer_add(arg, key, key_len, value, value_len)) ? 1 : 0;
+}
+
+/**
+ * @brief Writes a table's entries to a new image without stopping its writers, then drops the log records the image
+ * makes redundant. Each shard's slots are copied under its lock, which takes microseconds; the entries themselves are
+ * immutable and each shard's are written out inside their own epoch read section with no lock held, so the epoch
+ * keeps advancing and the snapshot holds back only one shard's retired entries at a time. The log position is read
+ * under the first shard's lock, so every write the snapshot misses is at or after it and survives the compaction;
+ * replaying the log over the image restores the table. Keys still only in the current image are carried over from it;
+ * reads do not promote image keys while it runs, so every image key is either in a shard's copy or carried over.
+ *
+ * @param table the table
+ * @param dir_fd directory to write the image in (an O_PATH fd is fine)
+ * @param name the image's file name; it is written as name.tmp and renamed into place
+ * @return returns the number of entries written, or -1 on failure
+ */
+ssize_t shtable_snapshot(shtable_t *table, int dir_fd, const char *name)
+{
+    ssize_t ret = -1;
+    shimage_writer_t *writer = NULL;
+    sh_entry_t **entries = NULL;
+    sh_entry_t **grown = NULL;
+    size_t entries_cap = 0;
+    size_t num_entries = 0;
+    size_t index = 0;
+    uint64_t snap_lsn = 0;
+    sh_shard_t *shard = NULL;
+    sh_layout_t *layout = NULL;
+    sh_entry_t *entry = NULL;
+    sh_image_visit_t image_visit = {0};
+    int shard_index = 0;
+    int counted = 0;
+
+    if ((NULL == table) || (NULL == name))
+    {
+        log_error("Invalid table or image name passed.");
+        goto END;
+    }
+    writer = shimage_writer_open(dir_fd, name);
+    if (NULL == writer)
+    {
+        goto END;
+    }
+    atomic_fetch_add(&table->snapshots, 1); // before the first shard lock; see sh_promote()
+    counted = 1;
+
+    for (shard_index = 0; shard_index < SHTABLE_SHARDS; shard_index++)
+    {
+        shard = &table->shards[shard_index];
+        if (-1 == epoch_enter())
+        {
+            goto END;
+        }
+        pthread_mutex_lock(&shard->lock);
+        if ((NULL != table->wal) && (0 == shard_index))
+        {
+            snap_lsn = wal_lsn(table->wal);
+        }
+        num_entries = 0;
+        for (layout = atomic_load_explicit(&shard->layout, memory_order_relaxed); NULL != layout;
+             layout = atomic_load_explicit(&layout->prev, memory_order_relaxed))
+        {
+            for (index = 0; index <= layout->mask; index++)
+            {
+                entry = atomic_load_explicit(&layout->slots[index], memory_order_relaxed);
+                if ((NULL == entry) || (1 == sh_is_delete_marker(entry)))
+                {
+                    continue;
+                }
+                if (num_entries == entries_cap)
+                {
+                    entries_cap = (0 == entries_cap) ? SHTABLE_MIN_SLOTS : entries_cap * 2;
+                    grown = realloc(entries, entries_cap * sizeof(sh_entry_t *));
+                    if (NULL == grown)
+                    {
+                        pthread_mutex_unlock(&shard->lock);
+                        log_error("Failed to alloc snapshot slots.");
+                        goto EXIT;
+                    }
+                    entries = grown;
+                }
+                entries[num_entries++] = entry;
+            }
+        }
+        pthread_mutex_unlock(&shard->lock);
+
+        // retired entries stay allocated until the read section ends, so this needs no lock
+        for (index = 0; index < num_entries; index++)
+        {
+            if (-1 == shimage_writer_add(writer, entries[index]->data, entries[index]->key_len,
+                                         entries[index]->data + entries[index]->key_len, entries[index]->value_len))
+            {
+                goto EXIT;
+            }
+        }
+        epoch_exit(); // the copied pointers are not used again
+    }
+
+    if (NULL != table->image) // each lookup takes its own short read section
+    {
+        image_visit.table = table;
+        image_visit.visit = sh_snapshot_add;
+        image_visit.arg = writer;
+        if (0 != shimage_foreach(table->image, sh_visit_image_entry, &image_visit))
+        {
+            goto END;
+        }
+    }
+
+    ret = (ssize_t)writer->num_entries;
+    if (-1 == shimage_writer_commit(writer, dir_fd, name))
+    {
+        ret = -1;
+    }
+    writer = NULL;
+    if ((-1 != ret) && (NULL != table->wal) && (-1 == wal_compact(table->wal, snap_lsn)))
+    {
+        log_warn("Image written but the log was not compacted."); // restart replays more, nothing lost
+    }
+    goto END;
+
+EXIT:
+    epoch_exit(); // a shard's write failed inside its read section
+END:
+    if (1 == counted)
+    {
+        atomic_fetch_sub(&table->snapshots, 1);
+    }
+    shimage_writer_abort(writer, dir_fd);
+    writer = NULL;
+    free(entries);
+    entries = NULL;
+    return ret;
+}
+
+/**
+ * @brief Frees the table, every entry in it and its image. No other thread may be using the table.
+ *
+ * @param table the table
+ * @return returns 0 on success, or -1 on failure
+ */
+int destroy_shtable(shtable_t *table)
+{
+    int ret = -1;
+    int shard_index = 0;
+    size_t index = 0;
+    sh_layout_t *layout = NULL;
+    sh_layout_t *prev = NULL;
+
+    if (NULL == table)
+    {
+        log_error("Table is already NULL. Exiting.");
+        goto END;
+    }
+
+    for (shard_index = 0; shard_index < SHTABLE_SHARDS; shard_index++)
+    {
+        for (layout = atomic_load(&table->shards[shard_index].layout); NULL != layout; layout = prev)
+        {
+            prev = atomic_load(&layout->prev);
+            for (index = 0; index <= layout->mask; index++)
+            {
+                free(atomic_load(&layout->slots[index]));
+            }
+            free(layout);
+        }
+        pthread_mutex_destroy(&table->shards[shard_index].lock);
+    }
+    shimage_close(table->image);
+    free(table);
+    table = NULL;
+
+    ret = 0;
+END:
+    return ret;
+}
+
+/*** end of file ***/
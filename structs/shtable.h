@@ -0,0 +1,219 @@
+#ifndef SHTABLE_H
+#define SHTABLE_H
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "aqueues.h"
+#include "epoch.h"
+#include "hashes.h"
+#include "metrics.h"
+#include "shimage.h"
+#include "wal.h"
+
+#define SHTABLE_SHARD_BITS 6
+#define SHTABLE_SHARDS (1 << SHTABLE_SHARD_BITS) // must be a power of two
+#define SHTABLE_GROUP_WIDTH 16                  // control bytes compared per probe step (one SSE2 register)
+#define SHTABLE_MIN_SLOTS 16                    // initial slots per shard; a power of two, at least one group
+#define SHTABLE_MAX_LOAD_NUM 7                  // a shard resizes once live entries and tombstones fill 7/8
+#define SHTABLE_MAX_LOAD_DEN 8
+#define SHTABLE_MIGRATE_SLOTS 32                // old slots a writer moves per operation while a resize is running
+#define SH_DELETE_MARKER UINT32_MAX              // value_len of an entry hiding a key deleted from the image
+#define SHTABLE_DEFAULT_HASH hash_siphash13     // table keys come from clients, so the default is keyed
+
+#define SH_CTRL_EMPTY 0x80   // never used since the last rehash; ends a probe
+#define SH_CTRL_DELETED 0xfe // tombstone; probes continue past it
+// a full slot's control byte holds the low 7 bits of its entry's hash (high bit clear)
+
+typedef keyed_hash_func sh_hash_func;
+
+/**
+ * @brief visitor called by shtable_foreach() for each entry
+ *
+ * @return 0 to keep going, anything else to stop
+ */
+typedef int (*sh_visit_func)(const void *key, size_t key_len, const void *value, size_t value_len, void *arg);
+
+/**
+ * @brief a key/value entry. The key and value are stored inline after the header and the entry never changes once it
+ * is published; a put on an existing key publishes a new entry in its slot.
+ */
+typedef struct sh_entry
+{
+    uint64_t hash;
+    uint32_t key_len;
+    uint32_t value_len;
+    char data[]; // key_len bytes of key, then value_len bytes of value
+} sh_entry_t;
+
+/**
+ * @brief a shard's flat slot array, Swiss table style. ctrl holds one byte per slot (SH_CTRL_EMPTY, SH_CTRL_DELETED,
+ * or 7 bits of the entry's hash), so a probe compares a whole group of SHTABLE_GROUP_WIDTH slots with one SIMD
+ * compare and only touches the entries whose byte matches. A resize publishes a new layout right away with prev
+ * pointing at the old one, and writers move entries across a few slots at a time, so no operation pays for the whole
+ * rehash. A key lives in exactly one of the two layouts; it is copied into the new one before it leaves the old.
+ */
+typedef struct sh_layout
+{
+    size_t mask;                      // number of slots - 1
+    _Atomic(struct sh_layout *) prev; // layout still being migrated into this one, or NULL
+    _Atomic(sh_entry_t *) *slots;     // in the same allocation, after ctrl
+    _Alignas(SHTABLE_GROUP_WIDTH) uint8_t ctrl[];
+} sh_layout_t;
+
+/**
+ * @brief one shard with its own writer lock, on its own cache line. Readers take no lock; they probe inside an epoch
+ * read section, and writers retire the entries and layouts they replace. Writers publish an entry's slot pointer
+ * before its control byte and readers check the entry's full hash and key, so a racing read sees a key either present
+ * or absent, never torn.
+ */
+typedef struct sh_shard
+{
+    _Alignas(CACHE_LINE_SIZE) pthread_mutex_t lock;
+    _Atomic(sh_layout_t *) layout;
+    atomic_size_t count;
+    size_t growth_left; // empty slots that may still be filled before a resize; writer only
+    size_t migrate_pos; // next slot of layout->prev to migrate; writer only
+    size_t num_markers; // delete markers, which fill slots but are not in count; writer only
+} sh_shard_t;
+
+/**
+ * @brief a sharded concurrent hash table for the server's shared tables (auth users, storage). A key's shard comes
+ * from the top bits of its hash, its probe start from the middle bits and its control byte from the low 7 bits, so
+ * writes to keys in different shards never contend and lookups never lock.
+ */
+typedef struct shtable
+{
+    sh_hash_func hash;
+    hash_seed_t seed;
+    wal_t *wal;                // logs every put and delete once attached; NULL for a table that is not durable
+    shimage_t *image;          // earlier contents read in place; NULL if none was attached
+    atomic_size_t image_live;  // image keys not yet read, written or deleted
+    atomic_int snapshots;      // snapshots running; image keys are not promoted meanwhile, see shtable_snapshot()
+    sh_shard_t shards[SHTABLE_SHARDS];
+} shtable_t;
+
+/**
+ * @brief Creates an empty sharded table.
+ *
+ * @param hash the key hash function (hash_siphash13, hash_wyhash), or NULL for SHTABLE_DEFAULT_HASH. It is keyed with
+ * the per-process random seed.
+ * @return returns the table, or NULL on failure
+ */
+shtable_t *create_shtable(sh_hash_func hash);
+
+/**
+ * @brief Maps a table to an image of its earlier contents, loaded with shimage_open(). Keys are then read from the
+ * image in place and copied into memory the first time they are read, so opening costs the same for any image and
+ * memory holds only the keys in use. Attach before replaying the log and before any other use. The table owns the
+ * image from then on.
+ *
+ * @param table the table, still empty
+ * @param image the image
+ * @return returns 0 on success, or -1 on failure
+ */
+int shtable_attach_image(shtable_t *table, shimage_t *image);
+
+/**
+ * @brief Makes a table durable: from now on every put and delete is logged to wal before it returns, as durably as
+ * the log's sync policy promises. Replay the log into the table with shtable_apply_wal() first.
+ *
+ * @param table the table
+ * @param wal the log; it must outlive the table's writers
+ * @return returns 0 on success, or -1 on failure
+ */
+int shtable_attach_wal(shtable_t *table, wal_t *wal);
+
+/**
+ * @brief A wal_apply_func that replays a logged put or delete into the shtable_t passed as arg.
+ *
+ * @return returns 0 on success, or -1 on failure
+ */
+int shtable_apply_wal(uint8_t op, const void *key, size_t key_len, const void *value, size_t value_len, void *arg);
+
+/**
+ * @brief Inserts a key, or replaces its value if it is already in the table. The key and value are copied.
+ *
+ * @param table the table
+ * @param key the key
+ * @param key_len length of the key
+ * @param value the value
+ * @param value_len length of the value
+ * @return returns 0 on success, or -1 on failure
+ */
+int shtable_put(shtable_t *table, const void *key, size_t key_len, const void *value, size_t value_len);
+
+/**
+ * @brief Looks up a key without taking a lock and copies its value out.
+ *
+ * @param table the table
+ * @param key the key
+ * @param key_len length of the key
+ * @param buf buffer receiving the value; at most buf_len bytes are copied
+ * @param buf_len size of buf
+ * @return returns the full length of the value (which may exceed buf_len), or -1 if the key is not in the table
+ */
+ssize_t shtable_get(shtable_t *table, const void *key, size_t key_len, void *buf, size_t buf_len);
+
+/**
+ * @brief Removes a key from the table.
+ *
+ * @param table the table
+ * @param key the key
+ * @param key_len length of the key
+ * @return returns 0 if the key was removed, or -1 if it was not in the table or the delete could not be logged
+ */
+int shtable_delete(shtable_t *table, const void *key, size_t key_len);
+
+/**
+ * @brief Counts the entries in the table. Exact when no writer is running.
+ *
+ * @param table the table
+ * @return the number of entries
+ */
+size_t shtable_count(shtable_t *table);
+
+/**
+ * @brief Calls visit for every entry, one shard at a time with that shard's writer lock held, so each shard is seen
+ * as a consistent whole. visit must not write to the table.
+ *
+ * @param table the table
+ * @param visit the visitor
+ * @param arg passed through to visit
+ * @return returns 0 on success, 1 if visit stopped the walk, or -1 on failure
+ */
+int shtable_foreach(shtable_t *table, sh_visit_func visit, void *arg);
+
+/**
+ * @brief Writes a table's entries to a new image without stopping its writers, then drops the log records the image
+ * makes redundant. Open the image with shimage_open() and attach it with shtable_attach_image() before replaying the
+ * log.
+ *
+ * @param table the table
+ * @param dir_fd directory to write the image in (an O_PATH fd is fine)
+ * @param name the image's file name; it is written as name.tmp and renamed into place
+ * @return returns the number of entries written, or -1 on failure
+ */
+ssize_t shtable_snapshot(shtable_t *table, int dir_fd, const char *name);
+
+/**
+ * @brief Frees the table, every entry in it and its image. No other thread may be using the table.
+ *
+ * @param table the table
+ * @return returns 0 on success, or -1 on failure
+ */
+int destroy_shtable(shtable_t *table);
+
+#endif
+
+/*** end of file ***/
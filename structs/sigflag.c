@@ -0,0 +1,65 @@
+#include "../include/sigflag.h"
+
+static volatile sig_atomic_t raised[NSIG] = {0};
+
+/**
+ * @brief signal handler for sigflag_install(); sets the signal's flag and nothing else
+ *
+ * @param signum the signal caught
+ */
+static void sigflag_handler(int signum)
+{
+    raised[signum] = 1;
+}
+
+/**
+ * @brief Installs a handler that raises a flag whenever signum arrives, and does nothing else, so it is
+ * async-signal-safe. Whoever acts on the signal checks the flag with sigflag_take() from its own loop.
+ *
+ * @param signum the signal, e.g. METRICS_DUMP_SIGNAL
+ * @return returns 0 on success, or -1 on failure
+ */
+int sigflag_install(int signum)
+{
+    int ret = -1;
+    struct sigaction action = {0};
+
+    if ((0 >= signum) || (NSIG <= signum))
+    {
+        log_error("Invalid signal passed.");
+        goto END;
+    }
+
+    action.sa_handler = sigflag_handler;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (-1 == sigaction(signum, &action, NULL))
+    {
+        log_perror("sigaction()");
+        goto END;
+    }
+
+    ret = 0;
+END:
+    return ret;
+}
+
+/**
+ * @brief Checks for and clears the flag of a signal installed with sigflag_install().
+ *
+ * @param signum the signal
+ * @return returns 1 if the signal arrived since the last check, or 0
+ */
+int sigflag_take(int signum)
+{
+    int ret = 0;
+
+    if ((0 < signum) && (NSIG > signum) && (0 != raised[signum]))
+    {
+        raised[signum] = 0;
+        ret = 1;
+    }
+    return ret;
+}
+
+/*** end of file ***/
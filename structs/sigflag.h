@@ -0,0 +1,29 @@
+#ifndef SIGFLAG_H
+#define SIGFLAG_H
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+
+#include "log.h"
+
+/**
+ * @brief Installs a handler that raises a flag whenever signum arrives, and does nothing else, so it is
+ * async-signal-safe. Whoever acts on the signal checks the flag with sigflag_take() from its own loop.
+ *
+ * @param signum the signal, e.g. METRICS_DUMP_SIGNAL
+ * @return returns 0 on success, or -1 on failure
+ */
+int sigflag_install(int signum);
+
+/**
+ * @brief Checks for and clears the flag of a signal installed with sigflag_install().
+ *
+ * @param signum the signal
+ * @return returns 1 if the signal arrived since the last check, or 0
+ */
+int sigflag_take(int signum);
+
+#endif
+
+/*** end of file ***/
@@ -1,9 +1,820 @@
 #include "../include/threadpoll.h"
 #include "../include/some_server.h"
+#include "../include/poller.h"
+#include "../include/transfers.h"
+
+#include <limits.h>
+#include <netdb.h>
+#include <sched.h>
+
+/**
+ * @brief Frees the poller workers and their queues. Connections still queued are closed.
+ *
+ * @param workers the workers array
+ * @param num_workers the number of workers in the array
+ * @return returns 0 on success, or -1 on failure
+ */
+static int destroy_poll_workers(poll_worker_t *workers, int num_workers)
+{
+    int ret = -1;
+    int worker_index = 0;
+    void *item = NULL;
+
+    if (NULL == workers)
+    {
+        log_error("Poll workers are already NULL.");
+        goto END;
+    }
+
+    for (worker_index = 0; worker_index < num_workers; worker_index++)
+    {
+        if (NULL == workers[worker_index].rqueue)
+        {
+            continue;
+        }
+        while (NULL != (item = rdequeue(workers[worker_index].rqueue)))
+        {
+            close(QITEM_TO_FD(item));
+        }
+        rdestroy(workers[worker_index].rqueue);
+        workers[worker_index].rqueue = NULL;
+    }
+    free(workers);
+    workers = NULL;
+
+    ret = 0;
+END:
+    return ret;
+}
+
+/**
+ * @brief Allocates one worker per poller thread, each with its own inbound queue and wakeup eventfd.
+ *
+ * @param num_workers the number of poller threads
+ * @return returns the workers array, or NULL on failure
+ */
+static poll_worker_t *create_poll_workers(int num_workers)
+{
+    poll_worker_t *ret = NULL;
+    poll_worker_t *workers = NULL;
+    int worker_index = 0;
+
+    if (0 >= num_workers)
+    {
+        log_error("Invalid number of poll workers.");
+        goto END;
+    }
+
+    // each worker has its own cache line, so calloc() is not enough here
+    if (0 != posix_memalign((void **)&workers, CACHE_LINE_SIZE, num_workers * sizeof(poll_worker_t)))
+    {
+        log_error("Failed to alloc poll workers.");
+        workers = NULL;
+        goto END;
+    }
+    memset(workers, 0, num_workers * sizeof(poll_worker_t));
+
+    for (worker_index = 0; worker_index < num_workers; worker_index++)
+    {
+        atomic_init(&workers[worker_index].num_conns, 0);
+        atomic_init(&workers[worker_index].total_conns, 0);
+        workers[worker_index].rqueue = create_rqueue(NULL, 0);
+        if (NULL == workers[worker_index].rqueue)
+        {
+            log_error("Failed to init poll queue %d.", worker_index);
+            goto FAIL;
+        }
+        if (-1 == rqueue_enable_wakeup(workers[worker_index].rqueue)) // the poller sleeps until a connection arrives
+        {
+            log_warn("No poll queue wakeups. Poller %d will check its queue every timeslice.", worker_index);
+        }
+    }
+
+    ret = workers;
+    goto END;
+
+FAIL:
+    destroy_poll_workers(workers, num_workers);
+    workers = NULL;
+
+END:
+    return ret;
+}
+
+/**
+ * @brief Hashes a connection's peer address, so every connection from one peer lands on the same poller.
+ *
+ * @param client_sockfd the accepted connection
+ * @return the hash, or 0 if the peer address could not be read
+ */
+static uint32_t peer_hash(int client_sockfd)
+{
+    uint32_t hash = 0;
+    size_t index = 0;
+    struct sockaddr_storage peer = {0};
+    socklen_t peer_len = sizeof(peer);
+    const uint8_t *p_addr = NULL;
+    size_t addr_len = 0;
+
+    if (-1 == getpeername(client_sockfd, (struct sockaddr *)&peer, &peer_len))
+    {
+        log_perror("getpeername()");
+        goto END;
+    }
+
+    if (AF_INET == peer.ss_family)
+    {
+        p_addr = (const uint8_t *)&((struct sockaddr_in *)&peer)->sin_addr;
+        addr_len = sizeof(struct in_addr);
+    }
+    else if (AF_INET6 == peer.ss_family)
+    {
+        p_addr = (const uint8_t *)&((struct sockaddr_in6 *)&peer)->sin6_addr;
+        addr_len = sizeof(struct in6_addr);
+    }
+
+    for (index = 0; index < addr_len; index++) // FNV-1a over the address bytes, then the murmur3 finalizer
+    {
+        hash = (hash ^ p_addr[index]) * 16777619U;
+    }
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bU;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35U;
+    hash ^= hash >> 16;
+
+END:
+    return hash;
+}
+
+/**
+ * @brief Picks the poller a new connection is handed to, according to the dispatch policy.
+ *
+ * @param main_data_args The main data struct holding the pollers' workers
+ * @param client_sockfd the accepted connection
+ * @return the index of the chosen worker
+ */
+static int pick_worker(main_data_t *main_data_args, int client_sockfd)
+{
+    int ret = 0;
+    int worker_index = 0;
+    int num_conns = 0;
+    int least_conns = INT_MAX;
+
+    switch (main_data_args->dispatch_policy)
+    {
+    case DISPATCH_ROUND_ROBIN:
+        ret = main_data_args->next_dispatch;
+        main_data_args->next_dispatch = (main_data_args->next_dispatch + 1) % main_data_args->num_workers;
+        break;
+
+    case DISPATCH_PEER_HASH:
+        ret = (int)(peer_hash(client_sockfd) % (uint32_t)main_data_args->num_workers);
+        break;
+
+    case DISPATCH_LEAST_CONN:
+    default:
+        // start the scan at the round robin position so ties do not all go to worker 0
+        for (worker_index = 0; worker_index < main_data_args->num_workers; worker_index++)
+        {
+            num_conns = atomic_load_explicit(
+                &main_data_args->workers[(main_data_args->next_dispatch + worker_index) % main_data_args->num_workers]
+                     .num_conns,
+                memory_order_relaxed);
+            if (num_conns < least_conns)
+            {
+                least_conns = num_conns;
+                ret = (main_data_args->next_dispatch + worker_index) % main_data_args->num_workers;
+            }
+        }
+        main_data_args->next_dispatch = (main_data_args->next_dispatch + 1) % main_data_args->num_workers;
+        break;
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Counts one main loop wakeup's accepts in the metrics.
+ *
+ * @param num_accepted connections accepted on the wakeup
+ */
+static void record_accepts(int num_accepted)
+{
+    if (0 < num_accepted)
+    {
+        metrics_add(METRIC_ACCEPTS, (uint64_t)num_accepted);
+        metrics_record(METRIC_ACCEPT_BATCH, (uint64_t)num_accepted);
+    }
+}
+
+/**
+ * @brief Hands a batch of accepted fds to the pollers picked by the dispatch policy, with one ring queue operation per
+ * poller. Connections that do not fit in their poller's queue are closed.
+ *
+ * @param main_data_args The main data struct holding the pollers' workers
+ * @param items the accepted fds, as FD_TO_QITEM() items
+ * @param num_items number of items (at most ACCEPT_BATCH)
+ */
+static void dispatch_fds(main_data_t *main_data_args, void **items, int num_items)
+{
+    int targets[ACCEPT_BATCH];
+    void *batch[ACCEPT_BATCH];
+    int item_index = 0;
+    int batch_index = 0;
+    int num_batch = 0;
+    int num_queued = 0;
+    poll_worker_t *worker = NULL;
+
+    for (item_index = 0; item_index < num_items; item_index++)
+    {
+        // counted before the handoff so least-connections sees the rest of this batch
+        targets[item_index] = pick_worker(main_data_args, QITEM_TO_FD(items[item_index]));
+        atomic_fetch_add_explicit(&main_data_args->workers[targets[item_index]].num_conns, 1, memory_order_relaxed);
+    }
+
+    for (item_index = 0; item_index < num_items; item_index++) // gather each poller's share into one bulk enqueue
+    {
+        if (-1 == targets[item_index])
+        {
+            continue;
+        }
+        worker = &main_data_args->workers[targets[item_index]];
+        batch[0] = items[item_index];
+        num_batch = 1;
+        for (batch_index = item_index + 1; batch_index < num_items; batch_index++)
+        {
+            if (targets[batch_index] == targets[item_index])
+            {
+                batch[num_batch] = items[batch_index];
+                num_batch++;
+                targets[batch_index] = -1;
+            }
+        }
+
+        log_debug("Sending poll %d new conns.", num_batch);
+        num_queued = renqueue_bulk(worker->rqueue, batch, num_batch);
+        num_queued = (0 > num_queued) ? 0 : num_queued;
+        for (batch_index = 0; batch_index < num_queued; batch_index++)
+        {
+            trace_point(TRACE_ENQUEUE, QITEM_TO_FD(batch[batch_index]));
+        }
+        atomic_fetch_add_explicit(&worker->total_conns, num_queued, memory_order_relaxed);
+        if (num_queued < num_batch)
+        {
+            log_error("Poll queue full. Dropping %d connections.", num_batch - num_queued);
+            metrics_add(METRIC_DISPATCH_DROPS, (uint64_t)(num_batch - num_queued));
+            atomic_fetch_sub_explicit(&worker->num_conns, num_batch - num_queued, memory_order_relaxed);
+        }
+        for (; num_queued < num_batch; num_queued++)
+        {
+            close(QITEM_TO_FD(batch[num_queued]));
+        }
+    }
+}
+
+#ifdef USE_IO_URING
+/**
+ * @brief The main thread accept loop on io_uring. A single multishot accept keeps producing connections, and each
+ * wakeup hands every accepted fd to the pollers in one pass, so one syscall covers a whole burst of accepts.
+ *
+ * @param main_data_args The main data struct containing the server socket and poll queue
+ * @param server_shutdown the global signal server_shutdown variable, checked with running for server termination
+ * @return returns 0 on shutdown, or -1 if the ring fails and the caller should fall back to poll()
+ */
+static int uring_accept_loop(main_data_t *main_data_args, sig_atomic_t server_shutdown)
+{
+    int ret = -1;
+    int check = 0;
+    int armed = 0;
+    int num_accepted = 0;
+    unsigned head = 0;
+    unsigned seen = 0;
+    void *accepted[ACCEPT_BATCH];
+    struct io_uring ring;
+    struct io_uring_sqe *sqe = NULL;
+    struct io_uring_cqe *cqe = NULL;
+    struct __kernel_timespec timeout = {.tv_sec = 0, .tv_nsec = OS_TIMESLICE * 1000000L};
+
+    check = io_uring_queue_init(POLLER_URING_ENTRIES, &ring, 0);
+    if (0 > check)
+    {
+        log_error("io_uring_queue_init(): %s", strerror(-check));
+        goto END;
+    }
+
+    while ((1 != server_shutdown) && (true == running)) // an -EINTR wait comes back here, so a shutdown signal ends it
+    {
+        if (0 == armed)
+        {
+            sqe = io_uring_get_sqe(&ring);
+            if (NULL == sqe)
+            {
+                log_error("Failed to get an io_uring sqe.");
+                goto EXIT;
+            }
+            // as the accept4() paths: client sockets must not leak into anything the server execs
+            io_uring_prep_multishot_accept(sqe, main_data_args->server_sockfd, NULL, NULL, SOCK_CLOEXEC);
+            armed = 1;
+        }
+
+        check = io_uring_submit_and_wait_timeout(&ring, &cqe, 1, &timeout, NULL);
+        if ((0 > check) && (-ETIME != check) && (-EINTR != check))
+        {
+            log_error("io_uring_submit_and_wait_timeout(): %s", strerror(-check));
+            goto EXIT;
+        }
+
+        seen = 0;
+        num_accepted = 0;
+        io_uring_for_each_cqe(&ring, head, cqe)
+        {
+            if (ACCEPT_BATCH == num_accepted) // the rest of the completions are picked up next pass
+            {
+                break;
+            }
+            seen++;
+            if (0 == (IORING_CQE_F_MORE & cqe->flags)) // the kernel stopped the multishot accept; re-arm it
+            {
+                armed = 0;
+            }
+            if (-EINVAL == cqe->res) // multishot accept refused
+            {
+                io_uring_cq_advance(&ring, seen);
+                record_accepts(num_accepted);
+                dispatch_fds(main_data_args, accepted, num_accepted);
+                goto EXIT;
+            }
+            if (0 > cqe->res)
+            {
+                log_error("accept: %s", strerror(-cqe->res));
+                continue;
+            }
+            trace_point(TRACE_ACCEPT, cqe->res);
+            accepted[num_accepted] = FD_TO_QITEM(cqe->res);
+            num_accepted++;
+        }
+        io_uring_cq_advance(&ring, seen);
+        record_accepts(num_accepted);
+        dispatch_fds(main_data_args, accepted, num_accepted);
+    }
+
+    ret = 0;
+EXIT:
+    io_uring_queue_exit(&ring);
+END:
+    return ret;
+}
+#endif
+
+/**
+ * @brief Pins the calling poller thread to one CPU, chosen round-robin by worker index.
+ *
+ * @param worker_id the poller's worker index
+ * @return returns the CPU pinned to, or -1 on failure
+ */
+static int pin_worker(int worker_id)
+{
+    int ret = -1;
+    int check = 0;
+    long num_cpus = 0;
+    cpu_set_t cpu_set;
+
+    num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (0 >= num_cpus)
+    {
+        log_perror("sysconf(_SC_NPROCESSORS_ONLN)");
+        goto END;
+    }
+
+    CPU_ZERO(&cpu_set);
+    CPU_SET(worker_id % num_cpus, &cpu_set);
+    check = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+    if (0 != check)
+    {
+        log_error("pthread_setaffinity_np(): %s", strerror(check));
+        goto END;
+    }
+
+    ret = (int)(worker_id % num_cpus);
+END:
+    return ret;
+}
+
+/**
+ * @brief Opens a non-blocking SO_REUSEPORT listener on the server port for one poller. When a CPU is given, the
+ * listener is tagged with SO_INCOMING_CPU so the kernel prefers it for connections arriving on that CPU.
+ *
+ * @param port The supplied server port
+ * @param cpu the CPU the owning poller is pinned to, or -1
+ * @return returns the listening socket, or -1 on failure
+ */
+static int init_reuseport_listener(const char *port, int cpu)
+{
+    int ret = -1;
+    int check = 0;
+    int opt = 1;
+    int sockfd = -1;
+    struct addrinfo hints = {0};
+    struct addrinfo *p_results = NULL;
+    struct addrinfo *p_addr = NULL;
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    check = getaddrinfo(NULL, port, &hints, &p_results);
+    if (0 != check)
+    {
+        log_error("getaddrinfo(): %s", gai_strerror(check));
+        goto END;
+    }
+
+    for (p_addr = p_results; NULL != p_addr; p_addr = p_addr->ai_next)
+    {
+        sockfd = socket(p_addr->ai_family, p_addr->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, p_addr->ai_protocol);
+        if (-1 == sockfd)
+        {
+            continue;
+        }
+        if ((0 == setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) &&
+            (0 == setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) &&
+            (0 == bind(sockfd, p_addr->ai_addr, p_addr->ai_addrlen)) && (0 == listen(sockfd, SOMAXCONN)))
+        {
+            break;
+        }
+        close(sockfd);
+        sockfd = -1;
+    }
+    if (-1 == sockfd)
+    {
+        log_error("Failed to open a SO_REUSEPORT listener.");
+        goto END;
+    }
+
+    if ((0 <= cpu) && (-1 == setsockopt(sockfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu))))
+    {
+        // affinity is a hint; the listener still works without it
+        log_warn("setsockopt(SO_INCOMING_CPU): %s", strerror(errno));
+    }
+
+    ret = sockfd;
+END:
+    if (NULL != p_results)
+    {
+        freeaddrinfo(p_results);
+        p_results = NULL;
+    }
+    return ret;
+}
+
+/**
+ * @brief Accepts every pending connection on a poller's own listener and registers it with that poller.
+ *
+ * @param poller the poller the listener belongs to
+ * @param worker the poller's worker, whose connection count is kept
+ * @param conns the poller's connections, or NULL when some_server() serves them
+ * @param listen_fd the non-blocking listening socket
+ */
+static void accept_ready(poller_t *poller, poll_worker_t *worker, conns_t *conns, int listen_fd)
+{
+    int client_sockfd = -1;
+    int num_accepted = 0;
+
+    for (;;)
+    {
+        client_sockfd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (-1 == client_sockfd)
+        {
+            if ((EAGAIN != errno) && (EWOULDBLOCK != errno))
+            {
+                log_perror("accept4()");
+            }
+            break;
+        }
+        num_accepted++;
+        trace_point(TRACE_ACCEPT, client_sockfd);
+
+        if (-1 == poller_add(poller, client_sockfd, POLLER_IN))
+        {
+            close(client_sockfd);
+            continue;
+        }
+        if ((NULL != conns) && (-1 == conn_open(conns, client_sockfd)))
+        {
+            poller_del(poller, client_sockfd);
+            close(client_sockfd);
+            continue;
+        }
+        atomic_fetch_add_explicit(&worker->num_conns, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&worker->total_conns, 1, memory_order_relaxed);
+    }
+    record_accepts(num_accepted);
+}
+
+/**
+ * @brief Registers every connection handed over through a poller's queue, a batch per queue operation.
+ *
+ * @param poller the poller to register the connections with
+ * @param worker the poller's worker, holding its queue and connection count
+ * @param conns the poller's connections, or NULL when some_server() serves them
+ */
+static void register_handoffs(poller_t *poller, poll_worker_t *worker, conns_t *conns)
+{
+    void *items[ACCEPT_BATCH];
+    int num_items = 0;
+    int item_index = 0;
+    int client_sockfd = -1;
+
+    while (0 < (num_items = rdequeue_bulk(worker->rqueue, items, ACCEPT_BATCH)))
+    {
+        for (item_index = 0; item_index < num_items; item_index++)
+        {
+            client_sockfd = QITEM_TO_FD(items[item_index]);
+            trace_point(TRACE_DEQUEUE, client_sockfd);
+            if (-1 == poller_add(poller, client_sockfd, POLLER_IN))
+            {
+                close(client_sockfd);
+                atomic_fetch_sub_explicit(&worker->num_conns, 1, memory_order_relaxed);
+            }
+            else if ((NULL != conns) && (-1 == conn_open(conns, client_sockfd)))
+            {
+                poller_del(poller, client_sockfd);
+                close(client_sockfd);
+                atomic_fetch_sub_explicit(&worker->num_conns, 1, memory_order_relaxed);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Closes a client connection: drops any transfer and connection state on it, unregisters it and closes it.
+ *
+ * @param poller the poller the connection is registered with
+ * @param worker the poller's worker, whose connection count is kept
+ * @param transfers the poller's transfers
+ * @param conns the poller's connections, or NULL when some_server() serves them
+ * @param client_sockfd the connection
+ */
+static void close_client(poller_t *poller, poll_worker_t *worker, transfers_t *transfers, conns_t *conns,
+                         int client_sockfd)
+{
+    trace_point(TRACE_CLOSE, client_sockfd);
+    transfer_cancel(transfers, client_sockfd);
+    conn_close(conns, client_sockfd);
+    poller_del(poller, client_sockfd);
+    close(client_sockfd);
+    atomic_fetch_sub_explicit(&worker->num_conns, 1, memory_order_relaxed);
+    metrics_add(METRIC_CONNS_CLOSED, 1);
+}
+
+/**
+ * @brief Runs a connection's transfer for one turn, closing the connection if the transfer fails. A download waits
+ * for the connection's queued response header to be written first, and a finished transfer hands the connection back
+ * to its request handler.
+ *
+ * @param poller the poller the connection is registered with
+ * @param worker the poller's worker, whose connection count is kept
+ * @param transfers the poller's transfers
+ * @param conns the poller's connections, or NULL when some_server() serves them
+ * @param transfer the transfer
+ */
+static void serve_transfer(poller_t *poller, poll_worker_t *worker, transfers_t *transfers, conns_t *conns,
+                           transfer_t *transfer)
+{
+    int client_sockfd = transfer->sock_fd;
+    int progress = -1;
+    conn_t *conn = conn_find(conns, client_sockfd);
+
+    if ((NULL != conn) && (0 != conn_pending(conn)))
+    {
+        if (-1 == conn_flush(conns, conn))
+        {
+            goto CLOSE;
+        }
+        if ((TRANSFER_DOWNLOAD == transfer->direction) && (0 != conn_pending(conn)))
+        {
+            goto END; // the socket is watched for writing, so the rest of the header goes out on the next event
+        }
+    }
+
+    progress = transfer_progress(transfers, transfer);
+    transfer = NULL; // freed once done
+    if (-1 == progress)
+    {
+        goto CLOSE;
+    }
+    if ((TRANSFER_DONE == progress) && (NULL != conn) && (-1 == conn_resume(conns, conn)))
+    {
+        goto CLOSE;
+    }
+    goto END;
+
+CLOSE:
+    close_client(poller, worker, transfers, conns, client_sockfd);
+END:
+    return;
+}
+
+/**
+ * @brief The snapshot job; a long task on the pool for the life of the server. Once SNAPSHOT_INTERVAL_SEC has passed
+ * and the storage log has grown by SNAPSHOT_MIN_LOG bytes, snapshots the storage table and compacts its log, so a
+ * restart loads the snapshot and replays only the log written since. The pollers keep serving while it runs.
+ *
+ * @param args The main data struct, passed as a void pointer
+ */
+static void snapshot_func(void *args)
+{
+    main_data_t *main_args = (main_data_t *)args;
+    struct timespec timeslice = {.tv_sec = 0, .tv_nsec = MAIN_OS_TIMESLICE};
+    struct timespec now = {0};
+    struct timespec last_snapshot = {0};
+    ssize_t num_written = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &last_snapshot);
+    while (true == running)
+    {
+        nanosleep(&timeslice, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((SNAPSHOT_INTERVAL_SEC > (now.tv_sec - last_snapshot.tv_sec)) ||
+            (SNAPSHOT_MIN_LOG > wal_size(main_args->p_storage_wal)))
+        {
+            continue;
+        }
+
+        last_snapshot = now;
+        num_written = shtable_snapshot(main_args->p_storage_table, main_args->root_dir_fd, STORAGE_IMAGE_NAME);
+        if (-1 == num_written)
+        {
+            log_warn("Storage snapshot failed; the log keeps growing until one succeeds.");
+        }
+    }
+}
+
+/**
+ * @brief metrics probe: a poller's live connections
+ *
+ * @param arg the poller's worker
+ * @return the count
+ */
+static int64_t probe_worker_conns(void *arg)
+{
+    return atomic_load_explicit(&((poll_worker_t *)arg)->num_conns, memory_order_relaxed);
+}
+
+/**
+ * @brief metrics probe: connections waiting in a poller's queue
+ *
+ * @param arg the poller's worker
+ * @return the count
+ */
+static int64_t probe_worker_queue(void *arg)
+{
+    return (int64_t)rqueue_count(((poll_worker_t *)arg)->rqueue);
+}
+
+/**
+ * @brief metrics probe: entries in the storage table
+ *
+ * @param arg the main data struct
+ * @return the count
+ */
+static int64_t probe_storage_entries(void *arg)
+{
+    return (int64_t)shtable_count(((main_data_t *)arg)->p_storage_table);
+}
+
+/**
+ * @brief metrics probe: bytes in the storage log
+ *
+ * @param arg the main data struct
+ * @return the size
+ */
+static int64_t probe_storage_log(void *arg)
+{
+    return (int64_t)wal_size(((main_data_t *)arg)->p_storage_wal);
+}
+
+/**
+ * @brief metrics probe: queue node allocations served from a thread's cache
+ *
+ * @param arg unused
+ * @return the count, summed over every thread's cache
+ */
+static int64_t probe_qpool_hits(void *arg)
+{
+    QPOOL_STATS_t stats = {0};
+
+    qpool_stats(&stats);
+    return (int64_t)stats.hits;
+}
+
+/**
+ * @brief metrics probe: queue node allocations that had to carve a new slab
+ *
+ * @param arg unused
+ * @return the count, summed over every thread's cache
+ */
+static int64_t probe_qpool_misses(void *arg)
+{
+    QPOOL_STATS_t stats = {0};
+
+    qpool_stats(&stats);
+    return (int64_t)stats.misses;
+}
+
+/**
+ * @brief metrics probe: queue nodes freed by a thread other than the one whose cache they came from
+ *
+ * @param arg unused
+ * @return the count, summed over every thread's cache
+ */
+static int64_t probe_qpool_remote_frees(void *arg)
+{
+    QPOOL_STATS_t stats = {0};
+
+    qpool_stats(&stats);
+    return (int64_t)stats.remote_frees;
+}
+
+/**
+ * @brief Registers the values the metrics read from the server's own structures: each poller's connections and queue
+ * depth, the storage table's size and the queue node pool's counters. They are read only by the stats job, which the
+ * pool joins before cleanup frees them.
+ *
+ * @param main_data_args The main data struct holding the pollers' workers and the storage table
+ */
+static void add_metrics_probes(main_data_t *main_data_args)
+{
+    int worker_index = 0;
+    char name[METRICS_NAME_MAX];
+
+    for (worker_index = 0; worker_index < main_data_args->num_workers; worker_index++)
+    {
+        snprintf(name, sizeof(name), "poller_conns{worker=\"%d\"}", worker_index);
+        metrics_add_probe(name, "Live connections per poller.", probe_worker_conns,
+                          &main_data_args->workers[worker_index]);
+        snprintf(name, sizeof(name), "poll_queue_depth{worker=\"%d\"}", worker_index);
+        metrics_add_probe(name, "Connections waiting in each poller's queue.", probe_worker_queue,
+                          &main_data_args->workers[worker_index]);
+    }
+    metrics_add_probe("storage_entries", "Entries in the storage table.", probe_storage_entries, main_data_args);
+    if (NULL != main_data_args->p_storage_wal)
+    {
+        metrics_add_probe("storage_log_bytes", "Bytes in the storage log.", probe_storage_log, main_data_args);
+    }
+    metrics_add_probe("qpool_hits", "Queue nodes allocated from a thread's cache.", probe_qpool_hits, NULL);
+    metrics_add_probe("qpool_misses", "Queue node allocations that carved a new slab.", probe_qpool_misses, NULL);
+    metrics_add_probe("qpool_remote_frees", "Queue nodes freed by a thread other than their owner.",
+                      probe_qpool_remote_frees, NULL);
+}
+
+/**
+ * @brief The stats job; a long task on the pool for the life of the server. Answers connections on the loopback stats
+ * listener with the metrics, dumps them to stdout whenever METRICS_DUMP_SIGNAL arrives, and writes the request trace
+ * to TRACE_OUTPUT_NAME whenever TRACE_DUMP_SIGNAL arrives. All the aggregation happens here, so the threads that keep
+ * the metrics and traces only ever touch their own shard and ring.
+ *
+ * @param args The main data struct, passed as a void pointer
+ */
+static void stats_func(void *args)
+{
+    main_data_t *main_args = (main_data_t *)args;
+    struct pollfd poll_fd = {.fd = -1, .events = POLLIN};
+    int poll_timeout = OS_TIMESLICE;
+
+    if (NULL != main_args->stats_port)
+    {
+        poll_fd.fd = metrics_listen(main_args->stats_port); // without it the signal dump still works
+    }
+
+    while (true == running)
+    {
+        // a negative fd is ignored, so this is only a timeslice sleep without a listener
+        if ((0 < poll(&poll_fd, 1, poll_timeout)) && (POLLIN & poll_fd.revents))
+        {
+            metrics_serve(poll_fd.fd);
+        }
+        if (1 == sigflag_take(METRICS_DUMP_SIGNAL))
+        {
+            metrics_write(STDOUT_FILENO);
+        }
+        if ((1 == sigflag_take(TRACE_DUMP_SIGNAL)) && (0 == trace_dump(AT_FDCWD, TRACE_OUTPUT_NAME)))
+        {
+            log_info("Wrote the request trace to %s.", TRACE_OUTPUT_NAME);
+        }
+    }
+
+    if (-1 != poll_fd.fd)
+    {
+        close(poll_fd.fd);
+        poll_fd.fd = -1;
+    }
+}
 
 /**
  * @brief The main thread loop. Until receiving the signal shutdown, polls for incoming connections. After receiving a
- * connection, passes the fd into an atomic queue for the polling threads to receive and act upon.
+ * connection, picks a polling thread by the dispatch policy and passes the fd into that thread's lock-free ring
+ * queue. In ACCEPT_REUSEPORT mode the pollers accept for themselves and this loop only waits for shutdown.
  *
  * @param main_args The main data struct containing the auth hash
  * table, sessions queue, threadpool, poll queue, server, and directory fd.
@@ -16,26 +827,96 @@ int main_loop(main_data_t *main_data_args, poll_data_t *p_poll_args, int num_thr
     int ret = -1;
     int thread_index = 0;
     int client_sockfd = 0;
+    int num_accepted = 0;
     int poll_ret = 0;
     int poll_timeout = OS_TIMESLICE; // set to 100 m/s; a general OS scheduling timeslice
     nfds_t nfds = 1;                 // only require 1 poll fd in main for the server socket
     struct pollfd poll_fds[1] = {0};
-    queue_data_t p_queue_args = {0};
+    void *accepted[ACCEPT_BATCH];
+    struct timespec timeslice = {.tv_sec = 0, .tv_nsec = MAIN_OS_TIMESLICE};
+
+    if (ACCEPT_REUSEPORT == main_data_args->accept_mode) // each poller binds the port itself
+    {
+        close(main_data_args->server_sockfd);
+        main_data_args->server_sockfd = -1;
+    }
 
     for (thread_index = 0; thread_index < num_threads;
          ++thread_index) // initialize each thread running poll and some_server 
     {
-        thread_task(main_data_args->tpool, (thread_func)poll_func, (void *)p_poll_args);
+        // pollers run for the life of the server, so each gets its own thread and the pool workers stay free
+        if (-1 == wspool_submit(main_data_args->tpool, poll_func, (void *)p_poll_args, WSPOOL_TASK_LONG))
+        {
+            log_error("Failed to start poller %d.", thread_index);
+            goto END;
+        }
+    }
+    if (-1 == wspool_submit(main_data_args->tpool, snapshot_func, (void *)main_data_args, WSPOOL_TASK_LONG))
+    {
+        log_error("Failed to start the snapshot job.");
+        goto END;
+    }
+    add_metrics_probes(main_data_args);
+    if (-1 == sigflag_install(METRICS_DUMP_SIGNAL))
+    {
+        log_warn("No metrics dump on signal.");
+    }
+    if (0 != main_data_args->trace_enabled) // -t turns tracing on while the arguments are read
+    {
+        trace_enable(1);
+    }
+    trace_thread_name("main");
+    if (-1 == sigflag_install(TRACE_DUMP_SIGNAL))
+    {
+        log_warn("No trace dump on signal.");
+    }
+    if (-1 == wspool_submit(main_data_args->tpool, stats_func, (void *)main_data_args, WSPOOL_TASK_LONG))
+    {
+        log_warn("Failed to start the stats job."); // the server runs on without metrics output
+    }
+
+    if (ACCEPT_REUSEPORT == main_data_args->accept_mode)
+    {
+        while ((1 != server_shutdown) && (true == running)) // the pollers accept; wait for the shutdown signal
+        {
+            nanosleep(&timeslice, NULL);
+        }
+        ret = 0;
+        goto END;
+    }
+
+#ifdef USE_IO_URING
+    if (poller_uring_supported())
+    {
+        if (0 == uring_accept_loop(main_data_args, server_shutdown))
+        {
+            ret = 0;
+            goto END;
+        }
+        log_warn("io_uring accept failed. Falling back to poll().");
+    }
+#endif
+
+    // non-blocking so each wakeup can accept until the backlog is empty
+    if (-1 == fcntl(main_data_args->server_sockfd, F_SETFL, fcntl(main_data_args->server_sockfd, F_GETFL) | O_NONBLOCK))
+    {
+        log_perror("fcntl()");
+        goto END;
     }
     poll_fds[0].fd = main_data_args->server_sockfd; // setup poll_fds
     poll_fds[0].events = POLLIN | POLLERR | POLLRDHUP;
 
-    while (1 != server_shutdown) // Server functionality
+    // server_shutdown is this call's copy; running is the flag the signal handler clears, shared with the pollers
+    while ((1 != server_shutdown) && (true == running)) // Server functionality
     {
         poll_ret = poll(poll_fds, nfds, poll_timeout);
+        if ((poll_ret < 0) && (EINTR == errno)) // e.g. a metrics dump signal; a shutdown signal ends the loop above
+        {
+            continue;
+        }
         if (poll_ret < 0)
         {
-            perror("poll()");
+            log_perror("poll()");
             goto END;
         }
         if (poll_ret == 0)
@@ -44,134 +925,247 @@ int main_loop(main_data_t *main_data_args, poll_data_t *p_poll_args, int num_thr
         }
         else
         {
-            client_sockfd = client_accept(main_data_args->server_sockfd);
-
-            p_queue_args.client_sockfd = client_sockfd; // set p_queue_args arguments (currently just fd)
-            // atomic_enqueue the fd and arguments
-            debug_printf(("Sending polls a new conn.\n"));
-            if (-1 == aenqueue(main_data_args->poll_fd_queue, &p_queue_args))
+            // accept the whole burst, then hand it over at once; the fd itself is the queue item, so nothing allocates
+            num_accepted = 0;
+            while (ACCEPT_BATCH > num_accepted)
             {
-                fprintf(stderr, "Failed aenqueue()\n");
-                goto END;
+                client_sockfd = accept4(main_data_args->server_sockfd, NULL, NULL, SOCK_CLOEXEC);
+                if (-1 == client_sockfd)
+                {
+                    if ((EAGAIN != errno) && (EWOULDBLOCK != errno))
+                    {
+                        log_perror("accept4()");
+                    }
+                    break;
+                }
+                trace_point(TRACE_ACCEPT, client_sockfd);
+                accepted[num_accepted] = FD_TO_QITEM(client_sockfd);
+                num_accepted++;
             }
+            record_accepts(num_accepted);
+            dispatch_fds(main_data_args, accepted, num_accepted);
         }
     }
 
     ret = 0;
 END:
+    if (0 == ret)
+    {
+        log_worker_stats(main_data_args); // spread of connections across the pollers at shutdown
+    }
     return ret;
 }
 
 /**
- * @brief The polling function within each thread. Each thread actively checks an atomic queue for new connections,
- * otherwise polling existing fd connections. Upon polling readable connections, performs the desired server operation.
- * This allows asynchronous IO across each thread's poll.
+ * @brief The polling function within each thread. Each thread checks its own lock-free ring queue for new connections,
+ * otherwise polling existing fd connections. Upon polling readable connections, performs the desired server operation:
+ * with a conn_handler each connection keeps its own buffers and parse state and is served only as far as it can go
+ * without blocking, so a slow client never holds up the others; without one, some_server() handles the socket.
+ * This allows asynchronous IO across each thread's poll. In ACCEPT_REUSEPORT mode each thread also owns a SO_REUSEPORT
+ * listener and accepts its own connections, so they never cross threads.
  *
  * @param args The client args struct passed as a void pointer
  */
 void poll_func(void *args)
 {
     poll_data_t *p_poll_args = NULL;
-    AQUEUE_t *poll_fd_queue = NULL;
+    poll_worker_t *worker = NULL;
+    client_data_t client_args = {0};
     client_data_t *p_client_args = NULL;
-    queue_data_t *p_queue_args = NULL;
-    Q_NODE_t *temp = NULL;
-    struct pollfd poll_fds[MAX_FDS] = {0};
-    size_t num_fds = 1;
+    poller_t *poller = NULL;
+    poller_event_t events[POLLER_MAX_EVENTS];
+    transfers_t *transfers = NULL;
+    transfer_t *transfer = NULL;
+    transfer_t *next_transfer = NULL;
+    conns_t *conns = NULL;
+    conn_t *conn = NULL;
+    int listen_fd = -1;
+    int wake_fd = -1;
+    int worker_id = 0;
+    int cpu = -1;
     int poll_ret = 0;
     int poll_index = 0;
     int poll_timeout = 100;
-    nfds_t nfds = 1; // begin poll array with 1 fd
+    uint64_t busy_start = 0;
+    char thread_name[TRACE_NAME_MAX];
 
     if (NULL == args)
     {
-        fprintf(stderr, "Failed to pass client args.\n");
+        log_error("Failed to pass client args.");
         goto END;
     }
 
     p_poll_args = (poll_data_t *)args;
-    poll_fd_queue = p_poll_args->aqueue;
-    p_client_args = p_poll_args->client_args;
+    client_args = *p_poll_args->client_args; // this poller's own copy: some_server() is handed a socket through it
+    p_client_args = &client_args;
+
+    poller = create_poller(p_poll_args->poller_flags);
+    if (NULL == poller)
+    {
+        log_error("Failed to create poller.");
+        goto END;
+    }
+    transfers = create_transfers(poller); // some_server starts file transfers here through transfers_local()
+    if (NULL == transfers)
+    {
+        goto END;
+    }
+    if (NULL != p_poll_args->conn_handler) // the handler gets the server state; the socket comes with each conn
+    {
+        conns = create_conns(poller, transfers, p_poll_args->conn_handler, p_client_args);
+        if (NULL == conns)
+        {
+            goto END;
+        }
+    }
 
-    // setup poll_fds
-    for (poll_index = 0; poll_index < MAX_FDS; poll_index++)
+    worker_id = atomic_fetch_add(&p_poll_args->next_worker, 1);
+    worker = &p_poll_args->workers[worker_id % p_poll_args->num_workers];
+    snprintf(thread_name, sizeof(thread_name), "poller %d", worker_id);
+    trace_thread_name(thread_name);
+    if (p_poll_args->pin_workers)
+    {
+        cpu = pin_worker(worker_id);
+    }
+    if (ACCEPT_REUSEPORT == p_poll_args->accept_mode)
+    {
+        listen_fd = init_reuseport_listener(p_poll_args->port, cpu);
+        if ((-1 == listen_fd) || (-1 == poller_add(poller, listen_fd, POLLER_IN)))
+        {
+            log_error("Failed to set up worker %d listener.", worker_id);
+            goto END;
+        }
+    }
+    else if (-1 != worker->rqueue->wake_fd)
     {
-        poll_fds[poll_index].fd = -1;
-        poll_fds[poll_index].events = POLLIN | POLLERR | POLLRDHUP;
+        wake_fd = worker->rqueue->wake_fd;
+        if (-1 == poller_add(poller, wake_fd, POLLER_IN))
+        {
+            wake_fd = -1; // fall back to checking the queue every pass
+        }
+        register_handoffs(poller, worker, conns); // anything queued before the eventfd was watched
     }
 
     while (true == running) // poll functionality
     {
+        if (-1 == wake_fd) // no eventfd to sleep on; check for handoffs every pass
+        {
+            register_handoffs(poller, worker, conns);
+        }
 
-        if ((num_fds < MAX_FDS) && (poll_fd_queue->num_nodes > 0))
+        // 100 m/s timeout so we can exit out; no wait while transfers that yielded can still make progress
+        poll_ret = poller_wait(poller, events, POLLER_MAX_EVENTS, (NULL == transfers->ready) ? poll_timeout : 0);
+        if (0 > poll_ret)
         {
-            temp = adequeue(poll_fd_queue, 0); // peek here, then dequeue after some server
-                                               // p_poll_args = (Q_NODE_t *)p_poll_args;
-            if (NULL == temp)
+            if (EINTR == errno)
             {
                 continue;
             }
-
-            p_queue_args = (queue_data_t *)temp->data;
-
-            p_client_args->client_sockfd = p_queue_args->client_sockfd;
-
-            // check if num_fds = -1, if so add
-            for (poll_index = 0; poll_index < num_fds; poll_index++)
-            {
-                if (-1 == poll_fds[poll_index].fd)
-                {
-                    poll_fds[poll_index].fd = p_queue_args->client_sockfd;
-                    break;
-                }
-            }
-
-            num_fds++;
-            nfds = num_fds;
-            free(temp);
-            temp = NULL;
+            log_perror("poller_wait() error'd");
+            goto END;
         }
-
-        poll_ret = poll(poll_fds, nfds, poll_timeout); // timeout set to 100 m/s so not blocking & can exit out
-        if (0 > poll_ret)
+        busy_start = metrics_now();
+        metrics_add(METRIC_POLL_WAKEUPS, 1);
+        if (0 == poll_ret)
         {
-            perror("poll() error'd");
-            goto END;
+            metrics_add(METRIC_POLL_TIMEOUTS, 1);
         }
-
-        if (0 == poll_ret) // poll timeout; waiting for event
+        else
         {
-            continue;
+            metrics_add(METRIC_POLL_EVENTS, (uint64_t)poll_ret);
+            metrics_record(METRIC_EVENTS_PER_WAKEUP, (uint64_t)poll_ret);
         }
 
-        for (size_t iter = 0; iter < num_fds; iter++)
+        expire_sessions(p_client_args->p_sessions); // one poller per tick sweeps the sessions timing wheel
+
+        for (poll_index = 0; poll_index < poll_ret; poll_index++) // only ready fds are visited
         {
-            if (POLLERR == (poll_fds[iter].revents & POLLERR))
+            transfer = transfer_find(transfers, events[poll_index].fd);
+            if (listen_fd == events[poll_index].fd)
             {
-                fprintf(stderr, "ERROR.\n");
-                poll_fds[iter].fd = -1;
+                accept_ready(poller, worker, conns, listen_fd);
             }
-            else if ((POLLHUP == (poll_fds[iter].revents & POLLHUP)) ||
-                     (POLLRDHUP == (poll_fds[iter].revents & POLLRDHUP)))
+            else if (wake_fd == events[poll_index].fd) // the main thread handed over connections
             {
-                debug_printf(("Client hung up.\n"));
-                close(poll_fds[iter].fd);
-                poll_fds[iter].fd = -1;
+                rqueue_wakeup_ack(worker->rqueue);
+                register_handoffs(poller, worker, conns);
             }
-            else if (POLLIN == (poll_fds[iter].revents & POLLIN))
+            else if (POLLER_ERR & events[poll_index].events)
             {
-                p_client_args->client_sockfd = poll_fds[iter].fd;
-                some_server(p_client_args); // perform server functionality
+                log_error("ERROR.");
+                close_client(poller, worker, transfers, conns, events[poll_index].fd);
             }
-            else
+            else if (NULL != transfer)
             {
-                debug_printf(("poll() waiting."));
-                continue;
+                // the peer's shutdown only ends its input: an upload reads to the end and fails if it is short, a
+                // download goes on, and a client that is gone fails the next send with EPIPE or ECONNRESET
+                if ((POLLER_IN | POLLER_OUT | POLLER_RDHUP) & events[poll_index].events)
+                {
+                    serve_transfer(poller, worker, transfers, conns, transfer);
+                }
+                if ((POLLER_HUP & events[poll_index].events) && // both directions closed; an upload drained first
+                    (NULL != transfer_find(transfers, events[poll_index].fd)))
+                {
+                    close_client(poller, worker, transfers, conns, events[poll_index].fd);
+                }
+            }
+            else if (NULL != (conn = conn_find(conns, events[poll_index].fd)))
+            {
+                if (POLLER_IN & events[poll_index].events)
+                {
+                    trace_point(TRACE_READABLE, events[poll_index].fd);
+                }
+                // reads, parses and writes what it can without blocking, then returns to the other connections
+                if (-1 == conn_ready(conns, conn, events[poll_index].events))
+                {
+                    close_client(poller, worker, transfers, conns, events[poll_index].fd);
+                }
+            }
+            else if ((POLLER_HUP | POLLER_RDHUP) & events[poll_index].events)
+            {
+                log_debug("Client hung up.");
+                close_client(poller, worker, transfers, conns, events[poll_index].fd);
+            }
+            else if (POLLER_IN & events[poll_index].events)
+            {
+                trace_point(TRACE_READABLE, events[poll_index].fd);
+                p_client_args->client_sockfd = events[poll_index].fd;
+                trace_point(TRACE_HANDLER_START, events[poll_index].fd);
+                some_server(p_client_args); // perform server functionality
+                trace_point(TRACE_HANDLER_END, events[poll_index].fd);
             }
         }
+
+        // transfers that used their budget last turn go again now that every other ready fd has had its turn
+        for (transfer = transfers_take_ready(transfers); NULL != transfer; transfer = next_transfer)
+        {
+            next_transfer = transfer->next;
+            serve_transfer(poller, worker, transfers, conns, transfer);
+        }
+        metrics_record(METRIC_POLL_BUSY_NS, metrics_now() - busy_start);
     }
 
 END:
+    if (-1 != listen_fd)
+    {
+        close(listen_fd);
+        listen_fd = -1;
+    }
+    if (NULL != conns)
+    {
+        destroy_conns(conns);
+        conns = NULL;
+    }
+    if (NULL != transfers)
+    {
+        destroy_transfers(transfers);
+        transfers = NULL;
+    }
+    if (NULL != poller)
+    {
+        destroy_poller(poller);
+        poller = NULL;
+    }
     return;
 }
 
@@ -189,25 +1183,32 @@ poll_data_t *init_p_poll_args(main_data_t *main_args)
 
     if (NULL == main_args)
     {
-        fprintf(stderr, "Null main_args.\n");
+        log_error("Null main_args.");
         goto FAIL;
     }
 
     temp_args = calloc(1, sizeof(poll_data_t));
     if (NULL == temp_args)
     {
-        fprintf(stderr, "Failed to alloc p_poll_args\n");
+        log_error("Failed to alloc p_poll_args");
         goto END;
     }
 
     temp_args->client_args = calloc(1, sizeof(client_data_t));
     if (NULL == temp_args->client_args)
     {
-        fprintf(stderr, "Failed to alloc p_poll_args->client_args");
+        log_error("Failed to alloc p_poll_args->client_args");
         goto FAIL;
     }
 
-    temp_args->aqueue = main_args->poll_fd_queue;
+    temp_args->workers = main_args->workers;
+    temp_args->num_workers = main_args->num_workers;
+    temp_args->conn_handler = main_args->conn_handler;
+    temp_args->poller_flags = main_args->poller_flags;
+    temp_args->accept_mode = main_args->accept_mode;
+    temp_args->pin_workers = main_args->pin_workers;
+    temp_args->port = main_args->port;
+    atomic_init(&temp_args->next_worker, 0);
     temp_args->client_args->p_auth_table = main_args->p_auth_table;
     temp_args->client_args->p_storage_table = main_args->p_storage_table;
     temp_args->client_args->p_sessions = main_args->p_sessions;
@@ -246,74 +1247,120 @@ main_data_t *init_main_data(char *p_port, char *p_base_dir, int num_threads)
 {
     main_data_t *ret = NULL;
     main_data_t *new_main_data = NULL;
+    shimage_t *storage_image = NULL;
 
+    log_start(STDERR_FILENO); // from here on the pollers never write to stderr themselves; on failure logging is direct
+    if (SIG_ERR == signal(SIGPIPE, SIG_IGN)) // sendfile() has no MSG_NOSIGNAL; a client gone mid-send gets EPIPE
+    {
+        log_perror("signal(SIGPIPE)");
+        goto FAIL;
+    }
     new_main_data = calloc(1, sizeof(main_data_t));
     if (NULL == new_main_data)
     {
-        fprintf(stderr, "Failed to alloc new_main_data\n");
+        log_error("Failed to alloc new_main_data");
         goto FAIL;
     }
 
     // checks
-    new_main_data->p_auth_table = create_hashtable((hash_func)djb2); // Authentication table setup
+    // Authentication table setup; filled from disk below. Usernames are chosen by clients, so the table is pinned to
+    // keyed SipHash rather than whatever SHTABLE_DEFAULT_HASH becomes: without the seed no one can pick colliding names
+    new_main_data->p_auth_table = create_shtable(hash_siphash13);
     if (NULL == new_main_data->p_auth_table)
     {
-        fprintf(stderr, "Failed to create authentication table. Exiting.");
+        log_error("Failed to create authentication table. Exiting.");
         goto FAIL;
     }
 
-    new_main_data->p_storage_table = create_hashtable((hash_func)djb2); // Authentication table setup
+    new_main_data->p_storage_table = create_shtable(NULL); // Storage table setup; filled from disk below
     if (NULL == new_main_data->p_storage_table)
     {
-        fprintf(stderr, "Failed to create storage table. Exiting.");
+        log_error("Failed to create storage table. Exiting.");
         goto FAIL;
     }
 
-    new_main_data->p_sessions = create_sessions_queue(); // Sessions setup
+    new_main_data->p_sessions = create_sessions_table(); // Sessions setup
     if (NULL == new_main_data->p_sessions)
     {
-        fprintf(stderr, "Failed to create sessions queue. Exiting.\n");
+        log_error("Failed to create sessions table. Exiting.");
         goto FAIL;
     }
 
-    new_main_data->tpool = create_threadpool(num_threads); // Threadpool setup
+    new_main_data->tpool = create_wspool(0); // Threadpool setup; one short task worker per CPU
     if (NULL == new_main_data->tpool)
     {
-        fprintf(stderr, "Failed to allocate threadpool.\n");
+        log_error("Failed to allocate threadpool.");
         goto FAIL;
     }
-    threads_init(new_main_data->tpool, &thread_spin, num_threads);
 
     if (NULL == p_base_dir)
     {
-        fprintf(stderr, "Invalid root dir set. Exiting.\n");
+        log_error("Invalid root dir set. Exiting.");
         goto FAIL;
     }
 
-    new_main_data->poll_fd_queue = calloc(1, sizeof(AQUEUE_t)); // poll queue setup
-    if (NULL == new_main_data->poll_fd_queue)
+    new_main_data->workers = create_poll_workers(num_threads); // poll queues setup
+    if (NULL == new_main_data->workers)
     {
-        fprintf(stderr, "Failed to init poll_fd_queue");
+        log_error("Failed to init poll workers");
         goto FAIL;
     }
+    new_main_data->num_workers = num_threads;
+
+    new_main_data->poller_flags = DEFAULT_POLLER_FLAGS;
+    new_main_data->accept_mode = DEFAULT_ACCEPT_MODE;
+    new_main_data->pin_workers = DEFAULT_PIN_WORKERS;
+    new_main_data->dispatch_policy = DEFAULT_DISPATCH;
+    new_main_data->wal_sync_policy = DEFAULT_WAL_SYNC;
+    new_main_data->conn_handler = DEFAULT_CONN_HANDLER;
+    new_main_data->port = p_port;
+    new_main_data->stats_port = DEFAULT_STATS_PORT;
+    new_main_data->trace_enabled = DEFAULT_TRACE;
 
     new_main_data->root_dir_fd = open(p_base_dir, O_PATH); // root directory setup
     if (-1 == new_main_data->root_dir_fd)
     {
-        perror("Failed to open the directory.\n");
+        log_perror("Failed to open the directory.");
         goto FAIL;
     }
 
     if (-1 == authentication_setup(new_main_data->p_auth_table, new_main_data->root_dir_fd))
     {
-        fprintf(stderr, "Failed to set up authentication table. Exiting.\n");
+        log_error("Failed to set up authentication table. Exiting.");
+        goto FAIL;
+    }
+
+    // the image first, then the log written since it; both before attaching the log, so nothing is logged again.
+    // The image is mapped, not read, so startup does not grow with the table.
+    if (-1 == shimage_open(new_main_data->root_dir_fd, STORAGE_IMAGE_NAME, &storage_image))
+    {
+        log_error("Failed to open storage image. Exiting.");
+        goto FAIL;
+    }
+    if ((NULL != storage_image) && (-1 == shtable_attach_image(new_main_data->p_storage_table, storage_image)))
+    {
+        shimage_close(storage_image);
+        log_error("Failed to attach storage image. Exiting.");
+        goto FAIL;
+    }
+    new_main_data->p_storage_wal = wal_open(new_main_data->root_dir_fd, STORAGE_WAL_NAME,
+                                            new_main_data->wal_sync_policy, shtable_apply_wal,
+                                            new_main_data->p_storage_table);
+    if (NULL == new_main_data->p_storage_wal)
+    {
+        log_error("Failed to open storage log. Exiting.");
+        goto FAIL;
+    }
+    if (-1 == shtable_attach_wal(new_main_data->p_storage_table, new_main_data->p_storage_wal))
+    {
+        log_error("Failed to attach storage log. Exiting.");
         goto FAIL;
     }
 
     new_main_data->server_sockfd = init_server_tcp(p_port, 1); // server setup
     if (-1 == new_main_data->server_sockfd)
     {
-        fprintf(stderr, "Failed init_server_tcp()");
+        log_error("Failed init_server_tcp()");
         goto FAIL;
     }
 
@@ -322,13 +1369,76 @@ main_data_t *init_main_data(char *p_port, char *p_base_dir, int num_threads)
 FAIL:
     if (-1 == main_cleanup(new_main_data, num_threads, NULL))
     {
-        fprintf(stderr, "Failed new main args cleanup.\n");
+        log_error("Failed new main args cleanup.");
+    }
+
+END:
+    return ret;
+}
+
+/**
+ * @brief Reads the live connection counts of every poller and how evenly they are spread.
+ *
+ * @param main_args The main data struct holding the pollers' workers
+ * @param stats struct to fill in
+ * @return returns 0 on success, or -1 on failure
+ */
+int poll_worker_stats(main_data_t *main_args, worker_stats_t *stats)
+{
+    int ret = -1;
+    int worker_index = 0;
+    int num_conns = 0;
+
+    if ((NULL == main_args) || (NULL == main_args->workers) || (NULL == stats))
+    {
+        log_error("Invalid main_args or stats passed.");
+        goto END;
+    }
+
+    memset(stats, 0, sizeof(worker_stats_t));
+    stats->num_workers = main_args->num_workers;
+    stats->min_conns = INT_MAX;
+    for (worker_index = 0; worker_index < main_args->num_workers; worker_index++)
+    {
+        num_conns = atomic_load_explicit(&main_args->workers[worker_index].num_conns, memory_order_relaxed);
+        stats->min_conns = (num_conns < stats->min_conns) ? num_conns : stats->min_conns;
+        stats->max_conns = (num_conns > stats->max_conns) ? num_conns : stats->max_conns;
+        stats->total_conns += num_conns;
+        stats->dispatched += atomic_load_explicit(&main_args->workers[worker_index].total_conns, memory_order_relaxed);
+    }
+    stats->imbalance = 1.0;
+    if (0 < stats->total_conns)
+    {
+        stats->imbalance = (double)stats->max_conns * stats->num_workers / stats->total_conns;
     }
 
+    ret = 0;
 END:
     return ret;
 }
 
+/**
+ * @brief Logs how connections are spread across the pollers, at LOG_LEVEL_INFO. Each poller's own counts are the
+ * poller_conns metrics.
+ *
+ * @param main_args The main data struct holding the pollers' workers
+ */
+void log_worker_stats(main_data_t *main_args)
+{
+    worker_stats_t stats = {0};
+
+    if (-1 == poll_worker_stats(main_args, &stats))
+    {
+        goto END;
+    }
+
+    log_info("pollers: %d live connections (min %d, max %d, imbalance %.2f), %zu dispatched", stats.total_conns,
+             stats.min_conns, stats.max_conns, stats.imbalance, stats.dispatched);
+
+END:
+    return;
+}
+
 /**
  * @brief Cleans up the structs initialized in main; main_data_args and p_poll_args
  *
@@ -343,46 +1453,48 @@ int main_cleanup(main_data_t *main_args, int num_threads, poll_data_t *poll_args
     int ret = -1;
     if (NULL == main_args)
     {
-        debug_printf(("Null main_args\n"));
+        log_debug("Null main_args");
         goto END;
     }
 
-    if (-1 == shutdown_threadpool(main_args->tpool, num_threads))
-    {
-        fprintf(stderr, "Failed to shutdown threadpool\n");
-        goto END;
-    }
-    if (-1 == destroy_threadpool(main_args->tpool))
+    if (-1 == destroy_wspool(main_args->tpool)) // joins the pollers, which exit once running is cleared
     {
-        fprintf(stderr, "Failed to destroy threadpool\n");
+        log_error("Failed to destroy threadpool");
         goto END;
     }
+    metrics_clear_probes(); // the stats job that reads them has been joined
     if (-1 == destroy_sessions(main_args->p_sessions))
     {
-        fprintf(stderr, "Failed to destroy sessions queue.\n");
+        log_error("Failed to destroy sessions table.");
         goto END;
     }
 
     if (-1 == dump_table(main_args->p_auth_table, main_args->root_dir_fd, "auth_users", 1))
     {
-        fprintf(stderr, "Failed to dump auth_table.\n");
+        log_error("Failed to dump auth_table.");
         goto END;
     }
-    if (-1 == empty_authtable(main_args->p_auth_table))
+    if (-1 == destroy_shtable(main_args->p_auth_table))
     {
-        fprintf(stderr, "Failed to destroy sessions authentication table.\n");
+        log_error("Failed to destroy sessions authentication table.");
         goto END;
     }
-    if (-1 == empty_storagetable(main_args->p_storage_table))
+    if ((NULL != main_args->p_storage_wal) && (-1 == wal_close(main_args->p_storage_wal)))
+    {
+        log_error("Failed to flush storage log; recent writes may be lost.");
+    }
+    main_args->p_storage_wal = NULL;
+    if (-1 == destroy_shtable(main_args->p_storage_table))
     {
-        fprintf(stderr, "Failed to destroy sessions authentication table.\n");
+        log_error("Failed to destroy storage table.");
         goto END;
     }
-    if (-1 == adestroy(main_args->poll_fd_queue))
+    if (-1 == destroy_poll_workers(main_args->workers, main_args->num_workers))
     {
-        fprintf(stderr, "Failed to destroy sessions authentication table.\n");
+        log_error("Failed to destroy poll queues.");
         goto END;
     }
+    main_args->workers = NULL;
     close(main_args->root_dir_fd);
     close(main_args->server_sockfd);
 
@@ -398,6 +1510,7 @@ int main_cleanup(main_data_t *main_args, int num_threads, poll_data_t *poll_args
 END:
     free(main_args);
     main_args = NULL;
+    log_stop(); // every thread that logs has been joined; write out what they queued
 
     return ret;
 }
@@ -415,6 +1528,7 @@ int read_args(int opt, uint32_t *num_threads, char **port, char **base_dir)
 {
     int b_ret = -1;
     uint32_t port_check = 0;
+    int level = 0;
     char *p_opt_arg = NULL;
     switch (opt)
     {
@@ -422,7 +1536,7 @@ int read_args(int opt, uint32_t *num_threads, char **port, char **base_dir)
         *base_dir = optarg;
         if (0 == strncmp(*base_dir, "/", 2))
         {
-            fprintf(stderr, "Cannot set the chat log directory to local root directory.\n");
+            log_error("Cannot set the chat log directory to local root directory.");
             goto END;
         }
         break;
@@ -431,12 +1545,12 @@ int read_args(int opt, uint32_t *num_threads, char **port, char **base_dir)
         port_check = strtol(*port, &p_opt_arg, 10);
         if (0 != *p_opt_arg)
         {
-            fprintf(stderr, "Failed to convert string. Exiting\n");
+            log_error("Failed to convert string. Exiting");
             goto END;
         }
         else if ((0 > port_check) || (65535 < port_check))
         {
-            fprintf(stderr, "Invalid port range. Please try another port.\n");
+            log_error("Invalid port range. Please try another port.");
             goto END;
         }
 
@@ -445,21 +1559,35 @@ int read_args(int opt, uint32_t *num_threads, char **port, char **base_dir)
         *num_threads = strtol(optarg, &p_opt_arg, 10);
         if (0 != *p_opt_arg)
         {
-            fprintf(stderr, "Failed to convert string. Exiting\n");
+            log_error("Failed to convert string. Exiting");
             goto END;
         }
         else if (0 == num_threads)
         {
-            fprintf(stderr, "Cannot set 0 threads. Exiting.\n\n");
+            log_error("Cannot set 0 threads. Exiting.");
+            goto END;
+        }
+        break;
+    case 'l':
+        level = log_level_from_name(optarg);
+        if (-1 == level)
+        {
+            log_error("Invalid log level. Use off, error, warn, info or debug.");
             goto END;
         }
+        log_set_level(level);
+        break;
+    case 't':
+        trace_enable(1); // each request then pays a clock read per trace point, and each thread a trace ring
         break;
     case 'h':
         fprintf(stdout, "file transfer capstone - secure file transfer service\n\nUsage: capstone "
                         "[options...]\n\n\t-d\tset the server's root directory\n\t-p\tset the server's "
-                        "port\n\t-n\tset the number of server threads\n\n");
+                        "port\n\t-n\tset the number of server threads\n\t-l\tset the log level: off, error, warn, "
+                        "info (default) or debug\n\t-t\trecord request traces, written to " TRACE_OUTPUT_NAME
+                        " on SIGUSR2\n\n");
     default:
-        debug_printf(("Invalid option passed.\n"));
+        log_debug("Invalid option passed.");
         goto END;
     }
 
@@ -482,12 +1610,12 @@ int args_check(char *port, char *base_dir, int num_threads)
 
     if (NULL == base_dir)
     {
-        fprintf(stderr, "Chat log directory required. Exiting.\n");
+        log_error("Chat log directory required. Exiting.");
         goto END;
     }
     if (0 >= num_threads)
     {
-        fprintf(stderr, "Invalid number of threads.\n");
+        log_error("Invalid number of threads.");
         goto END;
     }
 
@@ -496,4 +1624,4 @@ END:
     return ret;
 }
 
-/*** end of file ***/threadpoll/
+/*** end of file ***/
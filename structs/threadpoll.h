@@ -2,47 +2,115 @@
 #define MAIN_FUNCS_H
 
 // #include "some_server.h"
+#include "conns.h"
+#include "metrics.h"
+#include "shtable.h"
+#include "sigflag.h"
+#include "trace.h"
+#include "wal.h"
+#include "wspool.h"
 
 #define DEFAULT_PORT "8989"
 #define DEFAULT_THREADS 4
 #define MAIN_OS_TIMESLICE 100000000L // 100 m/s
+#define DEFAULT_POLLER_FLAGS 0       // level-triggered; POLLER_EDGE requires some_server to read until EAGAIN
+#define ACCEPT_BATCH 64 // most connections accepted, handed over or drained per queue operation
+#define DEFAULT_ACCEPT_MODE ACCEPT_SHARED
+#define DEFAULT_PIN_WORKERS 0 // 1 pins each poller to a CPU and steers its listener's connections to that CPU
+#define DEFAULT_DISPATCH DISPATCH_LEAST_CONN
+#define DEFAULT_WAL_SYNC WAL_DEFAULT_SYNC
+#define DEFAULT_CONN_HANDLER NULL // conn_handler_func serving connections as state machines; NULL: some_server()
+#define STORAGE_WAL_NAME "storage.wal"       // storage table log, under the root directory
+#define STORAGE_IMAGE_NAME "storage.img"     // storage table image, under the root directory
+#define SNAPSHOT_INTERVAL_SEC 60             // least time between storage snapshots
+#define SNAPSHOT_MIN_LOG (16 << 20)          // log bytes written since the last snapshot before another is worth it
+#define DEFAULT_STATS_PORT METRICS_DEFAULT_PORT // loopback-only metrics listener; NULL leaves only the signal dump
+#define DEFAULT_TRACE 0 // 1 records request trace points, dumped to TRACE_OUTPUT_NAME on TRACE_DUMP_SIGNAL; or pass -t
+
+#define ACCEPT_SHARED 0    // main_loop accepts on server_sockfd and hands fds to the pollers through their queues
+#define ACCEPT_REUSEPORT 1 // every poller accepts on its own SO_REUSEPORT listener; the kernel spreads connections
+
+#define DISPATCH_ROUND_ROBIN 0 // hand connections to the pollers in turn
+#define DISPATCH_LEAST_CONN 1  // hand each connection to the poller with the fewest live connections
+#define DISPATCH_PEER_HASH 2   // hand every connection from one peer address to the same poller
+
+// accepted fds travel through the poll queues as non-NULL pointers; fd 0 would otherwise look like an empty dequeue
+#define FD_TO_QITEM(fd) ((void *)(intptr_t)((fd) + 1))
+#define QITEM_TO_FD(item) ((int)((intptr_t)(item)-1))
+
+/**
+ * @brief a poller thread's inbound connection queue and its load. num_conns counts connections handed to the poller
+ * and not yet closed; the dispatcher adds to it at handoff and the poller subtracts as it closes them. Each worker has
+ * its own cache line so pollers updating their counts do not false share.
+ */
+typedef struct poll_worker
+{
+    _Alignas(CACHE_LINE_SIZE) RQUEUE_t *rqueue;
+    atomic_int num_conns;
+    atomic_size_t total_conns; // connections ever handed to this poller
+} poll_worker_t;
+
+/**
+ * @brief spread of live connections across the pollers. imbalance is the busiest poller's count over the mean; 1.0 is
+ * a perfectly even spread.
+ */
+typedef struct worker_stats
+{
+    int num_workers;
+    int min_conns;
+    int max_conns;
+    int total_conns;
+    size_t dispatched;
+    double imbalance;
+} worker_stats_t;
 
 /**
  * @brief a struct to store all initialized server structures and variables
  */
 typedef struct main_data
 {
-    hash_table_t *p_auth_table;
-    hash_table_t *p_storage_table;
-    QUEUE_t *p_sessions;
-    thpool *tpool;
-    AQUEUE_t *poll_fd_queue;
+    shtable_t *p_auth_table;
+    shtable_t *p_storage_table;
+    wal_t *p_storage_wal; // every storage write is logged here and replayed at startup
+    sessions_t *p_sessions;
+    wspool_t *tpool;
+    poll_worker_t *workers;
+    int num_workers;
+    int dispatch_policy;
+    int next_dispatch; // round robin position
+    int wal_sync_policy;
+    conn_handler_func conn_handler;
     int root_dir_fd;
     int server_sockfd;
+    int poller_flags;
+    int accept_mode;
+    int pin_workers;
+    char *port;
+    const char *stats_port;
+    int trace_enabled;
 } main_data_t;
 
 /**
- * @brief a struct to hold client_data (operational) arguments, and the atomic qeueue checked by the polling thread
- * functions
+ * @brief a struct to hold client_data (operational) arguments, and the per-poller workers whose queues are checked by
+ * the polling thread functions
  */
 typedef struct _poll_data // passed to the threaded poll func
 {
-    AQUEUE_t *aqueue;
-    client_data_t *client_args;
+    poll_worker_t *workers;
+    int num_workers;
+    client_data_t *client_args; // shared by a poller's connections; per-connection state lives in its conn_t
+    conn_handler_func conn_handler;
+    int poller_flags;
+    int accept_mode;
+    int pin_workers;
+    char *port;
+    atomic_int next_worker; // each poll_func claims a worker from this on start
 } poll_data_t;
 
-/**
- * @brief a struct to hold client_data (operational) arguments, and the client socket descriptor
- */
-typedef struct _queue_data // passed to the threaded poll func
-{
-    int client_sockfd;
-    // could also include additional socket information for logging
-} queue_data_t;
-
 /**
  * @brief The main thread loop. Until receiving the signal shutdown, polls for incoming connections. After receiving a
- * connection, passes the fd into an atomic queue for the polling threads to receive and act upon.
+ * connection, picks a polling thread by the dispatch policy and passes the fd into that thread's lock-free ring
+ * queue. In ACCEPT_REUSEPORT mode the pollers accept for themselves and this loop only waits for shutdown.
  *
  * @param main_args The main data struct containing the auth hash
  * table, sessions queue, threadpool, poll queue, server, and directory fd.
@@ -53,6 +121,23 @@ typedef struct _queue_data // passed to the threaded poll func
  */
 int main_loop(main_data_t *main_data_args, poll_data_t *p_poll_args, int num_threads, sig_atomic_t server_shutdown);
 
+/**
+ * @brief Reads the live connection counts of every poller and how evenly they are spread.
+ *
+ * @param main_args The main data struct holding the pollers' workers
+ * @param stats struct to fill in
+ * @return returns 0 on success, or -1 on failure
+ */
+int poll_worker_stats(main_data_t *main_args, worker_stats_t *stats);
+
+/**
+ * @brief Logs how connections are spread across the pollers, at LOG_LEVEL_INFO. Each poller's own counts are the
+ * poller_conns metrics.
+ *
+ * @param main_args The main data struct holding the pollers' workers
+ */
+void log_worker_stats(main_data_t *main_args);
+
 /**
  * @brief Cleans up the structs initialized in main; main_data_args and p_poll_args
  *
@@ -86,8 +171,11 @@ poll_data_t *init_p_poll_args(main_data_t *main_args);
 main_data_t *init_main_data(char *p_port, char *p_base_dir, int num_threads);
 
 /**
- * @brief The polling function within each thread. Each thread actively checks an atomic queue for new connections,
- * otherwise polling existing fd connections. Upon polling readable connections, performs the desired server operation.
+ * @brief The polling function within each thread. Each thread checks its own lock-free ring queue for new connections,
+ * otherwise polling existing fd connections. Upon polling readable connections, performs the desired server operation:
+ * with a conn_handler each connection keeps its own buffers and parse state and is served only as far as it can go
+ * without blocking, so a slow client never holds up the others; without one, some_server() handles the socket.
+ * In ACCEPT_REUSEPORT mode each thread also owns a SO_REUSEPORT listener and accepts its own connections.
  *
  * @param args The client args struct passed as a void pointer
  */
@@ -0,0 +1,204 @@
+#include "../include/timerwheel.h"
+
+/**
+ * @brief Links a timer into the slot for its expiry, relative to the wheel's current tick.
+ *
+ * @param wheel the wheel to link the timer into
+ * @param timer the timer to link; must not be armed
+ * @param earliest the first tick the timer may fire at: the next one when arming, as the current tick's slot has been
+ * emptied already, or the current one when cascading, as its slot is emptied right after
+ */
+static void tw_link(timer_wheel_t *wheel, tw_timer_t *timer, uint64_t earliest)
+{
+    uint64_t delta = 0;
+    int level = 0;
+    tw_timer_t *head = NULL;
+
+    if (timer->expires < earliest)
+    {
+        timer->expires = earliest;
+    }
+    delta = timer->expires - wheel->now;
+    if (TW_MAX_DELTA < delta)
+    {
+        timer->expires = wheel->now + TW_MAX_DELTA;
+        delta = TW_MAX_DELTA;
+    }
+
+    // the lowest level whose span covers the delta
+    while (((TW_LEVELS - 1) > level) && (delta >= (UINT64_C(1) << (TW_SLOT_BITS * (level + 1)))))
+    {
+        level++;
+    }
+
+    head = &wheel->slots[level][(timer->expires >> (TW_SLOT_BITS * level)) & TW_SLOT_MASK];
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+    wheel->count++;
+}
+
+/**
+ * @brief Unlinks an armed timer from its slot.
+ *
+ * @param wheel the wheel the timer is linked into
+ * @param timer the timer to unlink
+ */
+static void tw_unlink(timer_wheel_t *wheel, tw_timer_t *timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->prev = NULL;
+    timer->next = NULL;
+    wheel->count--;
+}
+
+/**
+ * @brief Re-links every timer in a higher level slot against the current tick, moving each down a level or more.
+ *
+ * @param wheel the wheel to cascade
+ * @param level the level of the slot
+ * @param slot the slot index
+ */
+static void tw_cascade(timer_wheel_t *wheel, int level, int slot)
+{
+    tw_timer_t *head = &wheel->slots[level][slot];
+    tw_timer_t *timer = NULL;
+
+    while (head->next != head)
+    {
+        timer = head->next;
+        tw_unlink(wheel, timer);
+        tw_link(wheel, timer, wheel->now); // due now: lands in the level 0 slot tw_advance() empties next
+    }
+}
+
+/**
+ * @brief Initializes an empty timing wheel.
+ *
+ * @param wheel the wheel to initialize
+ * @param now the current tick
+ */
+void tw_init(timer_wheel_t *wheel, uint64_t now)
+{
+    int level = 0;
+    int slot = 0;
+
+    wheel->now = now;
+    wheel->count = 0;
+    for (level = 0; level < TW_LEVELS; level++)
+    {
+        for (slot = 0; slot < TW_SLOTS; slot++)
+        {
+            wheel->slots[level][slot].prev = &wheel->slots[level][slot];
+            wheel->slots[level][slot].next = &wheel->slots[level][slot];
+        }
+    }
+}
+
+/**
+ * @brief Initializes a timer so it can be armed and cancelled.
+ *
+ * @param timer the timer to initialize
+ */
+void tw_timer_init(tw_timer_t *timer)
+{
+    timer->expires = 0;
+    timer->prev = NULL;
+    timer->next = NULL;
+}
+
+/**
+ * @brief Arms a timer to fire at the given tick. Re-arming an armed timer moves it, so this is also the refresh path.
+ * Ticks at or before the wheel's current tick fire on the next advance.
+ *
+ * @param wheel the wheel to arm the timer on
+ * @param timer the timer to arm
+ * @param expires the tick the timer should fire at
+ */
+void tw_arm(timer_wheel_t *wheel, tw_timer_t *timer, uint64_t expires)
+{
+    if (tw_armed(timer))
+    {
+        tw_unlink(wheel, timer);
+    }
+    timer->expires = expires;
+    tw_link(wheel, timer, wheel->now + 1);
+}
+
+/**
+ * @brief Cancels a timer. Cancelling a timer that is not armed does nothing.
+ *
+ * @param wheel the wheel the timer is armed on
+ * @param timer the timer to cancel
+ */
+void tw_cancel(timer_wheel_t *wheel, tw_timer_t *timer)
+{
+    if (tw_armed(timer))
+    {
+        tw_unlink(wheel, timer);
+    }
+}
+
+/**
+ * @brief Checks if a timer is armed.
+ *
+ * @param timer the timer to check
+ * @return returns 1 if the timer is armed, otherwise returns 0
+ */
+int tw_armed(tw_timer_t *timer)
+{
+    return (NULL != timer->prev) ? 1 : 0; // fired timers reuse next for the expired list, so only prev is checked
+}
+
+/**
+ * @brief Moves the wheel forward to the given tick and unlinks every timer that fired on the way. At most
+ * TW_MAX_TICKS_PER_ADVANCE ticks are processed per call; the rest are caught up on later calls.
+ *
+ * @param wheel the wheel to advance
+ * @param now the current tick
+ * @return a NULL-terminated list of fired timers linked through next, or NULL if none fired
+ */
+tw_timer_t *tw_advance(timer_wheel_t *wheel, uint64_t now)
+{
+    tw_timer_t *ret = NULL;
+    tw_timer_t *head = NULL;
+    tw_timer_t *timer = NULL;
+    int ticks = 0;
+    int level = 0;
+    int slot = 0;
+
+    while ((wheel->now < now) && (TW_MAX_TICKS_PER_ADVANCE > ticks))
+    {
+        wheel->now++;
+        ticks++;
+
+        // on a level 0 wrap, pull the next slot of each higher level down, top level first
+        for (level = 1; level < TW_LEVELS; level++)
+        {
+            if (0 != ((wheel->now >> (TW_SLOT_BITS * (level - 1))) & TW_SLOT_MASK))
+            {
+                break;
+            }
+        }
+        for (level = level - 1; level > 0; level--)
+        {
+            tw_cascade(wheel, level, (wheel->now >> (TW_SLOT_BITS * level)) & TW_SLOT_MASK);
+        }
+
+        slot = wheel->now & TW_SLOT_MASK;
+        head = &wheel->slots[0][slot];
+        while (head->next != head)
+        {
+            timer = head->next;
+            tw_unlink(wheel, timer);
+            timer->next = ret;
+            ret = timer;
+        }
+    }
+
+    return ret;
+}
+
+/*** end of file ***/
@@ -0,0 +1,90 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TW_LEVELS 4
+#define TW_SLOT_BITS 6
+#define TW_SLOTS (1 << TW_SLOT_BITS)
+#define TW_SLOT_MASK (TW_SLOTS - 1)
+#define TW_MAX_DELTA ((UINT64_C(1) << (TW_LEVELS * TW_SLOT_BITS)) - 1) // furthest a timer can be armed, in ticks
+#define TW_MAX_TICKS_PER_ADVANCE 64 // bounds the work done by one tw_advance() when the caller fell behind
+
+/**
+ * @brief A timer to be embedded in the object it times. Timers are linked into the wheel slot for their expiry tick,
+ * so arming, re-arming and cancelling are all O(1) list operations.
+ */
+typedef struct tw_timer
+{
+    uint64_t expires;
+    struct tw_timer *prev;
+    struct tw_timer *next;
+} tw_timer_t;
+
+/**
+ * @brief A hierarchical timing wheel. Level 0 has one slot per tick; every level above covers TW_SLOTS times the span
+ * of the one below it. Timers migrate down a level when the wheel reaches their slot, and fire from level 0. The wheel
+ * does no locking of its own.
+ */
+typedef struct timer_wheel
+{
+    uint64_t now;
+    size_t count;
+    tw_timer_t slots[TW_LEVELS][TW_SLOTS];
+} timer_wheel_t;
+
+/**
+ * @brief Initializes an empty timing wheel.
+ *
+ * @param wheel the wheel to initialize
+ * @param now the current tick
+ */
+void tw_init(timer_wheel_t *wheel, uint64_t now);
+
+/**
+ * @brief Initializes a timer so it can be armed and cancelled.
+ *
+ * @param timer the timer to initialize
+ */
+void tw_timer_init(tw_timer_t *timer);
+
+/**
+ * @brief Arms a timer to fire at the given tick. Re-arming an armed timer moves it, so this is also the refresh path.
+ * Ticks at or before the wheel's current tick fire on the next advance.
+ *
+ * @param wheel the wheel to arm the timer on
+ * @param timer the timer to arm
+ * @param expires the tick the timer should fire at
+ */
+void tw_arm(timer_wheel_t *wheel, tw_timer_t *timer, uint64_t expires);
+
+/**
+ * @brief Cancels a timer. Cancelling a timer that is not armed does nothing.
+ *
+ * @param wheel the wheel the timer is armed on
+ * @param timer the timer to cancel
+ */
+void tw_cancel(timer_wheel_t *wheel, tw_timer_t *timer);
+
+/**
+ * @brief Checks if a timer is armed.
+ *
+ * @param timer the timer to check
+ * @return returns 1 if the timer is armed, otherwise returns 0
+ */
+int tw_armed(tw_timer_t *timer);
+
+/**
+ * @brief Moves the wheel forward to the given tick and unlinks every timer that fired on the way. At most
+ * TW_MAX_TICKS_PER_ADVANCE ticks are processed per call; the rest are caught up on later calls.
+ *
+ * @param wheel the wheel to advance
+ * @param now the current tick
+ * @return a NULL-terminated list of fired timers linked through next, or NULL if none fired
+ */
+tw_timer_t *tw_advance(timer_wheel_t *wheel, uint64_t now);
+
+#endif
+
+/*** end of file ***/
@@ -0,0 +1,504 @@
+#include "../include/trace.h"
+
+static atomic_int trace_on = 0;
+static _Atomic(trace_ring_t *) all_rings = NULL; // every ring ever created, copied on export
+static _Thread_local trace_ring_t *thread_ring = NULL;
+static _Thread_local char thread_name[TRACE_NAME_MAX]; // kept until the thread's ring exists
+
+static const char *const point_names[TRACE_NUM_POINTS] = {
+    "accept", "enqueue", "dequeue", "readable", "handler_start", "handler_end", "flush", "close",
+};
+
+/**
+ * @brief per-connection state while the exporter walks the events in time order; one per fd, reset at each accept
+ */
+typedef struct trace_conn
+{
+    uint32_t generation; // accepts seen on the fd, so a reused fd's requests get new span IDs
+    uint64_t enqueue_ts;
+    int enqueue_tid;
+    uint64_t wait_ts; // registered with a poller and not yet readable
+    int wait_tid;
+    uint64_t start_ts;
+    uint64_t respond_ts; // a handler returned with output not yet flushed
+    int respond_tid;
+} trace_conn_t;
+
+/**
+ * @brief buffered JSON output
+ */
+typedef struct trace_out
+{
+    int fd;
+    int failed;
+    size_t len;
+    char buf[TRACE_OUT_BUF];
+} trace_out_t;
+
+/**
+ * @brief get the calling thread's ring, creating and registering it on first use
+ *
+ * @return the ring, or NULL if it could not be allocated
+ */
+static trace_ring_t *trace_thread_ring(void)
+{
+    trace_ring_t *ring = thread_ring;
+
+    if (NULL != ring)
+    {
+        goto END;
+    }
+
+    if (0 != posix_memalign((void **)&ring, CACHE_LINE_SIZE, sizeof(trace_ring_t)))
+    {
+        log_error("Failed to alloc trace ring.");
+        ring = NULL;
+        goto END;
+    }
+    memset(ring, 0, sizeof(trace_ring_t));
+    ring->slots = calloc(TRACE_RING_EVENTS, sizeof(trace_slot_t)); // all-zero slots read as never written
+    if (NULL == ring->slots)
+    {
+        log_error("Failed to alloc trace ring slots.");
+        free(ring);
+        ring = NULL;
+        goto END;
+    }
+    ring->tid = (int)syscall(SYS_gettid);
+    if ('\0' == thread_name[0])
+    {
+        snprintf(ring->name, sizeof(ring->name), "thread %d", ring->tid);
+    }
+    else
+    {
+        memcpy(ring->name, thread_name, sizeof(ring->name));
+    }
+
+    ring->next_ring = atomic_load(&all_rings);
+    while (!atomic_compare_exchange_weak(&all_rings, &ring->next_ring, ring))
+    {
+    }
+    thread_ring = ring;
+
+END:
+    return ring;
+}
+
+/**
+ * @brief Turns recording on or off for every thread. Off, a trace point costs one relaxed load.
+ *
+ * @param enabled 1 to record, 0 to stop
+ */
+void trace_enable(int enabled)
+{
+    atomic_store_explicit(&trace_on, (0 != enabled), memory_order_relaxed);
+}
+
+/**
+ * @brief Records that a connection reached a point in its request's life, in the calling thread's ring.
+ *
+ * @param point a TRACE_ point
+ * @param fd the connection
+ */
+void trace_point(int point, int fd)
+{
+    trace_ring_t *ring = NULL;
+    trace_slot_t *slot = NULL;
+    uint64_t index = 0;
+    struct timespec now = {0};
+
+    if ((0 == atomic_load_explicit(&trace_on, memory_order_relaxed)) || (0 > point) || (TRACE_NUM_POINTS <= point) ||
+        (0 > fd))
+    {
+        return;
+    }
+    ring = trace_thread_ring();
+    if (NULL == ring)
+    {
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    index = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    slot = &ring->slots[index & (TRACE_RING_EVENTS - 1)];
+
+    // the seqlock write side: mark the slot torn, write it, then publish its index
+    atomic_store_explicit(&slot->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&slot->ts, ((uint64_t)now.tv_sec * 1000000000ULL) + (uint64_t)now.tv_nsec,
+                          memory_order_relaxed);
+    atomic_store_explicit(&slot->tag, ((uint64_t)fd << 8) | (uint64_t)point, memory_order_relaxed);
+    atomic_store_explicit(&slot->seq, index + 1, memory_order_release);
+    atomic_store_explicit(&ring->head, index + 1, memory_order_relaxed);
+}
+
+/**
+ * @brief Names the calling thread in exported traces, e.g. "poller 2".
+ *
+ * @param name the name; cut at TRACE_NAME_MAX - 1 characters
+ */
+void trace_thread_name(const char *name)
+{
+    if (NULL == name)
+    {
+        return;
+    }
+    snprintf(thread_name, sizeof(thread_name), "%s", name); // a thread that never records never allocates a ring
+    if (NULL != thread_ring)
+    {
+        memcpy(thread_ring->name, thread_name, sizeof(thread_ring->name)); // a torn name on export is only cosmetic
+    }
+}
+
+/**
+ * @brief orders events by time, then by their point in a request's life
+ *
+ * @param a the first event
+ * @param b the second event
+ * @return less than, equal to or greater than 0 as a sorts before, with or after b
+ */
+static int trace_compare(const void *a, const void *b)
+{
+    const trace_event_t *event_a = a;
+    const trace_event_t *event_b = b;
+
+    if (event_a->ts != event_b->ts)
+    {
+        return (event_a->ts < event_b->ts) ? -1 : 1;
+    }
+    return event_a->point - event_b->point;
+}
+
+/**
+ * @brief Copies every thread's recorded events out, in time order. Recording goes on meanwhile; events overwritten
+ * during the copy are skipped.
+ *
+ * @param events receives the events, which the caller frees
+ * @return returns the number of events, or -1 on failure
+ */
+ssize_t trace_collect(trace_event_t **events)
+{
+    ssize_t ret = -1;
+    trace_event_t *copied = NULL;
+    trace_ring_t *ring = NULL;
+    trace_slot_t *slot = NULL;
+    size_t num_rings = 0;
+    size_t num_copied = 0;
+    uint64_t head = 0;
+    uint64_t index = 0;
+    uint64_t seq = 0;
+    uint64_t ts = 0;
+    uint64_t tag = 0;
+
+    if (NULL == events)
+    {
+        log_error("Invalid trace events passed.");
+        goto END;
+    }
+
+    for (ring = atomic_load(&all_rings); NULL != ring; ring = ring->next_ring)
+    {
+        num_rings++;
+    }
+    copied = malloc((num_rings * TRACE_RING_EVENTS + 1) * sizeof(trace_event_t)); // rings made later are skipped
+    if (NULL == copied)
+    {
+        log_error("Failed to alloc trace events.");
+        goto END;
+    }
+
+    for (ring = atomic_load(&all_rings); (NULL != ring) && (0 != num_rings); ring = ring->next_ring, num_rings--)
+    {
+        head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        for (index = (TRACE_RING_EVENTS < head) ? (head - TRACE_RING_EVENTS) : 0; index < head; index++)
+        {
+            // the seqlock read side: the slot is whole if it held this event before and after the copy
+            slot = &ring->slots[index & (TRACE_RING_EVENTS - 1)];
+            seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+            ts = atomic_load_explicit(&slot->ts, memory_order_relaxed);
+            tag = atomic_load_explicit(&slot->tag, memory_order_relaxed);
+            atomic_thread_fence(memory_order_acquire);
+            if ((index + 1 != seq) || (seq != atomic_load_explicit(&slot->seq, memory_order_relaxed)))
+            {
+                continue;
+            }
+            copied[num_copied].ts = ts;
+            copied[num_copied].fd = (int)(tag >> 8);
+            copied[num_copied].point = (int)(tag & 0xff);
+            copied[num_copied].tid = ring->tid;
+            num_copied++;
+        }
+    }
+    qsort(copied, num_copied, sizeof(trace_event_t), trace_compare);
+
+    *events = copied;
+    copied = NULL;
+    ret = (ssize_t)num_copied;
+END:
+    free(copied);
+    copied = NULL;
+    return ret;
+}
+
+/**
+ * @brief write out whatever is buffered
+ *
+ * @param out the output
+ */
+static void trace_out_flush(trace_out_t *out)
+{
+    size_t total_written = 0;
+    ssize_t num_written = 0;
+
+    while ((0 == out->failed) && (total_written < out->len))
+    {
+        num_written = write(out->fd, out->buf + total_written, out->len - total_written);
+        if (-1 == num_written)
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+            log_perror("write()");
+            out->failed = 1;
+            break;
+        }
+        total_written += (size_t)num_written;
+    }
+    out->len = 0;
+}
+
+/**
+ * @brief append formatted JSON to the output, writing the buffer out first if the text might not fit
+ *
+ * @param out the output
+ * @param format printf format
+ */
+static void trace_out_printf(trace_out_t *out, const char *format, ...)
+{
+    va_list args;
+    int len = 0;
+
+    if (512 > (sizeof(out->buf) - out->len)) // no single record is longer
+    {
+        trace_out_flush(out);
+    }
+    va_start(args, format);
+    len = vsnprintf(out->buf + out->len, sizeof(out->buf) - out->len, format, args);
+    va_end(args);
+    if ((0 < len) && ((size_t)len < (sizeof(out->buf) - out->len)))
+    {
+        out->len += (size_t)len;
+    }
+}
+
+/**
+ * @brief write one span as a pair of async events, so it can start on one thread and end on another
+ *
+ * @param out the output
+ * @param name the span name
+ * @param fd the connection
+ * @param conn the connection's export state, whose generation makes the span ID unique
+ * @param start_ts when the span started
+ * @param start_tid thread it started on
+ * @param end_ts when it ended
+ * @param end_tid thread it ended on
+ */
+static void trace_out_span(trace_out_t *out, const char *name, int fd, const trace_conn_t *conn, uint64_t start_ts,
+                           int start_tid, uint64_t end_ts, int end_tid)
+{
+    uint64_t span_id = ((uint64_t)conn->generation << 32) | (uint32_t)fd;
+
+    trace_out_printf(out,
+                     ",\n{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"b\",\"id\":\"0x%" PRIx64 "\",\"ts\":%" PRIu64
+                     ".%03" PRIu64 ",\"pid\":%d,\"tid\":%d,\"args\":{\"fd\":%d}}",
+                     name, span_id, start_ts / 1000, start_ts % 1000, (int)getpid(), start_tid, fd);
+    trace_out_printf(out,
+                     ",\n{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"e\",\"id\":\"0x%" PRIx64 "\",\"ts\":%" PRIu64
+                     ".%03" PRIu64 ",\"pid\":%d,\"tid\":%d}",
+                     name, span_id, end_ts / 1000, end_ts % 1000, (int)getpid(), end_tid);
+}
+
+/**
+ * @brief advance a connection's export state by one event, writing any span the event ends
+ *
+ * @param out the output
+ * @param event the event
+ * @param conn the event's connection state
+ */
+static void trace_out_request(trace_out_t *out, const trace_event_t *event, trace_conn_t *conn)
+{
+    switch (event->point)
+    {
+    case TRACE_ACCEPT:
+        conn->generation++;
+        conn->enqueue_ts = 0;
+        conn->start_ts = 0;
+        conn->respond_ts = 0;
+        conn->wait_ts = event->ts; // a poller accepting for itself registers the connection at once
+        conn->wait_tid = event->tid;
+        break;
+    case TRACE_ENQUEUE:
+        conn->enqueue_ts = event->ts;
+        conn->enqueue_tid = event->tid;
+        conn->wait_ts = 0; // the queued span covers the time until the poller takes it
+        break;
+    case TRACE_DEQUEUE:
+        if (0 != conn->enqueue_ts)
+        {
+            trace_out_span(out, "queued", event->fd, conn, conn->enqueue_ts, conn->enqueue_tid, event->ts, event->tid);
+            conn->enqueue_ts = 0;
+        }
+        conn->wait_ts = event->ts;
+        conn->wait_tid = event->tid;
+        break;
+    case TRACE_READABLE:
+        if (0 != conn->wait_ts)
+        {
+            trace_out_span(out, "wait", event->fd, conn, conn->wait_ts, conn->wait_tid, event->ts, event->tid);
+            conn->wait_ts = 0;
+        }
+        break;
+    case TRACE_HANDLER_START:
+        conn->start_ts = event->ts;
+        break;
+    case TRACE_HANDLER_END:
+        if (0 != conn->start_ts) // a complete event: the handler runs on one thread
+        {
+            trace_out_printf(out,
+                             ",\n{\"name\":\"handle\",\"cat\":\"request\",\"ph\":\"X\",\"ts\":%" PRIu64 ".%03" PRIu64
+                             ",\"dur\":%" PRIu64 ".%03" PRIu64 ",\"pid\":%d,\"tid\":%d,\"args\":{\"fd\":%d}}",
+                             conn->start_ts / 1000, conn->start_ts % 1000, (event->ts - conn->start_ts) / 1000,
+                             (event->ts - conn->start_ts) % 1000, (int)getpid(), event->tid, event->fd);
+            conn->start_ts = 0;
+        }
+        if (0 == conn->respond_ts)
+        {
+            conn->respond_ts = event->ts;
+            conn->respond_tid = event->tid;
+        }
+        break;
+    case TRACE_FLUSH:
+        if (0 != conn->respond_ts)
+        {
+            trace_out_span(out, "flush", event->fd, conn, conn->respond_ts, conn->respond_tid, event->ts, event->tid);
+            conn->respond_ts = 0;
+        }
+        break;
+    case TRACE_CLOSE:
+    default:
+        conn->wait_ts = 0;
+        conn->respond_ts = 0;
+        break;
+    }
+}
+
+/**
+ * @brief Writes the recorded events as Chrome trace event JSON, which chrome://tracing and Perfetto open. Every point
+ * is an instant event on its thread's track, and each request's phases are spans: queued (enqueue to dequeue), wait
+ * (accept or dequeue to first readable), handle (each handler call) and flush (handler end to the last byte sent).
+ *
+ * @param fd the descriptor the JSON is written to
+ * @return returns 0 on success, or -1 on failure
+ */
+int trace_write(int fd)
+{
+    int ret = -1;
+    ssize_t num_events = 0;
+    ssize_t event_index = 0;
+    int max_fd = -1;
+    trace_event_t *events = NULL;
+    trace_conn_t *conns = NULL;
+    trace_out_t *out = NULL;
+    trace_ring_t *ring = NULL;
+
+    out = calloc(1, sizeof(trace_out_t));
+    if (NULL == out)
+    {
+        log_error("Failed to alloc trace output.");
+        goto END;
+    }
+    out->fd = fd;
+
+    num_events = trace_collect(&events);
+    if (-1 == num_events)
+    {
+        goto END;
+    }
+    for (event_index = 0; event_index < num_events; event_index++)
+    {
+        max_fd = (events[event_index].fd > max_fd) ? events[event_index].fd : max_fd;
+    }
+    conns = calloc((size_t)max_fd + 1, sizeof(trace_conn_t));
+    if (NULL == conns)
+    {
+        log_error("Failed to alloc trace connection state.");
+        goto END;
+    }
+
+    trace_out_printf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n{\"name\":\"process_name\",\"ph\":\"M\","
+                          "\"pid\":%d,\"args\":{\"name\":\"server\"}}",
+                     (int)getpid());
+    for (ring = atomic_load(&all_rings); NULL != ring; ring = ring->next_ring)
+    {
+        trace_out_printf(out,
+                         ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                         (int)getpid(), ring->tid, ring->name);
+    }
+    for (event_index = 0; event_index < num_events; event_index++)
+    {
+        trace_out_printf(out,
+                         ",\n{\"name\":\"%s\",\"cat\":\"point\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%" PRIu64 ".%03" PRIu64
+                         ",\"pid\":%d,\"tid\":%d,\"args\":{\"fd\":%d}}",
+                         point_names[events[event_index].point], events[event_index].ts / 1000,
+                         events[event_index].ts % 1000, (int)getpid(), events[event_index].tid,
+                         events[event_index].fd);
+        trace_out_request(out, &events[event_index], &conns[events[event_index].fd]);
+    }
+    trace_out_printf(out, "\n]}\n");
+    trace_out_flush(out);
+
+    ret = (0 == out->failed) ? 0 : -1;
+END:
+    free(conns);
+    conns = NULL;
+    free(events);
+    events = NULL;
+    free(out);
+    out = NULL;
+    return ret;
+}
+
+/**
+ * @brief Writes the recorded events as Chrome trace event JSON to a file, replacing it.
+ *
+ * @param dir_fd directory the file is opened relative to, or AT_FDCWD
+ * @param name the file name
+ * @return returns 0 on success, or -1 on failure
+ */
+int trace_dump(int dir_fd, const char *name)
+{
+    int ret = -1;
+    int file_fd = -1;
+
+    if (NULL == name)
+    {
+        log_error("Invalid trace file name passed.");
+        goto END;
+    }
+
+    file_fd = openat(dir_fd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (-1 == file_fd)
+    {
+        log_perror("openat()");
+        goto END;
+    }
+    ret = trace_write(file_fd);
+    close(file_fd);
+    file_fd = -1;
+
+END:
+    return ret;
+}
+
+/*** end of file ***/
@@ -0,0 +1,125 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aqueues.h"
+
+// the points of a request's life, in the order they happen; ties in time are broken in this order
+#define TRACE_ACCEPT 0        // accept() returned the connection
+#define TRACE_ENQUEUE 1       // handed to a poller's queue
+#define TRACE_DEQUEUE 2       // the poller took it off its queue and registered it
+#define TRACE_READABLE 3      // the poller was woken with input on it
+#define TRACE_HANDLER_START 4 // a request handler (conn_handler or some_server) was entered
+#define TRACE_HANDLER_END 5   // and returned
+#define TRACE_FLUSH 6         // every queued response byte reached the socket
+#define TRACE_CLOSE 7         // the poller closed it
+#define TRACE_NUM_POINTS 8
+
+#define TRACE_RING_EVENTS (1 << 15)   // events kept per thread, the newest overwriting the oldest; a power of two
+#define TRACE_NAME_MAX 32             // thread name shown in the trace viewer
+#define TRACE_OUT_BUF (64 << 10)      // JSON is written out in chunks of this
+#define TRACE_OUTPUT_NAME "trace.json" // written to the working directory on TRACE_DUMP_SIGNAL
+#define TRACE_DUMP_SIGNAL SIGUSR2
+
+/**
+ * @brief one slot of a trace ring. seq is the event's index + 1 once the slot is written, and 0 while it is being
+ * rewritten, so a reader copying the slot can tell a whole event from a torn one (a per-slot seqlock).
+ */
+typedef struct trace_slot
+{
+    atomic_uint_fast64_t seq;
+    atomic_uint_fast64_t ts;  // CLOCK_MONOTONIC nanoseconds
+    atomic_uint_fast64_t tag; // (fd << 8) | point
+} trace_slot_t;
+
+/**
+ * @brief a thread's trace events. Only the owning thread writes it, without locked instructions; readers copy it while
+ * it is written. Rings live for the life of the process, like the epoch records.
+ */
+typedef struct trace_ring
+{
+    _Alignas(CACHE_LINE_SIZE) atomic_uint_fast64_t head; // events ever recorded
+    trace_slot_t *slots;
+    int tid;
+    char name[TRACE_NAME_MAX];
+    struct trace_ring *next_ring;
+} trace_ring_t;
+
+/**
+ * @brief an event copied out of a ring
+ */
+typedef struct trace_event
+{
+    uint64_t ts;
+    int fd;
+    int point;
+    int tid;
+} trace_event_t;
+
+/**
+ * @brief Turns recording on or off for every thread. Off, a trace point costs one relaxed load.
+ *
+ * @param enabled 1 to record, 0 to stop
+ */
+void trace_enable(int enabled);
+
+/**
+ * @brief Records that a connection reached a point in its request's life, in the calling thread's ring.
+ *
+ * @param point a TRACE_ point
+ * @param fd the connection
+ */
+void trace_point(int point, int fd);
+
+/**
+ * @brief Names the calling thread in exported traces, e.g. "poller 2".
+ *
+ * @param name the name; cut at TRACE_NAME_MAX - 1 characters
+ */
+void trace_thread_name(const char *name);
+
+/**
+ * @brief Copies every thread's recorded events out, in time order. Recording goes on meanwhile; events overwritten
+ * during the copy are skipped.
+ *
+ * @param events receives the events, which the caller frees
+ * @return returns the number of events, or -1 on failure
+ */
+ssize_t trace_collect(trace_event_t **events);
+
+/**
+ * @brief Writes the recorded events as Chrome trace event JSON, which chrome://tracing and Perfetto open. Every point
+ * is an instant event on its thread's track, and each request's phases are spans: queued (enqueue to dequeue), wait
+ * (accept or dequeue to first readable), handle (each handler call) and flush (handler end to the last byte sent).
+ *
+ * @param fd the descriptor the JSON is written to
+ * @return returns 0 on success, or -1 on failure
+ */
+int trace_write(int fd);
+
+/**
+ * @brief Writes the recorded events as Chrome trace event JSON to a file, replacing it.
+ *
+ * @param dir_fd directory the file is opened relative to, or AT_FDCWD
+ * @param name the file name
+ * @return returns 0 on success, or -1 on failure
+ */
+int trace_dump(int dir_fd, const char *name);
+
+#endif
+
+/*** end of file ***/
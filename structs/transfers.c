@@ -0,0 +1,624 @@
+#include "../include/transfers.h"
+
+static _Thread_local transfers_t *local_transfers = NULL; // the set of the poller thread running on this thread
+
+/**
+ * @brief Checks that a client supplied path stays below the directory it is resolved against: relative, non-empty and
+ * without ".." components.
+ *
+ * @param path the path
+ * @return returns 1 if the path is acceptable, otherwise returns 0
+ */
+static int transfer_path_ok(const char *path)
+{
+    int ret = 0;
+    const char *component = path;
+    size_t len = 0;
+
+    if ((NULL == path) || ('\0' == path[0]) || ('/' == path[0]))
+    {
+        goto END;
+    }
+
+    while ('\0' != *component)
+    {
+        len = strcspn(component, "/");
+        if ((2 == len) && ('.' == component[0]) && ('.' == component[1]))
+        {
+            goto END;
+        }
+        component += len;
+        component += ('/' == *component) ? 1 : 0;
+    }
+
+    ret = 1;
+END:
+    return ret;
+}
+
+/**
+ * @brief Grows the fd -> transfer map so fd is a valid index.
+ *
+ * @param set the set to grow
+ * @param fd the fd that must fit
+ * @return returns 0 on success. Otherwise returns -1.
+ */
+static int transfers_grow(transfers_t *set, int fd)
+{
+    int ret = -1;
+    transfer_t **new_map = NULL;
+    size_t new_size = set->by_fd_size;
+
+    while (new_size <= (size_t)fd)
+    {
+        new_size *= 2;
+    }
+
+    new_map = realloc(set->by_fd, new_size * sizeof(transfer_t *));
+    if (NULL == new_map)
+    {
+        log_error("Failed to grow transfer map.");
+        goto END;
+    }
+    memset(&new_map[set->by_fd_size], 0, (new_size - set->by_fd_size) * sizeof(transfer_t *));
+    set->by_fd = new_map;
+    set->by_fd_size = new_size;
+
+    ret = 0;
+END:
+    return ret;
+}
+
+/**
+ * @brief Closes a transfer's file and pipe and frees it.
+ *
+ * @param transfer the transfer
+ */
+static void transfer_free(transfer_t *transfer)
+{
+    if (-1 != transfer->file_fd)
+    {
+        close(transfer->file_fd);
+    }
+    if (-1 != transfer->pipe_fds[0])
+    {
+        close(transfer->pipe_fds[0]);
+        close(transfer->pipe_fds[1]);
+    }
+    free(transfer);
+}
+
+/**
+ * @brief Unlinks a transfer from the set, restores its socket's flags and frees it, taking it off the ready list if it
+ * is queued.
+ *
+ * @param set the set holding the transfer
+ * @param transfer the transfer
+ */
+static void transfer_remove(transfers_t *set, transfer_t *transfer)
+{
+    transfer_t **link = &set->ready;
+
+    if (1 == transfer->queued)
+    {
+        while ((NULL != *link) && (transfer != *link))
+        {
+            link = &(*link)->next;
+        }
+        if (NULL != *link)
+        {
+            *link = transfer->next;
+        }
+    }
+    set->by_fd[transfer->sock_fd] = NULL;
+    set->count--;
+    fcntl(transfer->sock_fd, F_SETFL, transfer->sock_flags); // the request handler may expect blocking reads
+    transfer_free(transfer);
+}
+
+/**
+ * @brief Registers a new transfer under its socket, makes the socket non-blocking and points its readiness at the
+ * transfer's direction. On failure the transfer is freed.
+ *
+ * @param set the calling poller thread's set
+ * @param transfer the transfer
+ * @return returns 0 on success, or -1 on failure
+ */
+static int transfer_start(transfers_t *set, transfer_t *transfer)
+{
+    int ret = -1;
+    uint32_t events = (TRANSFER_DOWNLOAD == transfer->direction) ? POLLER_OUT : POLLER_IN;
+
+    if (((size_t)transfer->sock_fd >= set->by_fd_size) && (-1 == transfers_grow(set, transfer->sock_fd)))
+    {
+        goto FAIL;
+    }
+    if (NULL != set->by_fd[transfer->sock_fd])
+    {
+        log_error("Socket already has a transfer.");
+        goto FAIL;
+    }
+    // sendfile() and splice() block on a blocking socket whatever their flags say
+    transfer->sock_flags = fcntl(transfer->sock_fd, F_GETFL);
+    if ((-1 == transfer->sock_flags) || (-1 == fcntl(transfer->sock_fd, F_SETFL, transfer->sock_flags | O_NONBLOCK)))
+    {
+        log_perror("fcntl()");
+        goto FAIL;
+    }
+    // even unchanged interest is set again: that re-arms edge-triggered polling for bytes already waiting
+    if (-1 == poller_mod(set->poller, transfer->sock_fd, events))
+    {
+        fcntl(transfer->sock_fd, F_SETFL, transfer->sock_flags);
+        goto FAIL;
+    }
+    set->by_fd[transfer->sock_fd] = transfer;
+    set->count++;
+
+    ret = 0;
+    goto END;
+
+FAIL:
+    transfer_free(transfer);
+END:
+    return ret;
+}
+
+/**
+ * @brief Sends the next chunk of a download.
+ *
+ * @param transfer the transfer
+ * @return the number of bytes sent, or -1 with errno set (EAGAIN once the socket is full)
+ */
+static ssize_t transfer_download_step(transfer_t *transfer)
+{
+    ssize_t ret = -1;
+    size_t count = (TRANSFER_CHUNK < transfer->remaining) ? TRANSFER_CHUNK : (size_t)transfer->remaining;
+
+    ret = sendfile(transfer->sock_fd, transfer->file_fd, &transfer->offset, count);
+    if (0 == ret) // the file is shorter than the length promised to the client
+    {
+        log_error("File ended %" PRIu64 " bytes short of a download.", transfer->remaining);
+        errno = EIO;
+        ret = -1;
+    }
+    if (0 < ret)
+    {
+        transfer->remaining -= (uint64_t)ret;
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Moves the next chunk of an upload: as much as the socket holds into the pipe, then all of the pipe into the
+ * file.
+ *
+ * @param transfer the transfer
+ * @return the number of bytes written to the file, or -1 with errno set (EAGAIN once the socket is drained)
+ */
+static ssize_t transfer_upload_step(transfer_t *transfer)
+{
+    ssize_t ret = -1;
+    ssize_t moved = 0;
+    ssize_t written = 0;
+    size_t count = (TRANSFER_CHUNK < transfer->remaining) ? TRANSFER_CHUNK : (size_t)transfer->remaining;
+
+    if ((0 == transfer->piped) && (0 != count))
+    {
+        moved = splice(transfer->sock_fd, NULL, transfer->pipe_fds[1], NULL, count,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (-1 == moved)
+        {
+            goto END;
+        }
+        if (0 == moved) // the client hung up before sending everything it announced
+        {
+            log_error("Client closed an upload %" PRIu64 " bytes short.", transfer->remaining);
+            errno = ECONNRESET;
+            goto END;
+        }
+        transfer->piped = (size_t)moved;
+        transfer->remaining -= (uint64_t)moved;
+    }
+
+    while (0 != transfer->piped)
+    {
+        moved = splice(transfer->pipe_fds[0], NULL, transfer->file_fd, &transfer->offset, transfer->piped,
+                       SPLICE_F_MOVE);
+        if (-1 == moved)
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+            log_perror("splice() to file");
+            errno = EIO; // not EAGAIN: a failed file write ends the upload
+            goto END;
+        }
+        transfer->piped -= (size_t)moved;
+        written += moved;
+    }
+
+    ret = written;
+END:
+    return ret;
+}
+
+/**
+ * @brief Creates the transfer set of the calling poller thread; transfers_local() returns it on that thread.
+ *
+ * @param poller the thread's poller, which every transfer's socket is registered with
+ * @return returns pointer to the set on success. Otherwise returns NULL.
+ */
+transfers_t *create_transfers(poller_t *poller)
+{
+    transfers_t *ret = NULL;
+    transfers_t *new_set = NULL;
+
+    if (NULL == poller)
+    {
+        log_error("Invalid poller passed.");
+        goto END;
+    }
+
+    new_set = calloc(1, sizeof(transfers_t));
+    if (NULL == new_set)
+    {
+        log_error("Failed to alloc transfer set.");
+        goto END;
+    }
+    new_set->by_fd = calloc(TRANSFER_MIN_SLOTS, sizeof(transfer_t *));
+    if (NULL == new_set->by_fd)
+    {
+        log_error("Failed to alloc transfer map.");
+        free(new_set);
+        new_set = NULL;
+        goto END;
+    }
+    new_set->by_fd_size = TRANSFER_MIN_SLOTS;
+    new_set->poller = poller;
+    local_transfers = new_set;
+
+    ret = new_set;
+END:
+    return ret;
+}
+
+/**
+ * @brief Gets the calling poller thread's transfer set, so request handlers can start transfers on their connection.
+ *
+ * @return the set, or NULL on a thread without one
+ */
+transfers_t *transfers_local(void)
+{
+    return local_transfers;
+}
+
+/**
+ * @brief Opens a file below the root directory. Absolute paths and ".." components are refused, and where the kernel
+ * supports openat2() no symlink may lead outside the root either.
+ *
+ * @param root_dir_fd the root directory (an O_PATH fd is fine)
+ * @param path the file's path relative to the root
+ * @param flags open() flags; O_CLOEXEC and O_NOFOLLOW are always added, and O_CREAT uses TRANSFER_FILE_MODE
+ * @return the fd, or -1 on failure with errno set
+ */
+int transfer_open(int root_dir_fd, const char *path, int flags)
+{
+    int ret = -1;
+#ifdef SYS_openat2
+    struct open_how how = {0};
+#endif
+
+    if (0 == transfer_path_ok(path))
+    {
+        log_error("Refusing path outside the root directory.");
+        errno = EACCES;
+        goto END;
+    }
+    flags |= O_CLOEXEC | O_NOFOLLOW;
+
+#ifdef SYS_openat2
+    how.flags = (uint64_t)flags;
+    how.mode = (O_CREAT & flags) ? TRANSFER_FILE_MODE : 0;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+    ret = (int)syscall(SYS_openat2, root_dir_fd, path, &how, sizeof(how));
+    if ((-1 != ret) || (ENOSYS != errno))
+    {
+        goto END;
+    }
+#endif
+    ret = openat(root_dir_fd, path, flags, TRANSFER_FILE_MODE); // kernels before 5.6: the path check above only
+
+END:
+    return ret;
+}
+
+/**
+ * @brief Starts sending length bytes of file_fd from offset to sock_fd. Send any response header first; the transfer
+ * owns file_fd from here, even on failure.
+ *
+ * @param set the calling poller thread's set
+ * @param sock_fd a client socket registered with the set's poller
+ * @param file_fd the file, opened for reading
+ * @param offset file offset of the first byte to send
+ * @param length number of bytes to send
+ * @return returns 0 on success, or -1 on failure
+ */
+int transfer_download(transfers_t *set, int sock_fd, int file_fd, off_t offset, uint64_t length)
+{
+    int ret = -1;
+    transfer_t *transfer = NULL;
+
+    if ((NULL == set) || (0 > sock_fd) || (0 > file_fd) || (0 > offset))
+    {
+        log_error("Invalid transfer set, socket or file passed.");
+        goto FAIL;
+    }
+    if (0 == length)
+    {
+        close(file_fd);
+        ret = 0;
+        goto END;
+    }
+
+    transfer = calloc(1, sizeof(transfer_t));
+    if (NULL == transfer)
+    {
+        log_error("Failed to alloc transfer.");
+        goto FAIL;
+    }
+    transfer->direction = TRANSFER_DOWNLOAD;
+    transfer->sock_fd = sock_fd;
+    transfer->file_fd = file_fd;
+    transfer->pipe_fds[0] = -1;
+    transfer->pipe_fds[1] = -1;
+    transfer->offset = offset;
+    transfer->remaining = length;
+    posix_fadvise(file_fd, offset, (off_t)length, POSIX_FADV_SEQUENTIAL); // larger readahead for the page cache
+
+    ret = transfer_start(set, transfer);
+    goto END;
+
+FAIL:
+    if (0 <= file_fd)
+    {
+        close(file_fd);
+    }
+END:
+    return ret;
+}
+
+/**
+ * @brief Starts receiving length bytes from sock_fd into file_fd at offset 0. Bytes already read off the socket into a
+ * user buffer must be written to the file first. The transfer owns file_fd from here, even on failure.
+ *
+ * @param set the calling poller thread's set
+ * @param sock_fd a client socket registered with the set's poller
+ * @param file_fd the file, opened for writing
+ * @param length number of bytes to receive
+ * @return returns 0 on success, or -1 on failure
+ */
+int transfer_upload(transfers_t *set, int sock_fd, int file_fd, uint64_t length)
+{
+    int ret = -1;
+    transfer_t *transfer = NULL;
+
+    if ((NULL == set) || (0 > sock_fd) || (0 > file_fd))
+    {
+        log_error("Invalid transfer set, socket or file passed.");
+        goto FAIL;
+    }
+    if (0 == length)
+    {
+        close(file_fd);
+        ret = 0;
+        goto END;
+    }
+
+    transfer = calloc(1, sizeof(transfer_t));
+    if (NULL == transfer)
+    {
+        log_error("Failed to alloc transfer.");
+        goto FAIL;
+    }
+    transfer->direction = TRANSFER_UPLOAD;
+    transfer->sock_fd = sock_fd;
+    transfer->file_fd = file_fd;
+    transfer->remaining = length;
+    if (-1 == pipe2(transfer->pipe_fds, O_NONBLOCK | O_CLOEXEC))
+    {
+        log_perror("pipe2()");
+        free(transfer);
+        transfer = NULL;
+        goto FAIL;
+    }
+    fcntl(transfer->pipe_fds[1], F_SETPIPE_SZ, TRANSFER_PIPE_SIZE); // best effort: capped by pipe-max-size
+
+    ret = transfer_start(set, transfer);
+    goto END;
+
+FAIL:
+    if (0 <= file_fd)
+    {
+        close(file_fd);
+    }
+END:
+    return ret;
+}
+
+/**
+ * @brief Gets the transfer running on a socket.
+ *
+ * @param set the set
+ * @param sock_fd the client socket
+ * @return the transfer, or NULL if the socket has none
+ */
+transfer_t *transfer_find(transfers_t *set, int sock_fd)
+{
+    transfer_t *ret = NULL;
+
+    if ((NULL != set) && (0 <= sock_fd) && ((size_t)sock_fd < set->by_fd_size))
+    {
+        ret = set->by_fd[sock_fd];
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Moves bytes until the socket would block, the transfer is done or it has moved TRANSFER_BUDGET bytes. A
+ * finished transfer is freed and its socket watched for requests again.
+ *
+ * @param set the set holding the transfer
+ * @param transfer the transfer
+ * @return returns TRANSFER_DONE, TRANSFER_BLOCKED or TRANSFER_YIELDED, or -1 on failure (the transfer is left for
+ * transfer_cancel())
+ */
+int transfer_progress(transfers_t *set, transfer_t *transfer)
+{
+    int ret = -1;
+    int sock_fd = -1;
+    ssize_t moved = 0;
+    size_t budget = TRANSFER_BUDGET;
+
+    if ((NULL == set) || (NULL == transfer))
+    {
+        log_error("Invalid transfer set or transfer passed.");
+        goto END;
+    }
+
+    while ((0 != transfer->remaining) || (0 != transfer->piped))
+    {
+        if (0 == budget)
+        {
+            if (0 == transfer->queued)
+            {
+                transfer->queued = 1;
+                transfer->next = set->ready;
+                set->ready = transfer;
+            }
+            ret = TRANSFER_YIELDED;
+            goto END;
+        }
+
+        moved = (TRANSFER_DOWNLOAD == transfer->direction) ? transfer_download_step(transfer)
+                                                           : transfer_upload_step(transfer);
+        if (-1 == moved)
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+            if ((EAGAIN == errno) || (EWOULDBLOCK == errno))
+            {
+                ret = TRANSFER_BLOCKED;
+                goto END;
+            }
+            if ((EPIPE != errno) && (ECONNRESET != errno)) // the client went away, which the poller reports too
+            {
+                log_perror("transfer");
+            }
+            goto END;
+        }
+        budget -= ((size_t)moved < budget) ? (size_t)moved : budget;
+    }
+
+    sock_fd = transfer->sock_fd;
+    transfer_remove(set, transfer);
+    transfer = NULL;
+    if (-1 == poller_mod(set->poller, sock_fd, POLLER_IN)) // back to requests
+    {
+        goto END;
+    }
+    ret = TRANSFER_DONE;
+
+END:
+    return ret;
+}
+
+/**
+ * @brief Takes the transfers that yielded with their socket still ready. Run each with transfer_progress(), reading
+ * its next link first: a transfer that yields again is relinked onto the set's new list. Under edge-triggered polling
+ * the poller will not report them again until they block.
+ *
+ * @param set the set
+ * @return the first transfer of the list, linked through next, or NULL if none is waiting
+ */
+transfer_t *transfers_take_ready(transfers_t *set)
+{
+    transfer_t *ret = NULL;
+    transfer_t *transfer = NULL;
+
+    if (NULL == set)
+    {
+        goto END;
+    }
+
+    ret = set->ready;
+    set->ready = NULL;
+    for (transfer = ret; NULL != transfer; transfer = transfer->next)
+    {
+        transfer->queued = 0;
+    }
+
+END:
+    return ret;
+}
+
+/**
+ * @brief Drops the transfer running on a socket, if any. Call before closing the socket.
+ *
+ * @param set the set
+ * @param sock_fd the client socket
+ */
+void transfer_cancel(transfers_t *set, int sock_fd)
+{
+    transfer_t *transfer = transfer_find(set, sock_fd);
+
+    if (NULL != transfer)
+    {
+        transfer_remove(set, transfer);
+        transfer = NULL;
+    }
+}
+
+/**
+ * @brief Cancels every transfer and frees the set. Sockets are not closed.
+ *
+ * @param set the set
+ * @return returns 0 on success. Otherwise returns -1.
+ */
+int destroy_transfers(transfers_t *set)
+{
+    int ret = -1;
+    size_t fd = 0;
+
+    if (NULL == set)
+    {
+        log_error("Transfer set is already NULL. Exiting.");
+        goto END;
+    }
+
+    for (fd = 0; (fd < set->by_fd_size) && (0 != set->count); fd++)
+    {
+        if (NULL != set->by_fd[fd])
+        {
+            transfer_remove(set, set->by_fd[fd]);
+        }
+    }
+    if (local_transfers == set)
+    {
+        local_transfers = NULL;
+    }
+    free(set->by_fd);
+    set->by_fd = NULL;
+    free(set);
+    set = NULL;
+
+    ret = 0;
+END:
+    return ret;
+}
+
+/*** end of file ***/
@@ -0,0 +1,172 @@
+#ifndef TRANSFERS_H
+#define TRANSFERS_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // splice(), pipe2() and F_SETPIPE_SZ
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#ifdef SYS_openat2
+#include <linux/openat2.h>
+#endif
+
+#include "poller.h"
+
+#define TRANSFER_DOWNLOAD 0 // file -> socket with sendfile()
+#define TRANSFER_UPLOAD 1   // socket -> pipe -> file with splice()
+
+#define TRANSFER_DONE 0    // every byte moved; the transfer is freed and the socket watched for requests again
+#define TRANSFER_BLOCKED 1 // the socket would block; progress resumes on its next readiness event
+#define TRANSFER_YIELDED 2 // used its budget with the socket still ready; queued to run after the next poll
+
+#define TRANSFER_CHUNK (1 << 20)     // most bytes asked of one sendfile() or splice() call
+#define TRANSFER_BUDGET (4 << 20)    // most bytes one transfer moves per turn, so one client cannot starve a poller
+#define TRANSFER_PIPE_SIZE (1 << 20) // capacity asked for an upload's pipe; the kernel may grant less
+#define TRANSFER_FILE_MODE 0640      // mode of files created by uploads
+#define TRANSFER_MIN_SLOTS 64        // initial size of the fd -> transfer map
+
+/**
+ * @brief one file moving between a client socket and a file under the root directory without passing through a user
+ * buffer. A download hands file pages straight to the socket with sendfile(); an upload moves socket pages into a
+ * pipe and from the pipe into the file with splice(). The transfer owns file_fd and its pipe, not sock_fd, which is
+ * non-blocking while the transfer runs.
+ */
+typedef struct transfer
+{
+    int direction;
+    int sock_fd;
+    int file_fd;
+    int sock_flags;        // the socket's file status flags before the transfer made it non-blocking
+    int pipe_fds[2];       // upload only: socket -> pipe_fds[1], pipe_fds[0] -> file
+    off_t offset;          // file offset of the next byte
+    uint64_t remaining;    // bytes still to read from the file (download) or the socket (upload)
+    size_t piped;          // upload bytes in the pipe and not yet in the file
+    int queued;            // on the ready list
+    struct transfer *next; // ready list link
+} transfer_t;
+
+/**
+ * @brief a poller thread's transfers, found by socket fd. While a socket has a transfer, the poller watches it for
+ * the transfer's direction only and its events go to transfer_progress() instead of the request handler.
+ */
+typedef struct transfers
+{
+    poller_t *poller;
+    transfer_t **by_fd;
+    size_t by_fd_size;
+    size_t count;
+    transfer_t *ready; // transfers that yielded with their socket still ready
+} transfers_t;
+
+/**
+ * @brief Creates the transfer set of the calling poller thread; transfers_local() returns it on that thread.
+ *
+ * @param poller the thread's poller, which every transfer's socket is registered with
+ * @return returns pointer to the set on success. Otherwise returns NULL.
+ */
+transfers_t *create_transfers(poller_t *poller);
+
+/**
+ * @brief Gets the calling poller thread's transfer set, so request handlers can start transfers on their connection.
+ *
+ * @return the set, or NULL on a thread without one
+ */
+transfers_t *transfers_local(void);
+
+/**
+ * @brief Opens a file below the root directory. Absolute paths and ".." components are refused, and where the kernel
+ * supports openat2() no symlink may lead outside the root either.
+ *
+ * @param root_dir_fd the root directory (an O_PATH fd is fine)
+ * @param path the file's path relative to the root
+ * @param flags open() flags; O_CLOEXEC and O_NOFOLLOW are always added, and O_CREAT uses TRANSFER_FILE_MODE
+ * @return the fd, or -1 on failure with errno set
+ */
+int transfer_open(int root_dir_fd, const char *path, int flags);
+
+/**
+ * @brief Starts sending length bytes of file_fd from offset to sock_fd. Send any response header first; the transfer
+ * owns file_fd from here, even on failure.
+ *
+ * @param set the calling poller thread's set
+ * @param sock_fd a client socket registered with the set's poller
+ * @param file_fd the file, opened for reading
+ * @param offset file offset of the first byte to send
+ * @param length number of bytes to send
+ * @return returns 0 on success, or -1 on failure
+ */
+int transfer_download(transfers_t *set, int sock_fd, int file_fd, off_t offset, uint64_t length);
+
+/**
+ * @brief Starts receiving length bytes from sock_fd into file_fd at offset 0. Bytes already read off the socket into a
+ * user buffer must be written to the file first. The transfer owns file_fd from here, even on failure.
+ *
+ * @param set the calling poller thread's set
+ * @param sock_fd a client socket registered with the set's poller
+ * @param file_fd the file, opened for writing
+ * @param length number of bytes to receive
+ * @return returns 0 on success, or -1 on failure
+ */
+int transfer_upload(transfers_t *set, int sock_fd, int file_fd, uint64_t length);
+
+/**
+ * @brief Gets the transfer running on a socket.
+ *
+ * @param set the set
+ * @param sock_fd the client socket
+ * @return the transfer, or NULL if the socket has none
+ */
+transfer_t *transfer_find(transfers_t *set, int sock_fd);
+
+/**
+ * @brief Moves bytes until the socket would block, the transfer is done or it has moved TRANSFER_BUDGET bytes. A
+ * finished transfer is freed and its socket watched for requests again.
+ *
+ * @param set the set holding the transfer
+ * @param transfer the transfer
+ * @return returns TRANSFER_DONE, TRANSFER_BLOCKED or TRANSFER_YIELDED, or -1 on failure (the transfer is left for
+ * transfer_cancel())
+ */
+int transfer_progress(transfers_t *set, transfer_t *transfer);
+
+/**
+ * @brief Takes the transfers that yielded with their socket still ready. Run each with transfer_progress(), reading
+ * its next link first: a transfer that yields again is relinked onto the set's new list. Under edge-triggered polling
+ * the poller will not report them again until they block.
+ *
+ * @param set the set
+ * @return the first transfer of the list, linked through next, or NULL if none is waiting
+ */
+transfer_t *transfers_take_ready(transfers_t *set);
+
+/**
+ * @brief Drops the transfer running on a socket, if any. Call before closing the socket.
+ *
+ * @param set the set
+ * @param sock_fd the client socket
+ */
+void transfer_cancel(transfers_t *set, int sock_fd);
+
+/**
+ * @brief Cancels every transfer and frees the set. Sockets are not closed.
+ *
+ * @param set the set
+ * @return returns 0 on success. Otherwise returns -1.
+ */
+int destroy_transfers(transfers_t *set);
+
+#endif
+
+/*** end of file ***/
@@ -0,0 +1,826 @@
+#include "../include/wal.h"
+
+static uint32_t crc32c_table[256] = {0};
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief fills the CRC-32C (Castagnoli) lookup table
+ */
+static void crc32c_init(void)
+{
+    uint32_t crc = 0;
+    int index = 0;
+    int bit = 0;
+
+    for (index = 0; index < 256; index++)
+    {
+        crc = (uint32_t)index;
+        for (bit = 0; bit < 8; bit++)
+        {
+            crc = (crc >> 1) ^ (0x82f63b78U & (0U - (crc & 1)));
+        }
+        crc32c_table[index] = crc;
+    }
+}
+
+/**
+ * @brief CRC-32C of a buffer, continuing from crc (0 to start)
+ */
+static uint32_t crc32c(uint32_t crc, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+
+    pthread_once(&crc32c_once, crc32c_init);
+    crc = ~crc;
+    while (0 != len--)
+    {
+        crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+/**
+ * @brief Checksums a buffer the way log records are checksummed (CRC-32C).
+ *
+ * @param data the bytes
+ * @param len number of bytes
+ * @return the checksum
+ */
+uint32_t wal_checksum(const void *data, size_t len)
+{
+    return crc32c(0, data, len);
+}
+
+static void wal_put_u32(char *p, uint32_t value)
+{
+    p[0] = (char)(value & 0xff);
+    p[1] = (char)((value >> 8) & 0xff);
+    p[2] = (char)((value >> 16) & 0xff);
+    p[3] = (char)((value >> 24) & 0xff);
+}
+
+static uint32_t wal_get_u32(const char *p)
+{
+    const uint8_t *u = (const uint8_t *)p;
+
+    return (uint32_t)u[0] | ((uint32_t)u[1] << 8) | ((uint32_t)u[2] << 16) | ((uint32_t)u[3] << 24);
+}
+
+/**
+ * @brief Writes all of buf to fd, retrying short writes and EINTR.
+ *
+ * @param fd the file
+ * @param buf the bytes to write
+ * @param len number of bytes
+ * @return returns 0 on success, or -1 on failure
+ */
+int wal_write_all(int fd, const char *buf, size_t len)
+{
+    int ret = -1;
+    ssize_t written = 0;
+
+    while (0 != len)
+    {
+        written = write(fd, buf, len);
+        if (-1 == written)
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+            log_perror("WAL write()");
+            goto END;
+        }
+        buf += written;
+        len -= (size_t)written;
+    }
+
+    ret = 0;
+END:
+    return ret;
+}
+
+/**
+ * @brief Encodes a record into dst, which must have room for WAL_RECORD_SIZE(key_len, value_len) bytes.
+ *
+ * @param dst where the record goes
+ * @param op WAL_OP_PUT or WAL_OP_DELETE
+ * @param key the key
+ * @param key_len length of the key; at most UINT32_MAX
+ * @param value the value
+ * @param value_len length of the value; at most UINT32_MAX
+ */
+void wal_encode_record(char *dst, uint8_t op, const void *key, size_t key_len, const void *value, size_t value_len)
+{
+    wal_put_u32(dst + 4, (uint32_t)key_len);
+    wal_put_u32(dst + 8, (uint32_t)value_len);
+    dst[12] = (char)op;
+    memcpy(dst + WAL_RECORD_HEADER, key, key_len);
+    if (0 != value_len)
+    {
+        memcpy(dst + WAL_RECORD_HEADER + key_len, value, value_len);
+    }
+    wal_put_u32(dst, crc32c(0, dst + 4, WAL_RECORD_SIZE(key_len, value_len) - 4));
+}
+
+/**
+ * @brief Syncs a directory, so names created or renamed in it survive a crash.
+ *
+ * @param dir_fd the directory (an O_PATH fd is fine)
+ * @return returns 0 on success, or -1 on failure
+ */
+static int wal_sync_dir(int dir_fd)
+{
+    int ret = -1;
+    int sync_fd = -1;
+
+    // an O_PATH fd cannot be fsync()ed
+    sync_fd = openat(dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if ((-1 == sync_fd) || (-1 == fsync(sync_fd)))
+    {
+        log_perror("directory fsync()");
+        goto END;
+    }
+
+    ret = 0;
+END:
+    if (-1 != sync_fd)
+    {
+        close(sync_fd);
+    }
+    return ret;
+}
+
+/**
+ * @brief Makes a fully written temporary file durable and renames it over name, so readers see either the old file or
+ * the complete new one.
+ *
+ * @param dir_fd directory holding both files (an O_PATH fd is fine)
+ * @param fd the temporary file
+ * @param tmp_name the temporary file's name
+ * @param name the name to install it as
+ * @return returns 0 on success, or -1 on failure
+ */
+int wal_install_file(int dir_fd, int fd, const char *tmp_name, const char *name)
+{
+    int ret = -1;
+
+    if (-1 == fdatasync(fd))
+    {
+        log_perror("fdatasync()");
+        goto END;
+    }
+    if (-1 == renameat(dir_fd, tmp_name, dir_fd, name))
+    {
+        log_perror("renameat()");
+        goto END;
+    }
+
+    if (-1 == wal_sync_dir(dir_fd)) // the rename itself is only durable once the directory is synced
+    {
+        goto END;
+    }
+
+    ret = 0;
+END:
+    return ret;
+}
+
+/**
+ * @brief Takes the buffered records as a batch and writes them, syncing if do_sync is set. Called with the lock held
+ * and no other leader running; drops the lock for the I/O and returns with it held.
+ *
+ * @param wal the log
+ * @param do_sync 1 to fdatasync() the batch
+ * @return returns 0 on success, or -1 on failure (the log is marked failed)
+ */
+static int wal_write_batch(wal_t *wal, int do_sync)
+{
+    int ret = -1;
+    char *batch = wal->buf;
+    size_t batch_len = wal->buf_len;
+    size_t batch_cap = wal->buf_cap;
+    uint64_t batch_lsn = wal->next_lsn;
+
+    wal->flushing = 1;
+    wal->buf = wal->spare;
+    wal->buf_cap = wal->spare_cap;
+    wal->buf_len = 0;
+    pthread_mutex_unlock(&wal->lock);
+
+    ret = wal_write_all(wal->fd, batch, batch_len);
+    if ((0 == ret) && (1 == do_sync) && (-1 == fdatasync(wal->fd)))
+    {
+        log_perror("WAL fdatasync()");
+        ret = -1;
+    }
+
+    pthread_mutex_lock(&wal->lock);
+    wal->spare = batch;
+    wal->spare_cap = batch_cap;
+    wal->flushing = 0;
+    if (0 == ret)
+    {
+        wal->written_lsn = batch_lsn;
+        if (1 == do_sync)
+        {
+            wal->synced_lsn = batch_lsn;
+        }
+    }
+    else
+    {
+        wal->failed = 1; // the file may hold part of the batch; later records would land after a hole
+    }
+    pthread_cond_broadcast(&wal->synced);
+
+    return ret;
+}
+
+/**
+ * @brief the flusher thread for the buffered sync policies: writes the buffer every WAL_FLUSH_INTERVAL_MS, or sooner
+ * once WAL_BUF_SIZE bytes are waiting, and syncs under WAL_SYNC_INTERVAL
+ */
+static void *wal_flusher(void *arg)
+{
+    wal_t *wal = arg;
+    struct timespec deadline = {0};
+
+    pthread_mutex_lock(&wal->lock);
+    while ((0 == wal->closing) && (0 == wal->failed))
+    {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += WAL_FLUSH_INTERVAL_MS * 1000000L;
+        if (1000000000L <= deadline.tv_nsec)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&wal->flush, &wal->lock, &deadline);
+
+        if ((0 == wal->flushing) && (0 != wal->buf_len))
+        {
+            wal_write_batch(wal, (WAL_SYNC_INTERVAL == wal->sync_policy) ? 1 : 0);
+        }
+    }
+    pthread_mutex_unlock(&wal->lock);
+
+    return NULL;
+}
+
+/**
+ * @brief Reads records from fd's current offset to the end or to the first torn or corrupt one, handing each to apply.
+ *
+ * @param fd the file
+ * @param apply called for every intact record
+ * @param arg passed through to apply
+ * @param good_end receives the offset past the last intact record, relative to where the read started
+ * @return returns the number of records read, or -1 on failure
+ */
+static ssize_t wal_read_records(int fd, wal_apply_func apply, void *arg, off_t *good_end)
+{
+    ssize_t ret = -1;
+    ssize_t num_records = 0;
+    char *buf = NULL;
+    char *grown = NULL;
+    size_t buf_cap = WAL_REPLAY_CHUNK;
+    size_t buf_len = 0;
+    size_t pos = 0;
+    size_t record_len = 0;
+    uint32_t key_len = 0;
+    uint32_t value_len = 0;
+    ssize_t bytes_read = 0;
+    int at_eof = 0;
+
+    *good_end = 0;
+    buf = malloc(buf_cap);
+    if (NULL == buf)
+    {
+        log_error("Failed to alloc WAL replay buffer.");
+        goto END;
+    }
+
+    while (1)
+    {
+        // parse every whole record in the buffer
+        while (WAL_RECORD_HEADER <= (buf_len - pos))
+        {
+            key_len = wal_get_u32(buf + pos + 4);
+            value_len = wal_get_u32(buf + pos + 8);
+            record_len = WAL_RECORD_HEADER + (size_t)key_len + (size_t)value_len;
+            if (record_len > (buf_len - pos))
+            {
+                break;
+            }
+            if (wal_get_u32(buf + pos) != crc32c(0, buf + pos + 4, record_len - 4))
+            {
+                goto TAIL;
+            }
+            if ((NULL != apply) && (-1 == apply((uint8_t)buf[pos + 12], buf + pos + WAL_RECORD_HEADER, key_len,
+                                                buf + pos + WAL_RECORD_HEADER + key_len, value_len, arg)))
+            {
+                log_error("Failed to apply WAL record.");
+                goto END;
+            }
+            pos += record_len;
+            *good_end += (off_t)record_len;
+            num_records++;
+        }
+        if (1 == at_eof)
+        {
+            goto TAIL;
+        }
+
+        // keep the partial record and read more behind it
+        memmove(buf, buf + pos, buf_len - pos);
+        buf_len -= pos;
+        pos = 0;
+        if ((buf_cap - buf_len) < WAL_REPLAY_CHUNK)
+        {
+            grown = realloc(buf, buf_cap * 2);
+            if (NULL == grown)
+            {
+                log_error("Failed to grow WAL replay buffer.");
+                goto END;
+            }
+            buf = grown;
+            buf_cap *= 2;
+        }
+        bytes_read = read(fd, buf + buf_len, buf_cap - buf_len);
+        if (-1 == bytes_read)
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+            log_perror("WAL read()");
+            goto END;
+        }
+        at_eof = (0 == bytes_read) ? 1 : 0;
+        buf_len += (size_t)bytes_read;
+    }
+
+TAIL:
+    ret = num_records;
+END:
+    free(buf);
+    buf = NULL;
+    return ret;
+}
+
+/**
+ * @brief Reads the log from the start, hands each intact record to apply, and cuts off whatever follows the last one.
+ *
+ * @param wal the log, not yet shared
+ * @param apply called for every intact record
+ * @param arg passed through to apply
+ * @return returns the number of records replayed, or -1 on failure
+ */
+static ssize_t wal_replay(wal_t *wal, wal_apply_func apply, void *arg)
+{
+    ssize_t ret = -1;
+    ssize_t num_records = 0;
+    off_t good_end = 0;
+
+    num_records = wal_read_records(wal->fd, apply, arg, &good_end);
+    if (-1 == num_records)
+    {
+        goto END;
+    }
+    if ((-1 == ftruncate(wal->fd, good_end)) || (-1 == lseek(wal->fd, good_end, SEEK_SET)))
+    {
+        log_perror("WAL ftruncate()");
+        goto END;
+    }
+    wal->next_lsn = (uint64_t)good_end;
+    wal->written_lsn = wal->next_lsn;
+    wal->synced_lsn = wal->next_lsn;
+
+    ret = num_records;
+END:
+    return ret;
+}
+
+/**
+ * @brief Opens or creates a log file under dir_fd, replays it through apply, and readies it for appends. A torn or
+ * corrupt tail (a crash mid-write) ends the replay and is cut off the file.
+ *
+ * @param dir_fd directory to keep the log in (an O_PATH fd is fine)
+ * @param name the log's file name
+ * @param sync_policy WAL_SYNC_ALWAYS, WAL_SYNC_INTERVAL or WAL_SYNC_NONE
+ * @param apply called for every intact record; NULL skips the replay
+ * @param arg passed through to apply
+ * @return the log, or NULL on failure
+ */
+wal_t *wal_open(int dir_fd, const char *name, int sync_policy, wal_apply_func apply, void *arg)
+{
+    wal_t *ret = NULL;
+    wal_t *wal = NULL;
+    ssize_t num_records = 0;
+    int init_state = 0; // lock, then conds, initialized
+
+    if ((NULL == name) || (WAL_SYNC_ALWAYS > sync_policy) || (WAL_SYNC_NONE < sync_policy))
+    {
+        log_error("Invalid WAL name or sync policy passed.");
+        goto END;
+    }
+
+    wal = calloc(1, sizeof(wal_t));
+    if (NULL == wal)
+    {
+        log_error("Failed to alloc WAL.");
+        goto END;
+    }
+    wal->fd = -1;
+    wal->dir_fd = dir_fd;
+    wal->sync_policy = sync_policy;
+    wal->name = strdup(name);
+    wal->buf_cap = WAL_BUF_SIZE;
+    wal->spare_cap = WAL_BUF_SIZE;
+    wal->buf = malloc(wal->buf_cap);
+    wal->spare = malloc(wal->spare_cap);
+    if ((NULL == wal->buf) || (NULL == wal->spare) || (NULL == wal->name))
+    {
+        log_error("Failed to alloc WAL buffers.");
+        goto FAIL;
+    }
+
+    if (0 != pthread_mutex_init(&wal->lock, NULL))
+    {
+        log_error("Error initializing WAL mutex.");
+        goto FAIL;
+    }
+    init_state++;
+    if ((0 != pthread_cond_init(&wal->synced, NULL)) || (0 != pthread_cond_init(&wal->flush, NULL)))
+    {
+        log_error("Error initializing WAL conditions.");
+        goto FAIL;
+    }
+    init_state++;
+
+    wal->fd = openat(dir_fd, name, O_RDWR | O_CLOEXEC);
+    if ((-1 == wal->fd) && (ENOENT == errno))
+    {
+        // a new log's name is only durable once the directory is synced; records synced into it before then
+        // could otherwise vanish with the file in a crash
+        wal->fd = openat(dir_fd, name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        if ((-1 != wal->fd) && (-1 == wal_sync_dir(dir_fd)))
+        {
+            goto FAIL;
+        }
+    }
+    if (-1 == wal->fd)
+    {
+        log_perror("WAL openat()");
+        goto FAIL;
+    }
+
+    num_records = wal_replay(wal, apply, arg);
+    if (-1 == num_records)
+    {
+        goto FAIL;
+    }
+    if (0 != num_records)
+    {
+        log_info("Replayed %zd records from %s.", num_records, name);
+    }
+
+    if (WAL_SYNC_ALWAYS != sync_policy)
+    {
+        if (0 != pthread_create(&wal->flusher, NULL, wal_flusher, wal))
+        {
+            log_error("Failed to start WAL flusher.");
+            goto FAIL;
+        }
+        wal->has_flusher = 1;
+    }
+
+    ret = wal;
+    goto END;
+
+FAIL:
+    if (-1 != wal->fd)
+    {
+        close(wal->fd);
+    }
+    if (2 <= init_state)
+    {
+        pthread_cond_destroy(&wal->synced);
+        pthread_cond_destroy(&wal->flush);
+    }
+    if (1 <= init_state)
+    {
+        pthread_mutex_destroy(&wal->lock);
+    }
+    free(wal->buf);
+    free(wal->spare);
+    free(wal->name);
+    free(wal);
+    wal = NULL;
+
+END:
+    return ret;
+}
+
+/**
+ * @brief Buffers a record. Does not wait for the disk; pass the returned lsn to wal_sync() for that. Callers that
+ * need the log order of two records on a key to match the order they were applied append under the same lock they
+ * apply under.
+ *
+ * @param wal the log
+ * @param op WAL_OP_PUT or WAL_OP_DELETE
+ * @param key the key
+ * @param key_len length of the key
+ * @param value the value; NULL with value_len 0 for deletes
+ * @param value_len length of the value
+ * @param lsn receives the log offset past the record
+ * @return returns 0 on success, or -1 on failure
+ */
+int wal_append(wal_t *wal, uint8_t op, const void *key, size_t key_len, const void *value, size_t value_len,
+               uint64_t *lsn)
+{
+    int ret = -1;
+    size_t record_len = WAL_RECORD_SIZE(key_len, value_len);
+    size_t new_cap = 0;
+    char *grown = NULL;
+
+    if ((NULL == wal) || (NULL == key) || ((NULL == value) && (0 != value_len)) || (NULL == lsn) ||
+        (UINT32_MAX < key_len) || (UINT32_MAX < value_len))
+    {
+        log_error("Invalid WAL, key or value passed.");
+        goto END;
+    }
+
+    pthread_mutex_lock(&wal->lock);
+    if (1 == wal->failed)
+    {
+        log_error("WAL has failed; refusing record.");
+        goto UNLOCK;
+    }
+
+    if (record_len > (wal->buf_cap - wal->buf_len)) // the leader holds the spare, so grow this one in place
+    {
+        for (new_cap = wal->buf_cap * 2; record_len > (new_cap - wal->buf_len); new_cap *= 2)
+        {
+        }
+        grown = realloc(wal->buf, new_cap);
+        if (NULL == grown)
+        {
+            log_error("Failed to grow WAL buffer.");
+            goto UNLOCK;
+        }
+        wal->buf = grown;
+        wal->buf_cap = new_cap;
+    }
+
+    wal_encode_record(wal->buf + wal->buf_len, op, key, key_len, value, value_len);
+    wal->buf_len += record_len;
+    wal->next_lsn += record_len;
+    *lsn = wal->next_lsn;
+
+    if ((1 == wal->has_flusher) && (WAL_BUF_SIZE <= wal->buf_len))
+    {
+        pthread_cond_signal(&wal->flush);
+    }
+
+    ret = 0;
+UNLOCK:
+    pthread_mutex_unlock(&wal->lock);
+END:
+    return ret;
+}
+
+/**
+ * @brief Waits until the log up to lsn is as durable as the sync policy promises: on disk for WAL_SYNC_ALWAYS, joining
+ * or leading a group commit; returns at once for the buffered policies.
+ *
+ * @param wal the log
+ * @param lsn an offset returned by wal_append()
+ * @return returns 0 on success, or -1 if the log failed
+ */
+int wal_sync(wal_t *wal, uint64_t lsn)
+{
+    int ret = -1;
+
+    if (NULL == wal)
+    {
+        log_error("Invalid WAL passed.");
+        goto END;
+    }
+    if (WAL_SYNC_ALWAYS != wal->sync_policy)
+    {
+        ret = 0;
+        goto END;
+    }
+
+    pthread_mutex_lock(&wal->lock);
+    while ((wal->synced_lsn < lsn) && (0 == wal->failed))
+    {
+        if (1 == wal->flushing)
+        {
+            pthread_cond_wait(&wal->synced, &wal->lock); // the running batch or the next one covers lsn
+        }
+        else
+        {
+            wal_write_batch(wal, 1); // lead: everything buffered so far goes out with one write and one sync
+        }
+    }
+    ret = (wal->synced_lsn >= lsn) ? 0 : -1;
+    pthread_mutex_unlock(&wal->lock);
+
+END:
+    return ret;
+}
+
+/**
+ * @brief Gets the log offset past the last appended record. Taken under a writer's lock, it splits that writer's
+ * records into those already applied (below it) and those to come.
+ *
+ * @param wal the log
+ * @return the lsn
+ */
+uint64_t wal_lsn(wal_t *wal)
+{
+    uint64_t ret = 0;
+
+    pthread_mutex_lock(&wal->lock);
+    ret = wal->next_lsn;
+    pthread_mutex_unlock(&wal->lock);
+
+    return ret;
+}
+
+/**
+ * @brief Gets the number of log bytes a restart would replay: everything appended since the last compaction.
+ *
+ * @param wal the log
+ * @return the size in bytes
+ */
+uint64_t wal_size(wal_t *wal)
+{
+    uint64_t ret = 0;
+
+    pthread_mutex_lock(&wal->lock);
+    ret = wal->next_lsn - wal->base_lsn;
+    pthread_mutex_unlock(&wal->lock);
+
+    return ret;
+}
+
+/**
+ * @brief Drops every record before lsn, once a snapshot holds their effects. The records from lsn on that are already
+ * in the file are copied to a new file, which is installed over the log; records still buffered go to the new file.
+ * Appends wait while the tail is copied, so compact right after a snapshot, while the tail is short.
+ *
+ * @param wal the log
+ * @param lsn the first lsn to keep, taken with wal_lsn()
+ * @return returns 0 on success, or -1 on failure (the log is left as it was)
+ */
+int wal_compact(wal_t *wal, uint64_t lsn)
+{
+    int ret = -1;
+    int new_fd = -1;
+    char tmp_name[PATH_MAX] = {0};
+    char *buf = NULL;
+    off_t offset = 0;
+    off_t end = 0;
+    ssize_t bytes_read = 0;
+
+    if (NULL == wal)
+    {
+        log_error("Invalid WAL passed.");
+        goto END;
+    }
+    if (PATH_MAX <= snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", wal->name))
+    {
+        log_error("WAL name too long.");
+        goto END;
+    }
+    buf = malloc(WAL_REPLAY_CHUNK);
+    if (NULL == buf)
+    {
+        log_error("Failed to alloc WAL copy buffer.");
+        goto END;
+    }
+
+    pthread_mutex_lock(&wal->lock);
+    while (1 == wal->flushing)
+    {
+        pthread_cond_wait(&wal->synced, &wal->lock);
+    }
+    if ((1 == wal->failed) || (lsn < wal->base_lsn) || (lsn > wal->next_lsn))
+    {
+        log_error("Cannot compact WAL to %lu.", (unsigned long)lsn);
+        goto UNLOCK;
+    }
+    if (lsn > wal->written_lsn) // lsn is still buffered; write the file up to it first
+    {
+        wal_write_batch(wal, 0);
+        if (1 == wal->failed)
+        {
+            goto UNLOCK;
+        }
+    }
+
+    new_fd = openat(wal->dir_fd, tmp_name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (-1 == new_fd)
+    {
+        log_perror("WAL openat()");
+        goto UNLOCK;
+    }
+    end = (off_t)(wal->written_lsn - wal->base_lsn);
+    for (offset = (off_t)(lsn - wal->base_lsn); offset < end; offset += bytes_read)
+    {
+        bytes_read = pread(wal->fd, buf, ((end - offset) < WAL_REPLAY_CHUNK) ? (size_t)(end - offset) : WAL_REPLAY_CHUNK,
+                           offset);
+        if (0 >= bytes_read)
+        {
+            if ((-1 == bytes_read) && (EINTR == errno))
+            {
+                bytes_read = 0;
+                continue;
+            }
+            log_perror("WAL pread()");
+            goto UNLOCK;
+        }
+        if (-1 == wal_write_all(new_fd, buf, (size_t)bytes_read))
+        {
+            goto UNLOCK;
+        }
+    }
+    if (-1 == wal_install_file(wal->dir_fd, new_fd, tmp_name, wal->name))
+    {
+        goto UNLOCK;
+    }
+
+    close(wal->fd);
+    wal->fd = new_fd;
+    new_fd = -1;
+    wal->base_lsn = lsn;
+    wal->synced_lsn = wal->written_lsn; // the copied tail was synced with the new file
+
+    ret = 0;
+UNLOCK:
+    pthread_mutex_unlock(&wal->lock);
+    if (-1 != new_fd)
+    {
+        close(new_fd);
+        unlinkat(wal->dir_fd, tmp_name, 0);
+    }
+END:
+    free(buf);
+    buf = NULL;
+    return ret;
+}
+
+/**
+ * @brief Writes and syncs everything buffered, stops the flusher and closes the log.
+ *
+ * @param wal the log
+ * @return returns 0 on success, or -1 if buffered records could not be made durable
+ */
+int wal_close(wal_t *wal)
+{
+    int ret = -1;
+
+    if (NULL == wal)
+    {
+        log_error("WAL is already NULL. Exiting.");
+        goto END;
+    }
+
+    pthread_mutex_lock(&wal->lock);
+    wal->closing = 1;
+    pthread_cond_signal(&wal->flush);
+    pthread_mutex_unlock(&wal->lock);
+    if (1 == wal->has_flusher)
+    {
+        pthread_join(wal->flusher, NULL);
+    }
+
+    pthread_mutex_lock(&wal->lock);
+    while (1 == wal->flushing)
+    {
+        pthread_cond_wait(&wal->synced, &wal->lock);
+    }
+    if ((0 == wal->failed) && ((0 != wal->buf_len) || (wal->synced_lsn < wal->written_lsn)))
+    {
+        wal_write_batch(wal, 1);
+    }
+    ret = (0 == wal->failed) ? 0 : -1;
+    pthread_mutex_unlock(&wal->lock);
+
+    close(wal->fd);
+    pthread_cond_destroy(&wal->synced);
+    pthread_cond_destroy(&wal->flush);
+    pthread_mutex_destroy(&wal->lock);
+    free(wal->buf);
+    free(wal->spare);
+    free(wal->name);
+    free(wal);
+    wal = NULL;
+
+END:
+    return ret;
+}
+
+/*** end of file ***/
@@ -0,0 +1,192 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+#define WAL_SYNC_ALWAYS 0   // a write is acknowledged once its batch is fdatasync()ed (group commit)
+#define WAL_SYNC_INTERVAL 1 // a write is acknowledged once buffered; a flusher writes and syncs every interval
+#define WAL_SYNC_NONE 2     // a write is acknowledged once buffered; a flusher writes and the kernel syncs
+#define WAL_DEFAULT_SYNC WAL_SYNC_ALWAYS
+
+#define WAL_FLUSH_INTERVAL_MS 10   // flusher period for WAL_SYNC_INTERVAL and WAL_SYNC_NONE
+#define WAL_BUF_SIZE (1 << 20)     // buffered bytes that wake the flusher early
+#define WAL_RECORD_HEADER 13       // crc32c, key_len, value_len (u32 LE each), then the op byte
+#define WAL_REPLAY_CHUNK (1 << 16) // bytes read per replay read()
+#define WAL_RECORD_SIZE(key_len, value_len) (WAL_RECORD_HEADER + (size_t)(key_len) + (size_t)(value_len))
+
+#define WAL_OP_PUT 1
+#define WAL_OP_DELETE 2
+
+/**
+ * @brief called by wal_open() for each intact record in the log, oldest first
+ *
+ * @return 0 to keep going, -1 to abort the replay
+ */
+typedef int (*wal_apply_func)(uint8_t op, const void *key, size_t key_len, const void *value, size_t value_len,
+                              void *arg);
+
+/**
+ * @brief an append-only write-ahead log. Writers copy records into buf under lock and get back the log offset just
+ * past their record (its lsn). Group commit: the first writer that needs its record on disk becomes the leader, swaps
+ * buf for the spare buffer and writes and syncs the whole batch with the lock dropped; writers arriving meanwhile fill
+ * the next batch, and every writer whose lsn the sync covered is released by one broadcast.
+ */
+typedef struct wal
+{
+    pthread_mutex_t lock;
+    pthread_cond_t synced;  // broadcast when a batch finishes
+    pthread_cond_t flush;   // wakes the flusher early
+    char *buf;              // records appended since the last batch was taken
+    size_t buf_len;
+    size_t buf_cap;
+    char *spare;            // the leader's batch while it writes
+    size_t spare_cap;
+    uint64_t base_lsn;      // log offset at the start of the file; advanced by compaction
+    uint64_t next_lsn;      // log offset past the last appended record
+    uint64_t written_lsn;   // log offset written to the file
+    uint64_t synced_lsn;    // log offset known to be on disk
+    int fd;
+    int dir_fd;
+    char *name;
+    int sync_policy;
+    int flushing;           // a leader is writing a batch
+    int failed;             // a write or sync failed; the log accepts no more records
+    int closing;
+    int has_flusher;
+    pthread_t flusher;
+} wal_t;
+
+/**
+ * @brief Opens or creates a log file under dir_fd, replays it through apply, and readies it for appends. A torn or
+ * corrupt tail (a crash mid-write) ends the replay and is cut off the file.
+ *
+ * @param dir_fd directory to keep the log in (an O_PATH fd is fine)
+ * @param name the log's file name
+ * @param sync_policy WAL_SYNC_ALWAYS, WAL_SYNC_INTERVAL or WAL_SYNC_NONE
+ * @param apply called for every intact record; NULL skips the replay
+ * @param arg passed through to apply
+ * @return the log, or NULL on failure
+ */
+wal_t *wal_open(int dir_fd, const char *name, int sync_policy, wal_apply_func apply, void *arg);
+
+/**
+ * @brief Buffers a record. Does not wait for the disk; pass the returned lsn to wal_sync() for that. Callers that
+ * need the log order of two records on a key to match the order they were applied append under the same lock they
+ * apply under.
+ *
+ * @param wal the log
+ * @param op WAL_OP_PUT or WAL_OP_DELETE
+ * @param key the key
+ * @param key_len length of the key
+ * @param value the value; NULL with value_len 0 for deletes
+ * @param value_len length of the value
+ * @param lsn receives the log offset past the record
+ * @return returns 0 on success, or -1 on failure
+ */
+int wal_append(wal_t *wal, uint8_t op, const void *key, size_t key_len, const void *value, size_t value_len,
+               uint64_t *lsn);
+
+/**
+ * @brief Waits until the log up to lsn is as durable as the sync policy promises: on disk for WAL_SYNC_ALWAYS, joining
+ * or leading a group commit; returns at once for the buffered policies.
+ *
+ * @param wal the log
+ * @param lsn an offset returned by wal_append()
+ * @return returns 0 on success, or -1 if the log failed
+ */
+int wal_sync(wal_t *wal, uint64_t lsn);
+
+/**
+ * @brief Gets the log offset past the last appended record. Taken under a writer's lock, it splits that writer's
+ * records into those already applied (below it) and those to come.
+ *
+ * @param wal the log
+ * @return the lsn
+ */
+uint64_t wal_lsn(wal_t *wal);
+
+/**
+ * @brief Gets the number of log bytes a restart would replay: everything appended since the last compaction.
+ *
+ * @param wal the log
+ * @return the size in bytes
+ */
+uint64_t wal_size(wal_t *wal);
+
+/**
+ * @brief Drops every record before lsn, once a snapshot holds their effects. The records from lsn on that are already
+ * in the file are copied to a new file, which is installed over the log; records still buffered go to the new file.
+ * Appends wait while the tail is copied, so compact right after a snapshot, while the tail is short.
+ *
+ * @param wal the log
+ * @param lsn the first lsn to keep, taken with wal_lsn()
+ * @return returns 0 on success, or -1 on failure (the log is left as it was)
+ */
+int wal_compact(wal_t *wal, uint64_t lsn);
+
+/**
+ * @brief Encodes a record into dst, which must have room for WAL_RECORD_SIZE(key_len, value_len) bytes.
+ *
+ * @param dst where the record goes
+ * @param op WAL_OP_PUT or WAL_OP_DELETE
+ * @param key the key
+ * @param key_len length of the key; at most UINT32_MAX
+ * @param value the value
+ * @param value_len length of the value; at most UINT32_MAX
+ */
+void wal_encode_record(char *dst, uint8_t op, const void *key, size_t key_len, const void *value, size_t value_len);
+
+/**
+ * @brief Checksums a buffer the way log records are checksummed (CRC-32C).
+ *
+ * @param data the bytes
+ * @param len number of bytes
+ * @return the checksum
+ */
+uint32_t wal_checksum(const void *data, size_t len);
+
+/**
+ * @brief Writes all of buf to fd, retrying short writes and EINTR.
+ *
+ * @param fd the file
+ * @param buf the bytes to write
+ * @param len number of bytes
+ * @return returns 0 on success, or -1 on failure
+ */
+int wal_write_all(int fd, const char *buf, size_t len);
+
+/**
+ * @brief Makes a fully written temporary file durable and renames it over name, so readers see either the old file or
+ * the complete new one.
+ *
+ * @param dir_fd directory holding both files (an O_PATH fd is fine)
+ * @param fd the temporary file
+ * @param tmp_name the temporary file's name
+ * @param name the name to install it as
+ * @return returns 0 on success, or -1 on failure
+ */
+int wal_install_file(int dir_fd, int fd, const char *tmp_name, const char *name);
+
+/**
+ * @brief Writes and syncs everything buffered, stops the flusher and closes the log.
+ *
+ * @param wal the log
+ * @return returns 0 on success, or -1 if buffered records could not be made durable
+ */
+int wal_close(wal_t *wal);
+
+#endif
+
+/*** end of file ***/
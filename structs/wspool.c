@@ -0,0 +1,567 @@
+#include "../include/wspool.h"
+
+static _Thread_local ws_worker_t *current_worker = NULL; // the worker the calling thread runs, if any
+
+/**
+ * @brief Sleeps on a futex word while it still holds the expected value.
+ *
+ * @param word the futex word
+ * @param expected the value read before deciding to sleep
+ */
+static void ws_futex_wait(atomic_uint *word, unsigned expected)
+{
+    if ((-1 == syscall(SYS_futex, (uint32_t *)word, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0)) &&
+        (EAGAIN != errno) && (EINTR != errno))
+    {
+        log_perror("futex(FUTEX_WAIT)");
+    }
+}
+
+/**
+ * @brief Wakes threads sleeping on a futex word.
+ *
+ * @param word the futex word
+ * @param count the most threads to wake
+ */
+static void ws_futex_wake(atomic_uint *word, int count)
+{
+    if (-1 == syscall(SYS_futex, (uint32_t *)word, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0))
+    {
+        log_perror("futex(FUTEX_WAKE)");
+    }
+}
+
+/**
+ * @brief Pushes a task onto the bottom of a deque. Only the owning worker calls this.
+ *
+ * @param deque the worker's own deque
+ * @param task the task to push
+ * @return returns 0 on success, or -1 if the deque is full
+ */
+static int ws_deque_push(ws_deque_t *deque, ws_task_t *task)
+{
+    int ret = -1;
+    long long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    long long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+
+    if ((WSPOOL_DEQUE_SIZE - 1) < (bottom - top))
+    {
+        goto END;
+    }
+
+    atomic_store_explicit(&deque->tasks[bottom & (WSPOOL_DEQUE_SIZE - 1)], task, memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_release); // thieves see the task with the bottom
+
+    ret = 0;
+END:
+    return ret;
+}
+
+/**
+ * @brief Takes the newest task from the bottom of a deque. Only the owning worker calls this. When a single task is
+ * left, the owner races thieves for it with the same CAS on top that they use.
+ *
+ * @param deque the worker's own deque
+ * @return the task, or NULL if the deque is empty
+ */
+static ws_task_t *ws_deque_take(ws_deque_t *deque)
+{
+    ws_task_t *ret = NULL;
+    long long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    long long top = 0;
+
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    if (top > bottom) // empty
+    {
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        goto END;
+    }
+
+    ret = atomic_load_explicit(&deque->tasks[bottom & (WSPOOL_DEQUE_SIZE - 1)], memory_order_relaxed);
+    if (top == bottom) // last task; a thief may be taking it too
+    {
+        if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst,
+                                                     memory_order_relaxed))
+        {
+            ret = NULL;
+        }
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+
+END:
+    return ret;
+}
+
+/**
+ * @brief Steals the oldest task from the top of another worker's deque.
+ *
+ * @param deque the victim's deque
+ * @return the task, or NULL if the deque was empty or another thread won the race for the task
+ */
+static ws_task_t *ws_deque_steal(ws_deque_t *deque)
+{
+    ws_task_t *ret = NULL;
+    long long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    long long bottom = 0;
+
+    atomic_thread_fence(memory_order_seq_cst);
+    bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (top >= bottom)
+    {
+        goto END;
+    }
+
+    ret = atomic_load_explicit(&deque->tasks[top & (WSPOOL_DEQUE_SIZE - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst,
+                                                 memory_order_relaxed))
+    {
+        ret = NULL;
+    }
+
+END:
+    return ret;
+}
+
+/**
+ * @brief Checks whether any task is waiting anywhere in the pool. Used by a worker about to park.
+ *
+ * @param pool the pool to check
+ * @return returns 1 if work is waiting, otherwise 0
+ */
+static int ws_has_work(wspool_t *pool)
+{
+    int ret = 1;
+    int worker_index = 0;
+
+    if (0 != rqueue_count(pool->inject))
+    {
+        goto END;
+    }
+    for (worker_index = 0; worker_index < pool->num_workers; worker_index++)
+    {
+        if (atomic_load(&pool->workers[worker_index].deque.top) <
+            atomic_load(&pool->workers[worker_index].deque.bottom))
+        {
+            goto END;
+        }
+    }
+
+    ret = 0;
+END:
+    return ret;
+}
+
+/**
+ * @brief Finds the next task for a worker: its own deque first, then the inject queue, then random victims.
+ *
+ * @param worker the worker looking for work
+ * @return the task, or NULL if no work was found
+ */
+static ws_task_t *ws_find_task(ws_worker_t *worker)
+{
+    ws_task_t *ret = NULL;
+    wspool_t *pool = worker->pool;
+    int round = 0;
+    int attempt = 0;
+    int victim = 0;
+
+    ret = ws_deque_take(&worker->deque);
+    if (NULL != ret)
+    {
+        goto END;
+    }
+    ret = rdequeue(pool->inject);
+    if (NULL != ret)
+    {
+        goto END;
+    }
+
+    for (round = 0; round < WSPOOL_STEAL_ROUNDS; round++)
+    {
+        for (attempt = 0; attempt < pool->num_workers; attempt++)
+        {
+            worker->rng ^= worker->rng << 13; // xorshift32
+            worker->rng ^= worker->rng >> 17;
+            worker->rng ^= worker->rng << 5;
+            victim = (int)(worker->rng % (uint32_t)pool->num_workers);
+            if (victim == worker->index)
+            {
+                continue;
+            }
+
+            ret = ws_deque_steal(&pool->workers[victim].deque);
+            if (NULL != ret)
+            {
+                atomic_fetch_add_explicit(&pool->stolen, 1, memory_order_relaxed);
+                goto END;
+            }
+        }
+    }
+
+END:
+    return ret;
+}
+
+/**
+ * @brief Parks an idle worker until a submit (or destroy) bumps wake_seq. The worker registers as parked before
+ * checking for work one last time, so a task pushed concurrently either is seen here or sees the parked worker and
+ * wakes it.
+ *
+ * @param pool the worker's pool
+ */
+static void ws_park(wspool_t *pool)
+{
+    unsigned seq = atomic_load(&pool->wake_seq);
+
+    atomic_fetch_add(&pool->num_parked, 1);
+    if ((0 == atomic_load(&pool->stop)) && (0 == ws_has_work(pool)))
+    {
+        atomic_fetch_add_explicit(&pool->parks, 1, memory_order_relaxed);
+        ws_futex_wait(&pool->wake_seq, seq);
+    }
+    atomic_fetch_sub(&pool->num_parked, 1);
+}
+
+/**
+ * @brief Wakes one parked worker, if any, after a task was queued.
+ *
+ * @param pool the pool the task was queued on
+ */
+static void ws_wake_one(wspool_t *pool)
+{
+    atomic_thread_fence(memory_order_seq_cst); // the queued task is visible before num_parked is checked
+    if (0 < atomic_load(&pool->num_parked))
+    {
+        atomic_fetch_add(&pool->wake_seq, 1);
+        ws_futex_wake(&pool->wake_seq, 1);
+    }
+}
+
+/**
+ * @brief The short task worker thread. Runs tasks until the pool stops and no queued task is left.
+ *
+ * @param arg the worker
+ * @return NULL
+ */
+static void *ws_worker_main(void *arg)
+{
+    ws_worker_t *worker = (ws_worker_t *)arg;
+    ws_task_t *task = NULL;
+
+    current_worker = worker;
+    for (;;)
+    {
+        task = ws_find_task(worker);
+        if (NULL != task)
+        {
+            task->func(task->arg);
+            free(task);
+            task = NULL;
+            atomic_fetch_add_explicit(&worker->pool->executed, 1, memory_order_relaxed);
+            continue;
+        }
+
+        if (0 != atomic_load(&worker->pool->stop))
+        {
+            break;
+        }
+        ws_park(worker->pool);
+    }
+
+    current_worker = NULL;
+    return NULL;
+}
+
+/**
+ * @brief The thread running a long task.
+ *
+ * @param arg the long thread record
+ * @return NULL
+ */
+static void *ws_long_main(void *arg)
+{
+    ws_long_thread_t *long_thread = (ws_long_thread_t *)arg;
+
+    long_thread->task.func(long_thread->task.arg);
+    return NULL;
+}
+
+/**
+ * @brief Creates a work-stealing pool and starts its short task workers.
+ *
+ * @param num_workers number of short task workers, or 0 for one per online CPU
+ * @return returns the pool, or NULL on failure
+ */
+wspool_t *create_wspool(int num_workers)
+{
+    wspool_t *ret = NULL;
+    wspool_t *pool = NULL;
+    int worker_index = 0;
+    int check = 0;
+
+    if (0 == num_workers)
+    {
+        num_workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (0 >= num_workers)
+    {
+        log_error("Invalid number of pool workers.");
+        goto END;
+    }
+
+    // the futex word and the deques are cache line aligned, so calloc() is not enough here
+    if (0 != posix_memalign((void **)&pool, CACHE_LINE_SIZE, sizeof(wspool_t)))
+    {
+        log_error("Failed to alloc pool.");
+        pool = NULL;
+        goto END;
+    }
+    memset(pool, 0, sizeof(wspool_t));
+    atomic_init(&pool->wake_seq, 0);
+    atomic_init(&pool->num_parked, 0);
+    atomic_init(&pool->stop, 0);
+    atomic_init(&pool->executed, 0);
+    atomic_init(&pool->stolen, 0);
+    atomic_init(&pool->parks, 0);
+
+    check = pthread_mutex_init(&pool->long_lock, NULL);
+    if (0 != check)
+    {
+        log_error("Error initializing pool mutex.");
+        free(pool);
+        pool = NULL;
+        goto END;
+    }
+
+    pool->inject = create_rqueue(NULL, 0);
+    if (NULL == pool->inject)
+    {
+        log_error("Failed to create pool inject queue.");
+        goto FAIL;
+    }
+
+    if (0 != posix_memalign((void **)&pool->workers, CACHE_LINE_SIZE, num_workers * sizeof(ws_worker_t)))
+    {
+        log_error("Failed to alloc pool workers.");
+        pool->workers = NULL;
+        goto FAIL;
+    }
+    memset(pool->workers, 0, num_workers * sizeof(ws_worker_t));
+    pool->num_workers = num_workers;
+
+    for (worker_index = 0; worker_index < num_workers; worker_index++)
+    {
+        atomic_init(&pool->workers[worker_index].deque.top, 0);
+        atomic_init(&pool->workers[worker_index].deque.bottom, 0);
+        pool->workers[worker_index].pool = pool;
+        pool->workers[worker_index].index = worker_index;
+        pool->workers[worker_index].rng = ((uint32_t)worker_index * 0x9e3779b9U) | 1;
+    }
+    for (worker_index = 0; worker_index < num_workers; worker_index++)
+    {
+        check = pthread_create(&pool->workers[worker_index].thread, NULL, ws_worker_main, &pool->workers[worker_index]);
+        if (0 != check)
+        {
+            log_error("pthread_create(): %s", strerror(check));
+            goto FAIL;
+        }
+        pool->workers[worker_index].started = 1;
+    }
+
+    ret = pool;
+    goto END;
+
+FAIL:
+    destroy_wspool(pool);
+    pool = NULL;
+
+END:
+    return ret;
+}
+
+/**
+ * @brief Submits a task to the pool. A short task is queued on the calling worker's deque (or the inject queue from
+ * other threads) and the pool wakes a parked worker for it. A long task is started on a thread of its own.
+ *
+ * @param pool the pool to run the task on
+ * @param func the task function
+ * @param arg the argument passed to func
+ * @param task_class WSPOOL_TASK_SHORT or WSPOOL_TASK_LONG
+ * @return returns 0 on success, or -1 on failure (including a full inject queue)
+ */
+int wspool_submit(wspool_t *pool, ws_func_t func, void *arg, int task_class)
+{
+    int ret = -1;
+    int check = 0;
+    ws_task_t *task = NULL;
+    ws_long_thread_t *long_thread = NULL;
+
+    if ((NULL == pool) || (NULL == func))
+    {
+        log_error("Invalid pool or task passed.");
+        goto END;
+    }
+    if (0 != atomic_load(&pool->stop))
+    {
+        log_error("Pool is stopping. Task not submitted.");
+        goto END;
+    }
+
+    if (WSPOOL_TASK_LONG == task_class)
+    {
+        long_thread = calloc(1, sizeof(ws_long_thread_t));
+        if (NULL == long_thread)
+        {
+            log_error("Failed to alloc long task thread.");
+            goto END;
+        }
+        long_thread->task.func = func;
+        long_thread->task.arg = arg;
+
+        pthread_mutex_lock(&pool->long_lock);
+        check = pthread_create(&long_thread->thread, NULL, ws_long_main, long_thread);
+        if (0 == check)
+        {
+            long_thread->next = pool->long_threads;
+            pool->long_threads = long_thread;
+            pool->num_long_threads++;
+            long_thread = NULL;
+        }
+        pthread_mutex_unlock(&pool->long_lock);
+
+        if (0 != check)
+        {
+            log_error("pthread_create(): %s", strerror(check));
+            free(long_thread);
+            long_thread = NULL;
+            goto END;
+        }
+        ret = 0;
+        goto END;
+    }
+
+    task = malloc(sizeof(ws_task_t));
+    if (NULL == task)
+    {
+        log_error("Failed to alloc task.");
+        goto END;
+    }
+    task->func = func;
+    task->arg = arg;
+
+    // a worker submitting follow-up work keeps it local; everyone else goes through the inject queue
+    if ((NULL == current_worker) || (pool != current_worker->pool) ||
+        (-1 == ws_deque_push(&current_worker->deque, task)))
+    {
+        if (-1 == renqueue(pool->inject, task))
+        {
+            log_error("Pool inject queue full. Task not submitted.");
+            free(task);
+            task = NULL;
+            goto END;
+        }
+    }
+    ws_wake_one(pool);
+
+    ret = 0;
+END:
+    return ret;
+}
+
+/**
+ * @brief Reads the pool counters.
+ *
+ * @param pool the pool to read
+ * @param stats struct to fill in
+ * @return returns 0 on success, or -1 on failure
+ */
+int wspool_stats(wspool_t *pool, WSPOOL_STATS_t *stats)
+{
+    int ret = -1;
+
+    if ((NULL == pool) || (NULL == stats))
+    {
+        log_error("Invalid pool or stats passed.");
+        goto END;
+    }
+
+    stats->executed = atomic_load_explicit(&pool->executed, memory_order_relaxed);
+    stats->stolen = atomic_load_explicit(&pool->stolen, memory_order_relaxed);
+    stats->parks = atomic_load_explicit(&pool->parks, memory_order_relaxed);
+    pthread_mutex_lock(&pool->long_lock);
+    stats->long_threads = pool->num_long_threads;
+    pthread_mutex_unlock(&pool->long_lock);
+
+    ret = 0;
+END:
+    return ret;
+}
+
+/**
+ * @brief Stops the pool. Workers finish the short tasks already queued, then exit; long tasks are joined, so they must
+ * have their own way to stop (the pollers watch running). Frees the pool.
+ *
+ * @param pool the pool to destroy
+ * @return returns 0 on success, or -1 on failure
+ */
+int destroy_wspool(wspool_t *pool)
+{
+    int ret = -1;
+    int worker_index = 0;
+    ws_task_t *task = NULL;
+    ws_long_thread_t *long_thread = NULL;
+
+    if (NULL == pool)
+    {
+        log_error("Pool is already NULL. Exiting.");
+        goto END;
+    }
+
+    atomic_store(&pool->stop, 1);
+    atomic_fetch_add(&pool->wake_seq, 1);
+    ws_futex_wake(&pool->wake_seq, INT32_MAX);
+
+    for (worker_index = 0; worker_index < pool->num_workers; worker_index++)
+    {
+        if (pool->workers[worker_index].started)
+        {
+            pthread_join(pool->workers[worker_index].thread, NULL);
+        }
+    }
+
+    pthread_mutex_lock(&pool->long_lock);
+    long_thread = pool->long_threads;
+    pool->long_threads = NULL;
+    pthread_mutex_unlock(&pool->long_lock);
+    while (NULL != long_thread)
+    {
+        pool->long_threads = long_thread->next;
+        pthread_join(long_thread->thread, NULL);
+        free(long_thread);
+        long_thread = pool->long_threads;
+    }
+
+    if (NULL != pool->inject)
+    {
+        while (NULL != (task = rdequeue(pool->inject))) // only left behind if no worker ever started
+        {
+            free(task);
+        }
+        rdestroy(pool->inject);
+        pool->inject = NULL;
+    }
+    free(pool->workers);
+    pool->workers = NULL;
+    pthread_mutex_destroy(&pool->long_lock);
+    free(pool);
+    pool = NULL;
+
+    ret = 0;
+END:
+    return ret;
+}
+
+/*** end of file ***/
@@ -0,0 +1,145 @@
+#ifndef WSPOOL_H
+#define WSPOOL_H
+
+#include <errno.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "aqueues.h"
+
+#define WSPOOL_DEQUE_SIZE 1024 // tasks per worker deque; must be a power of two
+#define WSPOOL_STEAL_ROUNDS 4  // passes over random victims before an idle worker parks
+
+#define WSPOOL_TASK_SHORT 0 // runs to completion quickly; scheduled on the work-stealing workers
+#define WSPOOL_TASK_LONG 1  // runs for the life of the server (e.g. a poller); gets a thread of its own
+
+typedef void (*ws_func_t)(void *arg);
+
+/**
+ * @brief a task submitted to the pool. Short tasks are freed once they have run; a long task lives in the thread that
+ * runs it.
+ */
+typedef struct ws_task
+{
+    ws_func_t func;
+    void *arg;
+} ws_task_t;
+
+/**
+ * @brief a Chase-Lev work-stealing deque. The owning worker pushes and takes at the bottom without contention; thieves
+ * take from the top with a CAS. top and bottom sit on their own cache lines.
+ */
+typedef struct ws_deque
+{
+    _Alignas(CACHE_LINE_SIZE) atomic_llong top;
+    _Alignas(CACHE_LINE_SIZE) atomic_llong bottom;
+    _Alignas(CACHE_LINE_SIZE) _Atomic(ws_task_t *) tasks[WSPOOL_DEQUE_SIZE];
+} ws_deque_t;
+
+struct wspool;
+
+/**
+ * @brief a short task worker: its deque, its thread, and the state for picking random victims
+ */
+typedef struct ws_worker
+{
+    ws_deque_t deque;
+    struct wspool *pool;
+    pthread_t thread;
+    uint32_t rng;
+    int index;
+    int started;
+} ws_worker_t;
+
+/**
+ * @brief a thread running one long task, kept so the pool can join it on destroy
+ */
+typedef struct ws_long_thread
+{
+    pthread_t thread;
+    ws_task_t task;
+    struct ws_long_thread *next;
+} ws_long_thread_t;
+
+/**
+ * @brief pool counters. Stolen counts tasks a worker took from another worker's deque; parks counts the times a worker
+ * ran out of work and slept.
+ */
+typedef struct wspool_stats
+{
+    size_t executed;
+    size_t stolen;
+    size_t parks;
+    int long_threads;
+} WSPOOL_STATS_t;
+
+/**
+ * @brief a work-stealing thread pool. Tasks submitted from a worker go on that worker's own deque; tasks submitted
+ * from any other thread go through the inject queue. An idle worker steals from random victims, then parks on the
+ * wake_seq futex until a submit bumps it. Long tasks never occupy a worker, so short tasks always have workers to run
+ * on.
+ */
+typedef struct wspool
+{
+    ws_worker_t *workers;
+    int num_workers;
+    RQUEUE_t *inject;
+    ws_long_thread_t *long_threads;
+    int num_long_threads;
+    pthread_mutex_t long_lock;
+    _Alignas(CACHE_LINE_SIZE) atomic_uint wake_seq;
+    atomic_int num_parked;
+    atomic_int stop;
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t executed;
+    atomic_size_t stolen;
+    atomic_size_t parks;
+} wspool_t;
+
+/**
+ * @brief Creates a work-stealing pool and starts its short task workers.
+ *
+ * @param num_workers number of short task workers, or 0 for one per online CPU
+ * @return returns the pool, or NULL on failure
+ */
+wspool_t *create_wspool(int num_workers);
+
+/**
+ * @brief Submits a task to the pool. A short task is queued on the calling worker's deque (or the inject queue from
+ * other threads) and the pool wakes a parked worker for it. A long task is started on a thread of its own.
+ *
+ * @param pool the pool to run the task on
+ * @param func the task function
+ * @param arg the argument passed to func
+ * @param task_class WSPOOL_TASK_SHORT or WSPOOL_TASK_LONG
+ * @return returns 0 on success, or -1 on failure (including a full inject queue)
+ */
+int wspool_submit(wspool_t *pool, ws_func_t func, void *arg, int task_class);
+
+/**
+ * @brief Reads the pool counters.
+ *
+ * @param pool the pool to read
+ * @param stats struct to fill in
+ * @return returns 0 on success, or -1 on failure
+ */
+int wspool_stats(wspool_t *pool, WSPOOL_STATS_t *stats);
+
+/**
+ * @brief Stops the pool. Workers finish the short tasks already queued, then exit; long tasks are joined, so they must
+ * have their own way to stop (the pollers watch running). Frees the pool.
+ *
+ * @param pool the pool to destroy
+ * @return returns 0 on success, or -1 on failure
+ */
+int destroy_wspool(wspool_t *pool);
+
+#endif
+
+/*** end of file ***/